@@ -5,7 +5,7 @@
 HEADERS	= conf.h conffile.h detail.h dhcp.h event.h features.h hash.h heap.h \
 	libradius.h md4.h md5.h missing.h modcall.h modules.h \
 	packet.h rad_assert.h radius.h radiusd.h radpaths.h \
-	radutmp.h realms.h sha1.h stats.h sysutmp.h token.h \
+	radutmp.h realms.h sha1.h stats.h sysutmp.h token.h trie.h \
 	udpfromto.h vmps.h vqp.h base64.h
 
 #
@@ -34,6 +34,7 @@ extern "C" {
 #endif
 
 typedef struct fr_connection_pool_t fr_connection_pool_t;
+typedef struct fr_connection fr_connection_t;
 
 /** Create a new connection handle
  *
@@ -71,19 +72,45 @@ typedef int (*fr_connection_alive_t)(void *ctx, void *connection);
  */
 typedef int (*fr_connection_delete_t)(void *ctx, void *connection);
 
+/** Connection pool counters
+ *
+ * A snapshot of the state of a connection pool, as shown by radmin.
+ *
+ * @see fr_connection_pool_stats
+ */
+typedef struct fr_connection_pool_stats_t {
+	int		num;		//!< Number of connections in the pool.
+	int		active;		//!< Number of reserved connections.
+	int		max;		//!< Maximum number of connections.
+	int		waiting;	//!< Callers currently waiting for
+					//!< a connection.
+
+	uint64_t	at_max;		//!< Times a caller found no free
+					//!< connection, and the pool at max.
+	uint64_t	waits;		//!< Times a caller waited for a
+					//!< connection to be released.
+	uint64_t	timeouts;	//!< Waits which timed out.
+	uint64_t	wait_usec;	//!< Total time spent waiting.
+	uint64_t	max_wait_usec;	//!< Longest time spent waiting.
+} fr_connection_pool_stats_t;
+
 fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *cs,
 					      void *ctx,
 					      fr_connection_create_t c,
 					      fr_connection_alive_t a,
 					      fr_connection_delete_t d);
 void fr_connection_pool_delete(fr_connection_pool_t *pool);
+int fr_connection_pool_stats(const CONF_SECTION *cs,
+			     fr_connection_pool_stats_t *stats);
 
-int fr_connection_check(fr_connection_pool_t *pool, void *conn);
-void *fr_connection_get(fr_connection_pool_t *pool);
-void fr_connection_release(fr_connection_pool_t *pool, void *conn);
-void *fr_connection_reconnect(fr_connection_pool_t *pool, void *conn);
+int fr_connection_check(fr_connection_pool_t *pool, fr_connection_t *this);
+fr_connection_t *fr_connection_get(fr_connection_pool_t *pool);
+void *fr_connection_handle(const fr_connection_t *this);
+void fr_connection_release(fr_connection_pool_t *pool, fr_connection_t *this);
+fr_connection_t *fr_connection_reconnect(fr_connection_pool_t *pool,
+					 fr_connection_t *this);
 int fr_connection_add(fr_connection_pool_t *pool, void *conn);
-int fr_connection_del(fr_connection_pool_t *pool, void *conn);
+int fr_connection_del(fr_connection_pool_t *pool, fr_connection_t *this);
 
 #ifdef __cplusplus
 }
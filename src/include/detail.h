@@ -24,18 +24,33 @@ typedef enum detail_state_t {
   STATE_REPLIED
 } detail_state_t;
 
+/*
+ *	One record read from the detail file, which is being
+ *	processed.
+ */
+typedef struct detail_record_t {
+	detail_state_t	state;
+	uint32_t	counter;	/* generates the packet ID */
+	int		tries;
+	time_t		running;
+	time_t		timestamp;
+	fr_ipaddr_t	client_ip;
+	off_t		done_offset;	/* of "Timestamp", or -1 */
+	off_t		end;		/* file offset after the record */
+	VALUE_PAIR	*vps;
+} detail_record_t;
+
 typedef struct listen_detail_t {
 	fr_event_t	*ev;	/* has to be first entry (ugh) */
 	int		delay_time;
 	char		*filename;
 	char		*filename_work;
-	VALUE_PAIR	*vps;
-	FILE		*fp;
+	char		*map;	/* contents of the work file, read-only */
+	size_t		map_size;
+	size_t		pos;	/* of the next record to read */
+	int		binary;	/* file holds binary records */
 	off_t		offset;
 	detail_state_t 	state;
-	time_t		timestamp;
-	time_t		running;
-	fr_ipaddr_t	client_ip;
 	int		load_factor; /* 1..100 */
 	int		signal;
 	int		poll_interval;
@@ -43,8 +58,25 @@ typedef struct listen_detail_t {
 	int		packets;
 	int		tries;
 	int		one_shot;
+	int		track;
+	int		eof;
+	int		shards;	/* files are split across this many listeners */
+	int		shard;	/* which one this is */
+	int		hash_dir; /* assign files by directory, not name */
+	int		orphans; /* look for work files of other shard counts */
+	int		watch_fd; /* inotify, or -1 to poll */
+	int		replayed; /* records done, for the rate */
+	int		rate_replayed;
+	time_t		rate_time;
+	int		rate;	/* records/s */
 	int		outstanding;
 	int		max_outstanding;
+	int		head;
+	detail_record_t	*window; /* max_outstanding records */
+	const DICT_ATTR	*da_cache[FR_DETAIL_DA_CACHE_SIZE];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
 	int		has_rtt;
 	int		srtt;
 	int		rttvar;
@@ -60,6 +92,9 @@ int detail_print(const rad_listen_t *this, char *buffer, size_t bufsize);
 int detail_encode(UNUSED rad_listen_t *this, UNUSED REQUEST *request);
 int detail_decode(UNUSED rad_listen_t *this, UNUSED REQUEST *request);
 int detail_parse(CONF_SECTION *cs, rad_listen_t *this);
+int detail_shard(rad_listen_t *this, const rad_listen_t *parent, int shard);
+int detail_watch(rad_listen_t *this);
+int detail_backlog(const rad_listen_t *this, int *files, off_t *bytes);
 
 #ifdef __cplusplus
 }
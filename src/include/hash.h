@@ -45,6 +45,13 @@ uint32_t fr_hash_string(const char *p);
  */
 uint32_t fr_hash_fold(uint32_t hash, int bits);
 
+/*
+ *	Score a node for rendezvous (highest random weight) hashing.
+ *	The node with the highest score for a key is chosen.  Nodes
+ *	with a larger weight are chosen proportionally more often.
+ */
+uint32_t fr_hash_rendezvous(uint32_t key, uint32_t node, int weight);
+
 typedef struct fr_hash_table_t fr_hash_table_t;
 typedef void (*fr_hash_table_free_t)(void *);
 typedef uint32_t (*fr_hash_table_hash_t)(const void *);
@@ -496,6 +496,10 @@ int fr_ipaddr2sockaddr(const fr_ipaddr_t *ipaddr, int port,
 		       struct sockaddr_storage *sa, socklen_t *salen);
 int fr_sockaddr2ipaddr(const struct sockaddr_storage *sa, socklen_t salen,
 		       fr_ipaddr_t *ipaddr, int * port);
+void		fr_tv_sub(const struct timeval *end,
+			  const struct timeval *start,
+			  struct timeval *elapsed);
+double		fr_tv_elapsed(const struct timeval *start);
 
 
 #ifdef WITH_ASCEND_BINARY
@@ -504,6 +508,40 @@ int		ascend_parse_filter(VALUE_PAIR *pair);
 void		print_abinary(const VALUE_PAIR *vp, char *buffer, size_t len, int delimitst);
 #endif /*WITH_ASCEND_BINARY*/
 
+/* detail.c */
+#define FR_DETAIL_MAGIC		{ 0xfd, 'R', 'D', 'B' }
+#define FR_DETAIL_VERSION	(1)
+#define FR_DETAIL_HDR_LEN	(36)
+#define FR_DETAIL_DONE_OFFSET	(5)
+#define FR_DETAIL_MAX_LEN	(65535)
+
+typedef struct fr_detail_hdr_t {
+	int		code;
+	int		done;
+	time_t		timestamp;
+	fr_ipaddr_t	client_ip;
+	size_t		length;		/* of the attributes */
+	uint32_t	checksum;
+} fr_detail_hdr_t;
+
+int		fr_detail_is_binary(const uint8_t *data, size_t len);
+ssize_t		fr_detail_encode(uint8_t *out, size_t outlen,
+				 fr_detail_hdr_t *hdr, VALUE_PAIR *vps);
+ssize_t		fr_detail_decode_hdr(const uint8_t *data, size_t len,
+				     fr_detail_hdr_t *hdr);
+int		fr_detail_decode(const uint8_t *data,
+				 const fr_detail_hdr_t *hdr, VALUE_PAIR **vps);
+
+/*
+ *	Attribute names seen in text detail files are looked up in the
+ *	dictionary once, and then found here.  Must be a power of 2.
+ */
+#define FR_DETAIL_DA_CACHE_SIZE	(64)
+
+int		fr_detail_read_pair(const DICT_ATTR **cache,
+				    fr_detail_hdr_t *hdr, VALUE_PAIR ***tail,
+				    const char *line, size_t len);
+
 /* random numbers in isaac.c */
 /* context of random number generator */
 typedef struct fr_randctx {
@@ -37,6 +37,9 @@ modcallable *compile_modsingle(modcallable *parent, int component, CONF_ITEM *ci
 void add_to_modcallable(modcallable **parent, modcallable *this,
 			int component, const char *name);
 
+/* Lower a complete tree into the instruction array run by modcall() */
+int modcallable_flatten(modcallable *c);
+
 /* Free a tree returned by compile_modgroup or compile_modsingle */
 void modcallable_free(modcallable **pc);
 
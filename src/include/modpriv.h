@@ -35,6 +35,7 @@ typedef struct module_entry_t {
 } module_entry_t;
 
 typedef struct fr_module_hup_t fr_module_hup_t;
+typedef struct fr_module_thread_t fr_module_thread_t;
 
 /*
  *	Per-instance data structure, to correlate the modules
@@ -51,6 +52,8 @@ typedef struct module_instance_t {
 	CONF_SECTION		*cs;
 	int			dead;
 	fr_module_hup_t	       	*mh;
+	int			state;
+	fr_module_thread_t	*owner;
 } module_instance_t;
 
 module_instance_t *find_module_instance(CONF_SECTION *, const char *instname,
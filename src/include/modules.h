@@ -145,6 +145,17 @@ typedef int (*instantiate_t)(CONF_SECTION *mod_cs, void *instance);
  */
 typedef int (*detach_t)(void *instance);
 
+/** Module flush callback
+ *
+ * Is called from the control socket, to drop data which the module has
+ * cached, for example after the database it was read from has changed.
+ *
+ * @param[in] instance of the module.
+ * @param[in] key of the entry to drop, or NULL to drop everything.
+ * @return the number of entries dropped.
+ */
+typedef int (*flush_t)(void *instance, const char *key);
+
 /** Metadata exported by the module
  *
  * This determines the capabilities of the module, and maps internal functions
@@ -163,12 +174,15 @@ typedef struct module_t {
 				//!< various section functions, ordering
 				//!< determines which function is mapped to
 				//!< which section.
-						
+	flush_t		flush;	//!< Function to drop cached data, or
+				//!< NULL if the module has none.
 } module_t;
 
 int setup_modules(int, CONF_SECTION *);
 int detach_modules(void);
 int module_hup(CONF_SECTION *modules);
+int module_instantiate_suspend(void);
+void module_instantiate_resume(int suspended);
 rlm_rcode_t process_authorize(int type, REQUEST *request);
 rlm_rcode_t process_authenticate(int type, REQUEST *request);
 rlm_rcode_t module_preacct(REQUEST *request);
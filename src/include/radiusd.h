@@ -39,6 +39,14 @@ typedef struct request REQUEST;
 #include	<pthread.h>
 #endif
 
+#ifdef HAVE_REGEX_H
+#ifdef HAVE_PCREPOSIX_H
+#include	<pcreposix.h>
+#else
+#include	<regex.h>
+#endif
+#endif
+
 #ifndef NDEBUG
 #define REQUEST_MAGIC (0xdeadbeef)
 #endif
@@ -85,13 +93,13 @@ typedef struct radclient {
 	int			number;	/* internal use only */
 	const CONF_SECTION	*cs;
 #ifdef WITH_STATS
-	fr_stats_t		auth;
+	fr_stats_id_t		auth;
 #ifdef WITH_ACCOUNTING
-	fr_stats_t		acct;
+	fr_stats_id_t		acct;
 #endif
 #ifdef WITH_COA
-	fr_stats_t		coa;
-	fr_stats_t		dsc;
+	fr_stats_id_t		coa;
+	fr_stats_id_t		dsc;
 #endif
 #endif
 
@@ -107,6 +115,9 @@ typedef struct radclient {
 	time_t			last_new_client;
 	char			*client_server;
 	int			rate_limit;
+	int			negative_lifetime; //!< How long failed lookups are cached.
+	int			max_resolving;	//!< Lookups allowed in parallel.
+	int			resolving;	//!< Lookups in progress.
 #endif
 
 #ifdef WITH_COA
@@ -263,6 +274,9 @@ struct request {
 
 	int			num_proxied_requests;
 	int			num_proxied_responses;
+
+	struct proxy_hedge_t	*hedge;		//!< Copy of the request sent
+						//!< to another home server.
 #endif
 
 	const char		*server;
@@ -370,7 +384,7 @@ struct rad_listen_t {
 	void		*data;
 
 #ifdef WITH_STATS
-	fr_stats_t	stats;
+	fr_stats_id_t	stats;
 #endif
 };
 
@@ -412,6 +426,22 @@ typedef struct listen_socket_t {
 	RADCLIENT	*client;
 
 	RADIUS_PACKET   *packet; /* for reading partial packets */
+
+	fr_tcp_buffer_t	*rbuf;	/* for reading many packets at once */
+
+	/*
+	 *	Data queued by other threads while one thread
+	 *	is writing to the socket.
+	 */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	wmutex;
+#endif
+	int		writing;
+	uint8_t		*wbuf;
+	size_t		wbuf_len;
+	size_t		wbuf_size;
+	uint8_t		*wspare;
+	size_t		wspare_size;
 #endif
 
 #ifdef WITH_TLS
@@ -661,6 +691,25 @@ int		client_validate(RADCLIENT_LIST *clients, RADCLIENT *master,
 				RADCLIENT *c);
 RADCLIENT	*client_read(const char *filename, int in_server, int flag);
 
+#ifdef WITH_DYNAMIC_CLIENTS
+typedef struct fr_dynamic_client_stats_t {
+	fr_uint_t	hits;		//!< Packets from known dynamic clients.
+	fr_uint_t	misses;		//!< Lookups through the virtual server.
+	fr_uint_t	failed;		//!< Lookups which didn't define a client.
+	fr_uint_t	negative_hits;	//!< Packets ignored as a lookup failed recently.
+	fr_uint_t	coalesced;	//!< Packets ignored as a lookup was in progress.
+	fr_uint_t	limited;	//!< Packets ignored due to max_resolving, or a full cache.
+} fr_dynamic_client_stats_t;
+
+int		client_dynamic_begin(RADCLIENT *network,
+				     const fr_ipaddr_t *ipaddr);
+void		client_dynamic_end(RADCLIENT *network,
+				   const fr_ipaddr_t *ipaddr, int failed);
+void		client_dynamic_hit(void);
+void		client_dynamic_stats(fr_dynamic_client_stats_t *stats);
+int		client_dynamic_num_cached(void);
+#endif
+
 
 /* files.c */
 int		pairlist_read(TALLOC_CTX *ctx, const char *file, PAIR_LIST **list, int complain);
@@ -753,6 +802,28 @@ void		xlat_unregister(const char *module, RAD_XLAT_FUNC func,
 				void *instance);
 void		xlat_free(void);
 
+typedef struct xlat_exp xlat_exp_t;
+typedef struct xlat_section xlat_section_t;
+xlat_exp_t	*xlat_compile(TALLOC_CTX *ctx, const char *fmt);
+size_t		radius_xlat_compiled(char *out, int outlen,
+				     const xlat_exp_t *exp, REQUEST *request,
+				     RADIUS_ESCAPE_STRING func, void *funcarg);
+const char	*xlat_literal(const xlat_exp_t *exp);
+xlat_section_t	*xlat_compile_section(TALLOC_CTX *ctx, CONF_SECTION *cs);
+const xlat_exp_t *xlat_section_find(const xlat_section_t *xs,
+				    const CONF_PAIR *cp);
+
+/* regex.c */
+typedef struct fr_regex fr_regex_t;
+#ifdef HAVE_REGEX_H
+fr_regex_t	*regex_cache_find(const char *pattern, int cflags, int pin,
+				  char *errbuf, size_t errlen);
+int		regex_cache_exec(const fr_regex_t *rx, const char *subject,
+				 size_t nmatch, regmatch_t pmatch[]);
+void		regex_cache_release(fr_regex_t *rx);
+void		regex_cache_free(void);
+#endif
+
 /* threads.c */
 extern		int thread_pool_init(CONF_SECTION *cs, int *spawn_flag);
 extern		void thread_pool_stop(void);
@@ -785,6 +856,12 @@ void fr_suid_down_permanent(void);
 void listen_free(rad_listen_t **head);
 int listen_init(CONF_SECTION *cs, rad_listen_t **head, int spawn_flag);
 rad_listen_t *proxy_new_listener(home_server *home, int src_port);
+#ifdef WITH_TCP
+typedef ssize_t (*listen_write_t)(rad_listen_t *listener,
+				  const uint8_t *data, size_t data_len);
+int listen_stream_write(rad_listen_t *listener, const uint8_t *data,
+			size_t data_len, listen_write_t write_fn);
+#endif
 RADCLIENT *client_listener_find(rad_listen_t *listener,
 				const fr_ipaddr_t *ipaddr, int src_port);
 
@@ -807,7 +884,13 @@ void mark_home_server_dead(home_server *home, struct timeval *when);
 /* evaluate.c */
 int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 			      const char **ptr, int evaluate_it, int *presult);
+typedef struct fr_cond_regex fr_cond_regex_t;
+int radius_compile_condition(const char **ptr, fr_cond_regex_t **pregex);
+int radius_evaluate_compiled(REQUEST *request, int modreturn,
+			     const char **ptr, int *presult,
+			     fr_cond_regex_t *regex);
 int radius_update_attrlist(REQUEST *request, CONF_SECTION *cs,
+			   const xlat_section_t *xs,
 			   VALUE_PAIR *input_vps, const char *name);
 void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from);
 
@@ -64,8 +64,16 @@ typedef struct home_server {
 
 	int		response_window;
 	int		max_outstanding; /* don't overload it */
+	int		weight;		/* for rendezvous-balance */
+	uint32_t	name_hash;	/* for rendezvous-balance */
+	int		response_time;	/* smoothed, in microseconds */
+	int		response_dev;	/* mean deviation of the above */
 	int		currently_outstanding;
 
+	int		spare_timeout;	/* close unneeded sockets after this */
+	time_t		sockets_busy;	/* last time we needed every socket */
+	int		socket_pending;	/* a new socket is being opened */
+
 	time_t		last_packet_sent;
 	time_t		last_packet_recv;
 	struct timeval	revive_time;
@@ -99,7 +107,7 @@ typedef struct home_server {
 #ifdef WITH_STATS
 	int		number;
 
-	fr_stats_t	stats;
+	fr_stats_id_t	stats;
 
 	fr_stats_ema_t  ema;
 #endif
@@ -112,7 +120,9 @@ typedef enum home_pool_type_t {
 	HOME_POOL_FAIL_OVER,
 	HOME_POOL_CLIENT_BALANCE,
 	HOME_POOL_CLIENT_PORT_BALANCE,
-	HOME_POOL_KEYED_BALANCE
+	HOME_POOL_KEYED_BALANCE,
+	HOME_POOL_RENDEZVOUS_BALANCE,
+	HOME_POOL_LEAST_LATENCY
 } home_pool_type_t;
 
 
@@ -129,6 +139,13 @@ typedef struct home_pool_t {
 	int			in_fallback;
 	time_t			time_all_dead;
 
+	int			hedge_percentile;
+	int			hedge_factor;	/* deviations, in 1/100 */
+	int			hedge_max;	/* percent of requests */
+	int			hedge_credit;
+	unsigned int		hedges;
+	unsigned int		hedge_wins;
+
 	int			num_home_servers;
 	home_server		*servers[1];
 } home_pool_t;
@@ -154,6 +171,12 @@ REALM *realm_find2(const char *name); /* ... with name taken from realm_find */
 void home_server_update_request(home_server *home, REQUEST *request);
 home_server *home_server_ldb(const char *realmname, home_pool_t *pool, REQUEST *request);
 home_server *home_server_find(fr_ipaddr_t *ipaddr, int port, int proto);
+void home_server_response_time(home_server *home, const struct timeval *sent,
+			       const struct timeval *received);
+uint64_t home_server_latency_score(const home_server *home);
+int home_server_hedge_delay(const home_pool_t *pool, const home_server *home);
+home_server *home_server_hedge(home_pool_t *pool, home_server *home,
+			       REQUEST *request);
 #ifdef WITH_COA
 home_server *home_server_byname(const char *name, int type);
 #endif
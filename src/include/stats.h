@@ -29,11 +29,7 @@ RCSIDH(stats_h, "$Id$")
 extern "C" {
 #endif
 
-#ifdef WITH_STATS_64BIT
 typedef uint64_t fr_uint_t;
-#else
-typedef uint32_t fr_uint_t;
-#endif
 
 #ifdef WITH_STATS
 typedef struct fr_stats_t {
@@ -54,6 +50,14 @@ typedef struct fr_stats_t {
 	fr_uint_t		elapsed[8];
 } fr_stats_t;
 
+/*
+ *	Clients, listeners, and home servers don't hold the counters
+ *	themselves.  Each thread has its own counters for each of
+ *	them, so that threads never write to the same memory.  The
+ *	counters are added up when they are read.
+ */
+typedef int fr_stats_id_t;
+
 typedef struct fr_stats_ema_t {
 	int		window;
 
@@ -62,40 +66,45 @@ typedef struct fr_stats_ema_t {
 
 } fr_stats_ema_t;
 
-extern fr_stats_t	radius_auth_stats;
+extern fr_stats_id_t	radius_auth_stats;
 #ifdef WITH_ACCOUNTING
-extern fr_stats_t	radius_acct_stats;
+extern fr_stats_id_t	radius_acct_stats;
 #endif
 #ifdef WITH_COA
-extern fr_stats_t	radius_coa_stats;
-extern fr_stats_t	radius_dsc_stats;
+extern fr_stats_id_t	radius_coa_stats;
+extern fr_stats_id_t	radius_dsc_stats;
 #endif
 #ifdef WITH_PROXY
-extern fr_stats_t	proxy_auth_stats;
+extern fr_stats_id_t	proxy_auth_stats;
 #ifdef WITH_ACCOUNTING
-extern fr_stats_t	proxy_acct_stats;
+extern fr_stats_id_t	proxy_acct_stats;
 #endif
 #ifdef WITH_COA
-extern fr_stats_t	proxy_coa_stats;
-extern fr_stats_t	proxy_dsc_stats;
+extern fr_stats_id_t	proxy_coa_stats;
+extern fr_stats_id_t	proxy_dsc_stats;
 #endif
 #endif
 
+fr_stats_id_t fr_stats_alloc(void);
+void fr_stats_free(fr_stats_id_t id);
+fr_stats_t *fr_stats_local(fr_stats_id_t id);
+void fr_stats_read(fr_stats_id_t id, fr_stats_t *stats);
+
 void radius_stats_init(int flag);
 void request_stats_final(REQUEST *request);
 void request_stats_reply(REQUEST *request);
 void radius_stats_ema(fr_stats_ema_t *ema,
 		      struct timeval *start, struct timeval *end);
 
-#define FR_STATS_INC(_x, _y) radius_ ## _x ## _stats._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
-#define FR_STATS_TYPE_INC(_x) _x++
+#define FR_STATS_INC(_x, _y) fr_stats_local(radius_ ## _x ## _stats)->_y++;if (listener) fr_stats_local(listener->stats)->_y++;if (client) fr_stats_local(client->_x)->_y++;
+#define FR_STATS_TYPE_INC(_x, _y) fr_stats_local(_x)->_y++
 
 #else  /* WITH_STATS */
 #define request_stats_init(_x)
 #define request_stats_final(_x)
 
 #define FR_STATS_INC(_x, _y)
-#define FR_STATS_TYPE_INC(_x)
+#define FR_STATS_TYPE_INC(_x, _y)
 
 #endif
 
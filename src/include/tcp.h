@@ -32,4 +32,21 @@ int fr_tcp_read_packet(RADIUS_PACKET *packet, int flags);
 RADIUS_PACKET *fr_tcp_recv(int sockfd, int flags);
 RADIUS_PACKET *fr_tcp_accept(int sockfd);
 ssize_t fr_tcp_write_packet(RADIUS_PACKET *packet);
+
+/*
+ *	A receive buffer for a stream.  Many packets can be read with
+ *	one system call, and split up afterwards.
+ */
+#define FR_TCP_BUFFER_SIZE (65536)
+
+typedef struct fr_tcp_buffer_t {
+	size_t		start;		/* first byte not yet returned */
+	size_t		end;		/* end of the data read so far */
+	uint8_t		data[FR_TCP_BUFFER_SIZE];
+} fr_tcp_buffer_t;
+
+size_t fr_tcp_buffer_room(fr_tcp_buffer_t *buf);
+ssize_t fr_tcp_buffer_read(fr_tcp_buffer_t *buf, int sockfd);
+int fr_tcp_buffer_packet(fr_tcp_buffer_t *buf, int sockfd, int flags,
+			 RADIUS_PACKET **packet_p);
 #endif /* FR_TCP_H */
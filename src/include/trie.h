@@ -0,0 +1,55 @@
+#ifndef FR_TRIE_H
+#define FR_TRIE_H
+
+/*
+ * trie.h	Structures and prototypes for path compressed binary tries.
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2013 The FreeRADIUS server project
+ */
+
+RCSIDH(trie_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	Keys are bit strings of up to 128 bits, which is enough for
+ *	IPv6 addresses.
+ */
+#define FR_TRIE_MAX_BITS (128)
+
+typedef struct fr_trie_t fr_trie_t;
+typedef int (*fr_trie_walk_t)(void *ctx, void *data);
+
+fr_trie_t *fr_trie_create(int max_bits);
+void fr_trie_free(fr_trie_t *ft);
+
+int fr_trie_insert(fr_trie_t *ft, const void *key, int bits, void *data);
+void *fr_trie_delete(fr_trie_t *ft, const void *key, int bits);
+void *fr_trie_find(const fr_trie_t *ft, const void *key, int bits);
+void *fr_trie_lookup(const fr_trie_t *ft, const void *key, int bits,
+		     int *prefix);
+int fr_trie_num_elements(const fr_trie_t *ft);
+int fr_trie_walk(fr_trie_t *ft, fr_trie_walk_t callback, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FR_TRIE_H */
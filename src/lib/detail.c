@@ -0,0 +1,787 @@
+/*
+ * detail.c	Binary detail file records.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2013  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#include <ctype.h>
+
+/*
+ *	A binary detail file is a series of records.  Each one is a
+ *	fixed header, followed by the attributes, encoded exactly as
+ *	they would be in a RADIUS packet.  All numbers are in network
+ *	byte order.
+ *
+ *	 0  magic	4 octets, FR_DETAIL_MAGIC
+ *	 4  version	FR_DETAIL_VERSION
+ *	 5  done	0, or 1 once the detail reader has processed it
+ *	 6  code	RADIUS packet code
+ *	 7  family	4 (IPv4), 6 (IPv6), or 0 for no client address
+ *	 8  client	16 octets, IPv4 addresses are in the first 4
+ *	24  timestamp	32 bits, when the packet was received
+ *	28  length	32 bits, of the attributes which follow
+ *	32  checksum	32 bits, fr_hash() of the attributes
+ *	36  attributes
+ *
+ *	The server's internal attributes can't be put into a RADIUS
+ *	packet, so they're written with an attribute number of zero,
+ *	which is never valid on the wire:
+ *
+ *	 0  zero	1 octet
+ *	 1  attribute	16 bits
+ *	 3  length	16 bits, of the value
+ *	 5  value
+ *
+ *	Encrypted attributes (User-Password, etc.) are encrypted with
+ *	an empty secret, and a zero authentication vector.  That's
+ *	enough to keep them from being read by accident, but it is
+ *	NOT security.
+ */
+static const uint8_t detail_magic[4] = FR_DETAIL_MAGIC;
+
+static const uint8_t nullvector[AUTH_VECTOR_LEN] = { 0 };
+
+static void detail_fake_packet(RADIUS_PACKET *packet, int code)
+{
+	memset(packet, 0, sizeof(*packet));
+	packet->code = code;
+	memcpy(packet->vector, nullvector, sizeof(packet->vector));
+}
+
+/** Check whether a detail file holds binary records
+ *
+ * @param data the start of the file.
+ * @param len of the data.
+ * @return TRUE if the file is binary, FALSE if it's text.
+ */
+int fr_detail_is_binary(const uint8_t *data, size_t len)
+{
+	if (len < sizeof(detail_magic)) return FALSE;
+
+	return (memcmp(data, detail_magic, sizeof(detail_magic)) == 0);
+}
+
+/*
+ *	Encode one of the server's internal attributes.
+ */
+static ssize_t detail_vp2internal(const VALUE_PAIR *vp, uint8_t *ptr,
+				  size_t room)
+{
+	ssize_t len;
+
+	if (room < 5) return 0;
+
+	len = rad_vp2data(vp, ptr + 5, room - 5);
+	if (len <= 0) return len;
+
+	ptr[0] = 0;
+	ptr[1] = (vp->da->attr >> 8) & 0xff;
+	ptr[2] = vp->da->attr & 0xff;
+	ptr[3] = (len >> 8) & 0xff;
+	ptr[4] = len & 0xff;
+
+	return len + 5;
+}
+
+/** Encode a list of attributes as a binary detail record
+ *
+ * @param[out] out where the record is written.
+ * @param[in] outlen size of out.  Attributes which don't fit, or which
+ *	can't be encoded, are skipped.
+ * @param[in] hdr the code, timestamp and client address.  The length
+ *	and checksum are filled in.
+ * @param[in] vps to encode.
+ * @return the length of the record, or -1 on error.
+ */
+ssize_t fr_detail_encode(uint8_t *out, size_t outlen, fr_detail_hdr_t *hdr,
+			 VALUE_PAIR *vps)
+{
+	RADIUS_PACKET	packet;
+	const VALUE_PAIR *vp;
+	uint8_t		*ptr, *end;
+	uint32_t	value;
+	ssize_t		len;
+
+	if (outlen < FR_DETAIL_HDR_LEN) {
+		fr_strerror_printf("Output buffer is too small");
+		return -1;
+	}
+
+	if ((hdr->code <= 0) || (hdr->code > 255)) {
+		fr_strerror_printf("Invalid packet code %d", hdr->code);
+		return -1;
+	}
+
+	detail_fake_packet(&packet, hdr->code);
+
+	ptr = out + FR_DETAIL_HDR_LEN;
+	end = out + outlen;
+	if ((end - ptr) > FR_DETAIL_MAX_LEN) end = ptr + FR_DETAIL_MAX_LEN;
+
+	vp = vps;
+	while (vp) {
+		if ((end - ptr) <= 2) break;
+
+		/*
+		 *	Non-wire attributes get their own encoding.
+		 *	Ones which don't fit are skipped.
+		 */
+		if ((vp->da->vendor == 0) && (vp->da->attr > 255)) {
+			len = detail_vp2internal(vp, ptr, end - ptr);
+			if (len > 0) ptr += len;
+
+			vp = vp->next;
+			continue;
+		}
+
+		/*
+		 *	Skip attributes which can't be encoded.
+		 */
+		len = rad_vp2attr(&packet, &packet, "", &vp, ptr, end - ptr);
+		if (len <= 0) {
+			vp = vp->next;
+			continue;
+		}
+
+		ptr += len;
+	}
+
+	hdr->length = ptr - (out + FR_DETAIL_HDR_LEN);
+	hdr->checksum = fr_hash(out + FR_DETAIL_HDR_LEN, hdr->length);
+
+	memcpy(out, detail_magic, sizeof(detail_magic));
+	out[4] = FR_DETAIL_VERSION;
+	out[5] = hdr->done ? 1 : 0;
+	out[6] = hdr->code;
+	memset(out + 7, 0, 17);
+
+	switch (hdr->client_ip.af) {
+	case AF_INET:
+		out[7] = 4;
+		memcpy(out + 8, &hdr->client_ip.ipaddr.ip4addr, 4);
+		break;
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		out[7] = 6;
+		memcpy(out + 8, &hdr->client_ip.ipaddr.ip6addr, 16);
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	value = htonl((uint32_t) hdr->timestamp);
+	memcpy(out + 24, &value, 4);
+	value = htonl(hdr->length);
+	memcpy(out + 28, &value, 4);
+	value = htonl(hdr->checksum);
+	memcpy(out + 32, &value, 4);
+
+	return ptr - out;
+}
+
+/** Check the header of a binary detail record
+ *
+ * @param[in] data the start of the record.
+ * @param[in] len of the data which is available.
+ * @param[out] hdr the decoded header.
+ * @return the length of the whole record, 0 if the record is
+ *	truncated, or -1 if it isn't a valid record.
+ */
+ssize_t fr_detail_decode_hdr(const uint8_t *data, size_t len,
+			     fr_detail_hdr_t *hdr)
+{
+	uint32_t value;
+
+	if (len < FR_DETAIL_HDR_LEN) return 0;
+
+	if (memcmp(data, detail_magic, sizeof(detail_magic)) != 0) {
+		fr_strerror_printf("Invalid magic number");
+		return -1;
+	}
+
+	if (data[4] != FR_DETAIL_VERSION) {
+		fr_strerror_printf("Unknown version %d", data[4]);
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->done = (data[5] != 0);
+	hdr->code = data[6];
+
+	switch (data[7]) {
+	case 0:
+		hdr->client_ip.af = AF_UNSPEC;
+		break;
+
+	case 4:
+		hdr->client_ip.af = AF_INET;
+		memcpy(&hdr->client_ip.ipaddr.ip4addr, data + 8, 4);
+		break;
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case 6:
+		hdr->client_ip.af = AF_INET6;
+		memcpy(&hdr->client_ip.ipaddr.ip6addr, data + 8, 16);
+		break;
+#endif
+
+	default:
+		fr_strerror_printf("Unknown address family %d", data[7]);
+		return -1;
+	}
+
+	memcpy(&value, data + 24, 4);
+	hdr->timestamp = ntohl(value);
+	memcpy(&value, data + 28, 4);
+	hdr->length = ntohl(value);
+	memcpy(&value, data + 32, 4);
+	hdr->checksum = ntohl(value);
+
+	if (hdr->length > FR_DETAIL_MAX_LEN) {
+		fr_strerror_printf("Record is too long");
+		return -1;
+	}
+
+	if ((len - FR_DETAIL_HDR_LEN) < hdr->length) return 0;
+
+	if (fr_hash(data + FR_DETAIL_HDR_LEN, hdr->length) != hdr->checksum) {
+		fr_strerror_printf("Checksum mismatch");
+		return -1;
+	}
+
+	return FR_DETAIL_HDR_LEN + hdr->length;
+}
+
+/** Decode the attributes of a binary detail record
+ *
+ * @param[in] data the start of the record, which has been checked
+ *	with fr_detail_decode_hdr().
+ * @param[in] hdr the decoded header.
+ * @param[out] vps where the attributes are added.
+ * @return 0 on success, -1 on error.
+ */
+int fr_detail_decode(const uint8_t *data, const fr_detail_hdr_t *hdr,
+		     VALUE_PAIR **vps)
+{
+	RADIUS_PACKET	packet;
+	VALUE_PAIR	*head, **tail, *vp;
+	const uint8_t	*ptr;
+	size_t		len;
+	ssize_t		my_len;
+
+	detail_fake_packet(&packet, hdr->code);
+
+	head = NULL;
+	tail = &head;
+	ptr = data + FR_DETAIL_HDR_LEN;
+	len = hdr->length;
+
+	while (len > 0) {
+		if (ptr[0] == 0) {
+			size_t attrlen;
+
+			if (len < 5) goto error;
+
+			attrlen = (ptr[3] << 8) | ptr[4];
+			if ((attrlen == 0) || ((attrlen + 5) > len)) goto error;
+
+			if (rad_data2vp((ptr[1] << 8) | ptr[2], 0, ptr + 5,
+					attrlen, &vp) < 0) goto error;
+			my_len = attrlen + 5;
+
+		} else {
+			my_len = rad_attr2vp(&packet, &packet, "", ptr, len, &vp);
+			if (my_len < 0) goto error;
+		}
+
+		*tail = vp;
+		while (vp) {
+			tail = &(vp->next);
+			vp = vp->next;
+		}
+
+		ptr += my_len;
+		len -= my_len;
+	}
+
+	for (tail = vps; *tail != NULL; tail = &((*tail)->next)) {
+		/* nothing */
+	}
+	*tail = head;
+
+	return 0;
+
+error:
+	pairfree(&head);
+	fr_strerror_printf("Invalid attribute at offset %d",
+			   (int) (ptr - data));
+	return -1;
+}
+
+/*
+ *	Look up an attribute name, going to the dictionary only if
+ *	it's not already in the cache.
+ */
+static const DICT_ATTR *detail_attrbyname(const DICT_ATTR **cache,
+					  const char *name, size_t len)
+{
+	const DICT_ATTR	**entry;
+	const DICT_ATTR	*da;
+	char		buffer[256];
+
+	entry = &cache[fr_hash(name, len) & (FR_DETAIL_DA_CACHE_SIZE - 1)];
+	if (*entry &&
+	    (strncasecmp((*entry)->name, name, len) == 0) &&
+	    ((*entry)->name[len] == '\0')) {
+		return *entry;
+	}
+
+	if (len >= sizeof(buffer)) return NULL;
+
+	memcpy(buffer, name, len);
+	buffer[len] = '\0';
+
+	da = dict_attrbyname(buffer);
+	if (da) *entry = da;
+
+	return da;
+}
+
+#define KEY_IS(_x) ((key_len == (sizeof(_x) - 1)) && (strncasecmp(key, _x, key_len) == 0))
+
+/** Decode one line of a text detail record
+ *
+ * The lines written by rlm_detail ("Attribute = value") are decoded
+ * here.  Anything else (tags, escapes, xlat's, unknown attributes,
+ * etc.) is given to userparse(), which is slower, but knows about
+ * all of it.
+ *
+ * @param[in,out] cache of attribute names, FR_DETAIL_DA_CACHE_SIZE
+ *	entries, all NULL to begin with.
+ * @param[in,out] hdr the timestamp and client_ip are set from the
+ *	"Timestamp" and "Client-IP-Address" lines.
+ * @param[in,out] tail where the attributes are added.
+ * @param[in] line without the trailing LF.
+ * @param[in] len of the line.
+ * @return 1 if the line was "Timestamp", 0 if any other line was
+ *	used or skipped, and -1 if the record is unusable.
+ */
+int fr_detail_read_pair(const DICT_ATTR **cache, fr_detail_hdr_t *hdr,
+			VALUE_PAIR ***tail, const char *line, size_t len)
+{
+	const char	*p, *end, *key, *value;
+	size_t		key_len, value_len;
+	const DICT_ATTR	*da;
+	VALUE_PAIR	*vp;
+	char		buffer[2048];
+
+	p = line;
+	end = line + len;
+
+	while ((p < end) && isspace((int) *p)) p++;
+
+	key = p;
+	while ((p < end) &&
+	       (isalnum((int) *p) || (*p == '-') || (*p == '_') || (*p == '.'))) {
+		p++;
+	}
+	key_len = p - key;
+	if ((key_len == 0) || (p == end) || (*p != ' ')) goto slow;
+
+	while ((p < end) && (*p == ' ')) p++;
+	if (((end - p) < 2) || (p[0] != '=') || (p[1] != ' ')) goto slow;
+
+	p += 2;
+	while ((p < end) && (*p == ' ')) p++;
+	if (p == end) goto slow;
+
+	if (*p == '"') {
+		value = ++p;
+		p = memchr(p, '"', end - p);
+		if (!p) goto slow;
+
+		value_len = p - value;
+		if (memchr(value, '\\', value_len) ||
+		    memchr(value, '%', value_len)) goto slow;
+		p++;
+	} else {
+		value = p;
+		while ((p < end) &&
+		       (isalnum((int) *p) || (*p == '-') || (*p == '_') ||
+			(*p == '.') || (*p == ':') || (*p == '/') || (*p == '+'))) {
+			p++;
+		}
+		value_len = p - value;
+	}
+
+	while ((p < end) && isspace((int) *p)) p++;
+	if (p != end) goto slow;
+
+	if (value_len >= sizeof(buffer)) goto slow;
+	memcpy(buffer, value, value_len);
+	buffer[value_len] = '\0';
+
+	/*
+	 *	Skip non-protocol attributes.
+	 */
+	if (KEY_IS("Request-Authenticator")) return 0;
+
+	/*
+	 *	The original client IP address.  We don't have the
+	 *	server IP address, or port.  Oh well.
+	 */
+	if (KEY_IS("Client-IP-Address")) {
+		hdr->client_ip.af = AF_INET;
+		if (ip_hton(buffer, AF_INET, &hdr->client_ip) < 0) {
+			fr_strerror_printf("Failed parsing Client-IP-Address");
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 *	The original time at which we received the packet.
+	 *	It's needed to properly calculate Acct-Delay-Time.
+	 */
+	if (KEY_IS("Timestamp")) {
+		hdr->timestamp = atoi(buffer);
+
+		vp = paircreate(NULL, PW_PACKET_ORIGINAL_TIMESTAMP, 0);
+		if (vp) {
+			vp->vp_date = (uint32_t) hdr->timestamp;
+			**tail = vp;
+			*tail = &(vp->next);
+		}
+		return 1;
+	}
+
+	da = detail_attrbyname(cache, key, key_len);
+	if (!da) goto slow;
+
+	/*
+	 *	Tags in the value, as in :1:foo
+	 */
+	if ((buffer[0] == ':') && da->flags.has_tag) goto slow;
+
+	vp = pairalloc(NULL, da);
+	if (!vp) return 0;
+
+	if (!pairparsevalue(vp, buffer)) {
+		pairbasicfree(vp);
+		return 0;
+	}
+
+	**tail = vp;
+	*tail = &(vp->next);
+	return 0;
+
+slow:
+	if (len >= sizeof(buffer)) {
+		DEBUG("Skipping long line in detail file\n");
+		return 0;
+	}
+	memcpy(buffer, line, len);
+	buffer[len] = '\0';
+
+	/*
+	 *	FIXME: do we want to check for non-protocol
+	 *	attributes like radsqlrelay does?
+	 */
+	vp = NULL;
+	if ((userparse(buffer, &vp) > 0) && (vp != NULL)) {
+		**tail = vp;
+		while (vp->next) vp = vp->next;
+		*tail = &(vp->next);
+	} else {
+		DEBUG("Skipping badly formatted line %s\n", buffer);
+	}
+
+	return 0;
+}
+
+#ifdef TESTING
+/*
+ *  From src/lib, in a tree which has been configured and built:
+ *
+ *  cc -O2 -DTESTING -D_LIBRADIUS -I .. \
+ *	-imacros ../freeradius-devel/build.h \
+ *	-imacros ../freeradius-devel/autoconf.h \
+ *	-imacros ../freeradius-devel/features.h detail.c -o detail \
+ *	-L ../../build/lib/.libs -lfreeradius-radius -ltalloc
+ *
+ *  ./detail <dictionary directory> <detail file>
+ *
+ *	Parses a text detail file twice: with fgets() and sscanf(),
+ *	as the detail reader used to, and from memory with
+ *	fr_detail_read_pair(), as it does now.  Both should find the
+ *	same attributes.
+ *
+ *  ./detail -w <records> <detail file>
+ *
+ *	Writes accounting records in the form rlm_detail uses, for
+ *	when there's no real detail file to hand.
+ */
+#include <sys/time.h>
+
+#define TEST_RECORD \
+	"Fri Oct 19 05:00:00 2026\n" \
+	"\tAcct-Session-Id = \"4D2BB8AC-%08x\"\n" \
+	"\tAcct-Status-Type = Stop\n" \
+	"\tAcct-Authentic = RADIUS\n" \
+	"\tUser-Name = \"user%u@example.com\"\n" \
+	"\tNAS-Port = %u\n" \
+	"\tCalled-Station-Id = \"00-04-5F-00-0F-D1\"\n" \
+	"\tCalling-Station-Id = \"00-01-24-80-B3-9C\"\n" \
+	"\tNAS-Port-Type = Wireless-802.11\n" \
+	"\tAcct-Session-Time = 3600\n" \
+	"\tAcct-Input-Octets = 12345678\n" \
+	"\tAcct-Output-Octets = 87654321\n" \
+	"\tFramed-IP-Address = 10.0.%u.%u\n" \
+	"\tNAS-IP-Address = 127.0.0.1\n" \
+	"\tEvent-Timestamp = \"Oct 19 2026 05:00:00 UTC\"\n" \
+	"\tAcct-Unique-Session-Id = \"%08x%08x\"\n" \
+	"\tTimestamp = %u\n" \
+	"\tRequest-Authenticator = Verified\n" \
+	"\n"
+
+static int test_write(unsigned int num, const char *filename)
+{
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		perror(filename);
+		return 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		fprintf(fp, TEST_RECORD, i, i, i & 0xffff, (i >> 8) & 0xff,
+			i & 0xff, i, ~i, 1350000000 + i);
+	}
+
+	if (fclose(fp) != 0) {
+		perror(filename);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void test_add(VALUE_PAIR ***tail, VALUE_PAIR *vp)
+{
+	**tail = vp;
+	while (vp) {
+		*tail = &(vp->next);
+		vp = vp->next;
+	}
+}
+
+static int test_count(VALUE_PAIR **vps)
+{
+	int num = 0;
+	VALUE_PAIR *vp;
+
+	for (vp = *vps; vp != NULL; vp = vp->next) num++;
+	pairfree(vps);
+
+	return num;
+}
+
+/*
+ *	The old reader.  A line at a time, sscanf() to look at the
+ *	key, and userparse() to decode it.
+ */
+static int test_fgets(FILE *fp, int *num_vps)
+{
+	int records = 0, reading = FALSE;
+	char buffer[2048], key[256], op[8], value[1024];
+	VALUE_PAIR *vps = NULL, *vp, **tail = &vps;
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		if (reading && (buffer[0] == '\n')) {
+			*num_vps += test_count(&vps);
+			tail = &vps;
+			records++;
+			reading = FALSE;
+			continue;
+		}
+
+		if (!reading) {
+			int y;
+
+			if (sscanf(buffer, "%*s %*s %*d %*d:%*d:%*d %d", &y)) {
+				reading = TRUE;
+			}
+			continue;
+		}
+
+		if (sscanf(buffer, "%255s %7s %1023s", key, op, value) != 3) {
+			continue;
+		}
+		if (!strchr(op, '=')) continue;
+
+		if ((strcasecmp(key, "Request-Authenticator") == 0) ||
+		    (strcasecmp(key, "Client-IP-Address") == 0)) {
+			continue;
+		}
+
+		if (strcasecmp(key, "Timestamp") == 0) {
+			vp = paircreate(NULL, PW_PACKET_ORIGINAL_TIMESTAMP, 0);
+			if (!vp) continue;
+
+			vp->vp_date = (uint32_t) atoi(value);
+			test_add(&tail, vp);
+			continue;
+		}
+
+		vp = NULL;
+		if ((userparse(buffer, &vp) > 0) && vp) {
+			test_add(&tail, vp);
+		}
+	}
+	*num_vps += test_count(&vps);
+
+	return records;
+}
+
+/*
+ *	The new reader.  Lines are found with memchr(), the same way
+ *	the detail listener does, and each one is decoded with
+ *	fr_detail_read_pair().
+ */
+static int test_memory(const char *start, size_t size, int *num_vps)
+{
+	int records = 0, reading = FALSE;
+	const char *line, *next, *end = start + size;
+	size_t len;
+	const DICT_ATTR *cache[FR_DETAIL_DA_CACHE_SIZE];
+	fr_detail_hdr_t hdr;
+	VALUE_PAIR *vps = NULL, **tail = &vps;
+
+	memset(cache, 0, sizeof(cache));
+	memset(&hdr, 0, sizeof(hdr));
+
+	for (next = start; next < end; ) {
+		line = next;
+		next = memchr(line, '\n', end - line);
+		if (!next) next = end;
+		len = next - line;
+		if (next < end) next++;
+
+		if (reading && (len == 0)) {
+			*num_vps += test_count(&vps);
+			tail = &vps;
+			records++;
+			reading = FALSE;
+			continue;
+		}
+
+		if (!reading) {
+			if ((len > 0) && !isspace((int) line[0])) reading = TRUE;
+			continue;
+		}
+
+		if ((len >= 5) && (memcmp(line, "\tDone", 5) == 0)) continue;
+
+		if (fr_detail_read_pair(cache, &hdr, &tail, line, len) < 0) {
+			fr_perror("detail");
+			exit(1);
+		}
+	}
+	*num_vps += test_count(&vps);
+
+	return records;
+}
+
+int main(int argc, char **argv)
+{
+	int records, vps_fgets = 0, vps_memory = 0;
+	long size;
+	char *data;
+	double t_fgets, t_memory;
+	FILE *fp;
+	struct timeval start;
+
+	if ((argc == 4) && (strcmp(argv[1], "-w") == 0)) {
+		return test_write(atoi(argv[2]), argv[3]);
+	}
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: detail <dictionary directory> <detail file>\n"
+			"       detail -w <records> <detail file>\n");
+		exit(1);
+	}
+
+	if (dict_init(argv[1], "dictionary") < 0) {
+		fr_perror("detail");
+		exit(1);
+	}
+
+	fp = fopen(argv[2], "r");
+	if (!fp) {
+		perror(argv[2]);
+		exit(1);
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	data = malloc(size);
+	if (!data) exit(1);
+
+	if (fread(data, 1, size, fp) != (size_t) size) {
+		perror("fread");
+		exit(1);
+	}
+
+	printf("%s: %ld bytes\n", argv[2], size);
+
+	rewind(fp);
+	gettimeofday(&start, NULL);
+	records = test_fgets(fp, &vps_fgets);
+	t_fgets = fr_tv_elapsed(&start);
+	printf("fgets:  %d records, %d attributes, %.1fs, %.0f records/s\n",
+	       records, vps_fgets, t_fgets, records / t_fgets);
+
+	gettimeofday(&start, NULL);
+	records = test_memory(data, size, &vps_memory);
+	t_memory = fr_tv_elapsed(&start);
+	printf("memory: %d records, %d attributes, %.1fs, %.0f records/s\n",
+	       records, vps_memory, t_memory, records / t_memory);
+
+	if (vps_fgets != vps_memory) {
+		fprintf(stderr, "Attribute counts differ!\n");
+		exit(1);
+	}
+
+	free(data);
+	fclose(fp);
+
+	return 0;
+}
+#endif
@@ -786,6 +786,45 @@ uint32_t fr_hash_string(const char *p)
 }
 
 
+/*
+ *	Spread the bits of a 32-bit value over the whole word.
+ *	This is the finalizer from MurmurHash3.
+ */
+static uint32_t hash_mix(uint32_t hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+/*
+ *	Rendezvous hashing.  The score for a node is the highest of
+ *	"weight" independent draws, so a node of weight W wins W/sum
+ *	of the keys.
+ *
+ *	When a node is added or removed, only the keys which it wins
+ *	(or won) change nodes.  Everything else stays where it was.
+ */
+uint32_t fr_hash_rendezvous(uint32_t key, uint32_t node, int weight)
+{
+	int i;
+	uint32_t score, best = 0;
+
+	if (weight < 1) weight = 1;
+
+	for (i = 0; i < weight; i++) {
+		score = hash_mix(key ^ hash_mix(node + (i * 0x9e3779b9)));
+		if (score > best) best = score;
+	}
+
+	return best;
+}
+
+
 #ifdef TESTING
 /*
  *  cc -g -DTESTING -I ../include hash.c -o hash
@@ -801,6 +840,132 @@ static uint32_t hash_int(const void *data)
 	return fr_hash((int *) data, sizeof(int));
 }
 
+#define RV_NODES (8)
+#define RV_KEYS (200000)
+
+static int rendezvous_pick(int num_nodes, const int *weights, uint32_t key)
+{
+	int i, found = -1;
+	uint32_t score, best = 0;
+
+	for (i = 0; i < num_nodes; i++) {
+		if (!weights[i]) continue;	/* removed */
+
+		score = fr_hash_rendezvous(key, fr_hash(&i, sizeof(i)),
+					   weights[i]);
+		if ((found < 0) || (score > best)) {
+			best = score;
+			found = i;
+		}
+	}
+
+	return found;
+}
+
+/*
+ *	Check that keys are spread evenly, that weights are honoured,
+ *	and that changing the membership moves only 1/N of the keys.
+ */
+static int rendezvous_test(void)
+{
+	int i, node, total, moved, bad;
+	int weights[RV_NODES];
+	int counts[RV_NODES];
+	static uint8_t picks[RV_KEYS];
+	uint32_t key;
+
+	/*
+	 *	Even distribution over equal weights.
+	 */
+	for (i = 0; i < RV_NODES; i++) weights[i] = 1;
+	weights[RV_NODES - 1] = 0; /* not yet added */
+	memset(counts, 0, sizeof(counts));
+
+	for (i = 0; i < RV_KEYS; i++) {
+		key = fr_hash(&i, sizeof(i));
+		picks[i] = rendezvous_pick(RV_NODES, weights, key);
+		counts[picks[i]]++;
+	}
+
+	bad = 0;
+	for (i = 0; i < RV_NODES - 1; i++) {
+		printf("node %d\t%d\t%.2f%%\n", i, counts[i],
+		       (100.0 * counts[i]) / RV_KEYS);
+		if ((counts[i] < (RV_KEYS / (RV_NODES - 1)) * 95 / 100) ||
+		    (counts[i] > (RV_KEYS / (RV_NODES - 1)) * 105 / 100)) bad++;
+	}
+	if (bad) {
+		fprintf(stderr, "Uneven distribution\n");
+		return -1;
+	}
+
+	/*
+	 *	Remove a node.  Only its keys should move.
+	 */
+	weights[2] = 0;
+	moved = bad = 0;
+	for (i = 0; i < RV_KEYS; i++) {
+		key = fr_hash(&i, sizeof(i));
+		node = rendezvous_pick(RV_NODES, weights, key);
+		if (node == picks[i]) continue;
+
+		moved++;
+		if (picks[i] != 2) bad++;
+	}
+	printf("remove: moved %.2f%% of keys (ideal %.2f%%), %d wrongly\n",
+	       (100.0 * moved) / RV_KEYS, 100.0 / (RV_NODES - 1), bad);
+	if (bad) return -1;
+	weights[2] = 1;
+
+	/*
+	 *	Add a node.  Only keys which move to it should move.
+	 */
+	weights[RV_NODES - 1] = 1;
+	moved = bad = 0;
+	for (i = 0; i < RV_KEYS; i++) {
+		key = fr_hash(&i, sizeof(i));
+		node = rendezvous_pick(RV_NODES, weights, key);
+		if (node == picks[i]) continue;
+
+		moved++;
+		if (node != (RV_NODES - 1)) bad++;
+	}
+	printf("add: moved %.2f%% of keys (ideal %.2f%%), %d wrongly\n",
+	       (100.0 * moved) / RV_KEYS, 100.0 / RV_NODES, bad);
+	if (bad) return -1;
+
+	/*
+	 *	Weights 1..N should get keys in proportion.
+	 */
+	total = 0;
+	for (i = 0; i < RV_NODES; i++) {
+		weights[i] = i + 1;
+		total += weights[i];
+	}
+	memset(counts, 0, sizeof(counts));
+
+	for (i = 0; i < RV_KEYS; i++) {
+		key = fr_hash(&i, sizeof(i));
+		counts[rendezvous_pick(RV_NODES, weights, key)]++;
+	}
+
+	bad = 0;
+	for (i = 0; i < RV_NODES; i++) {
+		double expected = ((double) RV_KEYS * weights[i]) / total;
+
+		printf("weight %d\t%d\t(expected %.0f)\n", weights[i],
+		       counts[i], expected);
+		if ((counts[i] < expected * 0.93) ||
+		    (counts[i] > expected * 1.07)) bad++;
+	}
+	if (bad) {
+		fprintf(stderr, "Weights are not honoured\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 #define MAX 1024*1024
 int main(int argc, char **argv)
 {
@@ -867,6 +1032,8 @@ int main(int argc, char **argv)
 	fr_hash_table_free(ht);
 	free(array);
 
+	if (rendezvous_test() < 0) exit(1);
+
 	exit(0);
 }
 #endif
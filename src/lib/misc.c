@@ -653,3 +653,45 @@ int fr_sockaddr2ipaddr(const struct sockaddr_storage *sa, socklen_t salen,
 
 	return 1;
 }
+
+#define USEC 1000000
+
+/** Subtract one timeval from another
+ *
+ * @param end the later time.
+ * @param start the earlier time.
+ * @param elapsed where the difference is written.
+ */
+void fr_tv_sub(const struct timeval *end, const struct timeval *start,
+	       struct timeval *elapsed)
+{
+	elapsed->tv_sec = end->tv_sec - start->tv_sec;
+	if (elapsed->tv_sec > 0) {
+		elapsed->tv_sec--;
+		elapsed->tv_usec = USEC;
+	} else {
+		elapsed->tv_usec = 0;
+	}
+	elapsed->tv_usec += end->tv_usec;
+	elapsed->tv_usec -= start->tv_usec;
+
+	if (elapsed->tv_usec >= USEC) {
+		elapsed->tv_usec -= USEC;
+		elapsed->tv_sec++;
+	}
+}
+
+/** Seconds since a time, for the timing loops in TESTING programs
+ *
+ * @param start from gettimeofday().
+ * @return the seconds since start, with fractions.
+ */
+double fr_tv_elapsed(const struct timeval *start)
+{
+	struct timeval now, elapsed;
+
+	gettimeofday(&now, NULL);
+	fr_tv_sub(&now, start, &elapsed);
+
+	return elapsed.tv_sec + ((double) elapsed.tv_usec / USEC);
+}
@@ -249,6 +249,14 @@ typedef struct fr_packet_socket_t {
 #endif
 
 	uint8_t		id[32];
+
+	/*
+	 *	Free IDs, in the order they were freed.  IDs are
+	 *	allocated from the head, and freed to the tail, so
+	 *	an ID is re-used as late as possible.
+	 */
+	int		free_head;
+	uint8_t		free_ids[256];
 } fr_packet_socket_t;
 
 
@@ -259,6 +267,14 @@ typedef struct fr_packet_socket_t {
 
 #define MAX_QUEUES (8)
 
+/*
+ *	Remembers which socket was last used for a destination, so
+ *	that we don't have to search all of the sockets on every
+ *	allocation.
+ */
+#define DST_CACHE_SIZE (64)
+#define DST_CACHE_MASK (DST_CACHE_SIZE - 1)
+
 /*
  *	Structure defining a list of packets (incoming or outgoing)
  *	that should be managed.
@@ -270,6 +286,9 @@ struct fr_packet_list_t {
 	int		num_outgoing;
 	int		last_recv;
 	int		num_sockets;
+	int		active[MAX_SOCKETS]; /* indexes of sockets in use */
+
+	int		dst_cache[DST_CACHE_SIZE];
 
 	fr_packet_socket_t sockets[MAX_SOCKETS];
 };
@@ -329,6 +348,7 @@ int fr_packet_list_socket_thaw(fr_packet_list_t *pl, int sockfd)
 int fr_packet_list_socket_remove(fr_packet_list_t *pl, int sockfd,
 				 void **pctx)
 {
+	int i;
 	fr_packet_socket_t *ps;
 
 	if (!pl) return 0;
@@ -341,6 +361,13 @@ int fr_packet_list_socket_remove(fr_packet_list_t *pl, int sockfd,
 	 */
 	if (ps->num_outgoing != 0) return 0;
 
+	for (i = 0; i < pl->num_sockets; i++) {
+		if (pl->active[i] != (ps - pl->sockets)) continue;
+
+		pl->active[i] = pl->active[pl->num_sockets - 1];
+		break;
+	}
+
 	ps->sockfd = -1;
 	pl->num_sockets--;
 	if (pctx) *pctx = ps->ctx;
@@ -397,6 +424,17 @@ int fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	ps->proto = proto;
 #endif
 
+	/*
+	 *	Start with the IDs in a random order, so that they
+	 *	aren't predictable.
+	 */
+	for (i = 0; i < 256; i++) {
+		int j = fr_rand() % (i + 1);
+
+		ps->free_ids[i] = ps->free_ids[j];
+		ps->free_ids[j] = i;
+	}
+
 	/*
 	 *	Get address family, etc. first, so we know if we
 	 *	need to do udpfromto.
@@ -431,7 +469,7 @@ int fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	 *	As the last step before returning.
 	 */
 	ps->sockfd = sockfd;
-	pl->num_sockets++;
+	pl->active[pl->num_sockets++] = ps - pl->sockets;
 
 	return 1;
 }
@@ -475,6 +513,10 @@ fr_packet_list_t *fr_packet_list_create(int alloc_id)
 		pl->sockets[i].sockfd = -1;
 	}
 
+	for (i = 0; i < DST_CACHE_SIZE; i++) {
+		pl->dst_cache[i] = -1;
+	}
+
 	pl->alloc_id = alloc_id;
 
 	return pl;
@@ -562,6 +604,91 @@ int fr_packet_list_num_elements(fr_packet_list_t *pl)
 }
 
 
+static uint32_t packet_ipaddr_hash(const fr_ipaddr_t *ipaddr, uint32_t hash)
+{
+	if (ipaddr->af == AF_INET) {
+		return fr_hash_update(&ipaddr->ipaddr.ip4addr,
+				      sizeof(ipaddr->ipaddr.ip4addr), hash);
+	}
+
+	return fr_hash_update(&ipaddr->ipaddr.ip6addr,
+			      sizeof(ipaddr->ipaddr.ip6addr), hash);
+}
+
+/*
+ *	Whether or not a new packet to the request's destination can
+ *	be sent from this socket.
+ */
+static int packet_socket_usable(fr_packet_socket_t *ps, int proto,
+				RADIUS_PACKET *request, int src_any)
+{
+	if (ps->sockfd == -1) return 0;
+
+	/*
+	 *	This socket is marked as "don't use for new
+	 *	packets".  But we can still receive packets
+	 *	that are outstanding.
+	 */
+	if (ps->dont_use) return 0;
+
+	/*
+	 *	All IDs are allocated: ignore it.
+	 */
+	if (ps->num_outgoing == 256) return 0;
+
+#ifdef WITH_TCP
+	if (ps->proto != proto) return 0;
+#endif
+
+	/*
+	 *	Address families don't match, skip it.
+	 */
+	if (ps->src_ipaddr.af != request->dst_ipaddr.af) return 0;
+
+	/*
+	 *	MUST match dst port, if we have one.
+	 */
+	if ((ps->dst_port != 0) &&
+	    (ps->dst_port != request->dst_port)) return 0;
+
+	/*
+	 *	MUST match requested src port, if one has been given.
+	 */
+	if ((request->src_port != 0) &&
+	    (ps->src_port != request->src_port)) return 0;
+
+	/*
+	 *	We're sourcing from *, and they asked for a
+	 *	specific source address: ignore it.
+	 */
+	if (ps->src_any && !src_any) return 0;
+
+	/*
+	 *	We're sourcing from a specific IP, and they
+	 *	asked for a source IP that isn't us: ignore
+	 *	it.
+	 */
+	if (!ps->src_any && !src_any &&
+	    (fr_ipaddr_cmp(&request->src_ipaddr,
+			   &ps->src_ipaddr) != 0)) return 0;
+
+	/*
+	 *	UDP sockets are allowed to match
+	 *	destination IPs exactly, OR a socket
+	 *	with destination * is allowed to match
+	 *	any requested destination.
+	 *
+	 *	TCP sockets must match the destination
+	 *	exactly.  They *always* have dst_any=0,
+	 *	so the first check always matches.
+	 */
+	if (!ps->dst_any &&
+	    (fr_ipaddr_cmp(&request->dst_ipaddr,
+			   &ps->dst_ipaddr) != 0)) return 0;
+
+	return 1;
+}
+
 /*
  *	1 == ID was allocated & assigned
  *	0 == couldn't allocate ID.
@@ -584,8 +711,9 @@ int fr_packet_list_num_elements(fr_packet_list_t *pl)
 int fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET *request, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, j, id;
 	int src_any = 0;
+	uint32_t hash;
 	fr_packet_socket_t *ps;
 
 	if ((request->dst_ipaddr.af == AF_UNSPEC) ||
@@ -624,136 +752,57 @@ int fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	}
 
 	/*
-	 *	FIXME: Go to an LRU system.  This prevents ID re-use
-	 *	for as long as possible.  The main problem with that
-	 *	approach is that it requires us to populate the
-	 *	LRU/FIFO when we add a new socket, or a new destination,
-	 *	which can be expensive.
-	 *
-	 *	The LRU can be avoided if the caller takes care to free
-	 *	Id's only when all responses have been received, OR after
-	 *	a timeout.
-	 *
-	 *	Right now, the random approach is almost OK... it's
-	 *	brute-force over all of the available ID's, BUT using
-	 *	random numbers for everything spreads the load a bit.
-	 *
-	 *	The old method had a hash lookup on allocation AND
-	 *	on free.  The new method has brute-force on allocation,
-	 *	and near-zero cost on free.
+	 *	Try the socket we used last time for this
+	 *	destination.  If it's full, or no longer usable,
+	 *	find the matching socket with the most free IDs.
 	 */
+	hash = packet_ipaddr_hash(&request->dst_ipaddr, proto);
+	hash = fr_hash_update(&request->dst_port, sizeof(request->dst_port), hash);
+	hash = fr_hash_update(&request->src_port, sizeof(request->src_port), hash);
+	if (!src_any) {
+		hash ^= packet_ipaddr_hash(&request->src_ipaddr, 0);
+	}
+	hash &= DST_CACHE_MASK;
 
-	id = fd = -1;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
-
-#define ID_i ((i + start_i) & SOCKOFFSET_MASK)
-	for (i = 0; i < MAX_SOCKETS; i++) {
-		if (pl->sockets[ID_i].sockfd == -1) continue; /* paranoia */
-
-		ps = &(pl->sockets[ID_i]);
-
-		/*
-		 *	This socket is marked as "don't use for new
-		 *	packets".  But we can still receive packets
-		 *	that are outstanding.
-		 */
-		if (ps->dont_use) continue;
-
-		/*
-		 *	All IDs are allocated: ignore it.
-		 */
-		if (ps->num_outgoing == 256) continue;
-
-#ifdef WITH_TCP
-		if (ps->proto != proto) continue;
-#endif
-
-		/*
-		 *	Address families don't match, skip it.
-		 */
-		if (ps->src_ipaddr.af != request->dst_ipaddr.af) continue;
-
-		/*
-		 *	MUST match dst port, if we have one.
-		 */
-		if ((ps->dst_port != 0) &&
-		    (ps->dst_port != request->dst_port)) continue;
-
-		/*
-		 *	MUST match requested src port, if one has been given.
-		 */
-		if ((request->src_port != 0) &&
-		    (ps->src_port != request->src_port)) continue;
-
-		/*
-		 *	We're sourcing from *, and they asked for a
-		 *	specific source address: ignore it.
-		 */
-		if (ps->src_any && !src_any) continue;
+	ps = NULL;
+	i = pl->dst_cache[hash];
+	if ((i >= 0) &&
+	    packet_socket_usable(&pl->sockets[i], proto, request, src_any)) {
+		ps = &pl->sockets[i];
 
-		/*
-		 *	We're sourcing from a specific IP, and they
-		 *	asked for a source IP that isn't us: ignore
-		 *	it.
-		 */
-		if (!ps->src_any && !src_any &&
-		    (fr_ipaddr_cmp(&request->src_ipaddr,
-				   &ps->src_ipaddr) != 0)) continue;
+	} else if (pl->num_sockets > 0) {
+		int start = fr_rand() % pl->num_sockets;
 
-		/*
-		 *	UDP sockets are allowed to match
-		 *	destination IPs exactly, OR a socket
-		 *	with destination * is allowed to match
-		 *	any requested destination.
-		 *
-		 *	TCP sockets must match the destination
-		 *	exactly.  They *always* have dst_any=0,
-		 *	so the first check always matches.
-		 */
-		if (!ps->dst_any &&
-		    (fr_ipaddr_cmp(&request->dst_ipaddr,
-				   &ps->dst_ipaddr) != 0)) continue;
-		
-		/*
-		 *	Otherwise, this socket is OK to use.
-		 */
+		for (j = 0; j < pl->num_sockets; j++) {
+			i = pl->active[(j + start) % pl->num_sockets];
 
-		/*
-		 *	Look for a free Id, starting from a random number.
-		 */
-		start_j = fr_rand() & 0x1f;
-#define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
-
-
-			start_k = fr_rand() & 0x07;
-#define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
+			if (!packet_socket_usable(&pl->sockets[i], proto,
+						  request, src_any)) continue;
 
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
+			if (!ps ||
+			    (pl->sockets[i].num_outgoing < ps->num_outgoing)) {
+				ps = &pl->sockets[i];
+				pl->dst_cache[hash] = i;
 			}
-			if (fd >= 0) break;
 		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
-		if (fd >= 0) break;
-		break;
 	}
 
 	/*
 	 *	Ask the caller to allocate a new ID.
 	 */
-	if (fd < 0) {
+	if (!ps) {
 		fr_strerror_printf("Failed finding socket, caller must allocate a new one");
 		return 0;
 	}
 
+	/*
+	 *	Take the ID which has been free for the longest time.
+	 */
+	id = ps->free_ids[ps->free_head];
+	ps->free_head = (ps->free_head + 1) & 0xff;
+
+	ps->id[id >> 3] |= (1 << (id & 0x07));
+
 	ps->num_outgoing++;
 	pl->num_outgoing++;
 
@@ -785,14 +834,22 @@ int fr_packet_list_id_free(fr_packet_list_t *pl,
 	ps = fr_socket_find(pl, request->sockfd);
 	if (!ps) return 0;
 
-#if 0
-	if (!ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) {
-		exit(1);
+	/*
+	 *	It's already free.  Don't put it into the free list
+	 *	twice.
+	 */
+	if ((ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) == 0) {
+		return 0;
 	}
-#endif
 
 	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
 
+	/*
+	 *	The tail of the free list is 256 - num_outgoing
+	 *	entries after the head.
+	 */
+	ps->free_ids[(ps->free_head + 256 - ps->num_outgoing) & 0xff] = request->id;
+
 	ps->num_outgoing--;
 	pl->num_outgoing--;
 
@@ -888,3 +945,202 @@ int fr_packet_list_num_outgoing(fr_packet_list_t *pl)
 
 	return pl->num_outgoing;
 }
+
+#ifdef TESTING
+/*
+ *  From src/lib, in a tree which has been configured and built:
+ *
+ *  cc -O2 -DTESTING -D_LIBRADIUS -I .. \
+ *	-imacros ../freeradius-devel/build.h \
+ *	-imacros ../freeradius-devel/autoconf.h \
+ *	-imacros ../freeradius-devel/features.h packet.c -o packet \
+ *	-L ../../build/lib/.libs -lfreeradius-radius -ltalloc
+ *
+ *  ./packet
+ *
+ *	Measures ID allocation with most of the IDs in use, and how
+ *	soon a freed ID is used again.  The old allocator (random
+ *	probing of the bitmaps) is included for comparison.
+ */
+#include <sys/time.h>
+
+#define TEST_SOCKETS	(4)
+#define TEST_IDS	(TEST_SOCKETS * 256)
+#define TEST_LOOPS	(1000000)
+#define TEST_SOON	(16)
+
+static int old_id_alloc(fr_packet_list_t *pl, RADIUS_PACKET *request)
+{
+	int i, j, k, fd, id, start_i, start_j, start_k;
+	fr_packet_socket_t *ps = NULL;
+
+	id = fd = -1;
+	start_i = fr_rand() & SOCKOFFSET_MASK;
+
+#define ID_i ((i + start_i) & SOCKOFFSET_MASK)
+	for (i = 0; i < MAX_SOCKETS; i++) {
+		ps = &(pl->sockets[ID_i]);
+
+		if (!packet_socket_usable(ps, IPPROTO_UDP, request, 1)) continue;
+
+		start_j = fr_rand() & 0x1f;
+#define ID_j ((j + start_j) & 0x1f)
+		for (j = 0; j < 32; j++) {
+			if (ps->id[ID_j] == 0xff) continue;
+
+			start_k = fr_rand() & 0x07;
+#define ID_k ((k + start_k) & 0x07)
+			for (k = 0; k < 8; k++) {
+				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
+
+				ps->id[ID_j] |= (1 << ID_k);
+				id = (ID_j * 8) + ID_k;
+				fd = i;
+				break;
+			}
+			if (fd >= 0) break;
+		}
+#undef ID_i
+#undef ID_j
+#undef ID_k
+		break;
+	}
+
+	if (fd < 0) return 0;
+
+	ps->num_outgoing++;
+	pl->num_outgoing++;
+	request->id = id;
+	request->sockfd = ps->sockfd;
+	request->src_ipaddr = ps->src_ipaddr;
+	request->src_port = ps->src_port;
+
+	return 1;
+}
+
+static int old_id_free(fr_packet_list_t *pl, RADIUS_PACKET *request)
+{
+	fr_packet_socket_t *ps;
+
+	ps = fr_socket_find(pl, request->sockfd);
+	if (!ps) return 0;
+
+	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->num_outgoing--;
+	pl->num_outgoing--;
+
+	return 1;
+}
+
+/*
+ *	Which of the test sockets a packet was sent from.
+ */
+static int test_socket(const int *fds, int sockfd)
+{
+	int sock;
+
+	for (sock = 0; sock < TEST_SOCKETS; sock++) {
+		if (fds[sock] == sockfd) return sock;
+	}
+
+	fprintf(stderr, "Packet has unknown socket %d\n", sockfd);
+	exit(1);
+}
+
+static void test_occupancy(int percent, int old)
+{
+	int i, n, slot, sock, soon = 0;
+	int num = (TEST_IDS * percent) / 100;
+	int fds[TEST_SOCKETS];
+	static RADIUS_PACKET packets[TEST_IDS];
+	static int last_freed[TEST_SOCKETS][256];
+	fr_packet_list_t *pl;
+	fr_ipaddr_t dst;
+	struct timeval start;
+	double ns;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.af = AF_INET;
+	dst.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	pl = fr_packet_list_create(1);
+	for (i = 0; i < TEST_SOCKETS; i++) {
+		fds[i] = fr_socket(&dst, 0);
+		if ((fds[i] < 0) ||
+		    !fr_packet_list_socket_add(pl, fds[i], IPPROTO_UDP, &dst,
+					       1812, NULL)) {
+			fprintf(stderr, "Failed adding socket: %s\n",
+				fr_strerror());
+			exit(1);
+		}
+	}
+
+	/*
+	 *	Fill the list to the requested occupancy.  The old
+	 *	allocator only ever uses the first socket it finds,
+	 *	so spread the packets over all of the sockets by
+	 *	asking for a particular source port.
+	 */
+	memset(packets, 0, sizeof(packets));
+	for (i = 0; i < num; i++) {
+		packets[i].dst_ipaddr = dst;
+		packets[i].dst_port = 1812;
+		packets[i].src_ipaddr.af = AF_UNSPEC;
+		packets[i].src_port = pl->sockets[pl->active[i % TEST_SOCKETS]].src_port;
+		if (!(old ? old_id_alloc(pl, &packets[i]) :
+		      fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packets[i], NULL))) {
+			fprintf(stderr, "Failed allocating %d: %s\n", i,
+				fr_strerror());
+			exit(1);
+		}
+	}
+
+	/*
+	 *	Free a random outstanding ID, and allocate a new one
+	 *	from the same socket.
+	 */
+	memset(last_freed, 0, sizeof(last_freed));
+	gettimeofday(&start, NULL);
+	for (n = 1; n <= TEST_LOOPS; n++) {
+		slot = fr_rand() % num;
+
+		sock = test_socket(fds, packets[slot].sockfd);
+		last_freed[sock][packets[slot].id] = n;
+
+		if (old) {
+			old_id_free(pl, &packets[slot]);
+			old_id_alloc(pl, &packets[slot]);
+		} else {
+			fr_packet_list_id_free(pl, &packets[slot]);
+			fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packets[slot], NULL);
+		}
+
+		/*
+		 *	The new ID may be on a different socket.
+		 */
+		sock = test_socket(fds, packets[slot].sockfd);
+		if ((n - last_freed[sock][packets[slot].id]) < TEST_SOON) soon++;
+	}
+	ns = fr_tv_elapsed(&start) * 1e9;
+
+	printf("%s %3d%% busy: %6.1f ns/alloc, %5.2f%% of IDs re-used within %d allocations\n",
+	       old ? "old " : "fifo", percent, ns / TEST_LOOPS,
+	       (100.0 * soon) / TEST_LOOPS, TEST_SOON);
+
+	for (i = 0; i < TEST_SOCKETS; i++) close(fds[i]);
+	fr_packet_list_free(pl);
+}
+
+int main(UNUSED int argc, UNUSED char **argv)
+{
+	static const int percent[] = { 50, 90, 95, 99, 0 };
+	int i;
+
+	for (i = 0; percent[i] != 0; i++) {
+		test_occupancy(percent[i], 1);
+		test_occupancy(percent[i], 0);
+	}
+
+	return 0;
+}
+#endif
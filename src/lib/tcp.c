@@ -339,6 +339,143 @@ int fr_tcp_read_packet(RADIUS_PACKET *packet, int flags)
 	return 1;		/* done reading the packet */
 }
 
+/*
+ *	Move any partial packet to the start of the buffer, and
+ *	return how much room there is after it.  The caller reads
+ *	into buf->data + buf->end, and adds what it read to buf->end.
+ */
+size_t fr_tcp_buffer_room(fr_tcp_buffer_t *buf)
+{
+	if (buf->start == buf->end) {
+		buf->start = buf->end = 0;
+
+	} else if (buf->start > 0) {
+		memmove(buf->data, buf->data + buf->start,
+			buf->end - buf->start);
+		buf->end -= buf->start;
+		buf->start = 0;
+	}
+
+	return sizeof(buf->data) - buf->end;
+}
+
+/*
+ *	Read as much as the socket has, up to the size of the buffer.
+ *
+ *	Returns the number of bytes read, -2 if the other end closed
+ *	the connection, or -1 on error.
+ */
+ssize_t fr_tcp_buffer_read(fr_tcp_buffer_t *buf, int sockfd)
+{
+	ssize_t len;
+	size_t room;
+
+	room = fr_tcp_buffer_room(buf);
+
+	/*
+	 *	fr_tcp_buffer_packet() always takes complete packets
+	 *	out, and a packet is much smaller than the buffer.
+	 */
+	if (room == 0) {
+		fr_strerror_printf("Receive buffer is full");
+		return -1;
+	}
+
+	len = recv(sockfd, buf->data + buf->end, room, 0);
+	if (len == 0) return -2; /* clean close */
+
+#ifdef ECONNRESET
+	if ((len < 0) && (errno == ECONNRESET)) { /* forced */
+		return -2;
+	}
+#endif
+
+	if (len < 0) {
+		fr_strerror_printf("Error receiving packet: %s",
+				   strerror(errno));
+		return -1;
+	}
+
+	buf->end += len;
+
+	return len;
+}
+
+/*
+ *	Take the next complete packet out of the buffer.
+ *
+ *	Returns 1 and fills in *packet_p if there was a packet, 0 if
+ *	more data is needed, or -1 if the data is not RADIUS.  The
+ *	stream cannot be re-synchronized after an error, so the
+ *	caller should close the connection.
+ */
+int fr_tcp_buffer_packet(fr_tcp_buffer_t *buf, int sockfd, int flags,
+			 RADIUS_PACKET **packet_p)
+{
+	size_t packet_len;
+	uint8_t *p;
+	RADIUS_PACKET *packet;
+
+	*packet_p = NULL;
+
+	if ((buf->end - buf->start) < 4) return 0;
+
+	p = buf->data + buf->start;
+	packet_len = (p[2] << 8) | p[3];
+
+	if (packet_len < AUTH_HDR_LEN) {
+		fr_strerror_printf("Discarding packet: Smaller than RFC minimum of 20 bytes.");
+		return -1;
+	}
+
+	if (packet_len > MAX_PACKET_LEN) {
+		fr_strerror_printf("Discarding packet: Larger than RFC limitation of 4096 bytes.");
+		return -1;
+	}
+
+	if ((buf->end - buf->start) < packet_len) return 0;
+
+	packet = rad_alloc(NULL, 0);
+	if (!packet) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	packet->sockfd = sockfd;
+	packet->data = talloc_array(packet, uint8_t, packet_len);
+	if (!packet->data) {
+		rad_free(&packet);
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	memcpy(packet->data, p, packet_len);
+	packet->data_len = packet->partial = packet_len;
+	buf->start += packet_len;
+
+	if (!rad_packet_ok(packet, flags)) {
+		rad_free(&packet);
+		return -1;
+	}
+
+	packet->vps = NULL;
+
+	if (fr_debug_flag) {
+		if ((packet->code > 0) && (packet->code < FR_MAX_PACKET_CODE)) {
+			DEBUG("rad_recv: %s packet from socket %d",
+			      fr_packet_codes[packet->code], sockfd);
+		} else {
+			DEBUG("rad_recv: Packet from socket %d code=%d",
+			      sockfd, packet->code);
+		}
+		DEBUG(", id=%d, length=%zu\n", packet->id, packet->data_len);
+	}
+
+	*packet_p = packet;
+
+	return 1;
+}
+
 RADIUS_PACKET *fr_tcp_accept(int sockfd)
 {
 	int newfd;
@@ -0,0 +1,675 @@
+/*
+ * trie.c	Path compressed binary (PATRICIA) tries.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2013  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/trie.h>
+
+/*
+ *	Each node holds a prefix of "bits" bits.  A node may or may
+ *	not have data.  Nodes without data ("glue" nodes) exist only
+ *	to split two branches, so they always have two children.
+ *	The child is selected by the first bit after the prefix.
+ *
+ *	A longest prefix match is a single walk from the root, which
+ *	remembers the last node with data that matched the key.
+ *
+ *	Readers do not lock.  Writers MUST be serialized by the
+ *	caller.  Writers never change the key or the children of a
+ *	node which is visible to readers, except to swap a single
+ *	pointer.  Nodes which are removed from the trie are kept on
+ *	a "dead" list for FR_TRIE_GRACE seconds, so that readers
+ *	which are still walking through them don't crash.
+ */
+#define FR_TRIE_GRACE (60)
+
+#define TRIE_BYTES ((FR_TRIE_MAX_BITS + 7) / 8)
+#define TRIE_BIT(_key, _n) ((((const uint8_t *) (_key))[(_n) >> 3] >> (7 - ((_n) & 0x07))) & 0x01)
+
+/*
+ *	Make sure that the node is fully written before it's linked
+ *	into the trie.
+ */
+#ifdef __GNUC__
+#define TRIE_PUBLISH() __sync_synchronize()
+#else
+#define TRIE_PUBLISH()
+#endif
+
+typedef struct fr_trie_node_t fr_trie_node_t;
+
+struct fr_trie_node_t {
+	fr_trie_node_t	*child[2];
+	void		*data;
+	int		bits;
+	uint8_t		key[TRIE_BYTES];
+
+	fr_trie_node_t	*next_dead;	//!< Only used once it's removed.
+	time_t		when;		//!< When it was removed.
+};
+
+struct fr_trie_t {
+	fr_trie_node_t	*root;
+	int		max_bits;
+	int		num_elements;
+
+	fr_trie_node_t	*dead_head;
+	fr_trie_node_t	*dead_tail;
+};
+
+
+/*
+ *	Return the number of leading bits which are the same in both
+ *	keys, up to "max".
+ */
+static int trie_common(const uint8_t *a, const uint8_t *b, int max)
+{
+	int i, bits;
+	uint8_t diff;
+
+	for (i = 0; (i * 8) < max; i++) {
+		if (a[i] == b[i]) continue;
+
+		diff = a[i] ^ b[i];
+		bits = i * 8;
+		while ((diff & 0x80) == 0) {
+			diff <<= 1;
+			bits++;
+		}
+
+		return (bits < max) ? bits : max;
+	}
+
+	return max;
+}
+
+static fr_trie_node_t *trie_node_alloc(const uint8_t *key, int bits,
+				       void *data)
+{
+	int bytes;
+	fr_trie_node_t *node;
+
+	node = malloc(sizeof(*node));
+	if (!node) return NULL;
+
+	memset(node, 0, sizeof(*node));
+	node->bits = bits;
+	node->data = data;
+
+	/*
+	 *	Copy the prefix, and zero out the rest of the key.
+	 */
+	bytes = bits >> 3;
+	memcpy(node->key, key, bytes);
+	if (bits & 0x07) {
+		node->key[bytes] = key[bytes] & (0xff << (8 - (bits & 0x07)));
+	}
+
+	return node;
+}
+
+/*
+ *	Free nodes which nobody can be looking at any more.
+ */
+static void trie_reap(fr_trie_t *ft, time_t now)
+{
+	fr_trie_node_t *node;
+
+	while (ft->dead_head && ((ft->dead_head->when + FR_TRIE_GRACE) < now)) {
+		node = ft->dead_head;
+		ft->dead_head = node->next_dead;
+		if (!ft->dead_head) ft->dead_tail = NULL;
+
+		free(node);
+	}
+}
+
+/*
+ *	A node has been unlinked from the trie.  Readers may still be
+ *	looking at it, so we free it later.
+ */
+static void trie_bury(fr_trie_t *ft, fr_trie_node_t *node)
+{
+	node->when = time(NULL);
+	node->next_dead = NULL;
+
+	if (ft->dead_tail) {
+		ft->dead_tail->next_dead = node;
+	} else {
+		ft->dead_head = node;
+	}
+	ft->dead_tail = node;
+
+	trie_reap(ft, node->when);
+}
+
+static void trie_free_nodes(fr_trie_node_t *node)
+{
+	if (!node) return;
+
+	trie_free_nodes(node->child[0]);
+	trie_free_nodes(node->child[1]);
+	free(node);
+}
+
+/** Create a new trie
+ *
+ * @param max_bits the longest key, e.g. 32 for IPv4 addresses.
+ * @return the new trie, or NULL on error.
+ */
+fr_trie_t *fr_trie_create(int max_bits)
+{
+	fr_trie_t *ft;
+
+	if ((max_bits <= 0) || (max_bits > FR_TRIE_MAX_BITS)) return NULL;
+
+	ft = malloc(sizeof(*ft));
+	if (!ft) return NULL;
+
+	memset(ft, 0, sizeof(*ft));
+	ft->max_bits = max_bits;
+
+	return ft;
+}
+
+/** Free a trie, and all of its nodes
+ *
+ * The data is not freed.  There must not be any readers left.
+ *
+ * @param ft to free.
+ */
+void fr_trie_free(fr_trie_t *ft)
+{
+	fr_trie_node_t *node, *next;
+
+	if (!ft) return;
+
+	trie_free_nodes(ft->root);
+
+	for (node = ft->dead_head; node != NULL; node = next) {
+		next = node->next_dead;
+		free(node);
+	}
+
+	free(ft);
+}
+
+/** Insert a prefix into the trie
+ *
+ * @param ft to insert into.
+ * @param key the prefix, in network byte order.  Bits after the
+ *	prefix are ignored.
+ * @param bits the length of the prefix.
+ * @param data to associate with the prefix.
+ * @return 1 on success, 0 if the prefix already exists, or on error.
+ */
+int fr_trie_insert(fr_trie_t *ft, const void *key, int bits, void *data)
+{
+	int common = 0;
+	fr_trie_node_t **p, *node, *leaf, *glue;
+
+	if (!ft || !key || !data) return 0;
+
+	if ((bits < 0) || (bits > ft->max_bits)) return 0;
+
+	p = &ft->root;
+	while ((node = *p) != NULL) {
+		common = trie_common(node->key, key,
+				     (node->bits < bits) ? node->bits : bits);
+		if (common < node->bits) break;
+
+		/*
+		 *	The node is a prefix of the key.
+		 */
+		if (node->bits == bits) {
+			if (node->data) return 0;
+
+			TRIE_PUBLISH();
+			node->data = data;
+			ft->num_elements++;
+			return 1;
+		}
+
+		p = &node->child[TRIE_BIT(key, node->bits)];
+	}
+
+	leaf = trie_node_alloc(key, bits, data);
+	if (!leaf) return 0;
+
+	if (!node) {
+		/*
+		 *	Empty branch, just add it.
+		 */
+
+	} else if (common == bits) {
+		/*
+		 *	The key is a prefix of the node.  The new node
+		 *	goes above it.
+		 */
+		leaf->child[TRIE_BIT(node->key, bits)] = node;
+
+	} else {
+		/*
+		 *	The two diverge.  Add a glue node where they
+		 *	split.
+		 */
+		glue = trie_node_alloc(key, common, NULL);
+		if (!glue) {
+			free(leaf);
+			return 0;
+		}
+
+		glue->child[TRIE_BIT(key, common)] = leaf;
+		glue->child[TRIE_BIT(node->key, common)] = node;
+		leaf = glue;
+	}
+
+	TRIE_PUBLISH();
+	*p = leaf;
+	ft->num_elements++;
+
+	return 1;
+}
+
+/** Remove a prefix from the trie
+ *
+ * @param ft to remove from.
+ * @param key the prefix.
+ * @param bits the length of the prefix.
+ * @return the data associated with the prefix, or NULL if it wasn't found.
+ */
+void *fr_trie_delete(fr_trie_t *ft, const void *key, int bits)
+{
+	void *data;
+	fr_trie_node_t **p, **parent_p, *node, *parent, *child;
+
+	if (!ft || !key) return NULL;
+
+	parent_p = NULL;
+	p = &ft->root;
+	while ((node = *p) != NULL) {
+		if (node->bits > bits) return NULL;
+
+		if (trie_common(node->key, key, node->bits) < node->bits) {
+			return NULL;
+		}
+
+		if (node->bits == bits) break;
+
+		parent_p = p;
+		p = &node->child[TRIE_BIT(key, node->bits)];
+	}
+
+	if (!node || !node->data) return NULL;
+
+	data = node->data;
+	node->data = NULL;
+	ft->num_elements--;
+
+	/*
+	 *	It's still needed to split two branches.
+	 */
+	if (node->child[0] && node->child[1]) return data;
+
+	child = node->child[0] ? node->child[0] : node->child[1];
+	*p = child;
+	trie_bury(ft, node);
+
+	if (child || !parent_p) return data;
+
+	/*
+	 *	We removed a leaf.  If the parent is a glue node, it
+	 *	now has only one child, and is no longer needed.
+	 */
+	parent = *parent_p;
+	if (parent->data) return data;
+
+	*parent_p = parent->child[0] ? parent->child[0] : parent->child[1];
+	trie_bury(ft, parent);
+
+	return data;
+}
+
+/** Find an exact prefix in the trie
+ *
+ * @param ft to search.
+ * @param key the prefix.
+ * @param bits the length of the prefix.
+ * @return the data associated with the prefix, or NULL if it wasn't found.
+ */
+void *fr_trie_find(const fr_trie_t *ft, const void *key, int bits)
+{
+	const fr_trie_node_t *node;
+
+	if (!ft || !key) return NULL;
+
+	node = ft->root;
+	while (node) {
+		if (node->bits > bits) return NULL;
+
+		if (trie_common(node->key, key, node->bits) < node->bits) {
+			return NULL;
+		}
+
+		if (node->bits == bits) return node->data;
+
+		node = node->child[TRIE_BIT(key, node->bits)];
+	}
+
+	return NULL;
+}
+
+/** Find the longest prefix in the trie which matches a key
+ *
+ * @param ft to search.
+ * @param key to match, e.g. an IP address.
+ * @param bits the length of the key.
+ * @param prefix where the length of the matching prefix is written.
+ *	May be NULL.
+ * @return the data associated with the longest matching prefix, or
+ *	NULL if nothing matched.
+ */
+void *fr_trie_lookup(const fr_trie_t *ft, const void *key, int bits,
+		     int *prefix)
+{
+	int best_bits = -1;
+	void *data, *best = NULL;
+	const fr_trie_node_t *node;
+
+	if (!ft || !key) return NULL;
+
+	node = ft->root;
+	while (node) {
+		if (node->bits > bits) break;
+
+		if (trie_common(node->key, key, node->bits) < node->bits) {
+			break;
+		}
+
+		data = node->data;
+		if (data) {
+			best = data;
+			best_bits = node->bits;
+		}
+
+		if (node->bits == bits) break;
+
+		node = node->child[TRIE_BIT(key, node->bits)];
+	}
+
+	if (prefix) *prefix = best_bits;
+
+	return best;
+}
+
+int fr_trie_num_elements(const fr_trie_t *ft)
+{
+	if (!ft) return 0;
+
+	return ft->num_elements;
+}
+
+static int trie_walk_node(fr_trie_node_t *node, fr_trie_walk_t callback,
+			  void *ctx)
+{
+	int rcode;
+
+	if (!node) return 0;
+
+	if (node->data) {
+		rcode = callback(ctx, node->data);
+		if (rcode != 0) return rcode;
+	}
+
+	rcode = trie_walk_node(node->child[0], callback, ctx);
+	if (rcode != 0) return rcode;
+
+	return trie_walk_node(node->child[1], callback, ctx);
+}
+
+/** Call a function for every entry in the trie
+ *
+ * Shorter prefixes are walked before the longer prefixes they
+ * contain.  The callback MUST NOT change the trie.
+ *
+ * @param ft to walk.
+ * @param callback to call.  Walking stops if it returns non-zero.
+ * @param ctx passed to the callback.
+ * @return the last return code from the callback.
+ */
+int fr_trie_walk(fr_trie_t *ft, fr_trie_walk_t callback, void *ctx)
+{
+	if (!ft || !callback) return 0;
+
+	return trie_walk_node(ft->root, callback, ctx);
+}
+
+#ifdef TESTING
+/*
+ *  From src/lib, in a tree which has been configured and built:
+ *
+ *  cc -O2 -DTESTING -D_LIBRADIUS -I .. \
+ *	-imacros ../freeradius-devel/build.h \
+ *	-imacros ../freeradius-devel/autoconf.h \
+ *	-imacros ../freeradius-devel/features.h trie.c -o trie \
+ *	-L ../../build/lib/.libs -lfreeradius-radius -ltalloc
+ *
+ *  ./trie [entries]
+ *
+ *  Compares the trie against looking up each prefix length in a
+ *  separate rbtree, which is what client_find() used to do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define LOOKUPS (1000000)
+
+typedef struct trie_entry_t {
+	uint32_t	addr;
+	int		prefix;
+} trie_entry_t;
+
+static int entry_cmp(const void *one, const void *two)
+{
+	const trie_entry_t *a = one;
+	const trie_entry_t *b = two;
+
+	if (a->addr < b->addr) return -1;
+	if (a->addr > b->addr) return +1;
+
+	return 0;
+}
+
+static uint32_t entry_mask(uint32_t addr, int prefix)
+{
+	if (prefix == 0) return 0;
+
+	return addr & (0xffffffff << (32 - prefix));
+}
+
+static trie_entry_t *tree_lookup(rbtree_t **trees, uint32_t addr)
+{
+	int i;
+	trie_entry_t my_entry, *entry;
+
+	for (i = 32; i >= 0; i--) {
+		if (!trees[i]) continue;
+
+		my_entry.addr = entry_mask(addr, i);
+		entry = rbtree_finddata(trees[i], &my_entry);
+		if (entry) return entry;
+	}
+
+	return NULL;
+}
+
+static trie_entry_t *trie_lookup(fr_trie_t *ft, uint32_t addr)
+{
+	uint32_t key = htonl(addr);
+
+	return fr_trie_lookup(ft, &key, 32, NULL);
+}
+
+static void check(rbtree_t **trees, fr_trie_t *ft, uint32_t *addrs, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (tree_lookup(trees, addrs[i]) != trie_lookup(ft, addrs[i])) {
+			fprintf(stderr, "Mismatch for address %08x\n", addrs[i]);
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i, num, found;
+	uint32_t key, *addrs;
+	trie_entry_t *entries;
+	rbtree_t *trees[33];
+	fr_trie_t *ft;
+	struct timeval start;
+	double t;
+
+	num = 100000;
+	if (argc > 1) num = atoi(argv[1]);
+	if (num <= 0) num = 100000;
+
+	srandom(1);
+
+	entries = malloc(sizeof(*entries) * num);
+	addrs = malloc(sizeof(*addrs) * LOOKUPS);
+	memset(trees, 0, sizeof(trees));
+
+	ft = fr_trie_create(32);
+	if (!ft) {
+		fprintf(stderr, "Failed creating trie\n");
+		exit(1);
+	}
+
+	/*
+	 *	Mostly hosts, with some networks down to /8.
+	 */
+	for (i = 0; i < num; i++) {
+		switch (random() % 8) {
+		case 0:
+			entries[i].prefix = 8 + (random() % 24);
+			break;
+
+		case 1:
+			entries[i].prefix = 24;
+			break;
+
+		default:
+			entries[i].prefix = 32;
+			break;
+		}
+		entries[i].addr = entry_mask(random(), entries[i].prefix);
+
+		if (!trees[entries[i].prefix]) {
+			trees[entries[i].prefix] = rbtree_create(entry_cmp, NULL, 0);
+		}
+
+		if (!rbtree_insert(trees[entries[i].prefix], &entries[i])) {
+			entries[i].prefix = -1;	/* duplicate */
+			continue;
+		}
+
+		key = htonl(entries[i].addr);
+		if (!fr_trie_insert(ft, &key, entries[i].prefix, &entries[i])) {
+			fprintf(stderr, "Failed inserting entry %d\n", i);
+			exit(1);
+		}
+	}
+
+	printf("%d entries\n", fr_trie_num_elements(ft));
+
+	/*
+	 *	Half of the lookups are for addresses inside of one of
+	 *	the entries, and half are random.
+	 */
+	for (i = 0; i < LOOKUPS; i++) {
+		if ((i & 0x01) == 0) {
+			trie_entry_t *entry = &entries[random() % num];
+
+			addrs[i] = entry->addr;
+			if ((entry->prefix >= 0) && (entry->prefix < 32)) {
+				addrs[i] |= random() & (0xffffffff >> entry->prefix);
+			}
+		} else {
+			addrs[i] = random();
+		}
+	}
+
+	check(trees, ft, addrs, LOOKUPS);
+
+	found = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < LOOKUPS; i++) {
+		if (tree_lookup(trees, addrs[i])) found++;
+	}
+	t = fr_tv_elapsed(&start);
+	printf("rbtree:\t%d lookups, %d found, %.3fs, %.0f ns/lookup\n",
+	       LOOKUPS, found, t, (t * 1e9) / LOOKUPS);
+
+	found = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < LOOKUPS; i++) {
+		if (trie_lookup(ft, addrs[i])) found++;
+	}
+	t = fr_tv_elapsed(&start);
+	printf("trie:\t%d lookups, %d found, %.3fs, %.0f ns/lookup\n",
+	       LOOKUPS, found, t, (t * 1e9) / LOOKUPS);
+
+	/*
+	 *	Delete every other entry, and check that the two
+	 *	still agree.
+	 */
+	for (i = 0; i < num; i += 2) {
+		if (entries[i].prefix < 0) continue;
+
+		key = htonl(entries[i].addr);
+		if (fr_trie_delete(ft, &key, entries[i].prefix) != &entries[i]) {
+			fprintf(stderr, "Failed deleting entry %d\n", i);
+			exit(1);
+		}
+		rbtree_deletebydata(trees[entries[i].prefix], &entries[i]);
+	}
+
+	check(trees, ft, addrs, LOOKUPS);
+
+	printf("%d entries after deletes, OK\n", fr_trie_num_elements(ft));
+
+	fr_trie_free(ft);
+	for (i = 0; i <= 32; i++) {
+		if (trees[i]) rbtree_free(trees[i]);
+	}
+	free(addrs);
+	free(entries);
+
+	return 0;
+}
+#endif
@@ -1,3 +1,3 @@
 SUBMAKEFILES := radclient.mk radiusd.mk radsniff.mk radmin.mk radattr.mk \
 	radconf2xml.mk radwho.mk radlast.mk radtest.mk radzap.mk checkrad.mk \
-	dhclient.mk
+	dhclient.mk raddetail.mk
@@ -26,6 +26,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/trie.h>
+#include <freeradius-devel/heap.h>
 
 #include <sys/stat.h>
 
@@ -38,14 +40,37 @@ RCSID("$Id$")
 #endif
 #endif
 
+/*
+ *	Clients are kept in one trie per address family, and per
+ *	protocol.  Entry 0 holds the clients which accept both UDP
+ *	and TCP.
+ */
+#ifdef WITH_TCP
+#define CLIENT_PROTOS (3)
+#else
+#define CLIENT_PROTOS (1)
+#endif
+
 struct radclient_list {
-	/*
-	 *	FIXME: One set of trees for IPv4, and another for IPv6?
-	 */
-	rbtree_t	*trees[129]; /* for 0..128, inclusive. */
-	int		min_prefix;
+	fr_trie_t	*v4[CLIENT_PROTOS];
+	fr_trie_t	*v6[CLIENT_PROTOS];
 };
 
+/*
+ *	Lookups don't lock.  Adding and deleting clients does, so
+ *	that radmin and the dynamic client code don't step on each
+ *	other.
+ */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 
 #ifdef WITH_STATS
 static rbtree_t		*tree_num = NULL;     /* client numbers 0..N */
@@ -55,6 +80,48 @@ static RADCLIENT_LIST	*root_clients = NULL;
 
 #ifdef WITH_DYNAMIC_CLIENTS
 static fr_fifo_t	*deleted_clients = NULL;
+
+/*
+ *	Unknown sources which are being looked up through a
+ *	"dynamic_clients" virtual server, or for which the lookup
+ *	failed recently.
+ */
+#define DYNAMIC_CACHE_MAX (65536)
+
+typedef struct dynamic_entry_t {
+	fr_ipaddr_t	ipaddr;
+	const RADCLIENT	*network;	//!< Which defines the dynamic clients.
+	int		pending;	//!< Lookup is in progress.
+	time_t		expires;	//!< When the lookup can be retried.
+	int		heap;		//!< Position in the expiry heap.
+} dynamic_entry_t;
+
+static rbtree_t		*dynamic_tree = NULL;
+static fr_heap_t	*dynamic_heap = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	dynamic_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static fr_dynamic_client_stats_t dynamic_client_stats;
+#endif
+
+#ifdef WITH_STATS
+static int client_stats_free(void *ctx)
+{
+	RADCLIENT *client = ctx;
+
+	fr_stats_free(client->auth);
+#ifdef WITH_ACCOUNTING
+	fr_stats_free(client->acct);
+#endif
+#ifdef WITH_COA
+	fr_stats_free(client->coa);
+	fr_stats_free(client->dsc);
+#endif
+
+	return 0;
+}
 #endif
 
 /*
@@ -99,29 +166,74 @@ void client_free(RADCLIENT *client)
 }
 
 /*
- *	Callback for comparing two clients.
+ *	Which trie a client goes into.
  */
-static int client_ipaddr_cmp(const void *one, const void *two)
+static int client_proto_index(UNUSED int proto)
 {
-	const RADCLIENT *a = one;
-	const RADCLIENT *b = two;
-#ifndef WITH_TCP
+#ifdef WITH_TCP
+	switch (proto) {
+	case IPPROTO_UDP:
+		return 1;
 
-	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-#else
-	int rcode;
+	case IPPROTO_TCP:
+		return 2;
 
-	rcode = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-	if (rcode != 0) return rcode;
+	default:
+		break;
+	}
+#endif
 
-	/*
-	 *	Wildcard match
-	 */
-	if ((a->proto == IPPROTO_IP) ||
-	    (b->proto == IPPROTO_IP)) return 0;
+	return 0;
+}
 
-	return (a->proto - b->proto);
-#endif
+static fr_trie_t **client_tries(RADCLIENT_LIST *clients, int af, int *bits)
+{
+	switch (af) {
+	case AF_INET:
+		*bits = 32;
+		return clients->v4;
+
+	case AF_INET6:
+		*bits = 128;
+		return clients->v6;
+
+	default:
+		return NULL;
+	}
+}
+
+/*
+ *	Find the longest prefix which matches, in the trie for the
+ *	protocol, and in the trie for clients which accept both.  A
+ *	lookup for both protocols checks all of the tries.
+ */
+static RADCLIENT *client_trie_lookup(fr_trie_t * const *tries, int bits,
+				     const fr_ipaddr_t *ipaddr, int proto,
+				     int exact)
+{
+	int i, index, prefix, best_prefix = -1;
+	RADCLIENT *client, *best = NULL;
+
+	index = client_proto_index(proto);
+
+	for (i = 0; i < CLIENT_PROTOS; i++) {
+		if ((index != 0) && (i != 0) && (i != index)) continue;
+
+		if (exact) {
+			client = fr_trie_find(tries[i], &ipaddr->ipaddr, bits);
+			if (client) return client;
+			continue;
+		}
+
+		client = fr_trie_lookup(tries[i], &ipaddr->ipaddr, bits,
+					&prefix);
+		if (client && (prefix > best_prefix)) {
+			best = client;
+			best_prefix = prefix;
+		}
+	}
+
+	return best;
 }
 
 #ifdef WITH_STATS
@@ -143,9 +255,11 @@ void clients_free(RADCLIENT_LIST *clients)
 
 	if (!clients) clients = root_clients;
 
-	for (i = 0; i <= 128; i++) {
-		if (clients->trees[i]) rbtree_free(clients->trees[i]);
-		clients->trees[i] = NULL;
+	for (i = 0; i < CLIENT_PROTOS; i++) {
+		fr_trie_free(clients->v4[i]);
+		clients->v4[i] = NULL;
+		fr_trie_free(clients->v6[i]);
+		clients->v6[i] = NULL;
 	}
 
 	if (clients == root_clients) {
@@ -175,8 +289,6 @@ RADCLIENT_LIST *clients_init(CONF_SECTION *cs)
 
 	if (!clients) return NULL;
 
-	clients->min_prefix = 128;
-
 	return clients;
 }
 
@@ -260,7 +372,9 @@ static int client_sane(RADCLIENT *client)
  */
 int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
+	int bits, index;
 	RADCLIENT *old;
+	fr_trie_t **tries;
 
 	if (!client) {
 		return 0;
@@ -286,13 +400,20 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 	if (!client_sane(client)) return 0;
 
+	tries = client_tries(clients, client->ipaddr.af, &bits);
+	if (!tries) return 0;
+
+	index = client_proto_index(client->proto);
+
+	PTHREAD_MUTEX_LOCK(&clients_mutex);
+
 	/*
-	 *	Create a tree for it.
+	 *	Create a trie for it.
 	 */
-	if (!clients->trees[client->prefix]) {
-		clients->trees[client->prefix] = rbtree_create(client_ipaddr_cmp,
-							       NULL, 0);
-		if (!clients->trees[client->prefix]) {
+	if (!tries[index]) {
+		tries[index] = fr_trie_create(bits);
+		if (!tries[index]) {
+			PTHREAD_MUTEX_UNLOCK(&clients_mutex);
 			return 0;
 		}
 	}
@@ -302,7 +423,8 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	/*
 	 *	Cannot insert the same client twice.
 	 */
-	old = rbtree_finddata(clients->trees[client->prefix], client);
+	old = client_trie_lookup(tries, client->prefix, &client->ipaddr,
+				 client->proto, TRUE);
 	if (old) {
 		/*
 		 *	If it's a complete duplicate, then free the new
@@ -323,29 +445,19 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		    (old->coa_pool == client->coa_pool) &&
 #endif
 		    (old->message_authenticator == client->message_authenticator)) {
+			PTHREAD_MUTEX_UNLOCK(&clients_mutex);
 			DEBUGW("Ignoring duplicate client %s", client->longname);
 			client_free(client);
 			return 1;
 		}
 
+		PTHREAD_MUTEX_UNLOCK(&clients_mutex);
 		radlog(L_ERR, "Failed to add duplicate client %s",
 		       client->shortname);
 		return 0;
 	}
 #undef namecmp
 
-	/*
-	 *	Other error adding client: likely is fatal.
-	 */
-	if (!rbtree_insert(clients->trees[client->prefix], client)) {
-		return 0;
-	}
-
-#ifdef WITH_STATS
-	if (!tree_num) {
-		tree_num = rbtree_create(client_num_cmp, NULL, 0);
-	}
-
 #ifdef WITH_DYNAMIC_CLIENTS
 	/*
 	 *	More catching of clients added by rlm_sql.
@@ -368,17 +480,45 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	}
 #endif
 
+#ifdef WITH_STATS
 	client->number = tree_num_max;
-	tree_num_max++;
-	if (tree_num) rbtree_insert(tree_num, client);
+
+	client->auth = fr_stats_alloc();
+#ifdef WITH_ACCOUNTING
+	client->acct = fr_stats_alloc();
 #endif
+#ifdef WITH_COA
+	client->coa = fr_stats_alloc();
+	client->dsc = fr_stats_alloc();
+#endif
+	talloc_set_destructor((void *) client, client_stats_free);
+#endif
+
+	/*
+	 *	Lookups can see the client as soon as it's in the
+	 *	trie, so it has to be filled in before this.
+	 *
+	 *	Other error adding client: likely is fatal.
+	 */
+	if (!fr_trie_insert(tries[index], &client->ipaddr.ipaddr,
+			    client->prefix, client)) {
+		PTHREAD_MUTEX_UNLOCK(&clients_mutex);
+		return 0;
+	}
 
-	if (client->prefix < clients->min_prefix) {
-		clients->min_prefix = client->prefix;
+#ifdef WITH_STATS
+	if (!tree_num) {
+		tree_num = rbtree_create(client_num_cmp, NULL, 0);
 	}
 
+	tree_num_max++;
+	if (tree_num) rbtree_insert(tree_num, client);
+#endif
+
 	(void) talloc_steal(clients, client); /* reparent it */
 
+	PTHREAD_MUTEX_UNLOCK(&clients_mutex);
+
 	return 1;
 }
 
@@ -386,6 +526,9 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_DYNAMIC_CLIENTS
 void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
+	int bits;
+	fr_trie_t **tries;
+
 	if (!client) return;
 
 	if (!clients) clients = root_clients;
@@ -394,12 +537,237 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 	rad_assert((client->prefix >= 0) && (client->prefix <= 128));
 
+	tries = client_tries(clients, client->ipaddr.af, &bits);
+	if (!tries) return;
+
+	PTHREAD_MUTEX_LOCK(&clients_mutex);
+
 	client->dynamic = 2;	/* signal to client_free */
 
 #ifdef WITH_STATS
 	rbtree_deletebydata(tree_num, client);
 #endif
-	rbtree_deletebydata(clients->trees[client->prefix], client);
+	fr_trie_delete(tries[client_proto_index(client->proto)],
+		       &client->ipaddr.ipaddr, client->prefix);
+
+	PTHREAD_MUTEX_UNLOCK(&clients_mutex);
+}
+
+static int dynamic_entry_cmp(const void *one, const void *two)
+{
+	const dynamic_entry_t *a = one;
+	const dynamic_entry_t *b = two;
+
+	if (a->network < b->network) return -1;
+	if (a->network > b->network) return +1;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+static int dynamic_expires_cmp(const void *one, const void *two)
+{
+	const dynamic_entry_t *a = one;
+	const dynamic_entry_t *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+/*
+ *	Forget failed lookups which have expired.  If "force" is set,
+ *	forget the oldest one regardless.  Lookups which are in
+ *	progress aren't in the heap, and are never forgotten here.
+ */
+static void dynamic_expire(time_t now, int force)
+{
+	dynamic_entry_t *entry;
+
+	while ((entry = fr_heap_peek(dynamic_heap)) != NULL) {
+		if (!force && (entry->expires > now)) break;
+		force = FALSE;
+
+		fr_heap_extract(dynamic_heap, NULL);
+		rbtree_deletebydata(dynamic_tree, entry);
+		free(entry);
+	}
+}
+
+/** Check whether we should look up an unknown source
+ *
+ * Packets from a source are ignored while a lookup is in progress,
+ * if a lookup failed within the last "negative_lifetime" seconds,
+ * or if "max_resolving" lookups are already in progress for the
+ * network.  Clients retransmit, so once the lookup is done, the
+ * next packet finds the new client.
+ *
+ * If this function returns 1, the caller MUST call
+ * client_dynamic_end() when the lookup is done.
+ *
+ * @param network the client which defines the dynamic clients.
+ * @param ipaddr of the unknown source.
+ * @return 1 if the caller should do the lookup, 0 to ignore the packet.
+ */
+int client_dynamic_begin(RADCLIENT *network, const fr_ipaddr_t *ipaddr)
+{
+	dynamic_entry_t my_entry, *entry;
+
+	PTHREAD_MUTEX_LOCK(&dynamic_mutex);
+
+	if (!dynamic_tree) {
+		dynamic_tree = rbtree_create(dynamic_entry_cmp, NULL, 0);
+		dynamic_heap = fr_heap_create(dynamic_expires_cmp,
+					      offsetof(dynamic_entry_t, heap));
+		if (!dynamic_tree || !dynamic_heap) {
+			PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+			return 0;
+		}
+	}
+
+	dynamic_expire(time(NULL), FALSE);
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.network = network;
+	my_entry.ipaddr = *ipaddr;
+
+	entry = rbtree_finddata(dynamic_tree, &my_entry);
+	if (entry) {
+		if (entry->pending) {
+			dynamic_client_stats.coalesced++;
+		} else {
+			dynamic_client_stats.negative_hits++;
+		}
+		PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+		return 0;
+	}
+
+	if ((network->max_resolving > 0) &&
+	    (network->resolving >= network->max_resolving)) {
+		dynamic_client_stats.limited++;
+		PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+		return 0;
+	}
+
+	/*
+	 *	Don't let a scan of a large network use up all of
+	 *	our memory.  Make room by forgetting the oldest failed
+	 *	lookup.  If every entry is a lookup in progress, there
+	 *	is nothing we can forget, so ignore the packet.  This
+	 *	bounds the cache even when "max_resolving" is zero.
+	 */
+	if (rbtree_num_elements(dynamic_tree) >= DYNAMIC_CACHE_MAX) {
+		dynamic_expire(0, TRUE);
+
+		if (rbtree_num_elements(dynamic_tree) >= DYNAMIC_CACHE_MAX) {
+			dynamic_client_stats.limited++;
+			PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+			return 0;
+		}
+	}
+
+	entry = malloc(sizeof(*entry));
+	if (!entry) {
+		PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+		return 0;
+	}
+
+	memcpy(entry, &my_entry, sizeof(*entry));
+	entry->pending = TRUE;
+	entry->heap = -1;
+
+	if (!rbtree_insert(dynamic_tree, entry)) {
+		PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+		free(entry);
+		return 0;
+	}
+
+	network->resolving++;
+	dynamic_client_stats.misses++;
+
+	PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+
+	return 1;
+}
+
+/** Finish a lookup started by client_dynamic_begin()
+ *
+ * @param network the client which defines the dynamic clients.
+ * @param ipaddr of the unknown source.
+ * @param failed whether the lookup failed to define a client.  If
+ *	so, the failure is remembered for "negative_lifetime" seconds.
+ */
+void client_dynamic_end(RADCLIENT *network, const fr_ipaddr_t *ipaddr,
+			int failed)
+{
+	dynamic_entry_t my_entry, *entry;
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.network = network;
+	my_entry.ipaddr = *ipaddr;
+
+	PTHREAD_MUTEX_LOCK(&dynamic_mutex);
+
+	entry = rbtree_finddata(dynamic_tree, &my_entry);
+	if (!entry || !entry->pending) {
+		PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+		return;
+	}
+
+	network->resolving--;
+	if (failed) dynamic_client_stats.failed++;
+
+	if (!failed || (network->negative_lifetime <= 0)) {
+		rbtree_deletebydata(dynamic_tree, entry);
+		PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+		free(entry);
+		return;
+	}
+
+	entry->pending = FALSE;
+	entry->expires = time(NULL) + network->negative_lifetime;
+
+	if (!fr_heap_insert(dynamic_heap, entry)) {
+		rbtree_deletebydata(dynamic_tree, entry);
+		free(entry);
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+}
+
+/*
+ *	A packet came from a known dynamic client.
+ */
+void client_dynamic_hit(void)
+{
+	PTHREAD_MUTEX_LOCK(&dynamic_mutex);
+	dynamic_client_stats.hits++;
+	PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+}
+
+/*
+ *	Copy the counters, so that they're consistent with each other.
+ */
+void client_dynamic_stats(fr_dynamic_client_stats_t *stats)
+{
+	PTHREAD_MUTEX_LOCK(&dynamic_mutex);
+	*stats = dynamic_client_stats;
+	PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+}
+
+/*
+ *	The number of sources which are being looked up, or which
+ *	are remembered as failed.
+ */
+int client_dynamic_num_cached(void)
+{
+	int num;
+
+	PTHREAD_MUTEX_LOCK(&dynamic_mutex);
+	num = rbtree_num_elements(dynamic_tree);
+	PTHREAD_MUTEX_UNLOCK(&dynamic_mutex);
+
+	return num;
 }
 #endif
 
@@ -440,43 +808,22 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 RADCLIENT *client_find(const RADCLIENT_LIST *clients,
 		       const fr_ipaddr_t *ipaddr, int proto)
 {
-	int i, max_prefix;
-	RADCLIENT myclient;
-
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
 	switch (ipaddr->af) {
 	case AF_INET:
-		max_prefix = 32;
-		break;
+		return client_trie_lookup(clients->v4, 32, ipaddr, proto,
+					  FALSE);
 
 	case AF_INET6:
-		max_prefix = 128;
-		break;
+		return client_trie_lookup(clients->v6, 128, ipaddr, proto,
+					  FALSE);
 
-	default :
+	default:
 		return NULL;
 	}
-
-	for (i = max_prefix; i >= clients->min_prefix; i--) {
-		void *data;
-
-		myclient.prefix = i;
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		client_sane(&myclient);	/* clean up the ipaddress */
-
-		if (!clients->trees[i]) continue;
-
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) {
-			return data;
-		}
-	}
-
-	return NULL;
 }
 
 
@@ -553,6 +900,10 @@ static const CONF_PARSER client_config[] = {
 	  offsetof(RADCLIENT, lifetime), 0, NULL },
 	{ "rate_limit",  PW_TYPE_BOOLEAN,
 	  offsetof(RADCLIENT, rate_limit), 0, NULL },
+	{ "negative_lifetime",  PW_TYPE_INTEGER,
+	  offsetof(RADCLIENT, negative_lifetime), 0, NULL },
+	{ "max_resolving",  PW_TYPE_INTEGER,
+	  offsetof(RADCLIENT, max_resolving), 0, NULL },
 #endif
 
 #ifdef WITH_COA
@@ -1097,11 +1448,11 @@ RADCLIENT *client_create(RADCLIENT_LIST *clients, REQUEST *request)
 
 		switch (dynamic_config[i].type) {
 		case PW_TYPE_IPADDR:
-			if (da->type == PW_FREERADIUS_CLIENT_IP_ADDRESS) {
+			if (da->attr == PW_FREERADIUS_CLIENT_IP_ADDRESS) {
 				c->ipaddr.af = AF_INET;
 				c->ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
 				c->prefix = 32;
-			} else if (da->type == PW_FREERADIUS_CLIENT_SRC_IP_ADDRESS) {
+			} else if (da->attr == PW_FREERADIUS_CLIENT_SRC_IP_ADDRESS) {
 #ifdef WITH_UDPFROMTO
 				c->src_ipaddr.af = AF_INET;
 				c->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
@@ -1113,11 +1464,11 @@ RADCLIENT *client_create(RADCLIENT_LIST *clients, REQUEST *request)
 			break;
 
 		case PW_TYPE_IPV6ADDR:
-			if (da->type == PW_FREERADIUS_CLIENT_SRC_IPV6_ADDRESS) {
+			if (da->attr == PW_FREERADIUS_CLIENT_IPV6_ADDRESS) {
 				c->ipaddr.af = AF_INET6;
 				c->ipaddr.ipaddr.ip6addr = vp->vp_ipv6addr;
 				c->prefix = 128;
-			} else if (da->type == PW_FREERADIUS_CLIENT_SRC_IPV6_ADDRESS) {
+			} else if (da->attr == PW_FREERADIUS_CLIENT_SRC_IPV6_ADDRESS) {
 #ifdef WITH_UDPFROMTO
 				c->src_ipaddr.af = AF_INET6;
 				c->src_ipaddr.ipaddr.ip6addr = vp->vp_ipv6addr;
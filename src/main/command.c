@@ -629,10 +629,17 @@ static int command_show_modules(rad_listen_t *listener, UNUSED int argc, UNUSED
 	return 1;		/* success */
 }
 
+#undef PU
+#ifdef PRIu64
+#define PU "%" PRIu64
+#else
+#define PU "%lu"
+#endif
+
 #ifdef WITH_PROXY
 static int command_show_home_servers(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
 {
-	int i;
+	int i, ids;
 	home_server *home;
 	const char *type, *state, *proto;
 
@@ -701,10 +708,24 @@ static int command_show_home_servers(rad_listen_t *listener, UNUSED int argc, UN
 
 		} else continue;
 
-		cprintf(listener, "%s\t%d\t%s\t%s\t%s\t%d\n",
+		/*
+		 *	Percentage of the IDs on the home server's own
+		 *	sockets which are in use.
+		 */
+		if (home->limit.num_connections > 0) {
+			ids = (home->currently_outstanding * 100) /
+				(home->limit.num_connections * 256);
+		} else {
+			ids = 0;
+		}
+
+		cprintf(listener, "%s\t%d\t%s\t%s\t%s\t%d\t%d\t" PU "\t%d\t%d%%\n",
 			ip_ntoh(&home->ipaddr, buffer, sizeof(buffer)),
 			home->port, proto, type, state,
-			home->currently_outstanding);
+			home->currently_outstanding,
+			home->response_time,
+			home_server_latency_score(home),
+			home->limit.num_connections, ids);
 	}
 
 	return 0;
@@ -1102,6 +1123,48 @@ static int command_show_home_server_state(rad_listen_t *listener, int argc, char
 	
 	return 1;
 }
+
+static int command_show_home_pool(rad_listen_t *listener, int argc, char *argv[])
+{
+	int type = HOME_TYPE_AUTH;
+	home_pool_t *pool;
+
+	if (argc < 1) {
+		cprintf(listener, "ERROR: Must specify <name>\n");
+		return 0;
+	}
+
+	if (argc > 1) {
+		if (strcmp(argv[1], "auth") == 0) {
+			type = HOME_TYPE_AUTH;
+#ifdef WITH_ACCOUNTING
+		} else if (strcmp(argv[1], "acct") == 0) {
+			type = HOME_TYPE_ACCT;
+#endif
+#ifdef WITH_COA
+		} else if (strcmp(argv[1], "coa") == 0) {
+			type = HOME_TYPE_COA;
+#endif
+		} else {
+			cprintf(listener, "ERROR: Unknown pool type \"%s\"\n",
+				argv[1]);
+			return 0;
+		}
+	}
+
+	pool = home_pool_byname(argv[0], type);
+	if (!pool) {
+		cprintf(listener, "ERROR: No such home server pool\n");
+		return 0;
+	}
+
+	cprintf(listener, "\thedge_percentile\t%d\n", pool->hedge_percentile);
+	cprintf(listener, "\thedge_max\t%d\n", pool->hedge_max);
+	cprintf(listener, "\thedges\t\t%u\n", pool->hedges);
+	cprintf(listener, "\thedge_wins\t%u\n", pool->hedge_wins);
+
+	return 1;
+}
 #endif
 
 /*
@@ -1470,6 +1533,9 @@ static fr_command_table_t command_table_show_home[] = {
 	{ "list", FR_READ,
 	  "show home_server list - shows list of home servers",
 	  command_show_home_servers, NULL },
+	{ "pool", FR_READ,
+	  "show home_server pool <name> [auth|acct|coa] - shows hedging statistics for given home server pool",
+	  command_show_home_pool, NULL },
 	{ "state", FR_READ,
 	  "show home_server state <ipaddr> <port> [proto] - shows state of given home server",
 	  command_show_home_server_state, NULL },
@@ -1637,25 +1703,13 @@ static const char *elapsed_names[8] = {
 	"1us", "10us", "100us", "1ms", "10ms", "100ms", "1s", "10s"
 };
 
-#undef PU
-#ifdef WITH_STATS_64BIT
-#ifdef PRIu64
-#define PU "%" PRIu64
-#else
-#define PU "%lu"
-#endif
-#else
-#ifdef PRIu32
-#define PU "%" PRIu32
-#else
-#define PU "%u"
-#endif
-#endif
-
-static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
+static int command_print_stats(rad_listen_t *listener, fr_stats_id_t id,
 			       int auth, int server)
 {
 	int i;
+	fr_stats_t snapshot, *stats = &snapshot;
+
+	fr_stats_read(id, stats);
 
 	cprintf(listener, "\trequests\t" PU "\n", stats->total_requests);
 	cprintf(listener, "\tresponses\t" PU "\n", stats->total_responses);
@@ -1682,7 +1736,7 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 
 	cprintf(listener, "\tlast_packet\t%lu\n", stats->last_packet);
 	for (i = 0; i < 8; i++) {
-		cprintf(listener, "\telapsed.%s\t%u\n",
+		cprintf(listener, "\telapsed.%s\t" PU "\n",
 			elapsed_names[i], stats->elapsed[i]);
 	}
 
@@ -1703,38 +1757,27 @@ static FR_NAME_NUMBER state_names[] = {
 	{ NULL, 0 }
 };
 
-static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
+static void command_print_detail(rad_listen_t *listener, rad_listen_t *this)
 {
-	rad_listen_t *this;
-	listen_detail_t *data;
+	int files;
+	off_t bytes;
+	listen_detail_t *data = this->data;
 	struct stat buf;
 
-	if (argc == 0) {
-		cprintf(listener, "ERROR: Must specify <filename>\n");
-		return 0;
-	}
-
-	data = NULL;
-	for (this = mainconfig.listen; this != NULL; this = this->next) {
-		if (this->type != RAD_LISTEN_DETAIL) continue;
-
-		data = this->data;
-		if (strcmp(argv[1], data->filename) != 0) continue;
-
-		break;
-	}
-
-	if (!data) {
-		cprintf(listener, "ERROR: No detail file listener\n");
-		return 0;
-	}
-
 	cprintf(listener, "\tstate\t%s\n",
 		fr_int2str(state_names, data->state, "?"));
 
+	/*
+	 *	What's left to do, and how quickly it's being done.
+	 */
+	detail_backlog(this, &files, &bytes);
+	cprintf(listener, "files\t%d\n", files);
+	cprintf(listener, "backlog\t%lu\n", (unsigned long) bytes);
+	cprintf(listener, "rate\t%d\n", data->rate);
+
 	if ((data->state == STATE_UNOPENED) ||
 	    (data->state == STATE_UNLOCKED)) {
-		return 1;
+		return;
 	}
 
 	/*
@@ -1745,13 +1788,48 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 		cprintf(listener, "tries\t0\n");
 		cprintf(listener, "offset\t0\n");
 		cprintf(listener, "size\t0\n");
-		return 1;
+		return;
 	}
 
 	cprintf(listener, "packets\t%d\n", data->packets);
 	cprintf(listener, "tries\t%d\n", data->tries);
+	cprintf(listener, "outstanding\t%d\n", data->outstanding);
 	cprintf(listener, "offset\t%u\n", (unsigned int) data->offset);
 	cprintf(listener, "size\t%u\n", (unsigned int) buf.st_size);
+}
+
+static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
+{
+	int found = FALSE;
+	rad_listen_t *this;
+	listen_detail_t *data;
+
+	if (argc == 0) {
+		cprintf(listener, "ERROR: Must specify <filename>\n");
+		return 0;
+	}
+
+	/*
+	 *	A listener may be split into shards.  Print them all.
+	 */
+	for (this = mainconfig.listen; this != NULL; this = this->next) {
+		if (this->type != RAD_LISTEN_DETAIL) continue;
+
+		data = this->data;
+		if (strcmp(argv[0], data->filename) != 0) continue;
+
+		if (data->shards > 1) {
+			cprintf(listener, "shard\t%d\n", data->shard);
+		}
+
+		command_print_detail(listener, this);
+		found = TRUE;
+	}
+
+	if (!found) {
+		cprintf(listener, "ERROR: No detail file listener\n");
+		return 0;
+	}
 
 	return 1;
 }
@@ -1771,12 +1849,12 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 #ifdef WITH_ACCOUNTING
 		if (strcmp(argv[0], "acct") == 0) {
 			return command_print_stats(listener,
-						   &proxy_acct_stats, 0, 1);
+						   proxy_acct_stats, 0, 1);
 		}
 #endif
 		if (strcmp(argv[0], "auth") == 0) {
 			return command_print_stats(listener,
-						   &proxy_auth_stats, 1, 1);
+						   proxy_auth_stats, 1, 1);
 		}
 
 		cprintf(listener, "ERROR: Should specify [auth/acct]\n");
@@ -1788,7 +1866,7 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 		return 0;
 	}
 
-	command_print_stats(listener, &home->stats,
+	command_print_stats(listener, home->stats,
 			    (home->type == HOME_TYPE_AUTH), 1);
 	cprintf(listener, "\toutstanding\t%d\n", home->currently_outstanding);
 	return 1;
@@ -1798,7 +1876,7 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 {
 	int auth = TRUE;
-	fr_stats_t *stats;
+	fr_stats_id_t stats;
 	RADCLIENT *client, fake;
 
 	if (argc < 1) {
@@ -1832,12 +1910,12 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 
 	if (strcmp(argv[0], "auth") == 0) {
 		auth = TRUE;
-		stats = &client->auth;
+		stats = client->auth;
 
 	} else if (strcmp(argv[0], "acct") == 0) {
 #ifdef WITH_ACCOUNTING
 		auth = FALSE;
-		stats = &client->acct;
+		stats = client->acct;
 #else
 		cprintf(listener, "ERROR: This server was built without accounting support.\n");
 		return 0;
@@ -1846,7 +1924,7 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	} else if (strcmp(argv[0], "coa") == 0) {
 #ifdef WITH_COA
 		auth = FALSE;
-		stats = &client->coa;
+		stats = client->coa;
 #else
 		cprintf(listener, "ERROR: This server was built without CoA support.\n");
 		return 0;
@@ -1855,7 +1933,7 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	} else if (strcmp(argv[0], "disconnect") == 0) {
 #ifdef WITH_COA
 		auth = FALSE;
-		stats = &client->dsc;
+		stats = client->dsc;
 #else
 		cprintf(listener, "ERROR: This server was built without CoA support.\n");
 		return 0;
@@ -1873,10 +1951,10 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 #ifdef WITH_ACCOUNTING
 		if (!auth) {
 			return command_print_stats(listener,
-						   &radius_acct_stats, auth, 0);
+						   radius_acct_stats, auth, 0);
 		}
 #endif
-		return command_print_stats(listener, &radius_auth_stats, auth, 0);
+		return command_print_stats(listener, radius_auth_stats, auth, 0);
 	}
 
 	return command_print_stats(listener, stats, auth, 0);
@@ -1895,7 +1973,66 @@ static int command_stats_socket(rad_listen_t *listener, int argc, char *argv[])
 
 	if (sock->type != RAD_LISTEN_AUTH) auth = FALSE;
 
-	return command_print_stats(listener, &sock->stats, auth, 0);
+	return command_print_stats(listener, sock->stats, auth, 0);
+}
+
+#ifdef WITH_DYNAMIC_CLIENTS
+static int command_stats_dynamic_clients(rad_listen_t *listener,
+					 UNUSED int argc, UNUSED char *argv[])
+{
+	fr_dynamic_client_stats_t stats;
+
+	client_dynamic_stats(&stats);
+
+	cprintf(listener, "\thits\t\t" PU "\n", stats.hits);
+	cprintf(listener, "\tmisses\t\t" PU "\n", stats.misses);
+	cprintf(listener, "\tfailed\t\t" PU "\n", stats.failed);
+	cprintf(listener, "\tnegative_hits\t" PU "\n", stats.negative_hits);
+	cprintf(listener, "\tcoalesced\t" PU "\n", stats.coalesced);
+	cprintf(listener, "\tlimited\t\t" PU "\n", stats.limited);
+	cprintf(listener, "\tcached\t\t%d\n", client_dynamic_num_cached());
+
+	return 1;
+}
+#endif
+
+static int command_stats_connection_pool(rad_listen_t *listener, int argc, char *argv[])
+{
+	CONF_SECTION *cs;
+	module_instance_t *mi;
+	fr_connection_pool_stats_t stats;
+
+	if (argc != 1) {
+		cprintf(listener, "ERROR: No module name was given\n");
+		return 0;
+	}
+
+	cs = cf_section_find("modules");
+	if (!cs) return 0;
+
+	mi = find_module_instance(cs, argv[0], 0);
+	if (!mi) {
+		cprintf(listener, "ERROR: No such module \"%s\"\n", argv[0]);
+		return 0;
+	}
+
+	if (!fr_connection_pool_stats(mi->cs, &stats)) {
+		cprintf(listener, "ERROR: Module %s has no connection pool\n",
+			argv[0]);
+		return 0;
+	}
+
+	cprintf(listener, "\tnum\t\t%d\n", stats.num);
+	cprintf(listener, "\tactive\t\t%d\n", stats.active);
+	cprintf(listener, "\tmax\t\t%d\n", stats.max);
+	cprintf(listener, "\twaiting\t\t%d\n", stats.waiting);
+	cprintf(listener, "\tat_max\t\t" PU "\n", stats.at_max);
+	cprintf(listener, "\twaits\t\t" PU "\n", stats.waits);
+	cprintf(listener, "\ttimeouts\t" PU "\n", stats.timeouts);
+	cprintf(listener, "\twait_usec\t" PU "\n", stats.wait_usec);
+	cprintf(listener, "\tmax_wait_usec\t" PU "\n", stats.max_wait_usec);
+
+	return 1;
 }
 #endif	/* WITH_STATS */
 
@@ -1957,6 +2094,36 @@ static int command_del_client(rad_listen_t *listener, int argc, char *argv[])
 	return 1;
 }
 
+static int command_del_module_cache(rad_listen_t *listener, int argc, char *argv[])
+{
+	CONF_SECTION *cs;
+	module_instance_t *mi;
+
+	if (argc < 1) {
+		cprintf(listener, "ERROR: No module name was given\n");
+		return 0;
+	}
+
+	cs = cf_section_find("modules");
+	if (!cs) return 0;
+
+	mi = find_module_instance(cs, argv[0], 0);
+	if (!mi) {
+		cprintf(listener, "ERROR: No such module \"%s\"\n", argv[0]);
+		return 0;
+	}
+
+	if (!mi->entry->module->flush) {
+		cprintf(listener, "ERROR: Module %s does not cache anything\n",
+			argv[0]);
+		return 0;
+	}
+
+	mi->entry->module->flush(mi->insthandle, (argc > 1) ? argv[1] : NULL);
+
+	return 1;		/* success */
+}
+
 
 static fr_command_table_t command_table_del_client[] = {
 	{ "ipaddr", FR_WRITE,
@@ -1967,10 +2134,22 @@ static fr_command_table_t command_table_del_client[] = {
 };
 
 
+static fr_command_table_t command_table_del_module[] = {
+	{ "cache", FR_WRITE,
+	  "del module cache <module> [<key>] - Delete everything <module> has cached, or only the entry for <key>",
+	  command_del_module_cache, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
+
 static fr_command_table_t command_table_del[] = {
 	{ "client", FR_WRITE,
 	  "del client <command> - Delete client configuration commands",
 	  NULL, command_table_del_client },
+	{ "module", FR_WRITE,
+	  "del module <command> - Delete module data commands",
+	  NULL, command_table_del_module },
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
@@ -2041,12 +2220,22 @@ static fr_command_table_t command_table_stats[] = {
 	  "- show statistics for given client, or for all clients (auth or acct)",
 	  command_stats_client, NULL },
 
+	{ "connection_pool", FR_READ,
+	  "stats connection_pool <module> - show statistics for the connection pool of the given module",
+	  command_stats_connection_pool, NULL },
+
 #ifdef WITH_DETAIL
 	{ "detail", FR_READ,
-	  "stats detail <filename> - show statistics for the given detail file",
+	  "stats detail <filename> - show statistics for the given detail file, and each of its shards",
 	  command_stats_detail, NULL },
 #endif
 
+#ifdef WITH_DYNAMIC_CLIENTS
+	{ "dynamic_clients", FR_READ,
+	  "stats dynamic_clients - show statistics for dynamic client lookups",
+	  command_stats_dynamic_clients, NULL },
+#endif
+
 #ifdef WITH_PROXY
 	{ "home_server", FR_READ,
 	  "stats home_server [<ipaddr>/auth/acct] <port> - show statistics for given home server (ipaddr and port), or for all home servers (auth or acct)",
@@ -2656,6 +2845,9 @@ static int command_domain_accept(rad_listen_t *listener)
 	socklen_t salen;
 	struct sockaddr_storage src;
 	fr_command_socket_t *sock = listener->data;
+#ifdef WITH_STATS
+	fr_stats_id_t stats;
+#endif
 	
 	salen = sizeof(src);
 
@@ -2735,10 +2927,16 @@ static int command_domain_accept(rad_listen_t *listener)
 	 *	information.
 	 */
 	sock = this->data;
+#ifdef WITH_STATS
+	stats = this->stats;
+#endif
 	memcpy(this, listener, sizeof(*this));
 	this->status = RAD_LISTEN_STATUS_INIT;
 	this->next = NULL;
 	this->data = sock;	/* fix it back */
+#ifdef WITH_STATS
+	this->stats = stats;
+#endif
 
 	sock->user[0] = '\0';
 	sock->path = ((fr_command_socket_t *) listener->data)->path;
@@ -941,13 +941,11 @@ int cf_item_parse(CONF_SECTION *cs, const char *name,
 		*q = value ? talloc_strdup(cs, value) : NULL;
 
 		/*
-		 *	And now we "stat" the file.
-		 *
-		 *	FIXME: This appears to leak memory on exit,
-		 *	and we don't use this information.  So it's
-		 *	commented out for now.
+		 *	And now we "stat" the file.  cf_section_cmp()
+		 *	uses the modification time to see if the
+		 *	file has changed since it was read.
 		 */
-		if (0 && *q) {
+		if (*q) {
 			struct stat buf;
 
 			if (stat(*q, &buf) == 0) {
@@ -955,9 +953,15 @@ int cf_item_parse(CONF_SECTION *cs, const char *name,
 
 				mtime = rad_malloc(sizeof(*mtime));
 				*mtime = buf.st_mtime;
-				/* FIXME: error? */
-				cf_data_add_internal(cs, *q, mtime, free,
-						     PW_TYPE_FILENAME);
+
+				/*
+				 *	The same file is already
+				 *	referenced by this section.
+				 */
+				if (cf_data_add_internal(cs, *q, mtime, free,
+							 PW_TYPE_FILENAME) < 0) {
+					free(mtime);
+				}
 			}
 		}
 		break;
@@ -2493,6 +2497,8 @@ static void cf_section_copy_data(CONF_SECTION *s, CONF_SECTION *d)
 	}
 }
 
+#endif
+
 /*
  *	For a CONF_DATA element, stat the filename, if necessary.
  */
@@ -2512,10 +2518,41 @@ static int filename_stat(UNUSED void *context, void *data)
 
 
 /*
- *	Compare two CONF_SECTIONS.  The items MUST be in the same
- *	order.
+ *	Whether an item was added by the server, rather than being
+ *	read from the configuration files.  Sections are created by
+ *	cf_section_parse() to hold default values, so they count if
+ *	everything in them does.
+ */
+static int cf_item_internal(const CONF_ITEM *ci)
+{
+	const CONF_ITEM *child;
+
+	if (ci->type == CONF_ITEM_DATA) return 1;
+
+	if (ci->type == CONF_ITEM_PAIR) {
+		return (ci->filename && (strcmp(ci->filename, "<internal>") == 0));
+	}
+
+	for (child = cf_itemtosection(ci)->children;
+	     child != NULL;
+	     child = child->next) {
+		if (!cf_item_internal(child)) return 0;
+	}
+
+	return 1;
+}
+
+/** Check whether two sections are the same
+ *
+ * The items MUST be in the same order.  Files referenced by PW_TYPE_FILENAME
+ * items in "a" are checked to see if they have been modified since "a" was
+ * parsed.
+ *
+ * @param a the older section.
+ * @param b the newer section.
+ * @return 1 if the sections are the same, else 0.
  */
-static int cf_section_cmp(CONF_SECTION *a, CONF_SECTION *b)
+int cf_section_cmp(CONF_SECTION *a, CONF_SECTION *b)
 {
 	CONF_ITEM *ca = a->children;
 	CONF_ITEM *cb = b->children;
@@ -2529,13 +2566,14 @@ static int cf_section_cmp(CONF_SECTION *a, CONF_SECTION *b)
 		if (!ca && !cb) break;
 
 		/*
-		 *	Skip CONF_DATA.
+		 *	Skip CONF_DATA, and defaults added by
+		 *	cf_section_parse().
 		 */
-		if (ca && ca->type == CONF_ITEM_DATA) {
+		if (ca && cf_item_internal(ca)) {
 			ca = ca->next;
 			continue;
 		}
-		if (cb && cb->type == CONF_ITEM_DATA) {
+		if (cb && cf_item_internal(cb)) {
 			cb = cb->next;
 			continue;
 		}
@@ -2554,6 +2592,10 @@ static int cf_section_cmp(CONF_SECTION *a, CONF_SECTION *b)
 			CONF_SECTION *sa = cf_itemtosection(ca);
 			CONF_SECTION *sb = cf_itemtosection(cb);
 
+			if (strcmp(sa->name1, sb->name1) != 0) return 0;
+			if (!sa->name2 != !sb->name2) return 0;
+			if (sa->name2 && (strcmp(sa->name2, sb->name2) != 0)) return 0;
+
 			if (!cf_section_cmp(sa, sb)) return 0;
 			goto next;
 		}
@@ -2566,8 +2608,10 @@ static int cf_section_cmp(CONF_SECTION *a, CONF_SECTION *b)
 		/*
 		 *	Different attr and/or value, Exit.
 		 */
-		if ((strcmp(pa->attr, pb->attr) != 0) ||
-		    (strcmp(pa->value, pb->value) != 0)) return 0;
+		if (strcmp(pa->attr, pb->attr) != 0) return 0;
+		if (!pa->value != !pb->value) return 0;
+		if (pa->value && (strcmp(pa->value, pb->value) != 0)) return 0;
+		if (pa->op != pb->op) return 0;
 
 
 		/*
@@ -2593,6 +2637,7 @@ static int cf_section_cmp(CONF_SECTION *a, CONF_SECTION *b)
 }
 
 
+#if 0
 /*
  *	Migrate CONF_DATA from one section to another.
  */
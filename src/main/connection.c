@@ -28,11 +28,10 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 
 #include <freeradius-devel/connection.h>
+#include <freeradius-devel/modules.h>
 
 #include <freeradius-devel/rad_assert.h>
 
-typedef struct fr_connection fr_connection_t;
-
 static int fr_connection_pool_check(fr_connection_pool_t *pool);
 
 /** An individual connection within the connection pool
@@ -40,6 +39,10 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool);
  * Defines connection counters, timestamps, and holds a pointer to the
  * connection handle itself.
  *
+ * Free connections are kept at the head of the connection list, and
+ * reserved ones at the tail, so a free connection can be found without
+ * walking the list.
+ *
  * @see fr_connection_pool_t
  */
 struct fr_connection {
@@ -121,12 +124,31 @@ struct fr_connection_pool_t {
 	int		spawning;	//!< Whether we are currently attempting
 					//!< to spawn a new connection.
 
+	int		wait_timeout;	//!< How long (in milliseconds) to wait
+					//!< for a connection to be released
+					//!< when the pool is at max
+					//!< (0 is don't wait).
+	int		waiting;	//!< Number of callers waiting for a
+					//!< connection.
+
+	uint64_t	at_max;		//!< Times we had no free connections
+					//!< and were at max.
+	uint64_t	waits;		//!< Times we waited for a connection.
+	uint64_t	timeouts;	//!< Times waiting timed out.
+	uint64_t	wait_usec;	//!< Total time spent waiting.
+	uint64_t	max_wait_usec;	//!< Longest time spent waiting.
+
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t	mutex;		//!< Mutex used to keep consistent state
 					//!< when making modifications in
 					//!< threaded mode.
+	pthread_cond_t	cond;		//!< Signalled when a connection is
+					//!< released or closed, to wake up
+					//!< callers waiting for one.
 #endif
 
+	CONF_SECTION	*parent;	//!< Configuration section of the
+					//!< module using the pool.
 	CONF_SECTION	*cs;		//!< Configuration section holding
 					//!< the section of parsed config file
 					//!< that relates to this pool.
@@ -143,12 +165,24 @@ struct fr_connection_pool_t {
 					//!< of connections.
 	fr_connection_delete_t	delete;	//!< Function used to close existing
 					//!< connections.
+
+	fr_connection_pool_t	*next;	//!< Next pool in the list of all
+					//!< pools.
 };
 
 #define LOG_PREFIX "rlm_%s (%s)"
 #ifndef HAVE_PTHREAD_H
 #define pthread_mutex_lock(_x)
 #define pthread_mutex_unlock(_x)
+#define pthread_cond_signal(_x)
+#endif
+
+/*
+ *	All of the connection pools, so that radmin can find them.
+ */
+static fr_connection_pool_t *pool_list = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t pool_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 static const CONF_PARSER connection_config[] = {
@@ -168,6 +202,8 @@ static const CONF_PARSER connection_config[] = {
 	  0, "5" },
 	{ "idle_timeout",  PW_TYPE_INTEGER, offsetof(fr_connection_pool_t, idle_timeout),
 	  0, "60" },
+	{ "wait_timeout",  PW_TYPE_INTEGER, offsetof(fr_connection_pool_t, wait_timeout),
+	  0, "0" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -226,6 +262,60 @@ static void fr_connection_link(fr_connection_pool_t *pool,
 	}
 }
 
+/** Adds a connection to the end of the connection list
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in,out] pool to modify.
+ * @param[in] this Connection to add.
+ */
+static void fr_connection_link_tail(fr_connection_pool_t *pool,
+				    fr_connection_t *this)
+{
+	rad_assert(pool != NULL);
+	rad_assert(this != NULL);
+	rad_assert(pool->head != this);
+	rad_assert(pool->tail != this);
+
+	if (pool->tail) pool->tail->next = this;
+	this->prev = pool->tail;
+	this->next = NULL;
+	pool->tail = this;
+	if (!pool->head) {
+		rad_assert(this->prev == NULL);
+		pool->head = this;
+	} else {
+		rad_assert(this->prev != NULL);
+	}
+}
+
+/** Mark a connection as in use
+ *
+ * Moves the connection to the end of the connection list, with the
+ * other reserved connections.
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in,out] pool the connection is in.
+ * @param[in,out] this Connection to reserve.
+ * @param[in] now Current time.
+ */
+static void fr_connection_reserve(fr_connection_pool_t *pool,
+				  fr_connection_t *this, time_t now)
+{
+	rad_assert(this->in_use == FALSE);
+
+	if (this != pool->tail) {
+		fr_connection_unlink(pool, this);
+		fr_connection_link_tail(pool, this);
+	}
+
+	pool->active++;
+	this->num_uses++;
+	this->last_used = now;
+	this->in_use = TRUE;
+}
+
 
 /** Spawns a new connection
  *
@@ -235,12 +325,16 @@ static void fr_connection_link(fr_connection_pool_t *pool,
  * @note Will call the 'open' trigger.
  * @note Must be called with the mutex free.
  *
+ * If in_use is TRUE, the connection is reserved for the caller while
+ * the mutex is still held, so that no other thread can take it.
+ *
  * @param[in] pool
  * @param[in] now Current time.
+ * @param[in] in_use Whether to reserve the new connection.
  * @return the new connection struct or NULL on error.
  */
 static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool,
-					    time_t now)
+					    time_t now, int in_use)
 {
 	fr_connection_t *this;
 	void *conn;
@@ -334,6 +428,12 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool,
 	pool->spawning = FALSE;
 	pool->last_spawned = time(NULL);
 
+	if (in_use) {
+		fr_connection_reserve(pool, this, now);
+	} else if (pool->waiting) {
+		pthread_cond_signal(&pool->cond);
+	}
+
 	pthread_mutex_unlock(&pool->mutex);
 
 	if (pool->trigger) exec_trigger(NULL, pool->cs, "open", TRUE);
@@ -391,6 +491,8 @@ int fr_connection_add(fr_connection_pool_t *pool, void *conn)
 	fr_connection_link(pool, this);
 	pool->num++;
 
+	if (pool->waiting) pthread_cond_signal(&pool->cond);
+
 	pthread_mutex_unlock(&pool->mutex);
 
 	if (pool->trigger) exec_trigger(NULL, pool->cs, "open", TRUE);
@@ -422,60 +524,40 @@ static void fr_connection_close(fr_connection_pool_t *pool,
 	rad_assert(pool->num > 0);
 	pool->num--;
 	free(this);
+
+	/*
+	 *	We're now below max, so a waiting caller can open a
+	 *	new connection.
+	 */
+	if (pool->waiting) pthread_cond_signal(&pool->cond);
 }
 
-/** Find a connection handle in the connection list
- *
- * Walks over the list of connections searching for a specified connection
- * handle and returns the first connection that contains that pointer.
- *
- * @note Will lock mutex and only release mutex if connection handle
- * is not found, so will usually return will mutex held.
- * @note Must be called with the mutex free.
+/** Get the handle of a connection
  *
- * @param[in] pool to search in.
- * @param[in] conn handle to search for.
- * @return the connection containing the specified handle, or NULL if non is
- * found.
+ * @param[in] this Connection returned by fr_connection_get or
+ * fr_connection_reconnect.
+ * @return the handle created by the module's create callback.
  */
-static fr_connection_t *fr_connection_find(fr_connection_pool_t *pool, void *conn)
+void *fr_connection_handle(const fr_connection_t *this)
 {
-	fr_connection_t *this;
-
-	if (!pool || !conn) return NULL;
-
-	pthread_mutex_lock(&pool->mutex);
-
-	/*
-	 *	FIXME: This loop could be avoided if we passed a 'void
-	 *	**connection' instead.  We could use "offsetof" in
-	 *	order to find top of the parent structure.
-	 */
-	for (this = pool->head; this != NULL; this = this->next) {
-		if (this->connection == conn) return this;
-	}
-
-	pthread_mutex_unlock(&pool->mutex);
-	return NULL;
+	return this->connection;
 }
 
 /** Delete a connection from the connection pool.
  *
- * Resolves the connection handle to a connection, then (if found)
- * closes, unlinks and frees that connection.
+ * Closes, unlinks and frees the connection.
  *
  * @note Must be called with the mutex free.
  *
  * @param[in,out] pool Connection pool to modify.
- * @param[in] conn to delete.
- * @return 0 if the connection could not be found, else 1.
+ * @param[in] this Connection to delete.
+ * @return 0 if there was no connection, else 1.
  */
-int fr_connection_del(fr_connection_pool_t *pool, void *conn)
+int fr_connection_del(fr_connection_pool_t *pool, fr_connection_t *this)
 {
-	fr_connection_t *this;
+	if (!pool || !this) return 0;
 
-	this = fr_connection_find(pool, conn);
-	if (!this) return 0;
+	pthread_mutex_lock(&pool->mutex);
 
 	/*
 	 *	If it's in use, release it.
@@ -509,11 +591,21 @@ int fr_connection_del(fr_connection_pool_t *pool, void *conn)
 void fr_connection_pool_delete(fr_connection_pool_t *pool)
 {
 	fr_connection_t *this, *next;
+	fr_connection_pool_t **last;
 
 	if (!pool) return;
 
 	DEBUG("%s: Removing connection pool", pool->log_prefix);
 
+	pthread_mutex_lock(&pool_list_mutex);
+	for (last = &pool_list; *last != NULL; last = &(*last)->next) {
+		if (*last == pool) {
+			*last = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool_list_mutex);
+
 	pthread_mutex_lock(&pool->mutex);
 
 	for (this = pool->head; this != NULL; this = next) {
@@ -530,6 +622,10 @@ void fr_connection_pool_delete(fr_connection_pool_t *pool)
 	rad_assert(pool->head == NULL);
 	rad_assert(pool->tail == NULL);
 	rad_assert(pool->num == 0);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&pool->cond);
+#endif
 	
 	free(pool->log_prefix);
 	free(pool);
@@ -558,7 +654,7 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 					      fr_connection_alive_t a,
 					      fr_connection_delete_t d)
 {
-	int i, lp_len;
+	int i, lp_len, suspended;
 	fr_connection_pool_t *pool;
 	fr_connection_t *this;
 	CONF_SECTION *modules;
@@ -574,6 +670,7 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 	pool = rad_malloc(sizeof(*pool));
 	memset(pool, 0, sizeof(*pool));
 
+	pool->parent = parent;
 	pool->cs = cs;
 	pool->ctx = ctx;
 	pool->create = c;
@@ -584,6 +681,7 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
 #endif
 
 	modules = cf_item_parent(cf_sectiontoitem(parent));
@@ -639,21 +737,80 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 	/*
 	 *	Create all of the connections, unless the admin says
 	 *	not to.
+	 *
+	 *	This may take a while if the back-end is slow, so let
+	 *	other modules instantiate while we're waiting.  The
+	 *	connections in this pool are still opened one at a
+	 *	time, as the create callback isn't re-entrant.
 	 */
+	suspended = module_instantiate_suspend();
 	for (i = 0; i < pool->start; i++) {
-		this = fr_connection_spawn(pool, now);	
-		if (!this) {
-		error:
-			fr_connection_pool_delete(pool);
-			return NULL;
-		}
+		this = fr_connection_spawn(pool, now, FALSE);
+		if (!this) break;
+	}
+	module_instantiate_resume(suspended);
+
+	if (i < pool->start) {
+	error:
+		fr_connection_pool_delete(pool);
+		return NULL;
 	}
 
 	if (pool->trigger) exec_trigger(NULL, pool->cs, "start", TRUE);
 
+	pthread_mutex_lock(&pool_list_mutex);
+	pool->next = pool_list;
+	pool_list = pool;
+	pthread_mutex_unlock(&pool_list_mutex);
+
 	return pool;
 }
 
+/** Get the counters for a connection pool
+ *
+ * Finds the connection pool created for the given configuration
+ * section, and copies its counters.
+ *
+ * @param[in] cs Configuration section passed to fr_connection_pool_init.
+ * @param[out] stats Where to write the counters.
+ * @return 0 if there is no pool for the section, else 1.
+ */
+int fr_connection_pool_stats(const CONF_SECTION *cs,
+			     fr_connection_pool_stats_t *stats)
+{
+	fr_connection_pool_t *pool;
+
+	pthread_mutex_lock(&pool_list_mutex);
+
+	/*
+	 *	The newest pool for the section is at the head.
+	 */
+	for (pool = pool_list; pool != NULL; pool = pool->next) {
+		if (pool->parent == cs) break;
+	}
+
+	if (!pool) {
+		pthread_mutex_unlock(&pool_list_mutex);
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	stats->num = pool->num;
+	stats->active = pool->active;
+	stats->max = pool->max;
+	stats->waiting = pool->waiting;
+	stats->at_max = pool->at_max;
+	stats->waits = pool->waits;
+	stats->timeouts = pool->timeouts;
+	stats->wait_usec = pool->wait_usec;
+	stats->max_wait_usec = pool->max_wait_usec;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_mutex_unlock(&pool_list_mutex);
+
+	return 1;
+}
+
 
 /** Check whether a connection needs to be removed from the pool
  *
@@ -752,7 +909,7 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool)
 
 		if (spawn) {
 			pthread_mutex_unlock(&pool->mutex);
-			fr_connection_spawn(pool, now); /* ignore return code */
+			fr_connection_spawn(pool, now, FALSE); /* ignore return code */
 			pthread_mutex_lock(&pool->mutex);
 		}
 	}
@@ -801,112 +958,177 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool)
 
 /** Trigger connection check for a given connection or all connections
  *
- * If conn is not NULL then we call fr_connection_manage on the connection.
- * If conn is NULL we call fr_connection_pool_check on the pool.
+ * If this is not NULL then we call fr_connection_manage on the connection.
+ * If this is NULL we call fr_connection_pool_check on the pool.
  *
  * @note Only connections that are not in use will be closed.
  *
  * @see fr_connection_manage
  * @see fr_connection_pool_check
  * @param[in,out] pool to manage.
- * @param[in,out] conn to check.
+ * @param[in,out] this Connection to check.
  * @return 0 if the connection was closed, else 1.
  */
-int fr_connection_check(fr_connection_pool_t *pool, void *conn)
+int fr_connection_check(fr_connection_pool_t *pool, fr_connection_t *this)
 {
-	fr_connection_t *this;
 	time_t now;
-	int ret = 1;
+	int ret;
 	
 	if (!pool) return 1;
 
 	now = time(NULL);
 	pthread_mutex_lock(&pool->mutex);
 
-	if (!conn) return fr_connection_pool_check(pool);
+	if (!this) return fr_connection_pool_check(pool);
 
-	for (this = pool->head; this != NULL; this = this->next) {
-		if (this->connection == conn) {
-			ret = fr_connection_manage(pool, conn, now);
-			break;
-		}
-	}
+	ret = fr_connection_manage(pool, this, now);
 
 	pthread_mutex_unlock(&pool->mutex);
 
 	return ret;
 }
 
+/** Wait for a connection to be released
+ *
+ * Called when there are no free connections, and the pool is at 'max'.
+ * Waits for up to 'wait_timeout' milliseconds for a connection to be
+ * released, or closed.
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in,out] pool to wait on.
+ * @return 0 if we didn't wait, or the wait timed out, else 1.
+ */
+static int fr_connection_wait(fr_connection_pool_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+	uint64_t usec;
+	struct timeval start, end;
+	struct timespec when;
+
+	if (pool->wait_timeout <= 0) return 0;
+
+	gettimeofday(&start, NULL);
+	when.tv_sec = start.tv_sec + (pool->wait_timeout / 1000);
+	when.tv_nsec = (start.tv_usec + ((pool->wait_timeout % 1000) * 1000)) * 1000;
+	if (when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	}
+
+	pool->waits++;
+	pool->waiting++;
+
+	while ((pool->num >= pool->max) &&
+	       (!pool->head || pool->head->in_use)) {
+		if (pthread_cond_timedwait(&pool->cond, &pool->mutex,
+					   &when) == ETIMEDOUT) break;
+	}
+
+	pool->waiting--;
+
+	gettimeofday(&end, NULL);
+	usec = ((uint64_t) (end.tv_sec - start.tv_sec) * 1000000) +
+		end.tv_usec - start.tv_usec;
+	pool->wait_usec += usec;
+	if (usec > pool->max_wait_usec) pool->max_wait_usec = usec;
+
+	if ((pool->num >= pool->max) &&
+	    (!pool->head || pool->head->in_use)) {
+		pool->timeouts++;
+		return 0;
+	}
+
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 /** Reserve a connection in the connection pool
  *
  * Will attempt to find an unused connection in the connection pool, if one is
  * found, will mark it as in in use increment the number of active connections
- * and return the connection handle.
+ * and return the connection.  Its handle is returned by fr_connection_handle.
  *
  * If no free connections are found will attempt to spawn a new one, conditional
  * on a connection spawning not already being in progress, and not being at the
  * 'max' connection limit.
  *
+ * If the pool is at 'max', will wait for up to 'wait_timeout' milliseconds for
+ * a connection to be released.
+ *
  * @note fr_connection_release must be called once the caller has finished
  * using the connection.
  *
  * @see fr_connection_release
  * @param[in,out] pool to reserve the connection from.
- * @return a pointer to the connection handle, or NULL on error.
+ * @return the connection, or NULL on error.
  */
-void *fr_connection_get(fr_connection_pool_t *pool)
+fr_connection_t *fr_connection_get(fr_connection_pool_t *pool)
 {
 	time_t now;
-	fr_connection_t *this, *next;
+	fr_connection_t *this;
 
 	if (!pool) return NULL;
 
 	pthread_mutex_lock(&pool->mutex);
 
 	now = time(NULL);
-	for (this = pool->head; this != NULL; this = next) {
-		next = this->next;
 
-		if (!this->in_use) goto do_return;
-	}
+	/*
+	 *	Free connections are always at the head.
+	 */
+	this = pool->head;
+	if (this && !this->in_use) goto do_return;
 
-	if (pool->num == pool->max) {
-		int complain = FALSE;
+	if (pool->num >= pool->max) {
+		pool->at_max++;
+
+		if (!fr_connection_wait(pool)) {
+			int complain = FALSE;
+
+			/*
+			 *	Rate-limit complaints.
+			 */
+			if (pool->last_at_max != now) {
+				complain = TRUE;
+				pool->last_at_max = now;
+			}
+
+			pthread_mutex_unlock(&pool->mutex);
+
+			if (complain) {
+				radlog(L_ERR, "%s: No connections available and at max "
+				       "connection limit", pool->log_prefix);
+			}
+
+			return NULL;
+		}
 
 		/*
-		 *	Rate-limit complaints.
+		 *	Either a connection was released, or one
+		 *	was closed and we can open a new one.
 		 */
-		if (pool->last_at_max != now) {
-			complain = TRUE;
-			pool->last_at_max = now;
-		}
-		
-		pthread_mutex_unlock(&pool->mutex);
-		
-		if (complain) {
-			radlog(L_ERR, "%s: No connections available and at max "
-			       "connection limit", pool->log_prefix);
-		}
-		
-		return NULL;
+		now = time(NULL);
+		this = pool->head;
+		if (this && !this->in_use) goto do_return;
 	}
 
 	pthread_mutex_unlock(&pool->mutex);
-	this = fr_connection_spawn(pool, now);
+	this = fr_connection_spawn(pool, now, TRUE);
 	if (!this) return NULL;
-	pthread_mutex_lock(&pool->mutex);
+	goto reserved;
 
 do_return:
-	pool->active++;
-	this->num_uses++;
-	this->last_used = now;
-	this->in_use = TRUE;
+	fr_connection_reserve(pool, this, now);
 
 	pthread_mutex_unlock(&pool->mutex);
-	
+
+reserved:
 	DEBUG("%s: Reserved connection (%i)", pool->log_prefix, this->number);
 	
-	return this->connection;
+	return this;
 }
 
 /** Release a connection
@@ -916,14 +1138,13 @@ do_return:
  *
  * @see fr_connection_get
  * @param[in,out] pool to release the connection in.
- * @param[in,out] conn to release.
+ * @param[in,out] this Connection to release.
  */
-void fr_connection_release(fr_connection_pool_t *pool, void *conn)
+void fr_connection_release(fr_connection_pool_t *pool, fr_connection_t *this)
 {
-	fr_connection_t *this;
+	if (!pool || !this) return;
 
-	this = fr_connection_find(pool, conn);
-	if (!this) return;
+	pthread_mutex_lock(&pool->mutex);
 
 	rad_assert(this->in_use == TRUE);
 	this->in_use = FALSE;
@@ -939,6 +1160,8 @@ void fr_connection_release(fr_connection_pool_t *pool, void *conn)
 	rad_assert(pool->active > 0);
 	pool->active--;
 
+	if (pool->waiting) pthread_cond_signal(&pool->cond);
+
 	DEBUG("%s: Released connection (%i)", pool->log_prefix, this->number);
 
 	/*
@@ -958,7 +1181,8 @@ void fr_connection_release(fr_connection_pool_t *pool, void *conn)
  * and if this is successful the new handle will be assigned to the existing
  * pool connection.
  *
- * If this is not successful, the connection will be removed from the pool.
+ * If this is not successful, the connection will be removed from the pool,
+ * and another one reserved instead.
  *
  * When implementing a module that uses the connection pool API, it is advisable
  * to pass a pointer to the pointer to the handle (void **conn)
@@ -968,23 +1192,24 @@ void fr_connection_release(fr_connection_pool_t *pool, void *conn)
  * connection handle.
  *
  * @warning After calling reconnect the caller *MUST NOT* attempt to use
- * the old handle in any other operations, as its memory will have been freed.
+ * the old handle or connection in any other operations, as their memory
+ * may have been freed.
  *
  * @see fr_connection_get
  * @param[in,out] pool to reconnect the connection in.
- * @param[in,out] conn to reconnect.
- * @return ew connection handle if successful else NULL.
+ * @param[in,out] this Connection to reconnect.
+ * @return the connection, with a new handle, if successful else NULL.
  */
-void *fr_connection_reconnect(fr_connection_pool_t *pool, void *conn)
+fr_connection_t *fr_connection_reconnect(fr_connection_pool_t *pool,
+					 fr_connection_t *this)
 {
 	void *new_conn;
-	fr_connection_t *this;
+	fr_connection_t *new_this;
 	int conn_number;
 
-	if (!pool || !conn) return NULL;
+	if (!pool || !this) return NULL;
 
-	this = fr_connection_find(pool, conn);
-	if (!this) return NULL;
+	pthread_mutex_lock(&pool->mutex);
 	
 	conn_number = this->number;
 
@@ -1014,8 +1239,8 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, void *conn)
 		 *	Can't create a new socket.
 		 *	Try grabbing a pre-existing one.
 		 */
-		new_conn = fr_connection_get(pool);
-		if (new_conn) return new_conn;
+		new_this = fr_connection_get(pool);
+		if (new_this) return new_this;
 		
 		if (!now) return NULL;
 		
@@ -1025,8 +1250,8 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, void *conn)
 		return NULL;
 	}
 	
-	pool->delete(pool->ctx, conn);
+	pool->delete(pool->ctx, this->connection);
 	this->connection = new_conn;
 	pthread_mutex_unlock(&pool->mutex);
-	return new_conn;
+	return this;
 }
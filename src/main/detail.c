@@ -37,8 +37,17 @@ RCSID("$Id$")
 #include <glob.h>
 #endif
 
+#include <ctype.h>
 #include <fcntl.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #ifdef WITH_DETAIL
 
 #define USEC (1000000)
@@ -56,33 +65,103 @@ static FR_NAME_NUMBER state_names[] = {
 	{ NULL, 0 }
 };
 
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#define DETAIL_RECORD(_data, _i) (&(_data)->window[((_data)->head + (_i)) % (_data)->max_outstanding])
+
 /*
- *	If we're limiting outstanding packets, then mark the response
- *	as being sent.
+ *	The packet ID, ports, and IP are generated from the record
+ *	counter.  Get the counter back.
+ */
+static uint32_t detail_packet_counter(const RADIUS_PACKET *packet)
+{
+	uint32_t counter;
+
+	counter = packet->id;
+	counter |= ((packet->src_port - 1024) & 0xff) << 8;
+	counter |= ((packet->dst_port - 1024) & 0xff) << 16;
+	counter |= (ntohl(packet->dst_ipaddr.ipaddr.ip4addr.s_addr) & 0xff) << 24;
+
+	return counter;
+}
+
+/*
+ *	Mark the response as being sent, so that the record can be
+ *	forgotten, and more records read.
  */
 int detail_send(rad_listen_t *listener, REQUEST *request)
 {
-	int rtt;
+	int i, rtt;
+	uint32_t counter;
 	struct timeval now;
+	detail_record_t *rec = NULL;
 	listen_detail_t *data = listener->data;
 
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == detail_send);
 
+	counter = detail_packet_counter(request->packet);
+
+	PTHREAD_MUTEX_LOCK(&data->mutex);
+	for (i = 0; i < data->outstanding; i++) {
+		if (DETAIL_RECORD(data, i)->counter == counter) {
+			rec = DETAIL_RECORD(data, i);
+			break;
+		}
+	}
+
+	/*
+	 *	A reply to an earlier copy of a record which has
+	 *	since been retried, and the retry has finished.
+	 */
+	if (!rec || (rec->state == STATE_REPLIED)) {
+		PTHREAD_MUTEX_UNLOCK(&data->mutex);
+		return 0;
+	}
+
 	/*
 	 *	This request timed out.  Remember that, and tell the
 	 *	caller it's OK to read more "detail" file stuff.
 	 */
 	if (request->reply->code == 0) {
-		data->delay_time = data->retry_interval * USEC;
-		data->signal = 1;
-		data->state = STATE_NO_REPLY;
+		rec->state = STATE_NO_REPLY;
+		rec->running = time(NULL);
+		PTHREAD_MUTEX_UNLOCK(&data->mutex);
 
 		RDEBUG("Detail - No response configured for request %d.  Will retry in %d seconds",
 		       request->number, data->retry_interval);
 
-		radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
-		return 0;
+		goto signal;
+	}
+
+	/*
+	 *	Overwrite the start of the "Timestamp" line with
+	 *	"Done", or set the "done" flag of a binary record, so
+	 *	that the record isn't processed again if the server
+	 *	restarts before the whole file is done.
+	 *
+	 *	This is done with the mutex held, so the file can't be
+	 *	closed underneath us.
+	 */
+	if (rec->done_offset >= 0) {
+		ssize_t rcode;
+
+		if (data->binary) {
+			rcode = pwrite(listener->fd, "\001", 1, rec->done_offset);
+		} else {
+			rcode = pwrite(listener->fd, "\tDone", 5, rec->done_offset);
+		}
+
+		if (rcode < 0) {
+			radlog(L_ERR, "Detail - Failed marking record done in %s: %s",
+			       data->filename_work, strerror(errno));
+		}
 	}
 
 	/*
@@ -102,9 +181,8 @@ int detail_send(rad_listen_t *listener, REQUEST *request)
 	now.tv_sec += 1;
 
 	/*
-	 *	Only one detail packet may be outstanding at a time,
-	 *	so it's safe to update some entries in the detail
-	 *	structure.
+	 *	Many records may be outstanding, so the RTT estimate
+	 *	is protected by the mutex.
 	 *
 	 *	We keep smoothed round trip time (SRTT), but not round
 	 *	trip timeout (RTO).  We use SRTT to calculate a rough
@@ -155,15 +233,123 @@ int detail_send(rad_listen_t *listener, REQUEST *request)
 		request->number, data->delay_time / USEC);
 	
 	data->last_packet = now;
-	data->signal = 1;
-	data->state = STATE_REPLIED;
-	data->counter++;
-	radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
+	rec->state = STATE_REPLIED;
+	PTHREAD_MUTEX_UNLOCK(&data->mutex);
+
+signal:
+	/*
+	 *	The signal is handled in this thread, and it reads
+	 *	the next record.  That's only safe when no other
+	 *	record is being processed.  With more records in
+	 *	flight, the main thread polls for replies instead.
+	 *	See detail_encode().
+	 */
+	if (data->max_outstanding == 1) {
+		data->signal = 1;
+		radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
+	}
 
 	return 0;
 }
 
 
+/*
+ *	Whether a file found by the glob is read by this listener.
+ *	When the files are split across shards, each file is always
+ *	read by the same shard, so its records are processed in
+ *	order.
+ */
+static int detail_mine(const listen_detail_t *data, const char *filename)
+{
+	size_t len;
+	const char *p;
+
+	if (data->shards == 1) return TRUE;
+
+	/*
+	 *	The work files of the other shards.
+	 */
+	len = strlen(filename);
+	if ((len > 5) && (strcmp(filename + len - 5, ".work") == 0)) {
+		return FALSE;
+	}
+
+	/*
+	 *	One directory per NAS.  Send all of the files in a
+	 *	directory to the same shard, so that the oldest is
+	 *	read first.
+	 */
+	if (data->hash_dir) {
+		p = strrchr(filename, FR_DIR_SEP);
+		if (p) len = p - filename;
+	}
+
+	return ((fr_hash(filename, len) % data->shards) == (uint32_t) data->shard);
+}
+
+#ifdef HAVE_GLOB_H
+/*
+ *	Find a work file which no shard owns.  They're left behind
+ *	when the server stops part way through a file, and is then
+ *	started with a different number of shards.  Only the first
+ *	shard looks for them, so that two shards don't read the
+ *	same one.
+ */
+static char *detail_orphan(listen_detail_t *data)
+{
+	unsigned int i;
+	int shard;
+	size_t len;
+	char *p, *q;
+	char *found = NULL;
+	char pattern[2048];
+	glob_t files;
+
+	p = strrchr(data->filename_work, FR_DIR_SEP);
+	len = p ? (size_t) (p - data->filename_work) + 1 : 0;
+	if ((len + sizeof("detail*.work")) > sizeof(pattern)) goto done;
+
+	memcpy(pattern, data->filename_work, len);
+	strcpy(pattern + len, "detail*.work");
+
+	memset(&files, 0, sizeof(files));
+	if (glob(pattern, 0, NULL, &files) != 0) {
+		globfree(&files);
+		goto done;
+	}
+
+	for (i = 0; i < files.gl_pathc; i++) {
+		p = files.gl_pathv[i] + len;
+
+		if (strcmp(p, "detail.work") == 0) {
+			if (data->shards == 1) continue;
+
+		} else if (strncmp(p, "detail-", 7) == 0) {
+			shard = strtol(p + 7, &q, 10);
+			if ((q == p + 7) || (strcmp(q, ".work") != 0)) continue;
+			if ((data->shards > 1) && (shard < data->shards)) continue;
+
+		} else {
+			continue;
+		}
+
+		found = strdup(files.gl_pathv[i]);
+		break;
+	}
+	globfree(&files);
+
+	if (found) {
+		radlog(L_INFO, "Detail - Replaying %s, which was left by a different number of shards",
+		       found);
+		return found;
+	}
+
+done:
+	data->orphans = FALSE;
+	return NULL;
+}
+#endif
+
 /*
  *	Open the detail file, if we can.
  *
@@ -195,6 +381,18 @@ static int detail_open(rad_listen_t *this)
 	 */
 	this->fd = open(data->filename_work, O_RDWR);
 	if (this->fd < 0) {
+#ifdef HAVE_GLOB_H
+		if (data->orphans) {
+			char *orphan;
+
+			orphan = detail_orphan(data);
+			if (orphan) {
+				filename = orphan;
+				goto open_file;
+			}
+		}
+#endif
+
 		DEBUG2("Polling for detail file %s", filename);
 
 		/*
@@ -221,9 +419,13 @@ static int detail_open(rad_listen_t *this)
 			chtime = 0;
 			found = -1;
 			for (i = 0; i < files.gl_pathc; i++) {
+				if (!detail_mine(data, files.gl_pathv[i])) continue;
+
 				if (stat(files.gl_pathv[i], &st) < 0) continue;
 
-				if ((i == 0) ||
+				if (!S_ISREG(st.st_mode)) continue;
+
+				if ((found < 0) ||
 				    (st.st_ctime < chtime)) {
 					chtime = st.st_ctime;
 					found = i;
@@ -246,6 +448,9 @@ static int detail_open(rad_listen_t *this)
 		 *	Open it BEFORE we rename it, just to
 		 *	be safe...
 		 */
+#ifdef HAVE_GLOB_H
+	open_file:
+#endif
 		this->fd = open(filename, O_RDWR);
 		if (this->fd < 0) {
 			radlog(L_ERR, "Detail - Failed to open %s: %s",
@@ -267,360 +472,344 @@ static int detail_open(rad_listen_t *this)
 		if (filename != data->filename) free(filename);
 	} /* else detail.work existed, and we opened it */
 
-	rad_assert(data->vps == NULL);
-	rad_assert(data->fp == NULL);
+	rad_assert(data->outstanding == 0);
+	rad_assert(data->map == NULL);
 
 	data->state = STATE_UNLOCKED;
 
-	data->client_ip.af = AF_UNSPEC;
-	data->timestamp = 0;
 	data->offset = 0;
 	data->packets = 0;
 	data->tries = 0;
+	data->eof = FALSE;
+	data->head = 0;
 
 	return 1;
 }
 
 
 /*
- *	FIXME: add a configuration "exit when done" so that the detail
- *	file reader can be used as a one-off tool to update stuff.
- *
- *	The time sequence for reading from the detail file is:
- *
- *	t_0		signalled that the server is idle, and we
- *			can read from the detail file.
- *
- *	t_rtt		the packet has been processed successfully,
- *			wait for t_delay to enforce load factor.
- *			
- *	t_rtt + t_delay wait for signal that the server is idle.
- *	
+ *	Load the work file into memory.  It has been renamed and
+ *	locked, so nothing else is writing to it.
  */
-int detail_recv(rad_listen_t *listener)
+static int detail_map(rad_listen_t *this)
 {
-	char		key[256], op[8], value[1024];
-	VALUE_PAIR	*vp, **tail;
-	RADIUS_PACKET	*packet;
-	char		buffer[2048];
-	listen_detail_t *data = listener->data;
-	struct timeval	now;
-
-	/*
-	 *	We may be in the main thread.  It needs to update the
-	 *	timers before we try to read from the file again.
-	 */
-	if (data->signal) return 0;
-
-	switch (data->state) {
-		case STATE_UNOPENED:
-	open_file:
-			rad_assert(listener->fd < 0);
-			
-			if (!detail_open(listener)) return 0;
-
-			rad_assert(data->state == STATE_UNLOCKED);
-			rad_assert(listener->fd >= 0);
-
-			/* FALL-THROUGH */
-
-			/*
-			 *	Try to lock fd.  If we can't, return.
-			 *	If we can, continue.  This means that
-			 *	the server doesn't block while waiting
-			 *	for the lock to open...
-			 */
-		case STATE_UNLOCKED:
-			/*
-			 *	Note that we do NOT block waiting for
-			 *	the lock.  We've re-named the file
-			 *	above, so we've already guaranteed
-			 *	that any *new* detail writer will not
-			 *	be opening this file.  The only
-			 *	purpose of the lock is to catch a race
-			 *	condition where the execution
-			 *	"ping-pongs" between radiusd &
-			 *	radrelay.
-			 */
-			if (rad_lockfd_nonblock(listener->fd, 0) < 0) {
-				/*
-				 *	Close the FD.  The main loop
-				 *	will wake up in a second and
-				 *	try again.
-				 */
-				close(listener->fd);
-				listener->fd = -1;
-				data->state = STATE_UNOPENED;
-				return 0;
-			}
-
-			data->fp = fdopen(listener->fd, "r");
-			if (!data->fp) {
-				radlog(L_ERR, "FATAL: Failed to re-open detail file %s: %s",
-				       data->filename, strerror(errno));
-				exit(1);
-			}
-
-			/*
-			 *	Look for the header
-			 */
-			data->state = STATE_HEADER;
-			data->delay_time = USEC;
-			data->vps = NULL;
+	struct stat	st;
+	void		*map;
+	listen_detail_t *data = this->data;
 
-			/* FALL-THROUGH */
+	rad_assert(data->map == NULL);
 
-		case STATE_HEADER:
-		do_header:
-			data->tries = 0;
-			if (!data->fp) {
-				data->state = STATE_UNOPENED;
-				goto open_file;
-			}
+	if (fstat(this->fd, &st) < 0) {
+		radlog(L_ERR, "Detail - Failed to stat %s: %s",
+		       data->filename_work, strerror(errno));
+		return -1;
+	}
 
-			{
-				struct stat buf;
-				
-				if (fstat(listener->fd, &buf) < 0) {
-					radlog(L_ERR, "Failed to stat "
-					       "detail file %s: %s",
-				       		data->filename,
-				       		strerror(errno));
-				       		
-				       	goto cleanup;
-				}
-				if (((off_t) ftell(data->fp)) == buf.st_size) {
-					goto cleanup;
-				}
-			}
+	data->pos = 0;
+	data->map_size = st.st_size;
+	if (data->map_size == 0) return 0;
 
-			/*
-			 *	End of file.  Delete it, and re-set
-			 *	everything.
-			 */
-			if (feof(data->fp)) {
-			cleanup:
-				DEBUG("Detail - unlinking %s",
-				      data->filename_work);
-				unlink(data->filename_work);
-				if (data->fp) fclose(data->fp);
-				data->fp = NULL;
-				listener->fd = -1;
-				data->state = STATE_UNOPENED;
-				rad_assert(data->vps == NULL);
+#ifdef HAVE_SYS_MMAN_H
+	map = mmap(NULL, data->map_size, PROT_READ, MAP_SHARED, this->fd, 0);
+	if (map == MAP_FAILED) {
+		radlog(L_ERR, "Detail - Failed to map %s: %s",
+		       data->filename_work, strerror(errno));
+		return -1;
+	}
 
-				if (data->one_shot) {
-					radlog(L_INFO, "Finished reading \"one shot\" detail file - Exiting");
-					radius_signal_self(RADIUS_SIGNAL_SELF_EXIT);
-				}
+#ifdef MADV_SEQUENTIAL
+	madvise(map, data->map_size, MADV_SEQUENTIAL);
+#endif
+#else
+	{
+		size_t	total = 0;
+		ssize_t	rcode;
+
+		map = malloc(data->map_size);
+		if (!map) {
+			radlog(L_ERR, "Detail - Out of memory reading %s",
+			       data->filename_work);
+			return -1;
+		}
 
-				return 0;
+		while (total < data->map_size) {
+			rcode = pread(this->fd, (uint8_t *) map + total,
+				      data->map_size - total, total);
+			if ((rcode < 0) && (errno == EINTR)) continue;
+
+			if (rcode <= 0) {
+				radlog(L_ERR, "Detail - Failed to read %s: %s",
+				       data->filename_work,
+				       (rcode < 0) ? strerror(errno) : "Unexpected end of file");
+				free(map);
+				return -1;
 			}
+			total += rcode;
+		}
+	}
+#endif
 
-			/*
-			 *	Else go read something.
-			 */
-			break;
-
-			/*
-			 *	Read more value-pair's, unless we're
-			 *	at EOF.  In that case, queue whatever
-			 *	we have.
-			 */
-		case STATE_READING:
-			if (data->fp && !feof(data->fp)) break;
-			data->state = STATE_QUEUED;
+	data->map = map;
+	data->binary = fr_detail_is_binary(map, data->map_size);
+	return 0;
+}
 
-			/* FALL-THROUGH */
+static void detail_unmap(listen_detail_t *data)
+{
+	if (data->map) {
+#ifdef HAVE_SYS_MMAN_H
+		munmap(data->map, data->map_size);
+#else
+		free(data->map);
+#endif
+	}
 
-		case STATE_QUEUED:
-			goto alloc_packet;
+	data->map = NULL;
+	data->map_size = 0;
+	data->pos = 0;
+	data->binary = FALSE;
+}
 
-			/*
-			 *	Periodically check what's going on.
-			 *	If the request is taking too long,
-			 *	retry it.
-			 */
-		case STATE_RUNNING:
-			if (time(NULL) < (data->running + data->retry_interval)) {
-				return 0;
-			}
+/*
+ *	Decode one "Attribute = value" line, which doesn't have the
+ *	trailing LF.
+ *
+ *	Returns 0 if the line was used or skipped, and -1 if the
+ *	record is unusable.
+ */
+static int detail_read_pair(listen_detail_t *data, detail_record_t *rec,
+			    VALUE_PAIR ***tail, const char *line, size_t len,
+			    off_t line_offset)
+{
+	int		rcode;
+	fr_detail_hdr_t	hdr;
 
-			DEBUG("No response to detail request.  Retrying");
-			data->state = STATE_NO_REPLY;
-			/* FALL-THROUGH */
+	hdr.timestamp = rec->timestamp;
+	hdr.client_ip = rec->client_ip;
 
-			/*
-			 *	If there's no reply, keep
-			 *	retransmitting the current packet
-			 *	forever.
-			 */
-		case STATE_NO_REPLY:
-			data->state = STATE_QUEUED;
-			goto alloc_packet;
-				
-			/*
-			 *	We have a reply.  Clean up the old
-			 *	request, and go read another one.
-			 */
-		case STATE_REPLIED:
-			pairfree(&data->vps);
-			data->state = STATE_HEADER;
-			goto do_header;
+	rcode = fr_detail_read_pair(data->da_cache, &hdr, tail, line, len);
+	if (rcode < 0) {
+		radlog(L_ERR, "Detail - Failed reading %s: %s",
+		       data->filename_work, fr_strerror());
+		return -1;
 	}
-	
-	tail = &data->vps;
-	while (*tail) tail = &(*tail)->next;
 
 	/*
-	 *	Read a header, OR a value-pair.
+	 *	"Done" is written over the "Timestamp" line once the
+	 *	record has been processed.
 	 */
-	while (fgets(buffer, sizeof(buffer), data->fp)) {
-		data->offset = ftell(data->fp); /* for statistics */
+	if ((rcode == 1) && data->track) rec->done_offset = line_offset;
 
-		/*
-		 *	Badly formatted file: delete it.
-		 *
-		 *	FIXME: Maybe flag an error?
-		 */
-		if (!strchr(buffer, '\n')) {
-			pairfree(&data->vps);
-			goto cleanup;
-		}
+	rec->timestamp = hdr.timestamp;
+	rec->client_ip = hdr.client_ip;
 
-		/*
-		 *	We're reading VP's, and got a blank line.
-		 *	Queue the packet.
-		 */
-		if ((data->state == STATE_READING) &&
-		    (buffer[0] == '\n')) {
-			data->state = STATE_QUEUED;
+	return 0;
+}
+
+/*
+ *	Read one record from a binary detail file.  The attributes are
+ *	decoded straight from the file.
+ */
+static int detail_read_binary(listen_detail_t *data, detail_record_t *rec)
+{
+	const uint8_t	*start, *p, *end;
+	ssize_t		len;
+	fr_detail_hdr_t	hdr;
+	VALUE_PAIR	*vp;
+
+	start = (const uint8_t *) data->map;
+	end = start + data->map_size;
+
+	while (data->pos < data->map_size) {
+		p = start + data->pos;
+
+		len = fr_detail_decode_hdr(p, end - p, &hdr);
+		if (len == 0) {
+			radlog(L_ERR, "Detail - Truncated record at offset %lu in %s",
+			       (unsigned long) data->pos, data->filename_work);
+			data->pos = data->map_size;
 			break;
 		}
 
 		/*
-		 *	Look for date/time header, and read VP's if
-		 *	found.  If not, keep reading lines until we
-		 *	find one.
+		 *	Skip to the start of the next record.
 		 */
-		if (data->state == STATE_HEADER) {
-			int y;
+		if (len < 0) {
+			radlog(L_ERR, "Detail - Skipping bad record at offset %lu in %s: %s",
+			       (unsigned long) data->pos, data->filename_work,
+			       fr_strerror());
 
-			if (sscanf(buffer, "%*s %*s %*d %*d:%*d:%*d %d", &y)) {
-				data->state = STATE_READING;
+			for (p++; p < end; p++) {
+				p = memchr(p, *start, end - p);
+				if (!p) break;
+
+				if (fr_detail_is_binary(p, end - p)) break;
 			}
-			continue;
-		}
 
-		/*
-		 *	We have a full "attribute = value" line.
-		 *	If it doesn't look reasonable, skip it.
-		 *
-		 *	FIXME: print an error for badly formatted attributes?
-		 */
-		if (sscanf(buffer, "%255s %8s %1023s", key, op, value) != 3) {
-			DEBUG2W("Skipping badly formatted line %s",
-			       buffer);
+			data->pos = p ? (size_t) (p - start) : data->map_size;
 			continue;
 		}
 
-		/*
-		 *	Should be =, :=, +=, ...
-		 */
-		if (!strchr(op, '=')) continue;
+		data->pos += len;
 
 		/*
-		 *	Skip non-protocol attributes.
+		 *	A record which was processed before the
+		 *	server was restarted.
 		 */
-		if (!strcasecmp(key, "Request-Authenticator")) continue;
+		if (hdr.done) continue;
 
-		/*
-		 *	Set the original client IP address, based on
-		 *	what's in the detail file.
-		 *
-		 *	Hmm... we don't set the server IP address.
-		 *	or port.  Oh well.
-		 */
-		if (!strcasecmp(key, "Client-IP-Address")) {
-			data->client_ip.af = AF_INET;
-			if (ip_hton(value, AF_INET, &data->client_ip) < 0) {
-				radlog(L_ERR,
-				       "Failed parsing Client-IP-Address");
-				
-				pairfree(&data->vps);
-				goto cleanup;
-			}
+		if (fr_detail_decode(p, &hdr, &rec->vps) < 0) {
+			radlog(L_ERR, "Detail - Skipping bad record at offset %lu in %s: %s",
+			       (unsigned long) (p - start), data->filename_work,
+			       fr_strerror());
+			pairfree(&rec->vps);
 			continue;
 		}
 
 		/*
-		 *	The original time at which we received the
-		 *	packet.  We need this to properly calculate
-		 *	Acct-Delay-Time.
+		 *	The text files say which packet this was, if it
+		 *	wasn't accounting.  Do the same here.
 		 */
-		if (!strcasecmp(key, "Timestamp")) {
-			data->timestamp = atoi(value);
-
-			vp = paircreate(data, PW_PACKET_ORIGINAL_TIMESTAMP, 0);
+		if (hdr.code != PW_ACCOUNTING_REQUEST) {
+			vp = paircreate(NULL, PW_PACKET_TYPE, 0);
 			if (vp) {
-				vp->vp_date = (uint32_t) data->timestamp;
-				*tail = vp;
-				tail = &(vp->next);
+				vp->vp_integer = hdr.code;
+				pairadd(&rec->vps, vp);
 			}
-			continue;
 		}
 
-		/*
-		 *	Read one VP.
-		 *
-		 *	FIXME: do we want to check for non-protocol
-		 *	attributes like radsqlrelay does?
-		 */
-		vp = NULL;
-		if ((userparse(buffer, &vp) > 0) &&
-		    (vp != NULL)) {
-			*tail = vp;
-			tail = &(vp->next);
+		vp = paircreate(NULL, PW_PACKET_ORIGINAL_TIMESTAMP, 0);
+		if (vp) {
+			vp->vp_date = (uint32_t) hdr.timestamp;
+			pairadd(&rec->vps, vp);
 		}
+
+		rec->client_ip = hdr.client_ip;
+		rec->timestamp = hdr.timestamp;
+		if (data->track) {
+			rec->done_offset = (p - start) + FR_DETAIL_DONE_OFFSET;
+		}
+		rec->end = data->pos;
+
+		data->state = STATE_READING;
+		return 1;
 	}
 
-	/*
-	 *	Some kind of error.
-	 *
-	 *	FIXME: Leave the file in-place, and warn the
-	 *	administrator?
-	 */
-	if (ferror(data->fp)) goto cleanup;
+	rec->end = data->pos;
+	return 0;
+}
 
-	data->tries = 0;
-	data->packets++;
+/*
+ *	Read one record from the detail file.
+ *
+ *	Returns 1 if a record was read, 0 at the end of the file, and
+ *	-1 if the file is unusable.
+ */
+static int detail_read_record(listen_detail_t *data, detail_record_t *rec)
+{
+	const char	*line, *next, *end;
+	size_t		len;
+	VALUE_PAIR	**tail;
+	int		done = FALSE;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->client_ip.af = AF_UNSPEC;
+	rec->done_offset = -1;
+	tail = &rec->vps;
+
+	data->state = STATE_HEADER;
+
+	if (!data->map) return 0;
+
+	if (data->binary) return detail_read_binary(data, rec);
+
+	end = data->map + data->map_size;
+	next = data->map + data->pos;
 
 	/*
-	 *	Process the packet.
-	 */
- alloc_packet:
-	data->tries++;
-	
-	/*
-	 *	The writer doesn't check that the record was
-	 *	completely written.  If the disk is full, this can
-	 *	result in a truncated record.  When that happens,
-	 *	treat it as EOF.
+	 *	Read a header, OR a value-pair.
 	 */
-	if (data->state != STATE_QUEUED) {
-		radlog(L_ERR, "Truncated record: treating it as EOF for detail file %s", data->filename_work);
-		goto cleanup;	
+	while (next < end) {
+		line = next;
+
+		/*
+		 *	The last line may be missing its LF.
+		 */
+		next = memchr(line, '\n', end - line);
+		if (!next) next = end;
+		len = next - line;
+		if (next < end) next++;
+
+		data->pos = next - data->map;
+
+		/*
+		 *	We're reading VP's, and got a blank line.
+		 *	Queue the packet, unless it was already done.
+		 */
+		if ((data->state == STATE_READING) && (len == 0)) {
+			rec->end = data->pos;
+			if (!done) return 1;
+
+			pairfree(&rec->vps);
+			memset(rec, 0, sizeof(*rec));
+			rec->client_ip.af = AF_UNSPEC;
+			rec->done_offset = -1;
+			tail = &rec->vps;
+			done = FALSE;
+			data->state = STATE_HEADER;
+			continue;
+		}
+
+		/*
+		 *	Look for date/time header, and read VP's if
+		 *	found.  If not, keep reading lines until we
+		 *	find one.  Headers are the only lines which
+		 *	don't start with white space.
+		 */
+		if (data->state == STATE_HEADER) {
+			if ((len > 0) && !isspace((int) line[0])) {
+				data->state = STATE_READING;
+			}
+			continue;
+		}
+
+		/*
+		 *	A record which was processed before the
+		 *	server was restarted.
+		 */
+		if ((len >= 5) && (memcmp(line, "\tDone", 5) == 0)) {
+			done = TRUE;
+			continue;
+		}
+
+		if (detail_read_pair(data, rec, &tail, line, len,
+				     line - data->map) < 0) {
+			pairfree(&rec->vps);
+			return -1;
+		}
 	}
 
 	/*
-	 *	We're done reading the file, but we didn't read
-	 *	anything.  Clean up, and don't return anything.
+	 *	The last record may be missing the blank line after
+	 *	it.
 	 */
-	if (!data->vps) {
-		data->state = STATE_HEADER;
-		if (!data->fp || feof(data->fp)) goto cleanup;
-		return 0;
-	}
+	rec->end = data->pos;
+	if ((data->state == STATE_READING) && !done && rec->vps) return 1;
+
+	pairfree(&rec->vps);
+	return 0;
+}
+
+/*
+ *	Turn a record into a request.
+ */
+static int detail_insert(rad_listen_t *listener, detail_record_t *rec)
+{
+	VALUE_PAIR	*vp;
+	RADIUS_PACKET	*packet;
+	listen_detail_t *data = listener->data;
+	time_t		timestamp = rec->timestamp;
+	struct timeval	now;
 
 	/*
 	 *	Allocate the packet.  If we fail, it's a serious
@@ -643,16 +832,16 @@ int detail_recv(rad_listen_t *listener)
 	 *	Remember where it came from, so that we don't
 	 *	proxy it to the place it came from...
 	 */
-	if (data->client_ip.af != AF_UNSPEC) {
-		packet->src_ipaddr = data->client_ip;
+	if (rec->client_ip.af != AF_UNSPEC) {
+		packet->src_ipaddr = rec->client_ip;
 	}
 
-	vp = pairfind(packet->vps, PW_PACKET_SRC_IP_ADDRESS, 0, TAG_ANY);
+	vp = pairfind(rec->vps, PW_PACKET_SRC_IP_ADDRESS, 0, TAG_ANY);
 	if (vp) {
 		packet->src_ipaddr.af = AF_INET;
 		packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
 	} else {
-		vp = pairfind(packet->vps, PW_PACKET_SRC_IPV6_ADDRESS, 0, TAG_ANY);
+		vp = pairfind(rec->vps, PW_PACKET_SRC_IPV6_ADDRESS, 0, TAG_ANY);
 		if (vp) {
 			packet->src_ipaddr.af = AF_INET6;
 			memcpy(&packet->src_ipaddr.ipaddr.ip6addr,
@@ -660,35 +849,29 @@ int detail_recv(rad_listen_t *listener)
 		}
 	}
 
-	vp = pairfind(packet->vps, PW_PACKET_DST_IP_ADDRESS, 0, TAG_ANY);
-	if (vp) {
-		packet->dst_ipaddr.af = AF_INET;
-		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-	} else {
-		vp = pairfind(packet->vps, PW_PACKET_DST_IPV6_ADDRESS, 0, TAG_ANY);
-		if (vp) {
-			packet->dst_ipaddr.af = AF_INET6;
-			memcpy(&packet->dst_ipaddr.ipaddr.ip6addr,
-			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-		}
-	}
-
 	/*
-	 *	Generate packet ID, ports, IP via a counter.
+	 *	Generate packet ID, ports, IP via a counter.  Each
+	 *	record has its own counter, so every record in
+	 *	flight is a different request.  Retries of a record
+	 *	use the same counter, so they're caught as duplicates
+	 *	if the first try is still running.
+	 *
+	 *	Shards each have their own counter, so the shard is
+	 *	put into the IP, too.
 	 */
-	packet->id = data->counter & 0xff;
-	packet->src_port = 1024 + ((data->counter >> 8) & 0xff);
-	packet->dst_port = 1024 + ((data->counter >> 16) & 0xff);
+	packet->id = rec->counter & 0xff;
+	packet->src_port = 1024 + ((rec->counter >> 8) & 0xff);
+	packet->dst_port = 1024 + ((rec->counter >> 16) & 0xff);
 
 	packet->dst_ipaddr.af = AF_INET;
-	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 24) & 0xff));
+	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->shard & 0xff) << 8) | ((rec->counter >> 24) & 0xff));
 
 	/*
 	 *	If everything's OK, this is a waste of memory.
 	 *	Otherwise, it lets us re-send the original packet
 	 *	contents, unmolested.
 	 */
-	packet->vps = paircopy(packet, data->vps);
+	packet->vps = paircopy(packet, rec->vps);
 
 	/*
 	 *	Prefer the Event-Timestamp in the packet, if it
@@ -698,7 +881,7 @@ int detail_recv(rad_listen_t *listener)
 	 */
 	vp = pairfind(packet->vps, PW_EVENT_TIMESTAMP, 0, TAG_ANY);
 	if (vp) {
-		data->timestamp = vp->vp_integer;
+		timestamp = vp->vp_integer;
 	}
 
 	/*
@@ -711,8 +894,8 @@ int detail_recv(rad_listen_t *listener)
 		rad_assert(vp != NULL);
 		pairadd(&packet->vps, vp);
 	}
-	if (data->timestamp != 0) {
-		vp->vp_integer += time(NULL) - data->timestamp;
+	if (timestamp != 0) {
+		vp->vp_integer += time(NULL) - timestamp;
 	}
 
 	/*
@@ -724,7 +907,7 @@ int detail_recv(rad_listen_t *listener)
 		rad_assert(vp != NULL);
 		pairadd(&packet->vps, vp);
 	}
-	vp->vp_integer = data->tries;
+	vp->vp_integer = rec->tries;
 
 	if (debug_flag) {
 		fr_printf_log("detail_recv: Read packet from %s\n", data->filename_work);
@@ -740,16 +923,274 @@ int detail_recv(rad_listen_t *listener)
 	if (!request_insert(listener, packet, &data->detail_client,
 			    rad_accounting, &now)) {
 		rad_free(&packet);
-		data->state = STATE_NO_REPLY;	/* try again later */
 		return 0;
 	}
 
-	data->state = STATE_RUNNING;
-	data->running = packet->timestamp.tv_sec;
-
 	return 1;
 }
 
+/*
+ *	FIXME: add a configuration "exit when done" so that the detail
+ *	file reader can be used as a one-off tool to update stuff.
+ *
+ *	Up to "max_outstanding" records are processed at the same
+ *	time.  They are kept in a window, in the order they were read
+ *	from the file.  Records which have been replied to are
+ *	forgotten only once every record before them is done, and
+ *	the file is deleted only once every record in it is done.
+ *
+ *	The time sequence for reading from the detail file is:
+ *
+ *	t_0		signalled that the server is idle, and we
+ *			can read from the detail file.
+ *
+ *	t_rtt		the packet has been processed successfully,
+ *			wait for t_delay to enforce load factor.
+ *			
+ *	t_rtt + t_delay wait for signal that the server is idle.
+ *	
+ */
+int detail_recv(rad_listen_t *listener)
+{
+	int		i, rcode, count = 0;
+	int		first, batch = 0;
+	time_t		now;
+	detail_record_t	*rec;
+	listen_detail_t *data = listener->data;
+
+	/*
+	 *	We may be in the main thread.  It needs to update the
+	 *	timers before we try to read from the file again.
+	 */
+	if (data->signal) return 0;
+
+	/*
+	 *	Update the replay rate once a second.  It's smoothed
+	 *	a little, so that a burst of replies doesn't make it
+	 *	jump around.
+	 */
+	now = time(NULL);
+	if (now > data->rate_time) {
+		if (data->rate_time) {
+			data->rate += (data->replayed - data->rate_replayed) /
+				(now - data->rate_time);
+			data->rate /= 2;
+		}
+		data->rate_time = now;
+		data->rate_replayed = data->replayed;
+	}
+
+	switch (data->state) {
+		case STATE_UNOPENED:
+	open_file:
+			rad_assert(listener->fd < 0);
+			
+			if (!detail_open(listener)) return 0;
+
+			rad_assert(data->state == STATE_UNLOCKED);
+			rad_assert(listener->fd >= 0);
+
+			/* FALL-THROUGH */
+
+			/*
+			 *	Try to lock fd.  If we can't, return.
+			 *	If we can, continue.  This means that
+			 *	the server doesn't block while waiting
+			 *	for the lock to open...
+			 */
+		case STATE_UNLOCKED:
+			/*
+			 *	Note that we do NOT block waiting for
+			 *	the lock.  We've re-named the file
+			 *	above, so we've already guaranteed
+			 *	that any *new* detail writer will not
+			 *	be opening this file.  The only
+			 *	purpose of the lock is to catch a race
+			 *	condition where the execution
+			 *	"ping-pongs" between radiusd &
+			 *	radrelay.
+			 */
+			if (rad_lockfd_nonblock(listener->fd, 0) < 0) {
+				/*
+				 *	Close the FD.  The main loop
+				 *	will wake up in a second and
+				 *	try again.
+				 */
+				close(listener->fd);
+				listener->fd = -1;
+				data->state = STATE_UNOPENED;
+				return 0;
+			}
+
+			/*
+			 *	Map the file into memory.  If we
+			 *	can't, the main loop will try again
+			 *	later.
+			 */
+			if (detail_map(listener) < 0) {
+				close(listener->fd);
+				listener->fd = -1;
+				data->state = STATE_UNOPENED;
+				return 0;
+			}
+
+			/*
+			 *	Look for the header
+			 */
+			data->state = STATE_HEADER;
+			data->delay_time = USEC;
+
+			/* FALL-THROUGH */
+
+		default:
+			if (listener->fd < 0) {
+				data->state = STATE_UNOPENED;
+				goto open_file;
+			}
+			break;
+	}
+
+	/*
+	 *	Forget the records at the start of the window which
+	 *	are done.  Stop at the first one which isn't, even if
+	 *	later ones are done.
+	 */
+	PTHREAD_MUTEX_LOCK(&data->mutex);
+	while (data->outstanding > 0) {
+		rec = DETAIL_RECORD(data, 0);
+		if (rec->state != STATE_REPLIED) break;
+
+		data->offset = rec->end; /* for statistics */
+		pairfree(&rec->vps);
+		data->head = (data->head + 1) % data->max_outstanding;
+		data->outstanding--;
+		data->replayed++;
+	}
+
+	/*
+	 *	Retry records which haven't had a reply in time.  If
+	 *	there's no reply, keep retransmitting forever.
+	 */
+	for (i = 0; i < data->outstanding; i++) {
+		rec = DETAIL_RECORD(data, i);
+		if (rec->state == STATE_REPLIED) continue;
+		if (now < (rec->running + data->retry_interval)) continue;
+
+		if (rec->state == STATE_RUNNING) {
+			DEBUG("No response to detail request.  Retrying");
+		}
+
+		rec->state = STATE_RUNNING;
+		rec->running = now;
+		rec->tries++;
+		data->tries++;
+		PTHREAD_MUTEX_UNLOCK(&data->mutex);
+
+		/*
+		 *	The request may be done before
+		 *	request_insert() returns, so the mutex can't
+		 *	be held.  Only this thread changes the
+		 *	window, so "rec" stays valid.
+		 */
+		if (detail_insert(listener, rec)) {
+			count++;
+		} else {
+			PTHREAD_MUTEX_LOCK(&data->mutex);
+			if (rec->state == STATE_RUNNING) {
+				rec->state = STATE_NO_REPLY; /* try again later */
+			}
+			PTHREAD_MUTEX_UNLOCK(&data->mutex);
+		}
+
+		PTHREAD_MUTEX_LOCK(&data->mutex);
+	}
+	PTHREAD_MUTEX_UNLOCK(&data->mutex);
+
+	/*
+	 *	Fill the window with new records.  They're all
+	 *	decoded first, and then sent, so that the parser
+	 *	runs over the file without interruption.
+	 */
+	first = data->outstanding;
+	while (!data->eof && ((first + batch) < data->max_outstanding)) {
+		rec = DETAIL_RECORD(data, first + batch);
+
+		rcode = detail_read_record(data, rec);
+		if (rcode < 0) {
+			for (i = 0; i < batch; i++) {
+				pairfree(&DETAIL_RECORD(data, first + i)->vps);
+			}
+			goto cleanup;
+		}
+
+		if (rcode == 0) {
+			data->eof = TRUE;
+			break;
+		}
+
+		rec->counter = data->counter++;
+		rec->state = STATE_RUNNING;
+		rec->running = now;
+		rec->tries = 1;
+		batch++;
+	}
+
+	PTHREAD_MUTEX_LOCK(&data->mutex);
+	data->outstanding += batch;
+	data->packets += batch;
+	PTHREAD_MUTEX_UNLOCK(&data->mutex);
+
+	for (i = 0; i < batch; i++) {
+		rec = DETAIL_RECORD(data, first + i);
+
+		if (detail_insert(listener, rec)) {
+			count++;
+		} else {
+			PTHREAD_MUTEX_LOCK(&data->mutex);
+			if (rec->state == STATE_RUNNING) {
+				rec->state = STATE_NO_REPLY; /* try again later */
+			}
+			PTHREAD_MUTEX_UNLOCK(&data->mutex);
+		}
+	}
+
+	if (!data->eof || (data->outstanding > 0)) return count;
+
+	/*
+	 *	End of file, and everything is done.  Delete it, and
+	 *	re-set everything.
+	 */
+ cleanup:
+	PTHREAD_MUTEX_LOCK(&data->mutex);
+	for (i = 0; i < data->outstanding; i++) {
+		pairfree(&DETAIL_RECORD(data, i)->vps);
+	}
+	data->outstanding = 0;
+	data->head = 0;
+
+	DEBUG("Detail - unlinking %s", data->filename_work);
+	unlink(data->filename_work);
+	detail_unmap(data);
+	close(listener->fd);
+	listener->fd = -1;
+	data->state = STATE_UNOPENED;
+	PTHREAD_MUTEX_UNLOCK(&data->mutex);
+
+	if (data->one_shot) {
+		radlog(L_INFO, "Finished reading \"one shot\" detail file - Exiting");
+		radius_signal_self(RADIUS_SIGNAL_SELF_EXIT);
+	}
+
+	/*
+	 *	There may be a backlog of files.  Look for the next
+	 *	one now, instead of waiting for the next poll.
+	 */
+	data->delay_time = 0;
+	data->signal = 1;
+
+	return count;
+}
+
 
 /*
  *	Free detail-specific stuff.
@@ -760,25 +1201,51 @@ void detail_free(rad_listen_t *this)
 
 	talloc_free(data->filename);
 	data->filename = NULL;
-	pairfree(&data->vps);
 
-	if (data->fp != NULL) {
-		fclose(data->fp);
-		data->fp = NULL;
+	if (data->window) {
+		int i;
+
+		for (i = 0; i < data->outstanding; i++) {
+			pairfree(&DETAIL_RECORD(data, i)->vps);
+		}
+		free(data->window);
+		data->window = NULL;
+		data->outstanding = 0;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&data->mutex);
+#endif
+	}
+
+	detail_unmap(data);
+
+	if (data->watch_fd >= 0) {
+		close(data->watch_fd);
+		data->watch_fd = -1;
 	}
 }
 
 
 int detail_print(const rad_listen_t *this, char *buffer, size_t bufsize)
 {
+	listen_detail_t *data = this->data;
+
 	if (!this->server) {
-		return snprintf(buffer, bufsize, "%s",
-				((listen_detail_t *)(this->data))->filename);
+		if (data->shards > 1) {
+			return snprintf(buffer, bufsize, "%s shard %d",
+					data->filename, data->shard);
+		}
+
+		return snprintf(buffer, bufsize, "%s", data->filename);
+	}
+
+	if (data->shards > 1) {
+		return snprintf(buffer, bufsize,
+				"detail file %s shard %d as server %s",
+				data->filename, data->shard, this->server);
 	}
 
 	return snprintf(buffer, bufsize, "detail file %s as server %s",
-			((listen_detail_t *)(this->data))->filename,
-			this->server);
+			data->filename, this->server);
 }
 
 /*
@@ -794,6 +1261,18 @@ int detail_encode(rad_listen_t *this, UNUSED REQUEST *request)
 	if (!data->signal) {
 		int delay = (data->poll_interval - 1) * USEC;
 
+		/*
+		 *	Records are being processed.  Look for replies
+		 *	often, but no more often than the load factor
+		 *	allows.
+		 */
+		if ((data->max_outstanding > 1) && (data->outstanding > 0)) {
+			delay = data->delay_time;
+			if (delay < (USEC / 100)) delay = USEC / 100;
+
+			return delay;
+		}
+
 		/*
 		 *	Add +/- 0.25s of jitter
 		 */
@@ -843,13 +1322,145 @@ static const CONF_PARSER detail_config[] = {
 	{ "one_shot",   PW_TYPE_BOOLEAN,
 	  offsetof(listen_detail_t, one_shot), NULL, NULL},
 	{ "max_outstanding",   PW_TYPE_INTEGER,
-	  offsetof(listen_detail_t, load_factor), NULL, NULL},
+	  offsetof(listen_detail_t, max_outstanding), NULL, Stringify(1)},
+	{ "track",   PW_TYPE_BOOLEAN,
+	  offsetof(listen_detail_t, track), NULL, "yes"},
+	{ "shards",   PW_TYPE_INTEGER,
+	  offsetof(listen_detail_t, shards), NULL, Stringify(1)},
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
 extern int check_config;
 
+/*
+ *	Set up everything which isn't in the configuration.
+ */
+static int detail_setup(rad_listen_t *this)
+{
+	listen_detail_t *data = this->data;
+	RADCLIENT	*client;
+	char		*p, *glob_char;
+	char		dir[2048];
+	char		buffer[sizeof(dir) + sizeof("detail-2147483647.work")];
+	int		len;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&data->mutex, NULL) != 0) {
+		radlog(L_ERR, "Detail - Failed initializing mutex");
+		return -1;
+	}
+#endif
+
+	data->window = rad_malloc(data->max_outstanding * sizeof(data->window[0]));
+	memset(data->window, 0, data->max_outstanding * sizeof(data->window[0]));
+	data->head = 0;
+
+	/*
+	 *	The work file goes into the directory of the detail
+	 *	file.  If the directory name is a glob, e.g. one
+	 *	directory per NAS, it goes into the directory above
+	 *	that.
+	 */
+	strlcpy(dir, data->filename, sizeof(dir));
+	glob_char = strpbrk(dir, "*[");
+	if (glob_char) {
+		data->hash_dir = (strchr(data->filename + (glob_char - dir),
+					 FR_DIR_SEP) != NULL);
+		*glob_char = '\0';
+	}
+	p = strrchr(dir, FR_DIR_SEP);
+	if (p) {
+		p[1] = '\0';
+	} else {
+		dir[0] = '\0';
+	}
+
+	/*
+	 *	If the filename is a glob, use "detail.work" as the
+	 *	work file name.  Each shard has its own.
+	 */
+	if (glob_char) {
+#ifndef HAVE_GLOB_H
+		radlog(L_INFO, "WARNING: Detail file \"%s\" appears to use file globbing, but it is not supported on this system.", data->filename);
+#endif
+		if (data->shards > 1) {
+			len = snprintf(buffer, sizeof(buffer), "%sdetail-%d.work",
+				       dir, data->shard);
+		} else {
+			len = snprintf(buffer, sizeof(buffer), "%sdetail.work",
+				       dir);
+		}
+
+	} else {
+		len = snprintf(buffer, sizeof(buffer), "%s.work",
+			       data->filename);
+	}
+
+	if ((len < 0) || ((size_t) len >= sizeof(buffer))) {
+		radlog(L_ERR, "Detail - Work file name for \"%s\" is too long",
+		       data->filename);
+		return -1;
+	}
+
+	free(data->filename_work);
+	data->filename_work = strdup(buffer); /* FIXME: leaked */
+
+#ifdef HAVE_GLOB_H
+	/*
+	 *	The number of shards may have changed since the
+	 *	server last ran.
+	 */
+	data->orphans = (glob_char && (data->shard == 0));
+#endif
+
+	/*
+	 *	Watch the directory, so that new files are read as
+	 *	soon as they appear.  If we can't, or if there are
+	 *	many directories, the directories are polled.
+	 *
+	 *	We wait for files to be closed, or moved into place.
+	 *	Files which are still being written are found by
+	 *	polling, as before.
+	 */
+	data->watch_fd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+	if (!data->hash_dir) {
+		if (!dir[0]) strlcpy(dir, ".", sizeof(dir));
+
+		data->watch_fd = inotify_init();
+		if ((data->watch_fd >= 0) &&
+		    ((inotify_add_watch(data->watch_fd, dir,
+					IN_CLOSE_WRITE | IN_MOVED_TO) < 0) ||
+		     (fr_nonblock(data->watch_fd) < 0))) {
+			DEBUG("Detail - Failed watching %s: %s.  Polling instead",
+			      dir, strerror(errno));
+			close(data->watch_fd);
+			data->watch_fd = -1;
+		}
+	}
+#endif
+
+	data->map = NULL;
+	data->state = STATE_UNOPENED;
+	data->delay_time = data->poll_interval * USEC;
+	data->signal = 1;
+
+	/*
+	 *	Initialize the fake client.
+	 */
+	client = &data->detail_client;
+	memset(client, 0, sizeof(*client));
+	client->ipaddr.af = AF_INET;
+	client->ipaddr.ipaddr.ip4addr.s_addr = INADDR_NONE;
+	client->prefix = 0;
+	client->longname = client->shortname = data->filename;
+	client->secret = client->shortname;
+	client->nastype = strdup("none");
+
+	return 0;
+}
+
 /*
  *	Parse a detail section.
  */
@@ -857,8 +1468,6 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 {
 	int		rcode;
 	listen_detail_t *data;
-	RADCLIENT	*client;
-	char buffer[2048];
 
 	if (check_config) return 0;
 
@@ -868,6 +1477,7 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	}
 
 	data = this->data;
+	data->watch_fd = -1;
 
 	rcode = cf_section_parse(cs, data, detail_config);
 	if (rcode < 0) {
@@ -890,53 +1500,123 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
-	if (data->max_outstanding == 0) data->max_outstanding = 1;
-	
-	/*
-	 *	If the filename is a glob, use "detail.work" as the
-	 *	work file name.
-	 */
-	if ((strchr(data->filename, '*') != NULL) ||
-	    (strchr(data->filename, '[') != NULL)) {
-		char *p;
+	if ((data->max_outstanding < 1) || (data->max_outstanding > 65536)) {
+		cf_log_err_cs(cs, "max_outstanding must be between 1 and 65536");
+		return -1;
+	}
 
-#ifndef HAVE_GLOB_H
-		radlog(L_INFO, "WARNING: Detail file \"%s\" appears to use file globbing, but it is not supported on this system.", data->filename);
-#endif
-		strlcpy(buffer, data->filename, sizeof(buffer));
-		p = strrchr(buffer, FR_DIR_SEP);
-		if (p) {
-			p[1] = '\0';
-		} else {
-			buffer[0] = '\0';
+	if ((data->shards < 1) || (data->shards > 256)) {
+		cf_log_err_cs(cs, "shards must be between 1 and 256");
+		return -1;
+	}
+
+	if (data->shards > 1) {
+		if (!strpbrk(data->filename, "*[")) {
+			cf_log_err_cs(cs, "shards can only be used when the filename is a glob");
+			return -1;
+		}
+
+		if (data->one_shot) {
+			cf_log_err_cs(cs, "shards cannot be used with one_shot");
+			return -1;
 		}
-		strlcat(buffer, "detail.work",
-			sizeof(buffer) - strlen(buffer));
-			
-	} else {
-		snprintf(buffer, sizeof(buffer), "%s.work", data->filename);
 	}
 
-	free(data->filename_work);
-	data->filename_work = strdup(buffer); /* FIXME: leaked */
+	if (detail_setup(this) < 0) {
+		cf_log_err_cs(cs, "Failed initializing detail listener");
+		return -1;
+	}
 
-	data->vps = NULL;
-	data->fp = NULL;
-	data->state = STATE_UNOPENED;
-	data->delay_time = data->poll_interval * USEC;
-	data->signal = 1;
+	return 0;
+}
+
+/*
+ *	Create another shard of a detail listener, with the same
+ *	configuration.
+ */
+int detail_shard(rad_listen_t *this, const rad_listen_t *parent, int shard)
+{
+	listen_detail_t *data, *old = parent->data;
+
+	this->data = data = rad_malloc(sizeof(*data));
+	memset(data, 0, sizeof(*data));
+	data->watch_fd = -1;
+
+	data->filename = talloc_strdup(this, old->filename);
+	data->load_factor = old->load_factor;
+	data->poll_interval = old->poll_interval;
+	data->retry_interval = old->retry_interval;
+	data->max_outstanding = old->max_outstanding;
+	data->track = old->track;
+	data->shards = old->shards;
+	data->shard = shard;
+
+	return detail_setup(this);
+}
+
+/*
+ *	Called when a file appears in the directory.  Returns whether
+ *	the listener should look for it now, instead of waiting for
+ *	the next poll.
+ */
+int detail_watch(rad_listen_t *this)
+{
+	listen_detail_t *data = this->data;
+#ifdef HAVE_SYS_INOTIFY_H
+	char buffer[4096];
 
 	/*
-	 *	Initialize the fake client.
+	 *	We only care that something happened, not what.
 	 */
-	client = &data->detail_client;
-	memset(client, 0, sizeof(*client));
-	client->ipaddr.af = AF_INET;
-	client->ipaddr.ipaddr.ip4addr.s_addr = INADDR_NONE;
-	client->prefix = 0;
-	client->longname = client->shortname = data->filename;
-	client->secret = client->shortname;
-	client->nastype = strdup("none");
+	while (read(data->watch_fd, buffer, sizeof(buffer)) > 0) {
+		/* nothing */
+	}
+#endif
+
+	return (data->state == STATE_UNOPENED);
+}
+
+/*
+ *	How much is left to read: the rest of the current file, and
+ *	the files waiting for this listener.
+ */
+int detail_backlog(const rad_listen_t *this, int *files, off_t *bytes)
+{
+	listen_detail_t *data = this->data;
+
+	*files = 0;
+	*bytes = 0;
+
+	if (data->map) *bytes = data->map_size - data->offset;
+
+#ifdef HAVE_GLOB_H
+	{
+		unsigned int i;
+		struct stat st;
+		glob_t glob_files;
+
+		memset(&glob_files, 0, sizeof(glob_files));
+		if (glob(data->filename, 0, NULL, &glob_files) != 0) {
+			globfree(&glob_files);
+			return 0;
+		}
+
+		for (i = 0; i < glob_files.gl_pathc; i++) {
+			if (strcmp(glob_files.gl_pathv[i], data->filename_work) == 0) continue;
+
+			if (!detail_mine(data, glob_files.gl_pathv[i])) continue;
+
+			if (stat(glob_files.gl_pathv[i], &st) < 0) continue;
+
+			if (!S_ISREG(st.st_mode)) continue;
+
+			(*files)++;
+			*bytes += st.st_size;
+		}
+
+		globfree(&glob_files);
+	}
+#endif
 
 	return 0;
 }
@@ -67,7 +67,8 @@ static const char *filler = "???????????????????????????????????????????????????
 
 static const char *expand_string(char *buffer, size_t sizeof_buffer,
 				 REQUEST *request,
-				 FR_TOKEN value_type, const char *value)
+				 FR_TOKEN value_type, const char *value,
+				 const xlat_exp_t *exp)
 {
 	int result;
 	char *p;
@@ -100,6 +101,12 @@ static const char *expand_string(char *buffer, size_t sizeof_buffer,
 	case T_DOUBLE_QUOTED_STRING:
 		if (!strchr(value, '%')) return value;
 
+		if (exp) {
+			radius_xlat_compiled(buffer, sizeof_buffer, exp,
+					     request, NULL, NULL);
+			return buffer;
+		}
+
 		radius_xlat(buffer, sizeof_buffer, value, request, NULL, NULL);
 		return buffer;
 	}
@@ -209,9 +216,9 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 			 FR_TOKEN lt, const char *pleft, FR_TOKEN token,
 			 UNUSED FR_TOKEN rt, const char *pright,
 #ifdef HAVE_REGEX_H
-			 int cflags,
+			 int cflags, fr_regex_t *prx,
 #else
-			 UNUSED int cflags,
+			 UNUSED int cflags, UNUSED fr_regex_t *prx,
 #endif
 			 int modreturn)
 {
@@ -376,27 +383,33 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 #ifdef HAVE_REGEX_H
 	case T_OP_REG_EQ: {
 		int i, compare;
-		regex_t reg;
+		fr_regex_t *rx = prx;
+		char errbuf[128];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 		
 		/*
-		 *	Include substring matches.
+		 *	Constant patterns were compiled when the
+		 *	condition was parsed.  Anything else is
+		 *	looked up in the cache.
 		 */
-		compare = regcomp(&reg, pright, cflags);
-		if (compare != 0) {
-			if (debug_flag) {
-				char errbuf[128];
-
-				regerror(compare, &reg, errbuf, sizeof(errbuf));
-				DEBUGE("Failed compiling regular expression: %s", errbuf);
+		if (!rx) {
+			rx = regex_cache_find(pright, cflags, FALSE,
+					      errbuf, sizeof(errbuf));
+			if (!rx) {
+				if (debug_flag) {
+					DEBUGE("Failed compiling regular expression: %s", errbuf);
+				}
+				return FALSE;
 			}
-			return FALSE;
 		}
 
-		compare = regexec(&reg, pleft,
-				  REQUEST_MAX_REGEX + 1,
-				  rxmatch, 0);
-		regfree(&reg);
+		/*
+		 *	Include substring matches.
+		 */
+		compare = regex_cache_exec(rx, pleft,
+					   REQUEST_MAX_REGEX + 1,
+					   rxmatch);
+		if (rx != prx) regex_cache_release(rx);
 		
 		/*
 		 *	Add new %{0}, %{1}, etc.
@@ -431,27 +444,25 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 		
 	case T_OP_REG_NE: {
 		int compare;
-		regex_t reg;
+		fr_regex_t *rx = prx;
+		char errbuf[128];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 		
-		/*
-		 *	Include substring matches.
-		 */
-		compare = regcomp(&reg, pright, cflags);
-		if (compare != 0) {
-			if (debug_flag) {
-				char errbuf[128];
-
-				regerror(compare, &reg, errbuf, sizeof(errbuf));
-				DEBUGE("Failed compiling regular expression: %s", errbuf);
+		if (!rx) {
+			rx = regex_cache_find(pright, cflags, FALSE,
+					      errbuf, sizeof(errbuf));
+			if (!rx) {
+				if (debug_flag) {
+					DEBUGE("Failed compiling regular expression: %s", errbuf);
+				}
+				return FALSE;
 			}
-			return FALSE;
 		}
 
-		compare = regexec(&reg, pleft,
-				  REQUEST_MAX_REGEX + 1,
-				  rxmatch, 0);
-		regfree(&reg);
+		compare = regex_cache_exec(rx, pleft,
+					   REQUEST_MAX_REGEX + 1,
+					   rxmatch);
+		if (rx != prx) regex_cache_release(rx);
 		
 		result = (compare != 0);
 	}
@@ -469,9 +480,39 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 	return TRUE;
 }
 
+/*
+ *	The constant regular expressions in a condition, compiled
+ *	when the condition is parsed.  They're in the order the
+ *	comparisons appear in the text, with NULL for patterns which
+ *	are expanded at run time.
+ */
+struct fr_cond_regex {
+	int		num;
+	fr_regex_t	**rx;
+};
 
-int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
-			      const char **ptr, int evaluate_it, int *presult)
+#ifdef HAVE_REGEX_H
+static int cond_regex_free(fr_cond_regex_t *cr)
+{
+	int i;
+
+	for (i = 0; i < cr->num; i++) {
+		regex_cache_release(cr->rx[i]);
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ *	When parsing (request == NULL), constant patterns are
+ *	compiled and added to "cr".  Otherwise, the pattern for the
+ *	Nth comparison is taken from "cr", and "rxnum" counts the
+ *	comparisons seen so far.
+ */
+static int evaluate_condition(REQUEST *request, int modreturn, int depth,
+			      const char **ptr, int evaluate_it, int *presult,
+			      fr_cond_regex_t *cr, int *rxnum)
 {
 	int found_condition = FALSE;
 	int result = TRUE;
@@ -484,6 +525,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 	const char *pleft, *pright;
 	char  xleft[1024], xright[1024];
 	int cflags = 0;
+	fr_regex_t *prx;
 	
 	if (!ptr || !*ptr || (depth >= 64)) {
 		radlog(L_ERR, "Internal sanity check failed in evaluate condition");
@@ -525,10 +567,10 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 			 *	parse error.
 			 */
 			RDEBUG4(">>> RECURSING WITH ... %s", end);
-			if (!radius_evaluate_condition(request, modreturn,
-						       depth + 1, &end,
-						       evaluate_next_condition,
-						       &result)) {
+			if (!evaluate_condition(request, modreturn,
+						depth + 1, &end,
+						evaluate_next_condition,
+						&result, cr, rxnum)) {
 				return FALSE;
 			}
 
@@ -614,6 +656,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 
 		RDEBUG4(">>> LOOKING AT %s", p);
 		start = p;
+		prx = NULL;
 
 		/*
 		 *	Look for common errors.
@@ -638,7 +681,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		pleft = left;
 		if (evaluate_next_condition) {
 			pleft = expand_string(xleft, sizeof(xleft), request,
-					      lt, left);
+					      lt, left, NULL);
 			if (!pleft) {
 				radlog(L_ERR, "Failed expanding string at: %s",
 				       left);
@@ -712,6 +755,37 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 				radlog(L_ERR, "Expected regular expression at: %s", p);
 				return FALSE;
 			}
+
+			/*
+			 *	We're being called from the config
+			 *	parser.  Compile constant patterns
+			 *	now, and keep them for the lifetime
+			 *	of the server.
+			 */
+			if (!request && !strchr(right, '%')) {
+				char errbuf[128];
+
+				prx = regex_cache_find(right, cflags, TRUE,
+						       errbuf, sizeof(errbuf));
+				if (!prx) {
+					radlog(L_ERR, "Invalid regular expression \"%s\": %s",
+					       right, errbuf);
+					return FALSE;
+				}
+			}
+
+			if (!request && cr) {
+				cr->rx = talloc_realloc(cr, cr->rx, fr_regex_t *,
+							cr->num + 1);
+				cr->rx[cr->num++] = prx;
+
+			} else if (!request) {
+				regex_cache_release(prx);
+
+			} else if (cr && (*rxnum < cr->num)) {
+				prx = cr->rx[*rxnum];
+			}
+			if (rxnum) (*rxnum)++;
 		} else
 #endif
 			rt = gettoken(&p, right, sizeof(right));
@@ -727,7 +801,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		pright = right;
 		if (evaluate_next_condition) {
 			pright = expand_string(xright, sizeof(xright), request,
-					       rt, right);
+					       rt, right, NULL);
 			if (!pright) {
 				radlog(L_ERR, "Failed expanding string at: %s",
 				       right);
@@ -744,7 +818,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 			 *	More parse errors.
 			 */
 			if (!radius_do_cmp(request, &result, lt, pleft, token,
-					   rt, pright, cflags, modreturn)) {
+					   rt, pright, cflags, prx, modreturn)) {
 				return FALSE;
 			}
 			RDEBUG4(">>> Comparison returned %d", result);
@@ -785,6 +859,62 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 	if (evaluate_it) *presult = result;
 	return TRUE;
 }
+
+int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
+			      const char **ptr, int evaluate_it, int *presult)
+{
+	return evaluate_condition(request, modreturn, depth, ptr,
+				  evaluate_it, presult, NULL, NULL);
+}
+
+/** Parse a condition, and compile its constant regular expressions
+ *
+ * @param[in,out] ptr the condition.  Updated to point to the end of it.
+ * @param[out] pregex the compiled expressions, which should be passed
+ *	to radius_evaluate_compiled(), and freed with talloc_free().
+ *	NULL if the condition has no regular expressions.
+ * @return TRUE if the condition was parsed, FALSE on error.
+ */
+int radius_compile_condition(const char **ptr, fr_cond_regex_t **pregex)
+{
+	int result;
+	fr_cond_regex_t *cr;
+
+	*pregex = NULL;
+
+	cr = talloc_zero(NULL, fr_cond_regex_t);
+#ifdef HAVE_REGEX_H
+	talloc_set_destructor(cr, cond_regex_free);
+#endif
+
+	if (!evaluate_condition(NULL, 0, 0, ptr, FALSE, &result, cr, NULL)) {
+		talloc_free(cr);
+		return FALSE;
+	}
+
+	if (cr->num == 0) {
+		talloc_free(cr);
+		return TRUE;
+	}
+
+	*pregex = cr;
+	return TRUE;
+}
+
+/** Evaluate a condition parsed by radius_compile_condition()
+ *
+ * The constant regular expressions are used directly, without
+ * looking them up in the regex cache.
+ */
+int radius_evaluate_compiled(REQUEST *request, int modreturn,
+			     const char **ptr, int *presult,
+			     fr_cond_regex_t *regex)
+{
+	int rxnum = 0;
+
+	return evaluate_condition(request, modreturn, 0, ptr, TRUE,
+				  presult, regex, &rxnum);
+}
 #endif
 
 
@@ -1123,6 +1253,7 @@ struct conf_pair {
  *	Add attributes to a list.
  */
 int radius_update_attrlist(REQUEST *request, CONF_SECTION *cs,
+			   const xlat_section_t *xs,
 			   VALUE_PAIR *input_vps, const char *name)
 {
 	int list;
@@ -1224,7 +1355,8 @@ int radius_update_attrlist(REQUEST *request, CONF_SECTION *cs,
 			vp->type = VT_DATA;
 
 			value = expand_string(buffer, sizeof(buffer), request,
-					      cp->value_type, cp->value);
+					      cp->value_type, cp->value,
+					      xlat_section_find(xs, cp));
 			if (!value) {
 				pairfree(&newlist);
 				return RLM_MODULE_INVALID;
@@ -198,7 +198,10 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		/*
 		 *	Lives forever.  Return it.
 		 */
-		if (client->lifetime == 0) return client;
+		if (client->lifetime == 0) {
+			client_dynamic_hit();
+			return client;
+		}
 		
 		/*
 		 *	Rate-limit the deletion of known clients.
@@ -206,12 +209,18 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		 *	prevents the server from melting down if (say)
 		 *	10k clients all expire at once.
 		 */
-		if (now == client->last_new_client) return client;
+		if (now == client->last_new_client) {
+			client_dynamic_hit();
+			return client;
+		}
 
 		/*
 		 *	It's not dead yet.  Return it.
 		 */
-		if ((client->created + client->lifetime) > now) return client;
+		if ((client->created + client->lifetime) > now) {
+			client_dynamic_hit();
+			return client;
+		}
 		
 		/*
 		 *	This really puts them onto a queue for later
@@ -247,21 +256,32 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		if (now == client->last_new_client) goto unknown;
 	}
 
+	/*
+	 *	Don't look up the same source again if a lookup is
+	 *	already in progress, or if one failed recently.
+	 */
+	if (!client_dynamic_begin(client, ipaddr)) goto unknown;
+
 	client->last_new_client = now;
 
 	request = request_alloc();
-	if (!request) goto unknown;
+	if (!request) {
+		client_dynamic_end(client, ipaddr, FALSE);
+		goto unknown;
+	}
 
 	request->listener = listener;
 	request->client = client;
 	request->packet = rad_recv(listener->fd, 0x02); /* MSG_PEEK */
 	if (!request->packet) {				/* badly formed, etc */
 		request_free(&request);
+		client_dynamic_end(client, ipaddr, FALSE);
 		goto unknown;
 	}
 	request->reply = rad_alloc_reply(request, request->packet);
 	if (!request->reply) {
 		request_free(&request);
+		client_dynamic_end(client, ipaddr, FALSE);
 		goto unknown;
 	}
 	gettimeofday(&request->packet->timestamp, NULL);
@@ -286,6 +306,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 
 	if (rcode != RLM_MODULE_OK) {
 		request_free(&request);
+		client_dynamic_end(client, ipaddr, TRUE);
 		goto unknown;
 	}
 
@@ -301,7 +322,11 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		/*
 		 *	This frees the client if it isn't valid.
 		 */
-		if (!client_validate(clients, client, created)) goto unknown;
+		if (!client_validate(clients, client, created)) {
+			request_free(&request);
+			client_dynamic_end(client, ipaddr, TRUE);
+			goto unknown;
+		}
 	}
 
 	request->server = client->server;
@@ -309,6 +334,8 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 
 	request_free(&request);
 
+	client_dynamic_end(client, ipaddr, (created == NULL));
+
 	if (!created) goto unknown;
 
 	return created;
@@ -556,6 +583,9 @@ static int dual_tcp_accept(rad_listen_t *listener)
 	listen_socket_t *sock;
 	fr_ipaddr_t src_ipaddr;
 	RADCLIENT *client = NULL;
+#ifdef WITH_STATS
+	fr_stats_id_t stats;
+#endif
 	
 	salen = sizeof(src);
 
@@ -631,9 +661,15 @@ static int dual_tcp_accept(rad_listen_t *listener)
 	 */
 	sock = this->data;
 	memcpy(this->data, listener->data, sizeof(*sock));
+#ifdef WITH_STATS
+	stats = this->stats;
+#endif
 	memcpy(this, listener, sizeof(*this));
 	this->next = NULL;
 	this->data = sock;	/* fix it back */
+#ifdef WITH_STATS
+	this->stats = stats;
+#endif
 
 	sock->parent = listener->data;
 	sock->other_ipaddr = src_ipaddr;
@@ -1299,6 +1335,102 @@ static int acct_socket_send(rad_listen_t *listener, REQUEST *request)
 }
 #endif
 
+#ifdef WITH_TCP
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	Write data to a stream socket.  If another thread is already
+ *	writing, the data is queued, and that thread sends it as soon
+ *	as its own write is done.  Everything queued in the mean time
+ *	goes out in one write, so a busy connection needs far fewer
+ *	system calls (and TLS records) than packets.  Packets are
+ *	never interleaved, as only one thread writes at a time.
+ *
+ *	Data queued behind a write which fails is lost, exactly as if
+ *	the connection had gone away after it was sent.
+ */
+int listen_stream_write(rad_listen_t *listener, const uint8_t *data,
+			size_t data_len, listen_write_t write_fn)
+{
+	int rcode = 0;
+	listen_socket_t *sock = listener->data;
+
+	PTHREAD_MUTEX_LOCK(&sock->wmutex);
+
+	if ((sock->wbuf_len + data_len) > sock->wbuf_size) {
+		size_t size = sock->wbuf_size ? sock->wbuf_size : 4096;
+		uint8_t *wbuf;
+
+		while (size < (sock->wbuf_len + data_len)) size <<= 1;
+
+		wbuf = talloc_realloc(sock, sock->wbuf, uint8_t, size);
+		if (!wbuf) {
+			PTHREAD_MUTEX_UNLOCK(&sock->wmutex);
+			radlog(L_ERR, "Out of memory");
+			return -1;
+		}
+
+		sock->wbuf = wbuf;
+		sock->wbuf_size = size;
+	}
+
+	memcpy(sock->wbuf + sock->wbuf_len, data, data_len);
+	sock->wbuf_len += data_len;
+
+	if (sock->writing) {
+		PTHREAD_MUTEX_UNLOCK(&sock->wmutex);
+		return 0;
+	}
+
+	sock->writing = TRUE;
+
+	while (sock->wbuf_len > 0) {
+		uint8_t *out = sock->wbuf;
+		size_t out_len = sock->wbuf_len;
+		size_t out_size = sock->wbuf_size;
+
+		/*
+		 *	Give the other threads an empty buffer to
+		 *	queue into while we write this one.
+		 */
+		sock->wbuf = sock->wspare;
+		sock->wbuf_size = sock->wspare_size;
+		sock->wbuf_len = 0;
+		sock->wspare = NULL;
+		sock->wspare_size = 0;
+
+		PTHREAD_MUTEX_UNLOCK(&sock->wmutex);
+
+		if (write_fn(listener, out, out_len) < 0) rcode = -1;
+
+		PTHREAD_MUTEX_LOCK(&sock->wmutex);
+
+		if (!sock->wspare) {
+			sock->wspare = out;
+			sock->wspare_size = out_size;
+		} else {
+			talloc_free(out);
+		}
+
+		if (rcode < 0) {
+			sock->wbuf_len = 0;
+			break;
+		}
+	}
+
+	sock->writing = FALSE;
+	PTHREAD_MUTEX_UNLOCK(&sock->wmutex);
+
+	return rcode;
+}
+#endif
+
 #ifdef WITH_PROXY
 /*
  *	Send a packet to a home server.
@@ -1319,6 +1451,63 @@ static int proxy_socket_send(rad_listen_t *listener, REQUEST *request)
 
 	return 0;
 }
+
+#ifdef WITH_TCP
+/*
+ *	Write all of the data to a blocking TCP socket.
+ */
+static ssize_t proxy_tcp_write(rad_listen_t *listener,
+			       const uint8_t *data, size_t data_len)
+{
+	ssize_t rcode;
+	size_t done = 0;
+
+	while (done < data_len) {
+		rcode = write(listener->fd, data + done, data_len - done);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			radlog(L_ERR, "Failed writing to home server: %s",
+			       strerror(errno));
+			return -1;
+		}
+
+		done += rcode;
+	}
+
+	return done;
+}
+
+/*
+ *	Send a packet to a home server over TCP.  Packets from many
+ *	threads are combined into one write where possible.
+ */
+static int proxy_socket_tcp_send(rad_listen_t *listener, REQUEST *request)
+{
+	RADIUS_PACKET *packet = request->proxy;
+
+	rad_assert(request->proxy_listener == listener);
+
+	if (!packet->data) {
+		if ((rad_encode(packet, NULL,
+				request->home_server->secret) < 0) ||
+		    (rad_sign(packet, NULL,
+			      request->home_server->secret) < 0)) {
+			radlog_request(L_ERR, 0, request, "Failed encoding proxied request: %s",
+				       fr_strerror());
+			return -1;
+		}
+	}
+
+	if (listen_stream_write(listener, packet->data, packet->data_len,
+				proxy_tcp_write) < 0) {
+		radlog_request(L_ERR, 0, request, "Failed sending proxied request");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
 #endif
 
 #ifdef WITH_STATS
@@ -1353,7 +1542,7 @@ static int stats_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+	FR_STATS_TYPE_INC(client->auth, total_requests);
 
 	/*
 	 *	We only understand Status-Server on this socket.
@@ -1420,7 +1609,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+	FR_STATS_TYPE_INC(client->auth, total_requests);
 
 	/*
 	 *	Some sanity checks, based on the packet code.
@@ -1501,7 +1690,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->acct.total_requests);
+	FR_STATS_TYPE_INC(client->acct, total_requests);
 
 	/*
 	 *	Some sanity checks, based on the packet code.
@@ -1853,68 +2042,89 @@ static int proxy_socket_recv(rad_listen_t *listener)
 
 #ifdef WITH_TCP
 /*
- *	Recieve packets from a proxy socket.
+ *	Recieve packets from a proxy socket.  Home servers may send
+ *	many replies back to back, so read everything which is
+ *	available, and process each complete packet in turn.  Any
+ *	partial packet is left in the buffer for the next read.
  */
 static int proxy_socket_tcp_recv(rad_listen_t *listener)
 {
+	int		rcode, count = 0;
 	RADIUS_PACKET	*packet;
 	listen_socket_t	*sock = listener->data;
 	char		buffer[128];
 
-	packet = fr_tcp_recv(listener->fd, 0);
-	if (!packet) {
+	if (!sock->rbuf) {
+		sock->rbuf = talloc_zero(sock, fr_tcp_buffer_t);
+		if (!sock->rbuf) return 0;
+	}
+
+	if (fr_tcp_buffer_read(sock->rbuf, listener->fd) < 0) {
+	do_close:
 		listener->status = RAD_LISTEN_STATUS_REMOVE_FD;
 		event_new_fd(listener);
-		return 0;
+		return count;
 	}
 
-	/*
-	 *	FIXME: Client MIB updates?
-	 */
-	switch(packet->code) {
-	case PW_AUTHENTICATION_ACK:
-	case PW_ACCESS_CHALLENGE:
-	case PW_AUTHENTICATION_REJECT:
-		break;
+	while ((rcode = fr_tcp_buffer_packet(sock->rbuf, listener->fd, 0,
+					     &packet)) != 0) {
+		if (rcode < 0) {
+			radlog(L_ERR, "Closing connection to home server %s port %d: %s",
+			       ip_ntoh(&sock->other_ipaddr, buffer, sizeof(buffer)),
+			       sock->other_port, fr_strerror());
+			goto do_close;
+		}
+
+		packet->src_ipaddr = sock->other_ipaddr;
+		packet->src_port = sock->other_port;
+		packet->dst_ipaddr = sock->my_ipaddr;
+		packet->dst_port = sock->my_port;
+
+		/*
+		 *	FIXME: Client MIB updates?
+		 */
+		switch(packet->code) {
+		case PW_AUTHENTICATION_ACK:
+		case PW_ACCESS_CHALLENGE:
+		case PW_AUTHENTICATION_REJECT:
+			break;
 
 #ifdef WITH_ACCOUNTING
-	case PW_ACCOUNTING_RESPONSE:
-		break;
+		case PW_ACCOUNTING_RESPONSE:
+			break;
 #endif
 
-	default:
+		default:
+			/*
+			 *	FIXME: Update MIB for packet types?
+			 */
+			radlog(L_ERR, "Invalid packet code %d sent to a proxy port "
+			       "from home server %s port %d - ID %d : IGNORED",
+			       packet->code,
+			       ip_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
+			       packet->src_port, packet->id);
+			rad_free(&packet);
+			continue;
+		}
+
 		/*
-		 *	FIXME: Update MIB for packet types?
+		 *	FIXME: Have it return an indication of packets that
+		 *	are OK to ignore (dups, too late), versus ones that
+		 *	aren't OK to ignore (unknown response, spoofed, etc.)
+		 *
+		 *	Close the socket on bad packets...
 		 */
-		radlog(L_ERR, "Invalid packet code %d sent to a proxy port "
-		       "from home server %s port %d - ID %d : IGNORED",
-		       packet->code,
-		       ip_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
-		       packet->src_port, packet->id);
-		rad_free(&packet);
-		return 0;
-	}
-
-	packet->src_ipaddr = sock->other_ipaddr;
-	packet->src_port = sock->other_port;
-	packet->dst_ipaddr = sock->my_ipaddr;
-	packet->dst_port = sock->my_port;
+		if (!request_proxy_reply(packet)) {
+			rad_free(&packet);
+			continue;
+		}
 
-	/*
-	 *	FIXME: Have it return an indication of packets that
-	 *	are OK to ignore (dups, too late), versus ones that
-	 *	aren't OK to ignore (unknown response, spoofed, etc.)
-	 *
-	 *	Close the socket on bad packets...
-	 */
-	if (!request_proxy_reply(packet)) {
-		rad_free(&packet);
-		return 0;
+		count++;
 	}
 
-	sock->opened = sock->last_packet = time(NULL);
+	if (count) sock->opened = sock->last_packet = time(NULL);
 
-	return 1;
+	return count;
 }
 #endif
 #endif
@@ -2454,6 +2664,10 @@ static int listener_free(void *ctx)
 		master_listen[this->type].free(this);
 	}
 
+#ifdef WITH_STATS
+	fr_stats_free(this->stats);
+#endif
+
 #ifdef WITH_TCP
 	if ((this->type == RAD_LISTEN_AUTH)
 #ifdef WITH_ACCT
@@ -2480,6 +2694,13 @@ static int listener_free(void *ctx)
 		} else
 #endif
 			rad_free(&sock->packet);
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+		if ((this->type == RAD_LISTEN_PROXY) &&
+		    (sock->proto == IPPROTO_TCP)) {
+			pthread_mutex_destroy(&sock->wmutex);
+		}
+#endif
 	}
 #endif				/* WITH_TCP */
 
@@ -2504,6 +2725,10 @@ static rad_listen_t *listen_alloc(TALLOC_CTX *ctx, RAD_LISTEN_TYPE type)
 
 	talloc_set_destructor((void *) this, listener_free);
 
+#ifdef WITH_STATS
+	this->stats = fr_stats_alloc();
+#endif
+
 	switch (type) {
 #ifdef WITH_STATS
 	case RAD_LISTEN_NONE:
@@ -2593,6 +2818,10 @@ rad_listen_t *proxy_new_listener(home_server *home, int src_port)
 
 	if (home->proto == IPPROTO_TCP) {
 		this->recv = proxy_socket_tcp_recv;
+		this->send = proxy_socket_tcp_send;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&sock->wmutex, NULL);
+#endif
 
 		/*
 		 *	FIXME: connect() is blocking!
@@ -2755,6 +2984,33 @@ static rad_listen_t *listen_parse(CONF_SECTION *cs, const char *server)
 		return NULL;
 	}
 
+#ifdef WITH_DETAIL
+	/*
+	 *	The files may be split across many detail listeners.
+	 *	They're returned as a list.
+	 */
+	if ((type == RAD_LISTEN_DETAIL) && this->data) {
+		int i;
+		rad_listen_t *shard, **last;
+		listen_detail_t *data = this->data;
+
+		last = &(this->next);
+		for (i = 1; i < data->shards; i++) {
+			shard = listen_alloc(cs, type);
+			shard->server = server;
+			shard->fd = -1;
+			*last = shard;
+			last = &(shard->next);
+
+			if (detail_shard(shard, this, i) < 0) {
+				cf_log_err_cs(cs, "Failed creating detail shard %d", i);
+				listen_free(&this);
+				return NULL;
+			}
+		}
+	}
+#endif
+
 	cf_log_info(cs, "}");
 
 	return this;
@@ -2957,6 +3213,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 			}
 
 			*last = this;
+			while (this->next) this = this->next;
 			last = &(this->next);
 		} /* loop over "listen" directives in server <foo> */
 
@@ -2976,6 +3233,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 		}
 
 		*last = this;
+		while (this->next) this = this->next;
 		last = &(this->next);
 	}
 
@@ -3000,6 +3258,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 			}
 			
 			*last = this;
+			while (this->next) this = this->next;
 			last = &(this->next);
 		} /* loop over "listen" directives in virtual servers */
 	} /* loop over virtual servers */
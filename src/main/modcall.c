@@ -41,6 +41,8 @@ static modcallable *do_compile_modgroup(modcallable *,
 #define MOD_ACTION_RETURN  (-1)
 #define MOD_ACTION_REJECT  (-2)
 
+typedef struct modcall_program modcall_program_t;
+
 /* Here are our basic types: modcallable, modgroup, and modsingle. For an
  * explanation of what they are all about, see ../../doc/README.failover */
 struct modcallable {
@@ -55,6 +57,7 @@ struct modcallable {
 	       MOD_POLICY, MOD_REFERENCE, MOD_XLAT } type;
 	int method;
 	int actions[RLM_MODULE_NUMCODES];
+	modcall_program_t *prog;	/* set on the root, by modcallable_flatten() */
 };
 
 #define GROUPTYPE_SIMPLE	0
@@ -68,6 +71,8 @@ typedef struct {
 	modcallable *children;
 	CONF_SECTION *cs;
 	VALUE_PAIR *vps;
+	xlat_section_t *xlat;	/* compiled "update" values */
+	fr_cond_regex_t *regex;	/* compiled "if" regular expressions */
 } modgroup;
 
 typedef struct {
@@ -367,18 +372,58 @@ static const char *modcall_spaces = "
 
 #define MODCALL_STACK_MAX (32)
 
+/*
+ *	Flattened trees.
+ *
+ *	modcallable_flatten() lowers a tree into an array of
+ *	instructions.  Children of a group follow the group, and
+ *	the group ends with MOD_OP_POP.  Each instruction records
+ *	where to go once it's done, so the interpreter doesn't
+ *	have to look at the parent to find the next child.
+ */
+typedef enum modcall_op {
+	MOD_OP_MODULE = 0,		//!< Call a module.
+	MOD_OP_GROUP,			//!< group, policy, if, else, elsif, case.
+	MOD_OP_LOAD_BALANCE,		//!< Run one of the children.
+	MOD_OP_REDUNDANT_LOAD_BALANCE,	//!< Start at a random child, and wrap.
+	MOD_OP_SWITCH,			//!< Run the matching case.
+	MOD_OP_UPDATE,			//!< Edit attribute lists.
+	MOD_OP_FOREACH,			//!< Run the body once per attribute.
+	MOD_OP_BREAK,			//!< Stop the enclosing foreach.
+	MOD_OP_REFERENCE,		//!< Call another virtual server.
+	MOD_OP_XLAT,			//!< Expand a string, or run a program.
+	MOD_OP_POP			//!< End of a group, or of the program.
+} modcall_op_t;
+
+typedef struct modcall_insn {
+	modcall_op_t	op;
+	int		actions[RLM_MODULE_NUMCODES]; //!< Copied from the node.
+	int		next;		//!< Instruction to run when this one
+					//!< is done.
+	int		pop;		//!< For groups, the MOD_OP_POP which
+					//!< ends the group.
+	int		num_children;	//!< For groups.
+	int		*children;	//!< Index of each child.
+	modcallable	*c;		//!< The node this was lowered from.
+	modcall_program_t *body;	//!< For foreach.
+} modcall_insn_t;
+
+struct modcall_program {
+	int		num_insns;
+	modcall_insn_t	*insns;
+};
+
 /*
  *	Don't call the modules recursively.  Instead, do them
  *	iteratively, and manage the call stack ourselves.
  */
-typedef struct modcall_stack {
-	int pointer;
-
-	int priority[MODCALL_STACK_MAX];
-	int result[MODCALL_STACK_MAX];
-	modcallable *children[MODCALL_STACK_MAX];
-	modcallable *start[MODCALL_STACK_MAX];
-} modcall_stack;
+typedef struct modcall_frame {
+	int		priority;
+	int		result;
+	int		group;		//!< Instruction which pushed the frame.
+	int		start;		//!< First child run, for redundant-load-balance.
+	int		wrap;		//!< Whether "next" wraps around to start.
+} modcall_frame_t;
 
 
 #ifdef WITH_UNLANG
@@ -389,31 +434,67 @@ static void pairfree_wrapper(void *data)
 }
 #endif
 
+static int modcall_program(int component, const modcall_program_t *prog,
+			   REQUEST *request);
+
 /**
  * @brief Call a module, iteratively, with a local stack, rather than
  *	recursively.  What did Paul Graham say about Lisp...?
+ *
+ *	The tree MUST have been flattened by modcallable_flatten().
  */
 int modcall(int component, modcallable *c, REQUEST *request)
 {
-	int myresult, mypriority;
-	modcall_stack stack;
-	modcallable *parent, *child;
-	modsingle *sp;
-	int if_taken, was_if;
-
 	if ((component < 0) || (component >= RLM_COMPONENT_COUNT)) {
 		return RLM_MODULE_FAIL;
 	}
 
-	stack.pointer = 0;
-	stack.priority[0] = 0;
-	stack.children[0] = c;
-	stack.start[0] = NULL;
-	myresult = stack.result[0] = default_component_results[component];
+	if (!c) return default_component_results[component];
+
+	if (!c->prog) {
+		radlog(L_ERR, "Internal sanity check failed: module section %s was not compiled",
+		       c->name ? c->name : "");
+		return RLM_MODULE_FAIL;
+	}
+
+	return modcall_program(component, c->prog, request);
+}
+
+/*
+ *	Run a flattened tree.  The "next" instruction and the actions
+ *	are taken from the instruction, instead of walking the tree.
+ */
+static int modcall_program(int component, const modcall_program_t *prog,
+			   REQUEST *request)
+{
+	int pc, sp;
+	int myresult, mypriority;
+	int if_taken, was_if;
+	const modcall_insn_t *insn;
+	modcallable *child, *parent;
+	modcall_frame_t stack[MODCALL_STACK_MAX];
+
+	sp = 0;
+	stack[0].priority = 0;
+	stack[0].group = -1;
+	stack[0].start = -1;
+	stack[0].wrap = FALSE;
+	myresult = stack[0].result = default_component_results[component];
 	mypriority = 0;
 	was_if = if_taken = FALSE;
+	pc = 0;
 
 	while (1) {
+		int first = -1;
+
+		insn = &prog->insns[pc];
+		child = insn->c;
+
+		if (insn->op == MOD_OP_POP) {
+			parent = (sp > 0) ? prog->insns[stack[sp].group].c : NULL;
+			goto do_return;
+		}
+
 		/*
 		 *	A module has taken too long to process the request,
 		 *	and we've been told to stop processing it.
@@ -425,92 +506,144 @@ int modcall(int component, modcallable *c, REQUEST *request)
 			break;
 		}
 
-		child = stack.children[stack.pointer];
-		if (!child) {
-			myresult = stack.result[stack.pointer];
-			break;
-		}
-		parent = child->parent;
+		switch (insn->op) {
+		case MOD_OP_MODULE:
+			myresult = call_modsingle(child->method,
+						  mod_callabletosingle(child),
+						  request);
+			RDEBUG2("%.*s[%s] = %s",
+				sp + 1, modcall_spaces,
+				child->name ? child->name : "",
+				fr_int2str(mod_rcode_table, myresult, "??"));
+			goto handle_priority;
 
+		case MOD_OP_GROUP:
 #ifdef WITH_UNLANG
-		if ((child->type == MOD_ELSE) || (child->type == MOD_ELSIF)) {
-			myresult = stack.result[stack.pointer];
-
-			if (!was_if) { /* error */
-				RDEBUG2("%.*s ... skipping %s for request %d: No preceding \"if\"",
-				       stack.pointer + 1, modcall_spaces,
-				       group_name[child->type],
-				       request->number);
-				goto unroll;
+			if ((child->type == MOD_ELSE) || (child->type == MOD_ELSIF)) {
+				myresult = stack[sp].result;
+
+				if (!was_if) { /* error */
+					RDEBUG2("%.*s ... skipping %s for request %d: No preceding \"if\"",
+						sp + 1, modcall_spaces,
+						group_name[child->type],
+						request->number);
+					goto unroll;
+				}
+				if (if_taken) {
+					RDEBUG2("%.*s ... skipping %s for request %d: Preceding \"if\" was taken",
+						sp + 1, modcall_spaces,
+						group_name[child->type],
+						request->number);
+					goto unroll;
+				}
 			}
-			if (if_taken) {
-				RDEBUG2("%.*s ... skipping %s for request %d: Preceding \"if\" was taken",
-				       stack.pointer + 1, modcall_spaces,
-				       group_name[child->type],
-				       request->number);
-				goto unroll;
+
+			if ((child->type == MOD_IF) || (child->type == MOD_ELSIF)) {
+				int condition = TRUE;
+				const char *p = child->name;
+
+				RDEBUG2("%.*s? %s %s",
+					sp + 1, modcall_spaces,
+					(child->type == MOD_IF) ? "if" : "elsif",
+					child->name);
+
+				if (radius_evaluate_compiled(request, myresult, &p,
+							     &condition,
+							     mod_callabletogroup(child)->regex)) {
+					RDEBUG2("%.*s? %s %s -> %s",
+						sp + 1, modcall_spaces,
+						(child->type == MOD_IF) ? "if" : "elsif",
+						child->name, (condition != FALSE) ? "TRUE" : "FALSE");
+				} else {
+					condition = FALSE;
+				}
+
+				if (!condition) {
+					was_if = TRUE;
+					if_taken = FALSE;
+					goto next_section;
+				}
+			}
+#endif
+			if (insn->num_children) first = insn->children[0];
+			goto push;
+
+		case MOD_OP_LOAD_BALANCE:
+		case MOD_OP_REDUNDANT_LOAD_BALANCE:
+		{
+			int i;
+
+			/*
+			 *	See the "camel book" for why this works.
+			 */
+			for (i = 0; i < insn->num_children; i++) {
+				if ((first < 0) ||
+				    (((i + 1) * (fr_rand() & 0xffff)) < (uint32_t) 0x10000)) {
+					first = insn->children[i];
+				}
 			}
 		}
+			goto push;
 
-		/*
-		 *	"if" or "elsif".  Evaluate the condition.
-		 */
-		if ((child->type == MOD_IF) || (child->type == MOD_ELSIF)) {
-			int condition = TRUE;
-			const char *p = child->name;
-
-			RDEBUG2("%.*s? %s %s",
-			       stack.pointer + 1, modcall_spaces,
-			       (child->type == MOD_IF) ? "if" : "elsif",
-			       child->name);
-
-			if (radius_evaluate_condition(request, myresult,
-						      0, &p, TRUE, &condition)) {
-				RDEBUG2("%.*s? %s %s -> %s",
-				       stack.pointer + 1, modcall_spaces,
-				       (child->type == MOD_IF) ? "if" : "elsif",
-				       child->name, (condition != FALSE) ? "TRUE" : "FALSE");
+#ifdef WITH_UNLANG
+		case MOD_OP_SWITCH:
+		{
+			int i, null_case = -1;
+			char buffer[1024];
+
+			if (!strchr(child->name, '%')) {
+				VALUE_PAIR *vp = NULL;
+
+				radius_get_vp(request, child->name, &vp);
+				if (vp) {
+					vp_prints_value(buffer, sizeof(buffer),
+							vp, 0);
+				} else {
+					*buffer = '\0';
+				}
 			} else {
-				/*
-				 *	This should never happen, the
-				 *	condition is checked when the
-				 *	module section is loaded.
-				 */
-				condition = FALSE;
+				radius_xlat(buffer, sizeof(buffer),
+					    child->name, request, NULL, NULL);
 			}
 
-			/*
-			 *	If the condition fails to match, go
-			 *	immediately to the next entry in the
-			 *	list.
-			 */
-			if (!condition) {
-				was_if = TRUE;
-				if_taken = FALSE;
-				goto next_section;
-			} /* else process it as a simple group */
+			for (i = 0; i < insn->num_children; i++) {
+				const char *name;
+
+				name = prog->insns[insn->children[i]].c->name;
+				if (!name) {
+					if (null_case < 0) null_case = insn->children[i];
+					continue;
+				}
+				if (strcmp(buffer, name) == 0) {
+					first = insn->children[i];
+					break;
+				}
+			}
+
+			if (first < 0) first = null_case;
 		}
+			goto push;
 
-		if (child->type == MOD_UPDATE) {
+		case MOD_OP_UPDATE:
+		{
 			int rcode;
 			modgroup *g = mod_callabletogroup(child);
 
 			RDEBUG2("%.*supdate %s {",
-				stack.pointer + 1, modcall_spaces,
+				sp + 1, modcall_spaces,
 				child->name);
 
-			rcode = radius_update_attrlist(request, g->cs,
+			rcode = radius_update_attrlist(request, g->cs, g->xlat,
 						       g->vps, child->name);
 			if (rcode != RLM_MODULE_UPDATED) {
 				myresult = rcode;
 				goto handle_priority;
 			}
-
-			/* else leave myresult && mypriority alone */
-			goto handle_result;
 		}
+			goto handle_result;
 
-		if (child->type == MOD_BREAK) {
+		case MOD_OP_BREAK:
+		{
 			int i;
 			VALUE_PAIR **copy_p;
 
@@ -518,20 +651,20 @@ int modcall(int component, modcallable *c, REQUEST *request)
 				copy_p = request_data_get(request,
 							  radius_get_vp, i);
 				if (copy_p) {
-						RDEBUG2("%.*s #  BREAK Foreach-Variable-%d", stack.pointer + 1, modcall_spaces, i);
+					RDEBUG2("%.*s #  BREAK Foreach-Variable-%d", sp + 1, modcall_spaces, i);
 					pairfree(copy_p);
 					break;
 				}
 			}
 
 			myresult = RLM_MODULE_NOOP;
-			goto handle_result;
 		}
+			goto handle_result;
 
-		if (child->type == MOD_FOREACH) {
+		case MOD_OP_FOREACH:
+		{
 			int i, depth = -1;
 			VALUE_PAIR *vp;
-			modgroup *g = mod_callabletogroup(child);
 
 			for (i = 0; i < 8; i++) {
 				if (!request_data_reference(request,
@@ -549,7 +682,7 @@ int modcall(int component, modcallable *c, REQUEST *request)
 
 			if (!(radius_get_vp(request, child->name, &vp) < 0)) {
 				RDEBUG2("%.*sforeach %s {",
-					stack.pointer + 1, modcall_spaces,
+					sp + 1, modcall_spaces,
 					child->name);
 				while (vp) {
 					VALUE_PAIR *copy = NULL, **copy_p;
@@ -559,7 +692,7 @@ int modcall(int component, modcallable *c, REQUEST *request)
 						char buffer[1024];
 
 						vp_prints_value(buffer, sizeof(buffer), vp, 1);
-						RDEBUG2("%.*s #  Foreach-Variable-%d = %s", stack.pointer + 1, modcall_spaces, depth, buffer);
+						RDEBUG2("%.*s #  Foreach-Variable-%d = %s", sp + 1, modcall_spaces, depth, buffer);
 					}
 #endif
 
@@ -570,11 +703,10 @@ int modcall(int component, modcallable *c, REQUEST *request)
 							 depth, copy_p,
 							 pairfree_wrapper);
 
-				 	myresult = modcall(component,
-							   g->children,
-							   request);
-					if (myresult == MOD_ACTION_RETURN) {
-						break;
+					if (insn->body) {
+						modcall_program(component,
+								insn->body,
+								request);
 					}
 					vp = pairfind(vp->next, vp->da->attr,
 						      vp->da->vendor, TAG_ANY);
@@ -595,11 +727,12 @@ int modcall(int component, modcallable *c, REQUEST *request)
 			}  /* if the VP exists */
 
 			myresult = RLM_MODULE_OK;
-			goto handle_result;
 		}
+			goto handle_result;
 #endif
-	
-		if (child->type == MOD_REFERENCE) {
+
+		case MOD_OP_REFERENCE:
+		{
 			modref *mr = mod_callabletoref(child);
 			const char *server = request->server;
 
@@ -608,16 +741,17 @@ int modcall(int component, modcallable *c, REQUEST *request)
 				myresult = RLM_MODULE_NOOP;
 				goto handle_priority;
 			}
-			
+
 			request->server = mr->ref_name;
 			RDEBUG("server %s { # nested call", mr->ref_name);
 			myresult = indexed_modcall(component, 0, request);
 			RDEBUG("} # server %s with nested call", mr->ref_name);
 			request->server = server;
-			goto handle_priority;
 		}
+			goto handle_priority;
 
-		if (child->type == MOD_XLAT) {
+		case MOD_OP_XLAT:
+		{
 			modxlat *mx = mod_callabletoxlat(child);
 			char buffer[128];
 
@@ -631,181 +765,73 @@ int modcall(int component, modcallable *c, REQUEST *request)
 						    request->packet->vps,
 						    NULL, 1);
 			}
-					    
+		}
 			goto skip; /* don't change anything on the stack */
+
+		default:
+			RDEBUG2("Internal sanity check failed in modcall %d", insn->op);
+			exit(1);
 		}
 
 		/*
-		 *	Child is a group that has children of it's own.
+		 *	Enter a group.  "first" is the child to start
+		 *	with, or -1 if there's nothing to run.
 		 */
-		if (child->type != MOD_SINGLE) {
-			int count = 1;
-			modcallable *p, *q;
-#ifdef WITH_UNLANG
-			modcallable *null_case;
-#endif
-			modgroup *g = mod_callabletogroup(child);
-
-			stack.pointer++;
-
-			/*
-			 *	Catastrophic error.  This SHOULD have
-			 *	been caught when we were reading in the
-			 *	conf files.
-			 *
-			 *	FIXME: Do so.
-			 */
-			if (stack.pointer >= MODCALL_STACK_MAX) {
-				radlog(L_ERR, "Internal sanity check failed: module stack is too deep");
-				exit(1);
-			}
-
-			stack.priority[stack.pointer] = stack.priority[stack.pointer - 1];
-			stack.result[stack.pointer] = stack.result[stack.pointer - 1];
+	push:
+		sp++;
 
-			RDEBUG2("%.*s%s %s {",
-				stack.pointer + 1, modcall_spaces,
-				group_name[child->type], child->name);
-
-			switch (child->type) {
-#ifdef WITH_UNLANG
-				char buffer[1024];
-
-			case MOD_IF:
-			case MOD_ELSE:
-			case MOD_ELSIF:
-			case MOD_CASE:
-			case MOD_FOREACH:
-#endif
-			case MOD_GROUP:
-			case MOD_POLICY: /* same as MOD_GROUP */
-				stack.children[stack.pointer] = g->children;
-				break;
-
-				/*
-				 *	See the "camel book" for why
-				 *	this works.
-				 *
-				 *	If (rand(0..n) < 1), pick the
-				 *	current realm.  We add a scale
-				 *	factor of 65536, to avoid
-				 *	floating point.
-				 */
-			case MOD_LOAD_BALANCE:
-			case MOD_REDUNDANT_LOAD_BALANCE:
-				q = NULL;
-				for(p = g->children; p; p = p->next) {
-					if (!q) {
-						q = p;
-						count = 1;
-						continue;
-					}
-
-					count++;
-
-					if ((count * (fr_rand() & 0xffff)) < (uint32_t) 0x10000) {
-						q = p;
-					}
-				}
-				stack.children[stack.pointer] = q;
-				break;
-
-#ifdef WITH_UNLANG
-			case MOD_SWITCH:
-				if (!strchr(child->name, '%')) {
-					VALUE_PAIR *vp = NULL;
-
-					radius_get_vp(request, child->name,
-						      &vp);
-					if (vp) {
-						vp_prints_value(buffer,
-								sizeof(buffer),
-								vp, 0);
-					} else {
-						*buffer = '\0';
-					}
-				} else {
-					radius_xlat(buffer, sizeof(buffer),
-						    child->name, request, NULL, NULL);
-				}
-				null_case = q = NULL;
-				for(p = g->children; p; p = p->next) {
-					if (!p->name) {
-						if (!null_case) null_case = p;
-						continue;
-					}
-					if (strcmp(buffer, p->name) == 0) {
-						q = p;
-						break;
-					}
-				}
-
-				if (!q) q = null_case;
-
-				stack.children[stack.pointer] = q;
-				break;
-#endif
-
-			default:
-				RDEBUG2("Internal sanity check failed in modcall %d", child->type);
-				exit(1); /* internal sanity check failure */
-				break;
-			}
-
-
-			stack.start[stack.pointer] = stack.children[stack.pointer];
-
-			RDEBUG2("%.*s- entering %s %s {...}",
-			       stack.pointer, modcall_spaces,
-			       group_name[child->type],
-			       child->name ? child->name : "");
+		/*
+		 *	modcallable_flatten() checks the depth, so
+		 *	this can't happen.
+		 */
+		if (sp >= MODCALL_STACK_MAX) {
+			radlog(L_ERR, "Internal sanity check failed: module stack is too deep");
+			exit(1);
+		}
 
-			/*
-			 *	Catch the special case of a NULL group.
-			 */
-			if (!stack.children[stack.pointer]) {
-				/*
-				 *	Print message for NULL group
-				 */
-				RDEBUG2("%.*s- %s %s = %s",
-				       stack.pointer + 1, modcall_spaces,
-				       group_name[child->type],
-				       child->name ? child->name : "",
-				       fr_int2str(mod_rcode_table,
-						    stack.result[stack.pointer],
-						  "??"));
-				goto do_return;
-			}
+		stack[sp].priority = stack[sp - 1].priority;
+		stack[sp].result = stack[sp - 1].result;
+		stack[sp].group = pc;
+		stack[sp].start = first;
+		stack[sp].wrap = (insn->op == MOD_OP_REDUNDANT_LOAD_BALANCE);
+
+		RDEBUG2("%.*s%s %s {",
+			sp + 1, modcall_spaces,
+			group_name[child->type], child->name);
+
+		RDEBUG2("%.*s- entering %s %s {...}",
+			sp, modcall_spaces,
+			group_name[child->type],
+			child->name ? child->name : "");
+
+		if (first < 0) {
+			RDEBUG2("%.*s- %s %s = %s",
+				sp + 1, modcall_spaces,
+				group_name[child->type],
+				child->name ? child->name : "",
+				fr_int2str(mod_rcode_table,
+					   stack[sp].result, "??"));
 
 			/*
-			 *	The child may be a group, so we want to
-			 *	recurse into it's children, rather than
-			 *	falling through to the code below.
+			 *	An empty group returns through its
+			 *	parent, not through itself.
 			 */
-			continue;
+			parent = child->parent;
+			goto do_return;
 		}
 
-		/*
-		 *	Process a stand-alone child, and fall through
-		 *	to dealing with it's parent.
-		 */
-		sp = mod_callabletosingle(child);
-
-		myresult = call_modsingle(child->method, sp, request);
-		RDEBUG2("%.*s[%s] = %s",
-			stack.pointer + 1, modcall_spaces,
-			child->name ? child->name : "",
-			fr_int2str(mod_rcode_table, myresult, "??"));
+		pc = first;
+		continue;
 
 	handle_priority:
-		mypriority = child->actions[myresult];
+		mypriority = insn->actions[myresult];
 
 #ifdef WITH_UNLANG
 		if (0) {
 		handle_result:
-			if (child->type != MOD_BREAK) {
+			if (insn->op != MOD_OP_BREAK) {
 				RDEBUG2("%.*s} # %s %s = %s",
-					stack.pointer + 1, modcall_spaces,
+					sp + 1, modcall_spaces,
 					group_name[child->type], child->name ? child->name : "",
 					fr_int2str(mod_rcode_table, myresult, "??"));
 			}
@@ -819,152 +845,66 @@ int modcall(int component, modcallable *c, REQUEST *request)
 		 */
 		if (component != RLM_COMPONENT_SESS) request->simul_max = myresult;
 
-		/*
-		 *	FIXME: Allow modules to push a modcallable
-		 *	onto this stack.  This should simplify
-		 *	configuration a LOT!
-		 *
-		 *	Once we do that, we can't do load-time
-		 *	checking of the maximum stack depth, and we've
-		 *	got to cache the stack pointer before storing
-		 *	myresult.
-		 *
-		 *	Also, if the stack changed, we need to set
-		 *	children[ptr] to NULL, and process the next
-		 *	entry on the stack, rather than falling
-		 *	through to finalize the processing of this
-		 *	entry.
-		 *
-		 *	Don't put "myresult" on the stack here,
-		 *	we have to do so with priority.
-		 */
-
-		/*
-		 *	We roll back up the stack at this point.
-		 */
 	unroll:
-		/*
-		 *	The child's action says return.  Do so.
-		 */
-		if ((child->actions[myresult] == MOD_ACTION_RETURN) &&
+		if ((insn->actions[myresult] == MOD_ACTION_RETURN) &&
 		    (mypriority <= 0)) {
-			stack.result[stack.pointer] = myresult;
-			stack.children[stack.pointer] = NULL;
-			goto do_return;
+			stack[sp].result = myresult;
+			goto pop_frame;
 		}
 
-		/*
-		 *	If "reject", break out of the loop and return
-		 *	reject.
-		 */
-		if (child->actions[myresult] == MOD_ACTION_REJECT) {
-			stack.children[stack.pointer] = NULL;
-			stack.result[stack.pointer] = RLM_MODULE_REJECT;
-			goto do_return;
+		if (insn->actions[myresult] == MOD_ACTION_REJECT) {
+			stack[sp].result = RLM_MODULE_REJECT;
+			goto pop_frame;
 		}
 
-		/*
-		 *	Otherwise, the action is a number, the
-		 *	preference level of this return code. If no
-		 *	higher preference has been seen yet, remember
-		 *	this one.
-		 */
-		if (mypriority >= stack.priority[stack.pointer]) {
+		if (mypriority >= stack[sp].priority) {
 #ifdef WITH_UNLANG
 		next_section:
 #endif
-			stack.result[stack.pointer] = myresult;
-			stack.priority[stack.pointer] = mypriority;
+			stack[sp].result = myresult;
+			stack[sp].priority = mypriority;
 		}
 
-		/*
-		 *	No parent, we must be done.
-		 */
 	skip:
-		if (!parent) {
- 			rad_assert(stack.pointer == 0);
-			myresult = stack.result[0];
-			break;
+		pc = insn->next;
+		if (stack[sp].wrap && (pc == stack[sp].start)) {
+			pc = prog->insns[stack[sp].group].pop;
 		}
+		continue;
 
-		rad_assert(child != NULL);
+	pop_frame:
+		parent = (sp > 0) ? prog->insns[stack[sp].group].c : NULL;
 
 		/*
-		 *	Go to the "next" child, whatever that is.
+		 *	Leave the current group, and return its result
+		 *	to the group which contains it.
 		 */
-		switch (parent->type) {
-#ifdef WITH_UNLANG
-			case MOD_IF:
-			case MOD_ELSE:
-			case MOD_ELSIF:
-			case MOD_CASE:
-			case MOD_FOREACH:
-#endif
-			case MOD_GROUP:
-			case MOD_POLICY: /* same as MOD_GROUP */
-				stack.children[stack.pointer] = child->next;
-				break;
+	do_return:
+		myresult = stack[sp].result;
+		if (sp == 0) break;
+		pc = stack[sp].group;
+		sp--;
+		if (sp == 0) break;
+
+		RDEBUG2("%.*s- %s %s returns %s",
+			sp + 1, modcall_spaces,
+			group_name[parent->type],
+			parent->name ? parent->name : "",
+			fr_int2str(mod_rcode_table, myresult, "??"));
 
 #ifdef WITH_UNLANG
-			case MOD_SWITCH:
-#endif
-			case MOD_LOAD_BALANCE:
-				stack.children[stack.pointer] = NULL;
-				break;
-
-			case MOD_REDUNDANT_LOAD_BALANCE:
-				if (child->next) {
-					stack.children[stack.pointer] = child->next;
-				} else {
-					modgroup *g = mod_callabletogroup(parent);
-
-					stack.children[stack.pointer] = g->children;
-				}
-				if (stack.children[stack.pointer] == stack.start[stack.pointer]) {
-					stack.children[stack.pointer] = NULL;
-				}
-				break;
-			default:
-				RDEBUG2("Internal sanity check failed in modcall  next %d", child->type);
-				exit(1);
+		if ((parent->type == MOD_IF) ||
+		    (parent->type == MOD_ELSIF)) {
+			if_taken = was_if = TRUE;
+		} else {
+			if_taken = was_if = FALSE;
 		}
-
-		/*
-		 *	No child, we're done this group, and we return
-		 *	"myresult" to the caller by pushing it back up
-		 *	the stack.
-		 */
-		if (!stack.children[stack.pointer]) {
-		do_return:
-			myresult = stack.result[stack.pointer];
-			if (stack.pointer == 0) break;
-			stack.pointer--;
-			if (stack.pointer == 0) break;
-
-			RDEBUG2("%.*s- %s %s returns %s",
-			       stack.pointer + 1, modcall_spaces,
-			       group_name[parent->type],
-			       parent->name ? parent->name : "",
-				fr_int2str(mod_rcode_table, myresult, "??"));
-
-#ifdef WITH_UNLANG
-			if ((parent->type == MOD_IF) ||
-			    (parent->type == MOD_ELSIF)) {
-				if_taken = was_if = TRUE;
-			} else {
-				if_taken = was_if = FALSE;
-			}
 #endif
 
-			/*
-			 *	Unroll the stack.
-			 */
-			child = stack.children[stack.pointer];
-			parent = child->parent;
-			goto unroll;
-		}
-
-	} /* loop until done */
+		insn = &prog->insns[pc];
+		child = insn->c;
+		goto unroll;
+	}
 
 	return myresult;
 }
@@ -1016,8 +956,50 @@ static void dump_tree(int comp, modcallable *c)
 	DEBUG("[%s]", comp2str[comp]);
 	dump_mc(c, 0);
 }
+
+static const char *op_name[] = {
+	"module",
+	"group",
+	"load-balance",
+	"redundant-load-balance",
+	"switch",
+	"update",
+	"foreach",
+	"break",
+	"reference",
+	"xlat",
+	"pop"
+};
+
+/* Dump a flattened tree, one instruction per line */
+static void dump_program(const modcall_program_t *prog, int indent)
+{
+	int i, j;
+
+	for (i = 0; i < prog->num_insns; i++) {
+		const modcall_insn_t *insn = &prog->insns[i];
+		char buffer[256], *p;
+
+		p = buffer;
+		*p = '\0';
+		for (j = 0; j < insn->num_children; j++) {
+			snprintf(p, sizeof(buffer) - (p - buffer), " %d",
+				 insn->children[j]);
+			p += strlen(p);
+		}
+
+		DEBUG("%.*s%4d: %s %s next=%d pop=%d children=[%s ]",
+		      indent, "\t\t\t\t\t\t\t\t\t\t\t", i,
+		      op_name[insn->op],
+		      (insn->c && insn->c->name) ? insn->c->name : "",
+		      insn->next, insn->pop, buffer);
+
+		if (insn->body) dump_program(insn->body, indent + 1);
+	}
+}
 #else
 #define dump_tree(a, b)
+#define dump_program(a, b)
 #endif
 
 /* These are the default actions. For each component, the group{} block
@@ -1551,6 +1533,7 @@ static modcallable *do_compile_modupdate(modcallable *parent, UNUSED int compone
 	g->children = NULL;
 	g->cs = cs;
 	g->vps = head;
+	g->xlat = xlat_compile_section(NULL, cs);
 
 	return csingle;
 }
@@ -1778,9 +1761,6 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 					 int grouptype,
 					 const char **modname)
 {
-#ifdef WITH_UNLANG
-	int result;
-#endif
 	const char *modrefname;
 	modsingle *single;
 	modcallable *csingle;
@@ -1866,8 +1846,8 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 			if (!csingle) return NULL;
 			csingle->type = MOD_IF;
 
-			if (!radius_evaluate_condition(NULL, 0, 0, modname,
-						       FALSE, &result)) {
+			if (!radius_compile_condition(modname,
+						      &mod_callabletogroup(csingle)->regex)) {
 				modcallable_free(&csingle);
 				return NULL;
 			}
@@ -1895,8 +1875,8 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 			if (!csingle) return NULL;
 			csingle->type = MOD_ELSIF;
 
-			if (!radius_evaluate_condition(NULL, 0, 0, modname,
-						       FALSE, &result)) {
+			if (!radius_compile_condition(modname,
+						      &mod_callabletogroup(csingle)->regex)) {
 				modcallable_free(&csingle);
 				return NULL;
 			}
@@ -2417,6 +2397,224 @@ void add_to_modcallable(modcallable **parent, modcallable *this,
 	add_child(g, this);
 }
 
+/*
+ *	Add an instruction to a program.
+ */
+static int modcall_emit(modcall_program_t *prog, modcall_op_t op,
+			modcallable *c)
+{
+	modcall_insn_t *insn;
+
+	prog->insns = talloc_realloc(prog, prog->insns, modcall_insn_t,
+				     prog->num_insns + 1);
+	insn = &prog->insns[prog->num_insns];
+	memset(insn, 0, sizeof(*insn));
+
+	insn->op = op;
+	insn->c = c;
+	insn->next = -1;
+	insn->pop = -1;
+	if (c) memcpy(insn->actions, c->actions, sizeof(insn->actions));
+
+	return prog->num_insns++;
+}
+
+static int modcall_flatten_node(modcall_program_t *prog, modcallable *c,
+				int depth);
+
+/*
+ *	Lower a list of nodes into a program of its own.  The nodes
+ *	are run one after the other, as with the children of a
+ *	foreach.
+ */
+static modcall_program_t *modcall_flatten_list(TALLOC_CTX *ctx,
+					       modcallable *head)
+{
+	int i, pc, last = -1;
+	modcallable *p;
+	modcall_program_t *prog;
+
+	prog = talloc_zero(ctx, modcall_program_t);
+
+	for (p = head; p != NULL; p = p->next) {
+		pc = modcall_flatten_node(prog, p, 0);
+		if (pc < 0) {
+			talloc_free(prog);
+			return NULL;
+		}
+
+		if (last >= 0) prog->insns[last].next = pc;
+		last = pc;
+	}
+
+	pc = modcall_emit(prog, MOD_OP_POP, NULL);
+	if (last >= 0) prog->insns[last].next = pc;
+
+	for (i = 0; i < prog->num_insns; i++) {
+		rad_assert((prog->insns[i].op == MOD_OP_POP) ||
+			   (prog->insns[i].next >= 0));
+	}
+
+	return prog;
+}
+
+/*
+ *	Lower one node, and all of its children.  Returns the index
+ *	of the instruction for the node, or -1 on error.
+ */
+static int modcall_flatten_node(modcall_program_t *prog, modcallable *c,
+				int depth)
+{
+	int i, pc, pop, count;
+	int *children;
+	modcall_op_t op;
+	modgroup *g;
+	modcallable *p;
+
+	switch (c->type) {
+	case MOD_SINGLE:
+		return modcall_emit(prog, MOD_OP_MODULE, c);
+
+	case MOD_REFERENCE:
+		return modcall_emit(prog, MOD_OP_REFERENCE, c);
+
+	case MOD_XLAT:
+		return modcall_emit(prog, MOD_OP_XLAT, c);
+
+#ifdef WITH_UNLANG
+	case MOD_UPDATE:
+		return modcall_emit(prog, MOD_OP_UPDATE, c);
+
+	case MOD_BREAK:
+		return modcall_emit(prog, MOD_OP_BREAK, c);
+
+	case MOD_FOREACH:
+		g = mod_callabletogroup(c);
+		pc = modcall_emit(prog, MOD_OP_FOREACH, c);
+		if (g->children) {
+			modcall_program_t *body;
+
+			body = modcall_flatten_list(prog, g->children);
+			if (!body) return -1;
+
+			prog->insns[pc].body = body;
+		}
+		return pc;
+
+	case MOD_SWITCH:
+		op = MOD_OP_SWITCH;
+		break;
+
+	case MOD_IF:
+	case MOD_ELSE:
+	case MOD_ELSIF:
+	case MOD_CASE:
+#endif
+	case MOD_GROUP:
+	case MOD_POLICY:
+		op = MOD_OP_GROUP;
+		break;
+
+	case MOD_LOAD_BALANCE:
+		op = MOD_OP_LOAD_BALANCE;
+		break;
+
+	case MOD_REDUNDANT_LOAD_BALANCE:
+		op = MOD_OP_REDUNDANT_LOAD_BALANCE;
+		break;
+
+	default:
+		radlog(L_ERR, "Internal sanity check failed: unknown section type %d",
+		       c->type);
+		return -1;
+	}
+
+	/*
+	 *	Catch this here, rather than when the request is
+	 *	being processed.
+	 */
+	if ((depth + 1) >= MODCALL_STACK_MAX) {
+		radlog(L_ERR, "%s %s is nested too deeply (maximum %d)",
+		       group_name[c->type], c->name ? c->name : "",
+		       MODCALL_STACK_MAX - 1);
+		return -1;
+	}
+
+	g = mod_callabletogroup(c);
+	pc = modcall_emit(prog, op, c);
+
+	count = 0;
+	for (p = g->children; p != NULL; p = p->next) count++;
+
+	children = talloc_array(prog, int, count ? count : 1);
+	i = 0;
+	for (p = g->children; p != NULL; p = p->next) {
+		children[i] = modcall_flatten_node(prog, p, depth + 1);
+		if (children[i] < 0) return -1;
+		i++;
+	}
+
+	pop = modcall_emit(prog, MOD_OP_POP, c);
+
+	/*
+	 *	Fold the parent's "go to the next child" logic into
+	 *	each child.
+	 */
+	for (i = 0; i < count; i++) {
+		switch (op) {
+		case MOD_OP_GROUP:
+			prog->insns[children[i]].next = (i + 1 < count) ? children[i + 1] : pop;
+			break;
+
+		case MOD_OP_REDUNDANT_LOAD_BALANCE:
+			prog->insns[children[i]].next = (i + 1 < count) ? children[i + 1] : children[0];
+			break;
+
+		default:
+			prog->insns[children[i]].next = pop;
+			break;
+		}
+	}
+
+	prog->insns[pc].children = children;
+	prog->insns[pc].num_children = count;
+	prog->insns[pc].pop = pop;
+
+	return pc;
+}
+
+/** Lower a tree into the instruction array used by modcall()
+ *
+ * Must be called on the root of the tree once it is complete,
+ * i.e. after all calls to add_to_modcallable().
+ *
+ * @param c the tree to flatten.
+ * @return 1 on success, 0 on error.
+ */
+int modcallable_flatten(modcallable *c)
+{
+	int pc, end;
+	modcall_program_t *prog;
+
+	if (!c || c->prog) return 1;
+
+	prog = talloc_zero(NULL, modcall_program_t);
+
+	pc = modcall_flatten_node(prog, c, 0);
+	if (pc < 0) {
+		talloc_free(prog);
+		return 0;
+	}
+
+	end = modcall_emit(prog, MOD_OP_POP, NULL);
+	prog->insns[pc].next = end;
+
+	c->prog = prog;
+	dump_program(prog, 0);
+
+	return 1;
+}
+
 void modcallable_free(modcallable **pc)
 {
 	modcallable *c, *loop, *next;
@@ -2432,7 +2630,10 @@ void modcallable_free(modcallable **pc)
 			modcallable_free(&loop);
 		}
 		pairfree(&g->vps);
+		if (g->xlat) talloc_free(g->xlat);
+		if (g->regex) talloc_free(g->regex);
 	}
+	if (c->prog) talloc_free(c->prog);
 	free(c);
 	*pc = NULL;
 }
@@ -65,6 +65,65 @@ struct fr_module_hup_t {
 	fr_module_hup_t		*next;
 };
 
+/*
+ *	Instantiation state of a module instance.
+ */
+#define MODULE_INST_PENDING	(0)
+#define MODULE_INST_RUNNING	(1)
+#define MODULE_INST_DONE	(2)
+#define MODULE_INST_FAILED	(3)
+
+/*
+ *	Maximum number of threads used to instantiate modules.
+ */
+#define MODULE_INST_THREADS	(16)
+
+/*
+ *	A thread which is instantiating modules.
+ */
+struct fr_module_thread_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_t		thread;
+#endif
+	module_instance_t	*waiting;	//!< Instance we're waiting for.
+};
+
+/*
+ *	A set of module instances to process, and what to do with
+ *	each of them.
+ */
+typedef struct module_inst_batch_t {
+	module_instance_t	**nodes;
+	int			num_nodes;
+	int			next;		//!< Next node to process.
+	int			failed;		//!< Number of failures.
+	int			(*func)(module_instance_t *node, void *ctx);
+	void			*ctx;
+} module_inst_batch_t;
+
+/*
+ *	Modules are instantiated from several threads, but the
+ *	instantiate() functions themselves still run one at a time.
+ *	Everything is done with instantiate_mutex held, as they
+ *	register xlats, attributes, etc. and none of that is
+ *	thread-safe.
+ *
+ *	The only work which overlaps is waiting for back-ends.  A
+ *	module releases the mutex with module_instantiate_suspend()
+ *	while it does that, e.g. fr_connection_pool_init() while it
+ *	opens the initial connections.  Modules which don't call it
+ *	take exactly as long as they did when instantiated serially.
+ */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	instantiate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	instantiate_cond = PTHREAD_COND_INITIALIZER;
+static int		instantiate_threaded = FALSE;
+#endif
+
+static fr_module_thread_t	inst_main;
+static fr_module_thread_t	*inst_threads = NULL;
+static int			inst_num_threads = 0;
+
 /*
  *	Ordered by component
  */
@@ -476,12 +535,56 @@ static module_entry_t *linkto_module(const char *module_name,
 }
 
 /*
- *	Find a module instance.
+ *	Allocate the instance data for a module, and parse its
+ *	configuration into it.
  */
-module_instance_t *find_module_instance(CONF_SECTION *modules,
-					const char *askedname, int do_link)
+static int module_alloc_instance(module_instance_t *node, CONF_SECTION *cs,
+				 void **insthandle)
+{
+	*insthandle = NULL;
+
+	if (!node->entry->module->inst_size) return 0;
+
+	/* FIXME: make this rlm_config_t ?? */
+	*insthandle = talloc_zero_array(node, uint8_t, node->entry->module->inst_size);
+	rad_assert(*insthandle != NULL);
+
+	/*
+	 *	So we can see where this configuration is from
+	 *	FIXME: set it to rlm_NAME_t, or some such thing
+	 */
+	talloc_set_name(*insthandle, "rlm_config_t");
+
+	if (node->entry->module->config &&
+	    (cf_section_parse(cs, *insthandle,
+			      node->entry->module->config) < 0)) {
+		cf_log_err_cs(cs,
+			      "Invalid configuration for module \"%s\"",
+			      node->name);
+		talloc_free(*insthandle);
+		*insthandle = NULL;
+		return -1;
+	}
+
+	/*
+	 *	Set the destructor.
+	 */
+	if (node->entry->module->detach) {
+		talloc_set_destructor((void *) *insthandle,
+				      node->entry->module->detach);
+	}
+
+	return 0;
+}
+
+/*
+ *	Find a module instance, or link to the module and parse its
+ *	configuration.  New instances are added to the instance tree,
+ *	but aren't usable until module_instantiate() has been called.
+ */
+static module_instance_t *module_bootstrap(CONF_SECTION *modules,
+					   const char *askedname, int do_link)
 {
-	int check_config_safe = FALSE;
 	CONF_SECTION *cs;
 	const char *name1, *instname;
 	module_instance_t *node, myNode;
@@ -527,6 +630,7 @@ module_instance_t *find_module_instance(CONF_SECTION *modules,
 
 	node->insthandle = NULL;
 	node->cs = cs;
+	strlcpy(node->name, instname, sizeof(node->name));
 
 	/*
 	 *	Names in the "modules" section aren't prefixed
@@ -541,6 +645,8 @@ module_instance_t *find_module_instance(CONF_SECTION *modules,
 		return NULL;
 	}
 
+	node->state = MODULE_INST_PENDING;
+
 	if (check_config && (node->entry->module->instantiate) &&
 	    (node->entry->module->type & RLM_TYPE_CHECK_CONFIG_SAFE) == 0) {
 		const char *value = NULL;
@@ -552,9 +658,9 @@ module_instance_t *find_module_instance(CONF_SECTION *modules,
 		if (value && (strcmp(value, "yes") == 0)) goto print_inst;
 
 		cf_log_module(cs, "Skipping instantiation of %s", instname);
+		node->state = MODULE_INST_DONE;
 	} else {
 	print_inst:
-		check_config_safe = TRUE;
 		cf_log_module(cs, "Instantiating module \"%s\" from file %s",
 			      instname, cf_section_filename(cs));
 	}
@@ -563,54 +669,12 @@ module_instance_t *find_module_instance(CONF_SECTION *modules,
 	 *	If there is supposed to be instance data, allocate it now.
 	 *	Also parse the configuration data, if required.
 	 */
-	if (node->entry->module->inst_size) {
-		/* FIXME: make this rlm_config_t ?? */
-		node->insthandle = talloc_zero_array(node, uint8_t, node->entry->module->inst_size);
-		rad_assert(node->insthandle != NULL);
-
-		/*
-		 *	So we can see where this configuration is from
-		 *	FIXME: set it to rlm_NAME_t, or some such thing
-		 */
-		talloc_set_name(node->insthandle, "rlm_config_t");
-
-		if (node->entry->module->config &&
-		    (cf_section_parse(cs, node->insthandle,
-				      node->entry->module->config) < 0)) {
-			cf_log_err_cs(cs,
-				      "Invalid configuration for module \"%s\"",
-				      instname);
-			talloc_free(node);
-			return NULL;
-		}
-		
-		/*
-		 *	Set the destructor.
-		 */
-		if (node->entry->module->detach) {
-			talloc_set_destructor((void *) node->insthandle,
-					      node->entry->module->detach);
-		}
-	}
-
-	/*
-	 *	Call the module's instantiation routine.
-	 */
-	if ((node->entry->module->instantiate) &&
-	    (!check_config || check_config_safe) &&
-	    ((node->entry->module->instantiate)(cs, node->insthandle) < 0)) {
-		cf_log_err_cs(cs,
-			      "Instantiation failed for module \"%s\"",
-			      instname);
+	if (module_alloc_instance(node, cs, &node->insthandle) < 0) {
 		talloc_free(node);
 		return NULL;
 	}
 
-	/*
-	 *	We're done.  Fill in the rest of the data structure,
-	 *	and link it to the module instance list.
-	 */
-	strlcpy(node->name, instname, sizeof(node->name));
+	if (!node->entry->module->instantiate) node->state = MODULE_INST_DONE;
 
 #ifdef HAVE_PTHREAD_H
 	/*
@@ -638,6 +702,264 @@ module_instance_t *find_module_instance(CONF_SECTION *modules,
 	return node;
 }
 
+/*
+ *	Find the data for the thread we're running in.
+ */
+static fr_module_thread_t *module_thread_self(void)
+{
+#ifdef HAVE_PTHREAD_H
+	int i;
+	pthread_t self = pthread_self();
+
+	for (i = 0; i < inst_num_threads; i++) {
+		if (pthread_equal(inst_threads[i].thread, self)) {
+			return &inst_threads[i];
+		}
+	}
+#endif
+
+	return &inst_main;
+}
+
+/*
+ *	Call the module's instantiation routine.
+ *
+ *	When modules are being instantiated in parallel, this is
+ *	called with instantiate_mutex held.  If the module is being
+ *	instantiated by another thread, we wait for it to finish.
+ */
+static int module_instantiate(module_instance_t *node)
+{
+	int rcode;
+	fr_module_thread_t *me, *t;
+	struct timeval start, end, elapsed;
+
+	me = module_thread_self();
+
+	while (node->state == MODULE_INST_RUNNING) {
+		/*
+		 *	Follow the chain of threads waiting for each
+		 *	other.  If it leads back to us, then the
+		 *	modules depend on each other.
+		 */
+		t = node->owner;
+		while ((t != me) && t->waiting) t = t->waiting->owner;
+
+		if (t == me) {
+			cf_log_err_cs(node->cs,
+				      "Circular dependency when instantiating module \"%s\"",
+				      node->name);
+			return -1;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		me->waiting = node;
+		pthread_cond_wait(&instantiate_cond, &instantiate_mutex);
+		me->waiting = NULL;
+#endif
+	}
+
+	if (node->state == MODULE_INST_DONE) return 0;
+	if (node->state == MODULE_INST_FAILED) return -1;
+
+	node->state = MODULE_INST_RUNNING;
+	node->owner = me;
+
+	gettimeofday(&start, NULL);
+	rcode = (node->entry->module->instantiate)(node->cs, node->insthandle);
+	gettimeofday(&end, NULL);
+
+	if (rcode < 0) {
+		cf_log_err_cs(node->cs,
+			      "Instantiation failed for module \"%s\"",
+			      node->name);
+
+		/*
+		 *	The instance stays in the tree, so that
+		 *	anything waiting for it sees the failure.
+		 */
+		talloc_free(node->insthandle);
+		node->insthandle = NULL;
+		node->state = MODULE_INST_FAILED;
+	} else {
+		fr_tv_sub(&end, &start, &elapsed);
+		cf_log_module(node->cs, "Instantiated module \"%s\" in %d.%06d seconds",
+			      node->name, (int) elapsed.tv_sec,
+			      (int) elapsed.tv_usec);
+		node->state = MODULE_INST_DONE;
+	}
+	node->owner = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	if (instantiate_threaded) pthread_cond_broadcast(&instantiate_cond);
+#endif
+
+	return (rcode < 0) ? -1 : 0;
+}
+
+/*
+ *	Find a module instance.
+ */
+module_instance_t *find_module_instance(CONF_SECTION *modules,
+					const char *askedname, int do_link)
+{
+	module_instance_t *node;
+
+	node = module_bootstrap(modules, askedname, do_link);
+	if (!node) return NULL;
+
+	if (module_instantiate(node) < 0) return NULL;
+
+	return node;
+}
+
+/** Let other modules instantiate while this one waits
+ *
+ * Should be called by modules before doing anything in their
+ * instantiate() function which may block for a long time, such as
+ * opening connections to a back-end.  While suspended, the caller
+ * MUST NOT touch anything other than its own instance data.
+ *
+ * @return a value to pass to module_instantiate_resume().
+ */
+int module_instantiate_suspend(void)
+{
+#ifdef HAVE_PTHREAD_H
+	if (!instantiate_threaded) return FALSE;
+
+	pthread_mutex_unlock(&instantiate_mutex);
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/** Resume instantiation after module_instantiate_suspend()
+ *
+ * @param suspended the value returned by module_instantiate_suspend().
+ */
+void module_instantiate_resume(int suspended)
+{
+#ifdef HAVE_PTHREAD_H
+	if (suspended) pthread_mutex_lock(&instantiate_mutex);
+#endif
+}
+
+/*
+ *	Process module instances until there are none left, or
+ *	until one of them fails.
+ */
+static void module_batch_process(module_inst_batch_t *batch)
+{
+	module_instance_t *node;
+
+	while (!batch->failed && (batch->next < batch->num_nodes)) {
+		node = batch->nodes[batch->next++];
+
+		if (batch->func(node, batch->ctx) < 0) batch->failed++;
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *module_batch_thread(void *arg)
+{
+	module_inst_batch_t *batch = arg;
+
+	pthread_mutex_lock(&instantiate_mutex);
+	module_batch_process(batch);
+	pthread_mutex_unlock(&instantiate_mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	Run "func" over all of the module instances, using multiple
+ *	threads if we can.  Only one thread runs "func" at a time.
+ *	The others may be waiting for back-ends, after calling
+ *	module_instantiate_suspend().
+ *
+ *	Returns the number of instances for which "func" failed.
+ *	No more instances are started after the first failure.
+ */
+static int module_batch_run(module_instance_t **nodes, int num_nodes,
+			    int (*func)(module_instance_t *, void *),
+			    void *ctx)
+{
+	module_inst_batch_t batch;
+#ifdef HAVE_PTHREAD_H
+	int i, rcode, num_threads;
+#endif
+
+	memset(&batch, 0, sizeof(batch));
+	batch.nodes = nodes;
+	batch.num_nodes = num_nodes;
+	batch.func = func;
+	batch.ctx = ctx;
+
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	talloc isn't thread-safe when tracking NULL contexts.
+	 */
+	num_threads = num_nodes;
+	if (num_threads > MODULE_INST_THREADS) num_threads = MODULE_INST_THREADS;
+	if (mainconfig.debug_memory) num_threads = 1;
+
+	if (num_threads > 1) {
+		inst_threads = rad_malloc(num_threads * sizeof(*inst_threads));
+		memset(inst_threads, 0, num_threads * sizeof(*inst_threads));
+
+		/*
+		 *	Hold the lock while the threads are created,
+		 *	so that they can find themselves in the
+		 *	inst_threads array.
+		 */
+		pthread_mutex_lock(&instantiate_mutex);
+		instantiate_threaded = TRUE;
+
+		inst_threads[0].thread = pthread_self();
+		inst_num_threads = 1;
+
+		for (i = 1; i < num_threads; i++) {
+			rcode = pthread_create(&inst_threads[i].thread, NULL,
+					       module_batch_thread, &batch);
+			if (rcode != 0) {
+				radlog(L_ERR, "Failed creating module instantiation thread: %s",
+				       strerror(rcode));
+				break;
+			}
+			inst_num_threads++;
+		}
+
+		/*
+		 *	We do our share of the work, too.
+		 */
+		module_batch_process(&batch);
+		pthread_mutex_unlock(&instantiate_mutex);
+
+		for (i = 1; i < inst_num_threads; i++) {
+			pthread_join(inst_threads[i].thread, NULL);
+		}
+
+		instantiate_threaded = FALSE;
+		inst_num_threads = 0;
+		free(inst_threads);
+		inst_threads = NULL;
+
+		return batch.failed;
+	}
+#endif
+
+	module_batch_process(&batch);
+
+	return batch.failed;
+}
+
+static int module_instantiate_batch(module_instance_t *node, UNUSED void *ctx)
+{
+	return module_instantiate(node);
+}
+
 static indexed_modcallable *lookup_by_index(rbtree_t *components,
 					    int comp, int idx)
 {
@@ -969,6 +1291,15 @@ static int load_component_section(CONF_SECTION *cs,
 	return 0;
 }
 
+static int flatten_component(UNUSED void *ctx, void *data)
+{
+	indexed_modcallable *c = data;
+
+	if (!modcallable_flatten(c->modulelist)) return -1;
+
+	return 0;
+}
+
 static int load_byserver(CONF_SECTION *cs)
 {
 	int comp, flag;
@@ -1175,6 +1506,14 @@ static int load_byserver(CONF_SECTION *cs)
 #endif
 	}
 
+	/*
+	 *	All of the sections have been loaded.  Convert them to
+	 *	the form used by modcall().
+	 */
+	if (rbtree_walk(components, InOrder, flatten_component, NULL) != 0) {
+		goto error;
+	}
+
 	cf_log_info(cs, "} # server");
 
 	if (!flag && name) {
@@ -1214,16 +1553,100 @@ static int load_byserver(CONF_SECTION *cs)
 }
 
 
+/*
+ *	Check whether the sections called "name" are the same in
+ *	both configurations.
+ */
+static int virtual_server_subcs_cmp(CONF_SECTION *old, CONF_SECTION *new,
+				    const char *name)
+{
+	CONF_SECTION *a, *b;
+	const char *name2a, *name2b;
+
+	a = cf_subsection_find_next(old, NULL, name);
+	b = cf_subsection_find_next(new, NULL, name);
+
+	while (a || b) {
+		if (!a || !b) return 0;
+
+		name2a = cf_section_name2(a);
+		name2b = cf_section_name2(b);
+		if (!name2a != !name2b) return 0;
+		if (name2a && (strcmp(name2a, name2b) != 0)) return 0;
+
+		if (!cf_section_cmp(a, b)) return 0;
+
+		a = cf_subsection_find_next(old, a, name);
+		b = cf_subsection_find_next(new, b, name);
+	}
+
+	return 1;
+}
+
+/*
+ *	On HUP, check whether a virtual server can be left alone.
+ *	If the server is the top-level configuration, only the
+ *	processing sections are compared.
+ */
+static int virtual_server_unchanged(virtual_server_t *server,
+				    CONF_SECTION *cs)
+{
+	int comp;
+
+	if (!server) return FALSE;
+
+	if (cf_top_section(cs) != cs) {
+		if (!cf_section_cmp(server->cs, cs)) return FALSE;
+	} else {
+		for (comp = 0; comp < RLM_COMPONENT_COUNT; comp++) {
+			if (!virtual_server_subcs_cmp(server->cs, cs,
+						      section_type_value[comp].section)) {
+				return FALSE;
+			}
+		}
+
+		if (!virtual_server_subcs_cmp(server->cs, cs, "vmps") ||
+		    !virtual_server_subcs_cmp(server->cs, cs, "dhcp")) {
+			return FALSE;
+		}
+	}
+
+	cf_log_info(cs, "Keeping virtual server %s, its configuration is unchanged",
+		    server->name ? server->name : "<default>");
+
+	return TRUE;
+}
+
 /*
  *	Load all of the virtual servers.
  */
 int virtual_servers_load(CONF_SECTION *config)
 {
 	CONF_SECTION *cs;
+	int kept = 0, loaded = 0, failed = 0;
 	static int first_time = TRUE;
+	int reload_all = first_time;
 
 	DEBUG2("%s: #### Loading Virtual Servers ####", mainconfig.name);
 
+	/*
+	 *	"policy" and "instantiate" are compiled into every
+	 *	virtual server which uses them, so if either one has
+	 *	changed, all of the servers have to be rebuilt.
+	 */
+	if (!reload_all) {
+		virtual_server_t *old = virtual_server_find(NULL);
+
+		if (!old ||
+		    !virtual_server_subcs_cmp(cf_top_section(old->cs), config,
+					      "policy") ||
+		    !virtual_server_subcs_cmp(cf_top_section(old->cs), config,
+					      "instantiate")) {
+			radlog(L_INFO, "HUP - \"policy\" or \"instantiate\" has changed, reloading all virtual servers");
+			reload_all = TRUE;
+		}
+	}
+
 	/*
 	 *	If we have "server { ...}", then there SHOULD NOT be
 	 *	bare "authorize", etc. sections.  if there is no such
@@ -1235,14 +1658,15 @@ int virtual_servers_load(CONF_SECTION *config)
 	cs = cf_section_find_name2(cf_subsection_find_next(config, NULL,
 							   "server"),
 				   "server", NULL);
-	if (cs) {
-		if (load_byserver(cs) < 0) {
-			return -1;
-		}
+	if (!cs) cs = config;
+
+	if (!reload_all && virtual_server_unchanged(virtual_server_find(NULL), cs)) {
+		kept++;
 	} else {
-		if (load_byserver(config) < 0) {
+		if (load_byserver(cs) < 0) {
 			return -1;
 		}
+		loaded++;
 	}
 
 	/*
@@ -1269,15 +1693,33 @@ int virtual_servers_load(CONF_SECTION *config)
 			return -1;
 		}
 
+		/*
+		 *	Servers which haven't changed keep running
+		 *	with the sections they were loaded from.
+		 */
+		if (!reload_all && virtual_server_unchanged(server, cs)) {
+			kept++;
+			continue;
+		}
+
 		if (load_byserver(cs) < 0) {
 			/*
 			 *	Once we successfully started once,
 			 *	continue loading the OTHER servers,
 			 *	even if one fails.
 			 */
-			if (!first_time) continue;
+			if (!first_time) {
+				failed++;
+				continue;
+			}
 			return -1;
 		}
+		loaded++;
+	}
+
+	if (!first_time) {
+		radlog(L_INFO, "HUP - virtual servers: %d kept, %d reloaded, %d failed",
+		       kept, loaded, failed);
 	}
 
 	/*
@@ -1300,11 +1742,17 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 	}
 
 	cf_log_module(cs, "Trying to reload module \"%s\"", node->name);
-	
-	if ((node->entry->module->instantiate)(cs, &insthandle) < 0) {
+
+	/*
+	 *	The new instance gets its own copy of the
+	 *	configuration, just like at startup.
+	 */
+	if ((module_alloc_instance(node, cs, &insthandle) < 0) ||
+	    ((node->entry->module->instantiate)(cs, insthandle) < 0)) {
 		cf_log_err_cs(cs,
 			   "HUP failed for module \"%s\".  Using old configuration.",
 			   node->name);
+		talloc_free(insthandle);
 		return 0;
 	}
 
@@ -1323,6 +1771,7 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 	node->mh = mh;
 
 	node->insthandle = insthandle;
+	node->cs = cs;
 	
 	/*
 	 *	FIXME: Set a timeout to come back in 60s, so that
@@ -1332,17 +1781,55 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 	return 1;
 }
 
+typedef struct module_hup_ctx_t {
+	CONF_SECTION	*modules;
+	time_t		when;
+	int		reloaded;
+	int		failed;
+} module_hup_ctx_t;
 
+static int module_hup_batch(module_instance_t *node, void *ctx)
+{
+	module_hup_ctx_t *hup = ctx;
+	CONF_SECTION *cs;
+
+	cs = cf_section_sub_find_name2(hup->modules, NULL, node->name);
+	if (!cs) return 0;
+
+	/*
+	 *	Failures are logged, and the old instance is kept.
+	 */
+	if (module_hup_module(cs, node, hup->when)) {
+		hup->reloaded++;
+	} else {
+		hup->failed++;
+	}
+
+	return 0;
+}
+
+/*
+ *	Reload the modules whose configuration has changed.  The
+ *	others keep their current instance, along with any
+ *	connections or cached data it has.
+ */
 int module_hup(CONF_SECTION *modules)
 {
-	time_t when;
 	CONF_ITEM *ci;
 	CONF_SECTION *cs;
 	module_instance_t *node;
+	module_instance_t **nodes;
+	int num_nodes = 0, max_nodes = 16;
+	int kept = 0, restart = 0;
+	module_hup_ctx_t hup;
 
 	if (!modules) return 0;
 
-	when = time(NULL);
+	memset(&hup, 0, sizeof(hup));
+	hup.modules = modules;
+	hup.when = time(NULL);
+
+	nodes = talloc_array(NULL, module_instance_t *, max_nodes);
 
 	/*
 	 *	Loop over the modules
@@ -1364,10 +1851,37 @@ int module_hup(CONF_SECTION *modules)
 
 		strlcpy(myNode.name, instname, sizeof(myNode.name));
 		node = rbtree_finddata(instance_tree, &myNode);
+		if (!node) continue;
+
+		if (cf_section_cmp(node->cs, cs)) {
+			cf_log_module(cs, "Keeping module \"%s\", its configuration is unchanged",
+				      node->name);
+			kept++;
+			continue;
+		}
 
-		module_hup_module(cs, node, when);
+		if (!node->entry->module->instantiate ||
+		    ((node->entry->module->type & RLM_TYPE_HUP_SAFE) == 0)) {
+			radlog(L_INFO, " Module: Configuration of module \"%s\" has changed, "
+			       "but the module can't be reloaded.  Restart the server to use "
+			       "the new configuration", node->name);
+			restart++;
+			continue;
+		}
+
+		if (num_nodes == max_nodes) {
+			max_nodes *= 2;
+			nodes = talloc_realloc(NULL, nodes, module_instance_t *, max_nodes);
+		}
+		nodes[num_nodes++] = node;
 	}
 
+	module_batch_run(nodes, num_nodes, module_hup_batch, &hup);
+	talloc_free(nodes);
+
+	radlog(L_INFO, "HUP - modules: %d kept, %d reloaded, %d failed, %d need a restart",
+	       kept, hup.reloaded, hup.failed, restart);
+
 	return 1;
 }
 
@@ -1384,6 +1898,9 @@ int setup_modules(int reload, CONF_SECTION *config)
 	CONF_ITEM	*ci, *next;
 	CONF_SECTION	*cs, *modules;
 	rad_listen_t	*listener;
+	module_instance_t **nodes;
+	int		num_nodes = 0, max_nodes = 16, failed;
+	struct timeval	start, end, elapsed;
 
 	if (reload) return 0;
 
@@ -1503,7 +2020,12 @@ int setup_modules(int reload, CONF_SECTION *config)
 	 *	load everything in the "modules" section.  This is
 	 *	because we've now split up the modules into
 	 *	mods-enabled.
+	 *
+	 *	Each module is linked, and its configuration parsed,
+	 *	in order.  The instantiate() calls are then run in
+	 *	parallel, as they may have to wait for back-ends.
 	 */
+	nodes = talloc_array(NULL, module_instance_t *, max_nodes);
 	cf_log_info(cs, " modules {");
 	for (ci=cf_item_find_next(modules, NULL);
 	     ci != NULL;
@@ -1520,9 +2042,37 @@ int setup_modules(int reload, CONF_SECTION *config)
 		name = cf_section_name2(subcs);
 		if (!name) name = cf_section_name1(subcs);
 
-		module = find_module_instance(modules, name, 1);
-		if (!module) return -1;
+		module = module_bootstrap(modules, name, 1);
+		if (!module) {
+			talloc_free(nodes);
+			return -1;
+		}
+
+		if (module->state != MODULE_INST_PENDING) continue;
+
+		if (num_nodes == max_nodes) {
+			max_nodes *= 2;
+			nodes = talloc_realloc(NULL, nodes, module_instance_t *, max_nodes);
+		}
+		nodes[num_nodes++] = module;
 	}
+
+	/*
+	 *	The modules don't depend on each other, except where
+	 *	one calls find_module_instance() for another.  That
+	 *	waits for the other module to be instantiated, so we
+	 *	can do them all at once.
+	 */
+	gettimeofday(&start, NULL);
+	failed = module_batch_run(nodes, num_nodes, module_instantiate_batch, NULL);
+	gettimeofday(&end, NULL);
+	talloc_free(nodes);
+
+	if (failed) return -1;
+
+	fr_tv_sub(&end, &start, &elapsed);
+	cf_log_info(cs, "  # Instantiated %d modules in %d.%06d seconds",
+		    num_nodes, (int) elapsed.tv_sec, (int) elapsed.tv_usec);
 	cf_log_info(cs, " } # modules");
 
 	/*
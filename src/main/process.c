@@ -167,6 +167,20 @@ static const char *action_codes[] = {
 
 #ifdef WITH_PROXY
 static fr_packet_list_t *proxy_list = NULL;
+
+/*
+ *	A copy of a proxied request, sent to a second home server
+ *	when the first one is slower than usual.  The "packet" field
+ *	is what goes into the proxy list.
+ */
+typedef struct proxy_hedge_t {
+	RADIUS_PACKET	*packet;
+	REQUEST		*request;
+	home_server	*home;
+	rad_listen_t	*listener;
+} proxy_hedge_t;
+
+static rbtree_t *proxy_hedges = NULL;
 #endif
 
 #ifdef HAVE_PTHREAD_H
@@ -213,6 +227,10 @@ STATE_MACHINE_DECL(proxy_running);
 static int process_proxy_reply(REQUEST *request);
 static void remove_from_proxy_hash(REQUEST *request);
 static void remove_from_proxy_hash_nl(REQUEST *request);
+static int proxy_hedge_time(REQUEST *request, struct timeval *when);
+static REQUEST *proxy_p2request(RADIUS_PACKET **proxy_p,
+				proxy_hedge_t **phedge);
+static void proxy_hedge_free_nl(REQUEST *request);
 static int insert_into_proxy_hash(REQUEST *request);
 #endif
 
@@ -717,6 +735,21 @@ static void request_process_timer(REQUEST *request)
 		tv_add(&when, request->delay);
 		request->delay += request->delay >> 1;
 
+#ifdef WITH_PROXY
+		/*
+		 *	Or in time to hedge a proxied request.
+		 */
+		if (request->process == proxy_wait_for_reply) {
+			struct timeval hedge;
+
+			if (proxy_hedge_time(request, &hedge) &&
+			    timercmp(&hedge, &when, <)) {
+				when = hedge;
+				if (timercmp(&when, &now, <)) when = now;
+			}
+		}
+#endif
+
 		STATE_MACHINE_TIMER(FR_ACTION_TIMER);
 		return;
 	}
@@ -1378,14 +1411,14 @@ int request_insert(rad_listen_t *listener, RADIUS_PACKET *packet,
 #endif
 
 #ifdef WITH_STATS
-	request->listener->stats.last_packet = request->packet->timestamp.tv_sec;
+	fr_stats_local(request->listener->stats)->last_packet = request->packet->timestamp.tv_sec;
 	if (packet->code == PW_AUTHENTICATION_REQUEST) {
-		request->client->auth.last_packet = request->packet->timestamp.tv_sec;
-		radius_auth_stats.last_packet = request->packet->timestamp.tv_sec;
+		fr_stats_local(request->client->auth)->last_packet = request->packet->timestamp.tv_sec;
+		fr_stats_local(radius_auth_stats)->last_packet = request->packet->timestamp.tv_sec;
 #ifdef WITH_ACCOUNTING
 	} else if (packet->code == PW_ACCOUNTING_REQUEST) {
-		request->client->acct.last_packet = request->packet->timestamp.tv_sec;
-		radius_acct_stats.last_packet = request->packet->timestamp.tv_sec;
+		fr_stats_local(request->client->acct)->last_packet = request->packet->timestamp.tv_sec;
+		fr_stats_local(radius_acct_stats)->last_packet = request->packet->timestamp.tv_sec;
 #endif
 	}
 #endif	/* WITH_STATS */
@@ -1460,7 +1493,36 @@ int request_insert(rad_listen_t *listener, RADIUS_PACKET *packet,
  ***********************************************************************/
 
 /*
- *	Timer function for all TCP sockets.
+ *	Check whether a home server still needs all of its sockets.
+ *	Returns 0 if this socket should be closed, otherwise the time
+ *	at which to check again.
+ */
+static time_t proxy_socket_spare(rad_listen_t *listener, time_t now)
+{
+	listen_socket_t *sock = listener->data;
+	home_server *home = sock->home;
+	time_t when;
+
+	PTHREAD_MUTEX_LOCK(&proxy_mutex);
+	when = home->sockets_busy + home->spare_timeout;
+	if ((home->limit.num_connections > 1) && (when <= now)) {
+		/*
+		 *	Close one socket per quiet period.
+		 */
+		home->sockets_busy = now;
+		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+		return 0;
+	}
+	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+
+	if (when <= now) when = now + home->spare_timeout;
+
+	return when;
+}
+
+/*
+ *	Timer function for all TCP sockets, and for UDP sockets
+ *	opened to a home server.
  */
 static void tcp_socket_timer(void *ctx)
 {
@@ -1469,12 +1531,24 @@ static void tcp_socket_timer(void *ctx)
 	struct timeval end, now;
 	char buffer[256];
 	fr_socket_limit_t *limit;
+	time_t spare = 0;
 
 	fr_event_now(el, &now);
 
 	switch (listener->type) {
 	case RAD_LISTEN_PROXY:
 		limit = &sock->home->limit;
+
+		if (sock->home->spare_timeout > 0) {
+			spare = proxy_socket_spare(listener, now.tv_sec);
+			if (!spare) {
+				listener->print(listener, buffer, sizeof(buffer));
+				DEBUG("Home server no longer needs socket %s", buffer);
+				listener->status = RAD_LISTEN_STATUS_CLOSED;
+				event_new_fd(listener);
+				return;
+			}
+		}
 		break;
 
 	case RAD_LISTEN_AUTH:
@@ -1489,7 +1563,7 @@ static void tcp_socket_timer(void *ctx)
 	/*
 	 *	If we enforce a lifetime, do it now.
 	 */
-	if (limit->lifetime > 0) {
+	if ((sock->proto == IPPROTO_TCP) && (limit->lifetime > 0)) {
 		end.tv_sec = sock->opened + limit->lifetime;
 		end.tv_usec = 0;
 
@@ -1511,7 +1585,7 @@ static void tcp_socket_timer(void *ctx)
 	/*
 	 *	Enforce an idle timeout.
 	 */
-	if (limit->idle_timeout > 0) {
+	if ((sock->proto == IPPROTO_TCP) && (limit->idle_timeout > 0)) {
 		struct timeval idle;
 
 		rad_assert(sock->last_packet != 0);
@@ -1532,6 +1606,12 @@ static void tcp_socket_timer(void *ctx)
 		}
 	}
 
+	/*
+	 *	Check again when the home server may have stopped
+	 *	needing this socket.
+	 */
+	if (spare && (spare < end.tv_sec)) end.tv_sec = spare;
+
 	/*
 	 *	Wake up at t + 0.5s.  The code above checks if the timers
 	 *	are <= t.  This addition gives us a bit of leeway.
@@ -1570,8 +1650,16 @@ static int disconnect_all_proxied_requests(void *ctx, void *data)
 	rad_listen_t *this = ctx;
 	RADIUS_PACKET **proxy_p = data;
 	REQUEST *request;
+	proxy_hedge_t *hedge;
 	
-	request = fr_packet2myptr(REQUEST, proxy, proxy_p);
+	request = proxy_p2request(proxy_p, &hedge);
+	if (hedge) {
+		if (hedge->packet->sockfd == this->fd) {
+			proxy_hedge_free_nl(request);
+		}
+		return 0;
+	}
+
 	if (request->proxy->sockfd != this->fd) return 0;
 
 	/*
@@ -1614,8 +1702,111 @@ static int remove_all_requests(void *ctx, void *data)
  *
  ***********************************************************************/
 
+static int proxy_hedge_cmp(const void *one, const void *two)
+{
+	const proxy_hedge_t *a = one;
+	const proxy_hedge_t *b = two;
+
+	if (a->packet < b->packet) return -1;
+	if (a->packet > b->packet) return +1;
+
+	return 0;
+}
+
+/*
+ *	Find the request for an entry in the proxy list.  The entry
+ *	is either request->proxy, or the packet of a hedge.
+ */
+static REQUEST *proxy_p2request(RADIUS_PACKET **proxy_p,
+				proxy_hedge_t **phedge)
+{
+	proxy_hedge_t myhedge;
+
+	*phedge = NULL;
+
+	if (rbtree_num_elements(proxy_hedges) > 0) {
+		myhedge.packet = *proxy_p;
+
+		*phedge = rbtree_finddata(proxy_hedges, &myhedge);
+		if (*phedge) return (*phedge)->request;
+	}
+
+	return fr_packet2myptr(REQUEST, proxy, proxy_p);
+}
+
+/*
+ *	Forget about the hedge, and release its Id.  Called with
+ *	the proxy mutex held.
+ */
+static void proxy_hedge_free_nl(REQUEST *request)
+{
+	proxy_hedge_t *hedge = request->hedge;
+
+	fr_packet_list_yank(proxy_list, hedge->packet);
+	fr_packet_list_id_free(proxy_list, hedge->packet);
+	rbtree_deletebydata(proxy_hedges, hedge);
+
+	if (hedge->home->currently_outstanding) {
+		hedge->home->currently_outstanding--;
+	}
+#ifdef WITH_TCP
+	hedge->listener->count--;
+#endif
+
+	rad_free(&hedge->packet);
+	free(hedge);
+	request->hedge = NULL;
+}
+
+/*
+ *	The home server we hedged to replied first.  Make it look
+ *	as if the request had been proxied there in the first
+ *	place, and release the Id used for the original.  Called
+ *	with the proxy mutex held.
+ */
+static void proxy_hedge_won_nl(REQUEST *request, const struct timeval *now)
+{
+	proxy_hedge_t *hedge = request->hedge;
+	RADIUS_PACKET *packet = request->proxy;
+
+	fr_packet_list_yank(proxy_list, packet);
+	fr_packet_list_id_free(proxy_list, packet);
+
+	if (request->home_server->currently_outstanding) {
+		request->home_server->currently_outstanding--;
+	}
+#ifdef WITH_TCP
+	request->proxy_listener->count--;
+#endif
+
+	/*
+	 *	The original home server hasn't replied yet, so it's
+	 *	at least this slow.
+	 */
+	home_server_response_time(request->home_server,
+				  &packet->timestamp, now);
+
+	fr_packet_list_yank(proxy_list, hedge->packet);
+	rbtree_deletebydata(proxy_hedges, hedge);
+
+	request->proxy = hedge->packet;
+	request->home_server = hedge->home;
+	request->proxy_listener = hedge->listener;
+	rad_free(&packet);
+
+	if (!fr_packet_list_insert(proxy_list, &request->proxy)) {
+		rad_panic("Failed inserting hedged request into the proxy list");
+	}
+
+	request->home_pool->hedge_wins++;
+	free(hedge);
+	request->hedge = NULL;
+}
+
 static void remove_from_proxy_hash_nl(REQUEST *request)
 {
+	if (request->hedge) proxy_hedge_free_nl(request);
+
 	fr_packet_list_yank(proxy_list, request->proxy);
 	fr_packet_list_id_free(proxy_list, request->proxy);
 
@@ -1680,10 +1871,80 @@ static void remove_from_proxy_hash(REQUEST *request)
   	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 }
 
+/*
+ *	Decide whether a home server needs another socket.  Each
+ *	socket carries at most 256 outstanding packets, so we open a
+ *	new one when the existing ones are 3/4 full, rather than
+ *	waiting for ID allocation to fail.  Sockets which are no
+ *	longer needed are closed by tcp_socket_timer().
+ *
+ *	Called with the proxy mutex held.
+ */
+static int proxy_socket_wanted(home_server *home, time_t now)
+{
+	int ids;
+
+	/*
+	 *	Home servers which are still using the "listen"
+	 *	proxy sockets get their own socket when those are
+	 *	full.
+	 */
+	if (home->limit.num_connections == 0) return FALSE;
+
+	ids = home->limit.num_connections * 256;
+
+	/*
+	 *	We couldn't do with one socket less.
+	 */
+	if ((home->currently_outstanding * 2) > (ids - 256)) {
+		home->sockets_busy = now;
+	}
+
+	if ((home->currently_outstanding * 4) < (ids * 3)) return FALSE;
+
+	if (home->socket_pending) return FALSE;
+
+#ifdef HAVE_PTHREAD_H
+	if (proxy_no_new_sockets) return FALSE;
+#endif
+
+	if ((home->limit.max_connections > 0) &&
+	    (home->limit.num_connections >= home->limit.max_connections)) {
+		return FALSE;
+	}
+
+	home->socket_pending = TRUE;
+	return TRUE;
+}
+
+/*
+ *	Open a spare socket to the home server.
+ */
+static void proxy_socket_open(REQUEST *request)
+{
+	rad_listen_t *this;
+	home_server *home = request->home_server;
+
+	RDEBUG3("proxy: Opening another socket to the home server");
+
+	PTHREAD_MUTEX_LOCK(&proxy_mutex);
+	this = proxy_new_listener(home, 0);
+	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+
+	if (this && !event_new_fd(this)) {
+		RDEBUG3("proxy: Failed inserting new socket into event loop");
+		listen_free(&this);
+	}
+
+	PTHREAD_MUTEX_LOCK(&proxy_mutex);
+	home->socket_pending = FALSE;
+	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+}
+
 static int insert_into_proxy_hash(REQUEST *request)
 {
 	char buf[128];
-	int rcode, tries;
+	int rcode, tries, open_socket;
 	void *proxy_listener;
 
 	rad_assert(request->proxy != NULL);
@@ -1716,7 +1977,7 @@ static int insert_into_proxy_hash(REQUEST *request)
 		RDEBUG3("proxy: Trying to open a new listener to the home server");
 		this = proxy_new_listener(request->home_server, 0);
 		if (!this) {
-			PTHREAD_MUTEX_LOCK(&proxy_mutex);
+			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 			radlog(L_ERR, "proxy: Failed to create a new outbound socket");
 			return 0;
 		}
@@ -1767,8 +2028,24 @@ static int insert_into_proxy_hash(REQUEST *request)
 	request->proxy_listener->count++;
 #endif
 
+	/*
+	 *	Every request sent through a hedging pool earns a
+	 *	fraction of a hedge, up to a burst of 10.
+	 */
+	if (request->home_pool && request->home_pool->hedge_max) {
+		request->home_pool->hedge_credit += request->home_pool->hedge_max;
+		if (request->home_pool->hedge_credit > 1000) {
+			request->home_pool->hedge_credit = 1000;
+		}
+	}
+
+	open_socket = proxy_socket_wanted(request->home_server,
+					  request->timestamp);
+
 	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 
+	if (open_socket) proxy_socket_open(request);
+
 	RDEBUG3(" proxy: allocating destination %s port %d - Id %d",
 	       inet_ntop(request->proxy->dst_ipaddr.af,
 			 &request->proxy->dst_ipaddr.ipaddr, buf, sizeof(buf)),
@@ -1778,6 +2055,141 @@ static int insert_into_proxy_hash(REQUEST *request)
 	return 1;
 }
 
+/*
+ *	When to send a copy of the request to another home server,
+ *	if at all.
+ */
+static int proxy_hedge_time(REQUEST *request, struct timeval *when)
+{
+	int delay;
+
+	if (!request->home_pool || !request->home_pool->hedge_factor) {
+		return FALSE;
+	}
+
+	if (request->hedge || request->proxy_reply ||
+	    !request->in_proxy_hash ||
+	    (request->packet->code != PW_AUTHENTICATION_REQUEST) ||
+	    (request->proxy->timestamp.tv_sec == 0)) {
+		return FALSE;
+	}
+
+	/*
+	 *	A State attribute ties the request to the home server
+	 *	which issued it, e.g. EAP, or challenge / response.
+	 *	Any other home server would quickly reject it, and
+	 *	that reject would win.
+	 *
+	 *	The first EAP request has no State, but the State in
+	 *	the reply would come from whichever home server won.
+	 *	The next request goes through the pool as usual, and
+	 *	may be sent to the other one.
+	 */
+	if (pairfind(request->proxy->vps, PW_STATE, 0, TAG_ANY) ||
+	    pairfind(request->proxy->vps, PW_EAP_MESSAGE, 0, TAG_ANY)) {
+		return FALSE;
+	}
+
+	delay = home_server_hedge_delay(request->home_pool,
+					request->home_server);
+	if (!delay) return FALSE;
+
+	*when = request->proxy->timestamp;
+	tv_add(when, delay);
+
+	return TRUE;
+}
+
+/*
+ *	Send a copy of the request to the next live home server in
+ *	the pool.  Whichever replies first is used.
+ */
+static void proxy_hedge_send(REQUEST *request, const struct timeval *now)
+{
+	home_pool_t *pool = request->home_pool;
+	home_server *home;
+	proxy_hedge_t *hedge;
+	void *listener = NULL;
+	char buffer[128];
+
+	ASSERT_MASTER;
+
+	home = home_server_hedge(pool, request->home_server, request);
+	if (!home) {
+		RDEBUG2("No other home server to hedge the request to");
+		return;
+	}
+
+	hedge = rad_malloc(sizeof(*hedge));
+	memset(hedge, 0, sizeof(*hedge));
+	hedge->request = request;
+	hedge->home = home;
+
+	hedge->packet = rad_alloc(request, TRUE);
+	hedge->packet->code = request->proxy->code;
+	hedge->packet->vps = paircopy(hedge->packet, request->proxy->vps);
+	hedge->packet->src_ipaddr = home->src_ipaddr;
+	hedge->packet->dst_ipaddr = home->ipaddr;
+	hedge->packet->dst_port = home->port;
+
+	PTHREAD_MUTEX_LOCK(&proxy_mutex);
+	if (!request->in_proxy_hash) goto unlock;
+
+	if (pool->hedge_credit < 100) {
+		RDEBUG2("Not hedging the request: too many requests have been hedged");
+		goto unlock;
+	}
+
+	if (!fr_packet_list_id_alloc(proxy_list, home->proto,
+				     hedge->packet, &listener)) {
+		RDEBUG2("Failed allocating Id for hedged request: %s",
+			fr_strerror());
+		goto unlock;
+	}
+
+	if (!fr_packet_list_insert(proxy_list, &hedge->packet)) {
+		fr_packet_list_id_free(proxy_list, hedge->packet);
+		goto unlock;
+	}
+
+	hedge->listener = listener;
+	rbtree_insert(proxy_hedges, hedge);
+	request->hedge = hedge;
+
+	home->currently_outstanding++;
+#ifdef WITH_TCP
+	hedge->listener->count++;
+#endif
+	pool->hedge_credit -= 100;
+	pool->hedges++;
+
+	RDEBUG2("Hedging request to home server %s port %d - ID: %d",
+		inet_ntop(hedge->packet->dst_ipaddr.af,
+			  &hedge->packet->dst_ipaddr.ipaddr,
+			  buffer, sizeof(buffer)),
+		hedge->packet->dst_port, hedge->packet->id);
+
+	hedge->packet->timestamp = *now;
+	home->last_packet_sent = now->tv_sec;
+	FR_STATS_TYPE_INC(home->stats, total_requests);
+
+	/*
+	 *	Send it while the packet is still in the proxy list,
+	 *	so that a reply can't free it first.
+	 */
+	if (rad_send(hedge->packet, NULL, home->secret) < 0) {
+		radlog_request(L_ERR, 0, request, "Failed sending hedged request: %s",
+			       fr_strerror());
+	}
+	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	return;
+
+unlock:
+	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	rad_free(&hedge->packet);
+	free(hedge);
+}
+
 static int process_proxy_reply(REQUEST *request)
 {
 	int rcode;
@@ -1883,6 +2295,7 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 {
 	RADIUS_PACKET **proxy_p;
 	REQUEST *request;
+	proxy_hedge_t *hedge;
 	struct timeval now;
 	char buffer[128];
 
@@ -1899,9 +2312,28 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 		return 0;
 	}
 
-	request = fr_packet2myptr(REQUEST, proxy, proxy_p);
+	request = proxy_p2request(proxy_p, &hedge);
 	request->num_proxied_responses++; /* needs to be protected by lock */
 
+	/*
+	 *	A reply to the copy we sent to another home server.
+	 *	If it's the first reply, use it instead of the
+	 *	original.
+	 */
+	if (hedge) {
+		if (request->proxy_reply ||
+		    (rad_verify(packet, hedge->packet,
+				hedge->home->secret) != 0)) {
+			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+			DEBUG("Ignoring reply to hedged request");
+			return 0;
+		}
+
+		RDEBUG2("Using reply to hedged request");
+		gettimeofday(&now, NULL);
+		proxy_hedge_won_nl(request, &now);
+	}
+
 	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 
 	/*
@@ -1962,6 +2394,21 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	packet->timestamp = now;
 	request->priority = RAD_LISTEN_PROXY;
 
+	/*
+	 *	The original request won: release the Id of the
+	 *	hedged copy.
+	 */
+	if (request->hedge) {
+		PTHREAD_MUTEX_LOCK(&proxy_mutex);
+		if (request->hedge) proxy_hedge_free_nl(request);
+		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	}
+
+	if (request->proxy->code != PW_STATUS_SERVER) {
+		home_server_response_time(request->home_server,
+					  &request->proxy->timestamp, &now);
+	}
+
 	/*
 	 *	We've received a reply.  If we hadn't been sending it
 	 *	packets for a while, just mark it alive.
@@ -1971,14 +2418,14 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	}
 
 #ifdef WITH_STATS
-	request->home_server->stats.last_packet = packet->timestamp.tv_sec;
-	request->proxy_listener->stats.last_packet = packet->timestamp.tv_sec;
+	fr_stats_local(request->home_server->stats)->last_packet = packet->timestamp.tv_sec;
+	fr_stats_local(request->proxy_listener->stats)->last_packet = packet->timestamp.tv_sec;
 
 	if (request->proxy->code == PW_AUTHENTICATION_REQUEST) {
-		proxy_auth_stats.last_packet = packet->timestamp.tv_sec;
+		fr_stats_local(proxy_auth_stats)->last_packet = packet->timestamp.tv_sec;
 #ifdef WITH_ACCOUNTING
 	} else if (request->proxy->code == PW_ACCOUNTING_REQUEST) {
-		proxy_acct_stats.last_packet = packet->timestamp.tv_sec;
+		fr_stats_local(proxy_acct_stats)->last_packet = packet->timestamp.tv_sec;
 #endif
 	}
 #endif	/* WITH_STATS */
@@ -2383,7 +2830,7 @@ static int request_proxy(REQUEST *request, int retransmit)
 #ifdef HAVE_PTHREAD_H
 	request->child_pid = NO_SUCH_CHILD_PID;
 #endif
-	FR_STATS_TYPE_INC(request->home_server->stats.total_requests);
+	FR_STATS_TYPE_INC(request->home_server->stats, total_requests);
 	request->proxy_listener->send(request->proxy_listener,
 				      request);
 	return 1;
@@ -2899,13 +3346,34 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 
 		rad_assert(request->proxy_listener != NULL);;
 		DEBUG_PACKET(request, request->proxy, 1);
-		FR_STATS_TYPE_INC(home->stats.total_requests);
+		FR_STATS_TYPE_INC(home->stats, total_requests);
 		home->last_packet_sent = now.tv_sec;
 		request->proxy_listener->send(request->proxy_listener,
 					      request);
 		break;
 
 	case FR_ACTION_TIMER:
+		/*
+		 *	If the home server is slower than usual, send a
+		 *	copy of the request to another one.
+		 */
+		if (proxy_hedge_time(request, &when)) {
+			if (timercmp(&when, &now, <=)) {
+				proxy_hedge_send(request, &now);
+
+			} else {
+				struct timeval window;
+
+				window = request->proxy->timestamp;
+				window.tv_sec += home->response_window;
+
+				if (timercmp(&when, &window, <)) {
+					STATE_MACHINE_TIMER(FR_ACTION_TIMER);
+					return;
+				}
+			}
+		}
+
 		/*
 		 *	Wake up "response_window" time in the future.
 		 *	i.e. when MY packet hasn't received a response.
@@ -2950,15 +3418,18 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 			mark_home_server_zombie(home);
 		}
 
-		FR_STATS_TYPE_INC(home->stats.total_timeouts);
+		home_server_response_time(home, &request->proxy->timestamp,
+					  &now);
+
+		FR_STATS_TYPE_INC(home->stats, total_timeouts);
 		if (home->type == HOME_TYPE_AUTH) {
-			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
-			FR_STATS_TYPE_INC(proxy_auth_stats.total_timeouts);
+			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats, total_timeouts);
+			FR_STATS_TYPE_INC(proxy_auth_stats, total_timeouts);
 		}
 #ifdef WITH_ACCT
 		else if (home->type == HOME_TYPE_ACCT) {
-			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
-			FR_STATS_TYPE_INC(proxy_acct_stats.total_timeouts);
+			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats, total_timeouts);
+			FR_STATS_TYPE_INC(proxy_acct_stats, total_timeouts);
 		}
 #endif
 
@@ -3213,7 +3684,7 @@ static void request_coa_originate(REQUEST *request)
 #endif
 	coa->child_state = REQUEST_ACTIVE;
 	rad_assert(coa->proxy_reply == NULL);
-	FR_STATS_TYPE_INC(coa->home_server->stats.total_requests);
+	FR_STATS_TYPE_INC(coa->home_server->stats, total_requests);
 	coa->home_server->last_packet_sent = coa->proxy->timestamp.tv_sec;
 	coa->proxy_listener->send(coa->proxy_listener, coa);
 }
@@ -3345,7 +3816,7 @@ static void request_coa_timer(REQUEST *request)
 
 	request->num_coa_requests++; /* is NOT reset by code 3 lines above! */
 
-	FR_STATS_TYPE_INC(request->home_server->stats.total_requests);
+	FR_STATS_TYPE_INC(request->home_server->stats, total_requests);
 
 	/*
 	 *	Status servers don't count as real packets sent.
@@ -3489,6 +3960,20 @@ static void event_poll_detail(void *ctx)
 		exit(1);
 	}
 }
+
+/*
+ *	A file has appeared in the directory.  Look for it now,
+ *	instead of waiting for the next poll.
+ */
+static void event_detail_watch(UNUSED fr_event_list_t *xel, UNUSED int fd,
+			       void *ctx)
+{
+	rad_listen_t *this = ctx;
+
+	if (!detail_watch(this)) return;
+
+	event_poll_detail(this);
+}
 #endif
 
 static void event_status(struct timeval *wake)
@@ -3583,13 +4068,16 @@ int event_new_fd(rad_listen_t *this)
 
 			if (sock->home) {
 				sock->home->limit.num_connections++;
+				sock->home->sockets_busy = time(NULL);
 				
 #ifdef HAVE_PTHREAD_H
 				/*
 				 *	If necessary, add it to the list of
 				 *	new proxy listeners.
 				 */
-				if (sock->home->limit.lifetime || sock->home->limit.idle_timeout) {
+				if (sock->home->limit.lifetime ||
+				    sock->home->limit.idle_timeout ||
+				    sock->home->spare_timeout) {
 					this->next = proxy_listener_list;
 					proxy_listener_list = this;
 				}
@@ -3605,7 +4093,9 @@ int event_new_fd(rad_listen_t *this)
 			 *	contention.
 			 */
 			if (sock->home) {
-				if (sock->home->limit.lifetime || sock->home->limit.idle_timeout) {
+				if (sock->home->limit.lifetime ||
+				    sock->home->limit.idle_timeout ||
+				    sock->home->spare_timeout) {
 					radius_signal_self(RADIUS_SIGNAL_SELF_NEW_FD);
 				}
 			}
@@ -3618,12 +4108,27 @@ int event_new_fd(rad_listen_t *this)
 		 *	put into the socket event loop.
 		 */
 		if (this->type == RAD_LISTEN_DETAIL) {
+			listen_detail_t *detail = this->data;
+
 			this->status = RAD_LISTEN_STATUS_KNOWN;
 			
 			/*
 			 *	Set up the first poll interval.
 			 */
 			event_poll_detail(this);
+
+			/*
+			 *	The directory may be watched, too.
+			 */
+			if (detail->watch_fd >= 0) {
+				FD_MUTEX_LOCK(&fd_mutex);
+				if (!fr_event_fd_insert(el, 0, detail->watch_fd,
+							event_detail_watch, this)) {
+					radlog(L_ERR, "Failed adding event handler for detail file directory");
+					exit(1);
+				}
+				FD_MUTEX_UNLOCK(&fd_mutex);
+			}
 			return 1;
 		}
 #endif
@@ -3968,11 +4473,10 @@ static void handle_signal_self(int flag)
 			rad_listen_t *this = proxy_listener_list;
 			listen_socket_t *sock = this->data;
 
-			rad_assert(sock->proto == IPPROTO_TCP);
 			proxy_listener_list = this->next;
 			this->next = NULL;
 
-			if (!sock->home) continue; /* skip UDP sockets */
+			if (!sock->home) continue; /* skip "listen" sockets */
 
 			when = now;
 
@@ -3981,7 +4485,9 @@ static void handle_signal_self(int flag)
 			 *	proxy_listener_list if they have limits.
 			 *	
 			 */
-			rad_assert(sock->home->limit.lifetime || sock->home->limit.idle_timeout);
+			rad_assert(sock->home->limit.lifetime ||
+				   sock->home->limit.idle_timeout ||
+				   sock->home->spare_timeout);
 
 			if (!fr_event_insert(el, tcp_socket_timer, this, &when,
 					     &(sock->ev))) {
@@ -4084,6 +4590,9 @@ int radius_event_init(CONF_SECTION *cs, int have_children)
 		proxy_list = fr_packet_list_create(1);
 		if (!proxy_list) return 0;
 
+		proxy_hedges = rbtree_create(proxy_hedge_cmp, NULL, 0);
+		if (!proxy_hedges) return 0;
+
 #ifdef HAVE_PTHREAD_H
 		if (pthread_mutex_init(&proxy_mutex, NULL) != 0) {
 			radlog(L_ERR, "FATAL: Failed to initialize proxy mutex: %s",
@@ -4199,7 +4708,13 @@ static int request_hash_cb(UNUSED void *ctx, void *data)
 #ifdef WITH_PROXY
 static int proxy_hash_cb(UNUSED void *ctx, void *data)
 {
-	REQUEST *request = fr_packet2myptr(REQUEST, proxy, data);
+	proxy_hedge_t *hedge;
+	REQUEST *request = proxy_p2request(data, &hedge);
+
+	/*
+	 *	Hedges are cleaned up with their request.
+	 */
+	if (hedge) return 0;
 
 	request_done(request, FR_ACTION_DONE);
 
@@ -4225,6 +4740,9 @@ void radius_event_free(void)
 		fr_packet_list_walk(proxy_list, NULL, proxy_hash_cb);
 		fr_packet_list_free(proxy_list);
 		proxy_list = NULL;
+
+		rbtree_free(proxy_hedges);
+		proxy_hedges = NULL;
 	}
 #endif
 
@@ -0,0 +1,377 @@
+/*
+ * raddetail.c	Convert detail files between text and binary.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2013  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/conf.h>
+#include <freeradius-devel/radpaths.h>
+
+#include <ctype.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+static const char *progname = "raddetail";
+
+static int records = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "Usage: %s [ -d raddb_dir ] [ -b | -t ] [ -x ] [ input [ output ] ]\n", progname);
+	fprintf(stderr, "  -d raddb_dir    Read the dictionaries from raddb_dir.\n");
+	fprintf(stderr, "  -b              Convert a text detail file to binary.\n");
+	fprintf(stderr, "  -t              Convert a binary detail file to text.\n");
+	fprintf(stderr, "  -x              Debugging mode.\n");
+	fprintf(stderr, "The input and output default to stdin and stdout.  Without -b or -t,\n");
+	fprintf(stderr, "the input is converted to the other format.\n");
+
+	exit(1);
+}
+
+/*
+ *	Read the whole input into memory.
+ */
+static uint8_t *read_file(FILE *fp, size_t *plen)
+{
+	uint8_t	*data = NULL, *p;
+	size_t	len = 0, size = 0, got;
+
+	while (1) {
+		if ((size - len) < 65536) {
+			size = size ? (size * 2) : 1024 * 1024;
+			p = realloc(data, size);
+			if (!p) {
+				fprintf(stderr, "%s: Out of memory\n", progname);
+				exit(1);
+			}
+			data = p;
+		}
+
+		got = fread(data + len, 1, size - len, fp);
+		len += got;
+		if (got == 0) break;
+	}
+
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: Failed reading input: %s\n",
+			progname, strerror(errno));
+		exit(1);
+	}
+
+	*plen = len;
+	return data;
+}
+
+static void write_binary(FILE *out, fr_detail_hdr_t *hdr, VALUE_PAIR *vps)
+{
+	uint8_t	data[FR_DETAIL_HDR_LEN + FR_DETAIL_MAX_LEN];
+	ssize_t	len;
+
+	len = fr_detail_encode(data, sizeof(data), hdr, vps);
+	if (len < 0) {
+		fprintf(stderr, "%s: Failed encoding record %d: %s\n",
+			progname, records + 1, fr_strerror());
+		exit(1);
+	}
+
+	if (fwrite(data, len, 1, out) != 1) {
+		fprintf(stderr, "%s: Failed writing output: %s\n",
+			progname, strerror(errno));
+		exit(1);
+	}
+
+	records++;
+}
+
+/*
+ *	Text to binary.  The special lines are the same ones the
+ *	detail file reader looks for.
+ */
+static void text2binary(const char *data, size_t len, FILE *out)
+{
+	const char	*line, *next, *end;
+	size_t		linelen;
+	int		lineno = 0, reading = FALSE;
+	long		timestamp;
+	char		buffer[2048];
+	fr_detail_hdr_t	hdr;
+	VALUE_PAIR	*vps = NULL, *vp, *next_vp;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.code = PW_ACCOUNTING_REQUEST;
+
+	end = data + len;
+	for (line = data; line < end; line = next) {
+		next = memchr(line, '\n', end - line);
+		if (!next) next = end;
+		linelen = next - line;
+		if (next < end) next++;
+		lineno++;
+
+		/*
+		 *	End of a record.
+		 */
+		if (linelen == 0) {
+			if (reading) {
+				write_binary(out, &hdr, vps);
+				pairfree(&vps);
+				memset(&hdr, 0, sizeof(hdr));
+				hdr.code = PW_ACCOUNTING_REQUEST;
+				reading = FALSE;
+			}
+			continue;
+		}
+
+		/*
+		 *	The header is the only line which doesn't
+		 *	start with white space.
+		 */
+		if (!reading) {
+			if (!isspace((int) line[0])) reading = TRUE;
+			continue;
+		}
+
+		if ((linelen >= 5) && (memcmp(line, "\tDone", 5) == 0)) {
+			hdr.done = TRUE;
+			continue;
+		}
+
+		if (linelen >= sizeof(buffer)) {
+			fprintf(stderr, "%s: Line %d is too long\n",
+				progname, lineno);
+			exit(1);
+		}
+		memcpy(buffer, line, linelen);
+		buffer[linelen] = '\0';
+
+		if (sscanf(buffer, " Timestamp = %ld", &timestamp) == 1) {
+			hdr.timestamp = timestamp;
+			continue;
+		}
+
+		if (strncmp(buffer, "\tRequest-Authenticator ", 23) == 0) continue;
+
+		vp = NULL;
+		if ((userparse(buffer, &vp) == T_OP_INVALID) || !vp) {
+			fprintf(stderr, "%s: Skipping line %d: %s\n",
+				progname, lineno, fr_strerror());
+			continue;
+		}
+
+		while (vp) {
+			next_vp = vp->next;
+			vp->next = NULL;
+
+			/*
+			 *	These go into the record header.
+			 */
+			if (!vp->da->vendor && (vp->da->attr == PW_PACKET_TYPE)) {
+				hdr.code = vp->vp_integer;
+				pairfree(&vp);
+
+			} else if (!vp->da->vendor &&
+				   (vp->da->attr == PW_CLIENT_IP_ADDRESS)) {
+				hdr.client_ip.af = AF_INET;
+				hdr.client_ip.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+				pairfree(&vp);
+
+			} else {
+				/*
+				 *	We can't expand xlat's here, so
+				 *	they're kept as literal strings.
+				 */
+				if (vp->type == VT_XLAT) {
+					pairparsevalue(vp, vp->value.xlat);
+				}
+				pairadd(&vps, vp);
+			}
+
+			vp = next_vp;
+		}
+	}
+
+	/*
+	 *	The last record may be missing the blank line after
+	 *	it.
+	 */
+	if (reading && vps) write_binary(out, &hdr, vps);
+	pairfree(&vps);
+}
+
+/*
+ *	Binary to text, in the format rlm_detail writes.
+ */
+static void binary2text(const uint8_t *data, size_t len, FILE *out)
+{
+	const uint8_t	*p, *end;
+	ssize_t		rcode;
+	fr_detail_hdr_t	hdr;
+	VALUE_PAIR	*vps, *vp;
+	char		buffer[128];
+	time_t		when;
+	struct tm	tm;
+
+	end = data + len;
+	for (p = data; p < end; p += rcode) {
+		rcode = fr_detail_decode_hdr(p, end - p, &hdr);
+		if (rcode <= 0) {
+			fprintf(stderr, "%s: Bad record at offset %lu: %s\n",
+				progname, (unsigned long) (p - data),
+				(rcode == 0) ? "Truncated record" : fr_strerror());
+			exit(1);
+		}
+
+		vps = NULL;
+		if (fr_detail_decode(p, &hdr, &vps) < 0) {
+			fprintf(stderr, "%s: Bad record at offset %lu: %s\n",
+				progname, (unsigned long) (p - data),
+				fr_strerror());
+			exit(1);
+		}
+
+		when = hdr.timestamp;
+		localtime_r(&when, &tm);
+		strftime(buffer, sizeof(buffer), "%a %b %e %H:%M:%S %Y", &tm);
+		fprintf(out, "%s\n", buffer);
+
+		if (hdr.done) fprintf(out, "\tDone\n");
+
+		if (hdr.code != PW_ACCOUNTING_REQUEST) {
+			if ((hdr.code > 0) && (hdr.code < FR_MAX_PACKET_CODE)) {
+				fprintf(out, "\tPacket-Type = %s\n",
+					fr_packet_codes[hdr.code]);
+			} else {
+				fprintf(out, "\tPacket-Type = %d\n", hdr.code);
+			}
+		}
+
+		for (vp = vps; vp != NULL; vp = vp->next) {
+			vp_print(out, vp);
+		}
+		pairfree(&vps);
+
+		/*
+		 *	The detail file reader only understands IPv4
+		 *	client addresses.
+		 */
+		if (hdr.client_ip.af == AF_INET) {
+			fprintf(out, "\tClient-IP-Address = %s\n",
+				inet_ntop(AF_INET, &hdr.client_ip.ipaddr.ip4addr,
+					  buffer, sizeof(buffer)));
+		}
+
+		fprintf(out, "\tTimestamp = %ld\n\n", (long) hdr.timestamp);
+		records++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	int		mode = 0;
+	const char	*radius_dir = RADDBDIR;
+	FILE		*in = stdin, *out = stdout;
+	uint8_t		*data;
+	size_t		len;
+
+	if ((progname = strrchr(argv[0], FR_DIR_SEP)) == NULL)
+		progname = argv[0];
+	else
+		progname++;
+
+	while ((c = getopt(argc, argv, "bd:htx")) != EOF) switch(c) {
+		case 'b':
+		case 't':
+			mode = c;
+			break;
+		case 'd':
+			radius_dir = optarg;
+			break;
+		case 'x':
+			fr_debug_flag++;
+			break;
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 2) usage();
+
+	if (dict_init(radius_dir, RADIUS_DICTIONARY) < 0) {
+		fr_perror("%s", progname);
+		return 1;
+	}
+
+	if ((argc > 0) && (strcmp(argv[0], "-") != 0)) {
+		in = fopen(argv[0], "r");
+		if (!in) {
+			fprintf(stderr, "%s: Failed opening %s: %s\n",
+				progname, argv[0], strerror(errno));
+			return 1;
+		}
+	}
+
+	data = read_file(in, &len);
+	if (in != stdin) fclose(in);
+
+	if (!mode) mode = fr_detail_is_binary(data, len) ? 't' : 'b';
+
+	if ((argc > 1) && (strcmp(argv[1], "-") != 0)) {
+		out = fopen(argv[1], "w");
+		if (!out) {
+			fprintf(stderr, "%s: Failed opening %s: %s\n",
+				progname, argv[1], strerror(errno));
+			return 1;
+		}
+	}
+
+	if (mode == 'b') {
+		if (fr_detail_is_binary(data, len)) {
+			fprintf(stderr, "%s: Input is already binary\n", progname);
+			return 1;
+		}
+		text2binary((const char *) data, len, out);
+	} else {
+		if (len && !fr_detail_is_binary(data, len)) {
+			fprintf(stderr, "%s: Input is not binary\n", progname);
+			return 1;
+		}
+		binary2text(data, len, out);
+	}
+
+	if (fclose(out) != 0) {
+		fprintf(stderr, "%s: Failed writing output: %s\n",
+			progname, strerror(errno));
+		return 1;
+	}
+
+	free(data);
+
+	if (fr_debug_flag) fprintf(stderr, "%s: Converted %d records\n",
+				   progname, records);
+
+	return 0;
+}
@@ -515,6 +515,10 @@ int main(int argc, char *argv[])
 	 *	Free the configuration items.
 	 */
 	free_mainconfig();
+
+#ifdef HAVE_REGEX_H
+	regex_cache_free();
+#endif
 	
 	rad_const_free(radius_dir);
 		
@@ -179,26 +179,6 @@ static void sort(RADIUS_PACKET *packet)
 	vp->next = NULL;
 }
 
-#define USEC 1000000
-static void tv_sub(const struct timeval *end, const struct timeval *start,
-		   struct timeval *elapsed)
-{
-	elapsed->tv_sec = end->tv_sec - start->tv_sec;
-	if (elapsed->tv_sec > 0) {
-		elapsed->tv_sec--;
-		elapsed->tv_usec = USEC;
-	} else {
-		elapsed->tv_usec = 0;
-	}
-	elapsed->tv_usec += end->tv_usec;
-	elapsed->tv_usec -= start->tv_usec;
-	
-	if (elapsed->tv_usec >= USEC) {
-		elapsed->tv_usec -= USEC;
-		elapsed->tv_sec++;
-	}
-}
-
 static void got_packet(UNUSED uint8_t *args, const struct pcap_pkthdr *header, const uint8_t *data)
 {
 
@@ -328,7 +308,7 @@ static void got_packet(UNUSED uint8_t *args, const struct pcap_pkthdr *header, c
 		start_pcap = header->ts;
 	}
 
-	tv_sub(&header->ts, &start_pcap, &elapsed);
+	fr_tv_sub(&header->ts, &start_pcap, &elapsed);
 
 	INFO(log_dst, "\t+%u.%03u", (unsigned int) elapsed.tv_sec,
 	       (unsigned int) elapsed.tv_usec / 1000);
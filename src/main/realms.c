@@ -58,9 +58,32 @@ RCSID("$Id$")
 
 static rbtree_t *realms_byname = NULL;
 
+/*
+ *	Realms named "*.example.com" match any name which ends in
+ *	".example.com".  They are indexed by their labels, last label
+ *	first, so that finding the longest matching suffix is one walk
+ *	down the tree, no matter how many such realms there are.
+ *
+ *	The index is built by realms_init() once all of the realms
+ *	have been read.  Realms aren't re-read on HUP, so the index is
+ *	never changed afterwards, and lookups don't lock.
+ */
+typedef struct realm_label_t {
+	const char	*label;
+	size_t		len;
+	REALM		*wildcard;	//!< Realm for "*." + the labels to here.
+	int		num_children;
+	struct realm_label_t **children; //!< Sorted by label.
+} realm_label_t;
+
+static realm_label_t *realms_suffix = NULL;
+
+#define REALM_IS_WILDCARD(_name) ((_name[0] == '*') && (_name[1] == '.'))
+
 #ifdef HAVE_REGEX_H
 typedef struct realm_regex_t {
 	REALM	*realm;
+	regex_t	reg;		//!< Compiled once, when the realm is added.
 	struct realm_regex_t *next;
 } realm_regex_t;
 
@@ -131,6 +154,9 @@ static void home_server_free(void *data)
 {
 	home_server *home = data;
 
+#ifdef WITH_STATS
+	fr_stats_free(home->stats);
+#endif
 	free(home);
 }
 
@@ -280,12 +306,16 @@ void realms_free(void)
 	rbtree_free(realms_byname);
 	realms_byname = NULL;
 
+	talloc_free(realms_suffix);
+	realms_suffix = NULL;
+
 #ifdef HAVE_REGEX_H
 	if (realms_regex) {
 		realm_regex_t *this, *next;
 
 		for (this = realms_regex; this != NULL; this = next) {
 			next = this->next;
+			regfree(&this->reg);
 			free(this->realm);
 			free(this);
 		}
@@ -312,6 +342,9 @@ static CONF_PARSER limit_config[] = {
 	{ "idle_timeout", PW_TYPE_INTEGER,
 	  offsetof(home_server, limit.idle_timeout), NULL,   "0" },
 
+	{ "spare_timeout", PW_TYPE_INTEGER,
+	  offsetof(home_server, spare_timeout), NULL,   "60" },
+
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
@@ -369,6 +402,8 @@ static CONF_PARSER home_server_config[] = {
 	  offsetof(home_server,response_window), NULL,   "30" },
 	{ "max_outstanding", PW_TYPE_INTEGER,
 	  offsetof(home_server,max_outstanding), NULL,   "65536" },
+	{ "weight", PW_TYPE_INTEGER,
+	  offsetof(home_server,weight), NULL,   "1" },
 
 	{ "zombie_period", PW_TYPE_INTEGER,
 	  offsetof(home_server,zombie_period), NULL,   "40" },
@@ -433,6 +468,9 @@ static int home_server_add(realm_config_t *rc, CONF_SECTION *cs)
 	memset(home, 0, sizeof(*home));
 
 	home->name = name2;
+#ifdef WITH_STATS
+	home->stats = fr_stats_alloc();
+#endif
 	home->cs = cs;
 	home->state = HOME_STATE_UNKNOWN;
 
@@ -741,6 +779,10 @@ static int home_server_add(realm_config_t *rc, CONF_SECTION *cs)
 	if (home->max_outstanding < 8) home->max_outstanding = 8;
 	if (home->max_outstanding > 65536*16) home->max_outstanding = 65536*16;
 
+	if (home->weight < 1) home->weight = 1;
+	if (home->weight > 100) home->weight = 100;
+	home->name_hash = fr_hash_string(home->name);
+
 	if (home->ping_interval < 6) home->ping_interval = 6;
 	if (home->ping_interval > 120) home->ping_interval = 120;
 
@@ -780,13 +822,6 @@ static int home_server_add(realm_config_t *rc, CONF_SECTION *cs)
 
 	if (home->limit.max_connections > 1024) home->limit.max_connections = 1024;
 
-#ifdef WITH_TCP
-	/*
-	 *	UDP sockets can't be connection limited.
-	 */
-	if (home->proto != IPPROTO_TCP) home->limit.max_connections = 0;
-#endif
-
 	if ((home->limit.idle_timeout > 0) && (home->limit.idle_timeout < 5))
 		home->limit.idle_timeout = 5;
 	if ((home->limit.lifetime > 0) && (home->limit.lifetime < 5))
@@ -794,6 +829,9 @@ static int home_server_add(realm_config_t *rc, CONF_SECTION *cs)
 	if ((home->limit.lifetime > 0) && (home->limit.idle_timeout > home->limit.lifetime))
 		home->limit.idle_timeout = 0;
 
+	if ((home->spare_timeout > 0) && (home->spare_timeout < 5))
+		home->spare_timeout = 5;
+
 	tls = cf_item_parent(cf_sectiontoitem(cs));
 	if (strcmp(cf_section_name1(tls), "server") == 0) {
 		home->parent_server = cf_section_name2(tls);
@@ -803,6 +841,9 @@ static int home_server_add(realm_config_t *rc, CONF_SECTION *cs)
 		home_server *home2 = rad_malloc(sizeof(*home2));
 
 		memcpy(home2, home, sizeof(*home2));
+#ifdef WITH_STATS
+		home2->stats = fr_stats_alloc();
+#endif
 
 		home2->type = HOME_TYPE_ACCT;
 		home2->port++;
@@ -921,7 +962,7 @@ static int server_pool_add(realm_config_t *rc,
 	home_pool_t *pool = NULL;
 	const char *value;
 	CONF_PAIR *cp;
-	int num_home_servers;
+	int i, num_home_servers;
 	home_server *home;
 
 	name2 = cf_section_name1(cs);
@@ -1003,6 +1044,8 @@ static int server_pool_add(realm_config_t *rc,
 			{ "client-balance", HOME_POOL_CLIENT_BALANCE },
 			{ "client-port-balance", HOME_POOL_CLIENT_PORT_BALANCE },
 			{ "keyed-balance", HOME_POOL_KEYED_BALANCE },
+			{ "rendezvous-balance", HOME_POOL_RENDEZVOUS_BALANCE },
+			{ "least-latency", HOME_POOL_LEAST_LATENCY },
 			{ NULL, 0 }
 		};
 
@@ -1045,6 +1088,68 @@ static int server_pool_add(realm_config_t *rc,
 
 	}
 
+	cp = cf_pair_find(cs, "hedge_percentile");
+	if (cp) {
+		/*
+		 *	Multiples of the mean deviation which cover
+		 *	the given percentile of a normal distribution.
+		 */
+		static const int hedge_factors[][2] = {
+			{ 50, 0 }, { 60, 32 }, { 70, 66 }, { 75, 84 },
+			{ 80, 105 }, { 85, 130 }, { 90, 160 },
+			{ 95, 206 }, { 98, 257 }, { 99, 291 },
+			{ 0, 0 }
+		};
+
+		value = cf_pair_value(cp);
+		if (!value) {
+			cf_log_err_cp(cp, "No value given for hedge_percentile");
+			goto error;
+		}
+
+		pool->hedge_percentile = atoi(value);
+		if ((pool->hedge_percentile != 0) &&
+		    ((pool->hedge_percentile < 50) ||
+		     (pool->hedge_percentile > 99))) {
+			cf_log_err_cp(cp, "hedge_percentile must be 0, or between 50 and 99");
+			goto error;
+		}
+
+		if (pool->hedge_percentile && (server_type != HOME_TYPE_AUTH)) {
+			cf_log_err_cp(cp, "Only authentication requests can be hedged");
+			goto error;
+		}
+
+		for (i = 0; hedge_factors[i][0] != 0; i++) {
+			if (hedge_factors[i][0] >= pool->hedge_percentile) break;
+		}
+		pool->hedge_factor = hedge_factors[i][1];
+
+		if (do_print) {
+			cf_log_info(cs, "\thedge_percentile = %d",
+				    pool->hedge_percentile);
+		}
+	}
+
+	if (pool->hedge_percentile) {
+		pool->hedge_max = 5;
+
+		cp = cf_pair_find(cs, "hedge_max");
+		if (cp) {
+			value = cf_pair_value(cp);
+			if (!value) {
+				cf_log_err_cp(cp, "No value given for hedge_max");
+				goto error;
+			}
+			pool->hedge_max = atoi(value);
+		}
+
+		if (pool->hedge_max < 1) pool->hedge_max = 1;
+		if (pool->hedge_max > 100) pool->hedge_max = 100;
+
+		if (do_print) cf_log_info(cs, "\thedge_max = %d", pool->hedge_max);
+	}
+
 	num_home_servers = 0;
 	for (cp = cf_pair_find(cs, "home_server");
 	     cp != NULL;
@@ -1207,6 +1312,9 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 		memset(home, 0, sizeof(*home));
 
 		home->name = name;
+#ifdef WITH_STATS
+		home->stats = fr_stats_alloc();
+#endif
 		home->hostname = name;
 		home->type = type;
 		home->secret = secret;
@@ -1267,6 +1375,8 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 		 *	Use the old-style configuration.
 		 */
 		home->max_outstanding = 65535*16;
+		home->weight = 1;
+		home->name_hash = fr_hash_string(home->name);
 		home->zombie_period = rc->retry_delay * rc->retry_count;
 		if (home->zombie_period == 0) home->zombie_period =30;
 		home->response_window = home->zombie_period - 1;
@@ -1532,11 +1642,156 @@ static int add_pool_to_realm(realm_config_t *rc, CONF_SECTION *cs,
 #endif
 
 
+static int realm_label_cmp(const char *a, size_t a_len,
+			   const char *b, size_t b_len)
+{
+	int rcode;
+
+	rcode = strncasecmp(a, b, (a_len < b_len) ? a_len : b_len);
+	if (rcode != 0) return rcode;
+
+	return (int) a_len - (int) b_len;
+}
+
+/*
+ *	Binary search of the children.  If the label isn't there,
+ *	*where is set to the position it should be inserted at.
+ */
+static realm_label_t *realm_label_find(const realm_label_t *node,
+				       const char *label, size_t len,
+				       int *where)
+{
+	int lo, hi, mid, rcode;
+
+	lo = 0;
+	hi = node->num_children - 1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		rcode = realm_label_cmp(label, len,
+					node->children[mid]->label,
+					node->children[mid]->len);
+		if (rcode == 0) return node->children[mid];
+
+		if (rcode < 0) {
+			hi = mid - 1;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	if (where) *where = lo;
+	return NULL;
+}
+
+/*
+ *	"*." followed by one or more non-empty labels, and no other
+ *	wildcards.
+ */
+static int realm_wildcard_ok(const char *name)
+{
+	const char *p;
+
+	if (!REALM_IS_WILDCARD(name)) return 0;
+
+	for (p = name + 2; *p != '\0'; p++) {
+		if (*p == '*') return 0;
+		if ((*p == '.') && ((p[-1] == '.') || (p[1] == '\0'))) {
+			return 0;
+		}
+	}
+
+	return (p > (name + 2));
+}
+
+static int realm_suffix_add(void *ctx, void *data)
+{
+	int where;
+	const char *end, *p;
+	realm_label_t *node = ctx, *child;
+	REALM *r = data;
+
+	if (!REALM_IS_WILDCARD(r->name)) return 0;
+
+	/*
+	 *	Walk the labels from the right, adding nodes as
+	 *	necessary.
+	 */
+	end = r->name + strlen(r->name);
+	while (end > (r->name + 2)) {
+		p = end;
+		while ((p > (r->name + 2)) && (p[-1] != '.')) p--;
+
+		child = realm_label_find(node, p, end - p, &where);
+		if (!child) {
+			realm_label_t **children;
+
+			child = talloc_zero(node, realm_label_t);
+			if (!child) return -1;
+
+			child->label = talloc_strndup(child, p, end - p);
+			child->len = end - p;
+
+			children = talloc_realloc(node, node->children,
+						  realm_label_t *,
+						  node->num_children + 1);
+			if (!child->label || !children) return -1;
+
+			memmove(children + where + 1, children + where,
+				(node->num_children - where) * sizeof(children[0]));
+			children[where] = child;
+			node->children = children;
+			node->num_children++;
+		}
+
+		node = child;
+		end = p - 1;
+	}
+
+	node->wildcard = r;
+
+	return 0;
+}
+
+/*
+ *	Find the realm with the longest wildcard suffix matching the
+ *	name.  The wildcard has to match at least one label, so
+ *	"*.example.com" matches "foo.example.com", but not
+ *	"example.com".
+ */
+static REALM *realm_suffix_find(const realm_label_t *node, const char *name)
+{
+	const char *end, *p;
+	REALM *best = NULL;
+
+	end = name + strlen(name);
+	while (end > name) {
+		p = end;
+		while ((p > name) && (p[-1] != '.')) p--;
+
+		node = realm_label_find(node, p, end - p, NULL);
+		if (!node) break;
+
+		/*
+		 *	There's nothing left for the '*' to match.
+		 */
+		if ((p - 1) <= name) break;
+
+		if (node->wildcard) best = node->wildcard;
+		end = p - 1;
+	}
+
+	return best;
+}
+
 static int realm_add(realm_config_t *rc, CONF_SECTION *cs)
 {
 	const char *name2;
 	REALM *r = NULL;
 	CONF_PAIR *cp;
+#ifdef HAVE_REGEX_H
+	realm_regex_t *rr = NULL;
+#endif
 #ifdef WITH_PROXY
 	home_pool_t *auth_pool, *acct_pool;
 	const char *auth_pool_name, *acct_pool_name;
@@ -1662,27 +1917,37 @@ static int realm_add(realm_config_t *rc, CONF_SECTION *cs)
 	}
 #endif
 
+	if ((name2[0] == '*') && !realm_wildcard_ok(name2)) {
+		cf_log_err_cs(cs, "Invalid wildcard realm \"%s\": It must be \"*.\" followed by a domain name", name2);
+		cf_log_info(cs, " } # realm %s", name2);
+		return 0;
+	}
+
 #ifdef HAVE_REGEX_H
 	if (name2[0] == '~') {
 		int rcode;
-		regex_t reg;
 		
 		/*
-		 *	Include substring matches.
+		 *	Compile it once here, rather than for every
+		 *	call to realm_find().
 		 */
-		rcode = regcomp(&reg, name2 + 1,
+		rr = rad_malloc(sizeof(*rr));
+		memset(rr, 0, sizeof(*rr));
+
+		rcode = regcomp(&rr->reg, name2 + 1,
 				REG_EXTENDED | REG_NOSUB | REG_ICASE);
 		if (rcode != 0) {
 			char buffer[256];
 
-			regerror(rcode, &reg, buffer, sizeof(buffer));
+			regerror(rcode, &rr->reg, buffer, sizeof(buffer));
 
 			cf_log_err_cs(cs,
 				   "Invalid regex \"%s\": %s",
 				   name2 + 1, buffer);
+			free(rr);
+			rr = NULL;
 			goto error;
 		}
-		regfree(&reg);
 	}
 #endif
 
@@ -1742,11 +2007,9 @@ static int realm_add(realm_config_t *rc, CONF_SECTION *cs)
 	/*
 	 *	It's a regex.  Add it to a separate list.
 	 */
-	if (name2[0] == '~') {
-		realm_regex_t *rr, **last;
+	if (rr) {
+		realm_regex_t **last;
 
-		rr = rad_malloc(sizeof(*rr));
-		
 		last = &realms_regex;
 		while (*last) last = &((*last)->next);  /* O(N^2)... sue me. */
 
@@ -1772,6 +2035,12 @@ static int realm_add(realm_config_t *rc, CONF_SECTION *cs)
 
  error:
 	cf_log_info(cs, " } # realm %s", name2);
+#ifdef HAVE_REGEX_H
+	if (rr) {
+		regfree(&rr->reg);
+		free(rr);
+	}
+#endif
 	free(r);
 	return 0;
 }
@@ -1967,6 +2236,20 @@ int realms_init(CONF_SECTION *config)
 #endif
 
 
+	/*
+	 *	Realms aren't re-read on HUP, so the wildcard index
+	 *	is built once, here.
+	 */
+	realms_suffix = talloc_zero(NULL, realm_label_t);
+	if (!realms_suffix ||
+	    (rbtree_walk(realms_byname, InOrder, realm_suffix_add,
+			 realms_suffix) != 0)) {
+		radlog(L_ERR, "Failed building index of wildcard realms");
+		free(rc);
+		realms_free();
+		return 0;
+	}
+
 #ifdef WITH_PROXY
 	xlat_register("home_server", xlat_home_server, NULL);
 	xlat_register("home_server_pool", xlat_server_pool, NULL);
@@ -2030,26 +2313,23 @@ REALM *realm_find(const char *name)
 	realm = rbtree_finddata(realms_byname, &myrealm);
 	if (realm) return realm;
 
+	/*
+	 *	Wildcard realms are checked before regexes, as
+	 *	they're much cheaper.
+	 */
+	if (realms_suffix && realms_suffix->num_children) {
+		realm = realm_suffix_find(realms_suffix, name);
+		if (realm) return realm;
+	}
+
 #ifdef HAVE_REGEX_H
 	if (realms_regex) {
 		realm_regex_t *this;
 
 		for (this = realms_regex; this != NULL; this = this->next) {
-			int compare;
-			regex_t reg;
-
-			/*
-			 *	Include substring matches.
-			 */
-			if (regcomp(&reg, this->realm->name + 1,
-				    REG_EXTENDED | REG_NOSUB | REG_ICASE) != 0) {
-				continue;
+			if (regexec(&this->reg, name, 0, NULL, 0) == 0) {
+				return this->realm;
 			}
-
-			compare = regexec(&reg, name, 0, NULL, 0);
-			regfree(&reg);
-
-			if (compare == 0) return this->realm;
 		}
 	}
 #endif
@@ -2138,6 +2418,269 @@ void home_server_update_request(home_server *home, REQUEST *request)
 	}
 }
 
+/*
+ *	Whether or not the request can be sent to a home server.
+ *	Zombie servers are usable, but the caller should prefer
+ *	live ones.
+ */
+static int home_server_usable(REQUEST *request, home_server *home)
+{
+	/*
+	 *	Skip dead home servers.
+	 *
+	 *	Home servers that are unknown, alive, or zombie
+	 *	are used for proxying.
+	 */
+	if (home->state == HOME_STATE_IS_DEAD) {
+		return FALSE;
+	}
+
+	/*
+	 *	This home server is too busy.  Choose another one.
+	 */
+	if (home->currently_outstanding >= home->max_outstanding) {
+		return FALSE;
+	}
+
+#ifdef WITH_DETAIL
+	/*
+	 *	We read the packet from a detail file, AND it
+	 *	came from this server.  Don't re-proxy it
+	 *	there.
+	 */
+	if ((request->listener->type == RAD_LISTEN_DETAIL) &&
+	    (request->packet->code == PW_ACCOUNTING_REQUEST) &&
+	    (fr_ipaddr_cmp(&home->ipaddr, &request->packet->src_ipaddr) == 0)) {
+		return FALSE;
+	}
+#endif
+
+	/*
+	 *	Default virtual: ignore homes tied to a
+	 *	virtual.
+	 */
+	if (!request->server && home->parent_server) {
+		return FALSE;
+	}
+
+	/*
+	 *	A virtual AND home is tied to virtual,
+	 *	ignore ones which don't match.
+	 */
+	if (request->server && home->parent_server &&
+	    strcmp(request->server, home->parent_server) != 0) {
+		return FALSE;
+	}
+
+	/*
+	 *	Allow request->server && !home->parent_server
+	 *
+	 *	i.e. virtuals can proxy to globally defined
+	 *	homes.
+	 */
+	return TRUE;
+}
+
+/*
+ *	Choose the usable home server with the highest rendezvous
+ *	score for the key.  If one server goes away, only the keys
+ *	which it had are moved to other servers.
+ */
+static home_server *home_pool_rendezvous(REQUEST *request, home_pool_t *pool,
+					 uint32_t key, home_server **pzombie)
+{
+	int		i;
+	uint32_t	score, best = 0, best_zombie = 0;
+	home_server	*found = NULL;
+	home_server	*zombie = NULL;
+
+	for (i = 0; i < pool->num_home_servers; i++) {
+		home_server *home = pool->servers[i];
+
+		if (!home) continue;
+
+		if (!home_server_usable(request, home)) continue;
+
+		score = fr_hash_rendezvous(key, home->name_hash, home->weight);
+
+		if (home->state == HOME_STATE_ZOMBIE) {
+			if (!zombie || (score > best_zombie)) {
+				zombie = home;
+				best_zombie = score;
+			}
+			continue;
+		}
+
+		if (!found || (score > best)) {
+			found = home;
+			best = score;
+		}
+	}
+
+	if (found) {
+		RDEBUG3("PROXY Choosing %s from pool %s", found->name, pool->name);
+	}
+
+	*pzombie = zombie;
+	return found;
+}
+
+#define USEC (1000000)
+
+/*
+ *	Track how long the home server takes to respond.  Requests
+ *	which time out count as taking the whole response window,
+ *	so that unresponsive servers are avoided quickly.
+ *
+ *	This is only called from the main thread.
+ */
+void home_server_response_time(home_server *home, const struct timeval *sent,
+			       const struct timeval *received)
+{
+	int usec;
+
+	if (received->tv_sec < sent->tv_sec) return;
+
+	if ((received->tv_sec - sent->tv_sec) >= 60) {
+		usec = 60 * USEC;
+	} else {
+		usec = ((received->tv_sec - sent->tv_sec) * USEC) +
+			received->tv_usec - sent->tv_usec;
+		if (usec < 0) usec = 0;
+	}
+
+	/*
+	 *	An EWMA with a weight of 1/8 for the new sample, and
+	 *	of 1/4 for its mean deviation, as with TCP (RFC 6298).
+	 */
+	if (home->response_time == 0) {
+		home->response_time = usec;
+		home->response_dev = usec / 2;
+	} else {
+		int dev = usec - home->response_time;
+
+		if (dev < 0) dev = -dev;
+		home->response_dev += (dev - home->response_dev) / 4;
+		home->response_time += (usec - home->response_time) / 8;
+	}
+}
+
+/*
+ *	The expected time for a new request to be answered: the
+ *	response time, multiplied by the number of requests ahead
+ *	of it.  Lower is better.
+ */
+uint64_t home_server_latency_score(const home_server *home)
+{
+	return ((uint64_t) (home->currently_outstanding + 1)) *
+		(home->response_time + 1);
+}
+
+/*
+ *	How long to wait for a reply before hedging, in
+ *	microseconds.  Returns 0 if we know too little about the
+ *	home server to guess.
+ */
+int home_server_hedge_delay(const home_pool_t *pool, const home_server *home)
+{
+	if (!pool->hedge_factor || (home->response_time == 0)) return 0;
+
+	return home->response_time +
+		(int) (((int64_t) home->response_dev * pool->hedge_factor) / 100);
+}
+
+/*
+ *	Find a home server to send a copy of the request to: the
+ *	next live one in the pool after the current one.  Zombie
+ *	servers are skipped, as they are unlikely to be faster.
+ *	Copies are only sent over UDP.
+ */
+home_server *home_server_hedge(home_pool_t *pool, home_server *home,
+			       REQUEST *request)
+{
+	int i, start;
+
+	for (start = 0; start < pool->num_home_servers; start++) {
+		if (pool->servers[start] == home) break;
+	}
+
+	for (i = 1; i < pool->num_home_servers; i++) {
+		home_server *next;
+
+		next = pool->servers[(start + i) % pool->num_home_servers];
+		if (!next) continue;
+		if (next == home) continue;
+		if (next->server || (next->proto != IPPROTO_UDP)) continue;
+		if (next->state == HOME_STATE_ZOMBIE) continue;
+		if (!home_server_usable(request, next)) continue;
+
+		return next;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Power of two choices: pick two usable home servers at
+ *	random, and use the one with the lower latency score.  This
+ *	moves traffic away from slow servers as soon as they slow
+ *	down, without herding every request onto the fastest one.
+ */
+static home_server *home_pool_least_latency(REQUEST *request, home_pool_t *pool,
+					    home_server **pzombie)
+{
+	int		i, num = 0;
+	uint64_t	score_a, score_b;
+	home_server	*a = NULL, *b = NULL;
+	home_server	*zombie = NULL;
+
+	for (i = 0; i < pool->num_home_servers; i++) {
+		home_server *home = pool->servers[i];
+
+		if (!home) continue;
+
+		if (!home_server_usable(request, home)) continue;
+
+		if (home->state == HOME_STATE_ZOMBIE) {
+			if (!zombie) zombie = home;
+			continue;
+		}
+
+		/*
+		 *	Choose two servers uniformly at random, in one
+		 *	pass over the pool.
+		 */
+		num++;
+		if (num == 1) {
+			a = home;
+		} else if (num == 2) {
+			b = home;
+		} else if ((fr_rand() % num) < 2) {
+			if ((fr_rand() & 0x01) == 0) {
+				a = home;
+			} else {
+				b = home;
+			}
+		}
+	}
+
+	*pzombie = zombie;
+
+	if (!b) return a;
+
+	score_a = home_server_latency_score(a);
+	score_b = home_server_latency_score(b);
+
+	RDEBUG3("PROXY %s %d %dus\t%s %d %dus",
+		a->name, a->currently_outstanding, a->response_time,
+		b->name, b->currently_outstanding, b->response_time);
+
+	if (score_b < score_a) return b;
+	if ((score_b == score_a) && ((fr_rand() & 0x01) != 0)) return b;
+
+	return a;
+}
+
 home_server *home_server_ldb(const char *realmname,
 			     home_pool_t *pool, REQUEST *request)
 {
@@ -2210,6 +2753,29 @@ home_server *home_server_ldb(const char *realmname,
 		start = 0;
 		break;
 
+		/*
+		 *	Hash the Load-Balance-Key if there is one, and
+		 *	otherwise the client IP address.
+		 */
+	case HOME_POOL_RENDEZVOUS_BALANCE:
+		if ((vp = pairfind(request->config_items, PW_LOAD_BALANCE_KEY, 0, TAG_ANY)) != NULL) {
+			hash = fr_hash(vp->vp_strvalue, vp->length);
+
+		} else if (request->packet->src_ipaddr.af == AF_INET6) {
+			hash = fr_hash(&request->packet->src_ipaddr.ipaddr.ip6addr,
+					 sizeof(request->packet->src_ipaddr.ipaddr.ip6addr));
+		} else {
+			hash = fr_hash(&request->packet->src_ipaddr.ipaddr.ip4addr,
+					 sizeof(request->packet->src_ipaddr.ipaddr.ip4addr));
+		}
+
+		found = home_pool_rendezvous(request, pool, hash, &zombie);
+		goto chosen;
+
+	case HOME_POOL_LEAST_LATENCY:
+		found = home_pool_least_latency(request, pool, &zombie);
+		goto chosen;
+
 	default:		/* this shouldn't happen... */
 		start = 0;
 		break;
@@ -2228,59 +2794,7 @@ home_server *home_server_ldb(const char *realmname,
 
 		if (!home) continue;
 
-		/*
-		 *	Skip dead home servers.
-		 *
-		 *	Home servers that are unknown, alive, or zombie
-		 *	are used for proxying.
-		 */
-		if (home->state == HOME_STATE_IS_DEAD) {
-			continue;
-		}
-
-		/*
-		 *	This home server is too busy.  Choose another one.
-		 */
-		if (home->currently_outstanding >= home->max_outstanding) {
-			continue;
-		}
-
-#ifdef WITH_DETAIL
-		/*
-		 *	We read the packet from a detail file, AND it
-		 *	came from this server.  Don't re-proxy it
-		 *	there.
-		 */
-		if ((request->listener->type == RAD_LISTEN_DETAIL) &&
-		    (request->packet->code == PW_ACCOUNTING_REQUEST) &&
-		    (fr_ipaddr_cmp(&home->ipaddr, &request->packet->src_ipaddr) == 0)) {
-			continue;
-		}
-#endif
-
-		/*
-		 *	Default virtual: ignore homes tied to a
-		 *	virtual.
-		 */
-		if (!request->server && home->parent_server) {
-			continue;
-		}
-
-		/*
-		 *	A virtual AND home is tied to virtual,
-		 *	ignore ones which don't match.
-		 */
-		if (request->server && home->parent_server &&
-		    strcmp(request->server, home->parent_server) != 0) {
-			continue;
-		}
-
-		/*
-		 *	Allow request->server && !home->parent_server
-		 *
-		 *	i.e. virtuals can proxy to globally defined
-		 *	homes.
-		 */
+		if (!home_server_usable(request, home)) continue;
 
 		/*
 		 *	It's zombie, so we remember the first zombie
@@ -2343,6 +2857,7 @@ home_server *home_server_ldb(const char *realmname,
 		}
 	} /* loop over the home servers */
 
+ chosen:
 	/*
 	 *	We have no live servers, BUT we have a zombie.  Use
 	 *	the zombie as a last resort.
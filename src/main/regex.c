@@ -0,0 +1,321 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file regex.c
+ * @brief Cache of compiled regular expressions.
+ *
+ * Conditions are re-parsed on every evaluation, and the right hand side
+ * of a regex comparison may be the result of an xlat expansion.  Rather
+ * than calling regcomp() / regfree() for every comparison, patterns are
+ * looked up here by (pattern, flags).
+ *
+ * Entries which are "pinned" come from the configuration, and live
+ * until the server exits.  All other entries are kept on an LRU list,
+ * which is bounded to REGEX_CACHE_MAX entries.  Entries which are in
+ * use by a request are never freed, the caller has to release them.
+ *
+ * @copyright 2013  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef HAVE_REGEX_H
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	Maximum number of unpinned entries.  Pinned entries don't
+ *	count, as there's a fixed number of them in the configuration.
+ */
+#define REGEX_CACHE_MAX (256)
+
+struct fr_regex {
+	const char	*pattern;	//!< The uncompiled pattern.
+	int		cflags;		//!< Flags passed to regcomp().
+	regex_t		reg;		//!< The compiled expression.
+
+	int		refs;		//!< Number of callers using the entry.
+	int		pinned;		//!< Never evicted.
+	int		dead;		//!< Evicted while in use, free on release.
+
+	fr_regex_t	*prev;		//!< LRU list, most recent first.
+	fr_regex_t	*next;
+};
+
+static fr_hash_table_t *regex_cache = NULL;
+static fr_regex_t *lru_head = NULL;
+static fr_regex_t *lru_tail = NULL;
+static int lru_count = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t regex_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static uint32_t regex_hash(const void *data)
+{
+	const fr_regex_t *rx = data;
+	uint32_t hash;
+
+	hash = fr_hash_string(rx->pattern);
+	return fr_hash_update(&rx->cflags, sizeof(rx->cflags), hash);
+}
+
+static int regex_cmp(const void *one, const void *two)
+{
+	const fr_regex_t *a = one;
+	const fr_regex_t *b = two;
+
+	if (a->cflags != b->cflags) return a->cflags - b->cflags;
+
+	return strcmp(a->pattern, b->pattern);
+}
+
+static void regex_entry_free(fr_regex_t *rx)
+{
+	regfree(&rx->reg);
+	talloc_free(rx);
+}
+
+static void lru_unlink(fr_regex_t *rx)
+{
+	if (rx->prev) {
+		rx->prev->next = rx->next;
+	} else {
+		lru_head = rx->next;
+	}
+
+	if (rx->next) {
+		rx->next->prev = rx->prev;
+	} else {
+		lru_tail = rx->prev;
+	}
+
+	rx->prev = rx->next = NULL;
+	lru_count--;
+}
+
+static void lru_push(fr_regex_t *rx)
+{
+	rx->prev = NULL;
+	rx->next = lru_head;
+	if (lru_head) lru_head->prev = rx;
+	lru_head = rx;
+	if (!lru_tail) lru_tail = rx;
+	lru_count++;
+}
+
+/*
+ *	Drop the least recently used entries until we're back under
+ *	the limit.  Entries which are still in use are taken out of
+ *	the cache, and freed by the last caller to release them.
+ */
+static void lru_trim(void)
+{
+	while ((lru_count > REGEX_CACHE_MAX) && lru_tail) {
+		fr_regex_t *rx = lru_tail;
+
+		lru_unlink(rx);
+		fr_hash_table_yank(regex_cache, rx);
+
+		if (rx->refs > 0) {
+			rx->dead = TRUE;
+			continue;
+		}
+
+		regex_entry_free(rx);
+	}
+}
+
+/** Find or compile a regular expression
+ *
+ * The returned entry MUST be passed to regex_cache_release() when the
+ * caller is done with it.
+ *
+ * @param pattern to compile.
+ * @param cflags to pass to regcomp().
+ * @param pin if TRUE, the entry is never evicted.  Use this for
+ *	patterns taken directly from the configuration.
+ * @param errbuf where the error from regcomp() is written.  May be NULL.
+ * @param errlen size of errbuf.
+ * @return the compiled expression, or NULL on error.
+ */
+fr_regex_t *regex_cache_find(const char *pattern, int cflags, int pin,
+			     char *errbuf, size_t errlen)
+{
+	int rcode;
+	fr_regex_t my_rx, *rx;
+
+	memset(&my_rx, 0, sizeof(my_rx));
+	my_rx.pattern = pattern;
+	my_rx.cflags = cflags;
+
+	PTHREAD_MUTEX_LOCK(&regex_cache_mutex);
+
+	if (!regex_cache) {
+		regex_cache = fr_hash_table_create(regex_hash, regex_cmp,
+						   NULL);
+		if (!regex_cache) {
+			PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+			if (errbuf) strlcpy(errbuf, "Failed creating regex cache", errlen);
+			return NULL;
+		}
+	}
+
+	rx = fr_hash_table_finddata(regex_cache, &my_rx);
+	if (rx) {
+		if (!rx->pinned) {
+			if (pin) {
+				lru_unlink(rx);
+				rx->pinned = TRUE;
+			} else if (rx != lru_head) {
+				lru_unlink(rx);
+				lru_push(rx);
+			}
+		}
+		rx->refs++;
+		PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+		return rx;
+	}
+
+	/*
+	 *	Not found.  Compile it without holding the lock, as
+	 *	complex patterns can take a while.
+	 */
+	PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+
+	rx = talloc_zero(NULL, fr_regex_t);
+	rx->pattern = talloc_strdup(rx, pattern);
+	rx->cflags = cflags;
+
+	rcode = regcomp(&rx->reg, pattern, cflags);
+	if (rcode != 0) {
+		if (errbuf) regerror(rcode, &rx->reg, errbuf, errlen);
+		talloc_free(rx);
+		return NULL;
+	}
+
+	rx->refs = 1;
+	rx->pinned = pin;
+
+	PTHREAD_MUTEX_LOCK(&regex_cache_mutex);
+
+	/*
+	 *	Someone else compiled the same pattern while we
+	 *	weren't looking.  Use theirs.
+	 */
+	my_rx.pattern = rx->pattern;
+	if (fr_hash_table_finddata(regex_cache, &my_rx) != NULL) {
+		PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+		regex_entry_free(rx);
+		return regex_cache_find(pattern, cflags, pin, errbuf, errlen);
+	}
+
+	if (!fr_hash_table_insert(regex_cache, rx)) {
+		PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+
+		/*
+		 *	Still usable, it just isn't cached.
+		 */
+		rx->dead = TRUE;
+		return rx;
+	}
+
+	if (!pin) {
+		lru_push(rx);
+		lru_trim();
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+
+	return rx;
+}
+
+/** Run a cached regular expression against a string
+ *
+ * @param rx from regex_cache_find().
+ * @param subject to match against.
+ * @param nmatch size of the pmatch array.
+ * @param pmatch where the substring matches are written.
+ * @return the return code from regexec().
+ */
+int regex_cache_exec(const fr_regex_t *rx, const char *subject,
+		     size_t nmatch, regmatch_t pmatch[])
+{
+	return regexec(&rx->reg, subject, nmatch, pmatch, 0);
+}
+
+/** Release an entry returned by regex_cache_find()
+ *
+ * @param rx to release.  May be NULL.
+ */
+void regex_cache_release(fr_regex_t *rx)
+{
+	int dead;
+
+	if (!rx) return;
+
+	PTHREAD_MUTEX_LOCK(&regex_cache_mutex);
+	rad_assert(rx->refs > 0);
+	rx->refs--;
+	dead = (rx->dead && (rx->refs == 0));
+	PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+
+	if (dead) regex_entry_free(rx);
+}
+
+static int regex_entry_walk(UNUSED void *ctx, void *data)
+{
+	fr_regex_t *rx = data;
+
+	if (rx->refs > 0) {
+		rx->dead = TRUE;
+		return 0;
+	}
+
+	regex_entry_free(rx);
+	return 0;
+}
+
+/** Free all cached regular expressions
+ *
+ * Called on exit.  Entries which are still in use are freed when
+ * they are released.
+ */
+void regex_cache_free(void)
+{
+	PTHREAD_MUTEX_LOCK(&regex_cache_mutex);
+	if (regex_cache) {
+		fr_hash_table_walk(regex_cache, regex_entry_walk, NULL);
+		fr_hash_table_free(regex_cache);
+		regex_cache = NULL;
+	}
+	lru_head = lru_tail = NULL;
+	lru_count = 0;
+	PTHREAD_MUTEX_UNLOCK(&regex_cache_mutex);
+}
+#endif /* HAVE_REGEX_H */
@@ -37,47 +37,325 @@ RCSID("$Id$")
 static struct timeval	start_time;
 static struct timeval	hup_time;
 
-#define FR_STATS_INIT { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 	\
-				 { 0, 0, 0, 0, 0, 0, 0, 0 }}
-
-fr_stats_t radius_auth_stats = FR_STATS_INIT;
+/*
+ *	Fixed IDs for the global statistics.  ID 0 is used for
+ *	anything which doesn't have statistics of its own.
+ */
+fr_stats_id_t radius_auth_stats = 1;
 #ifdef WITH_ACCOUNTING
-fr_stats_t radius_acct_stats = FR_STATS_INIT;
+fr_stats_id_t radius_acct_stats = 2;
 #endif
 #ifdef WITH_COA
-fr_stats_t radius_coa_stats = FR_STATS_INIT;
-fr_stats_t radius_dsc_stats = FR_STATS_INIT;
+fr_stats_id_t radius_coa_stats = 3;
+fr_stats_id_t radius_dsc_stats = 4;
 #endif
 
 #ifdef WITH_PROXY
-fr_stats_t proxy_auth_stats = FR_STATS_INIT;
+fr_stats_id_t proxy_auth_stats = 5;
 #ifdef WITH_ACCOUNTING
-fr_stats_t proxy_acct_stats = FR_STATS_INIT;
+fr_stats_id_t proxy_acct_stats = 6;
 #endif
 #ifdef WITH_COA
-fr_stats_t proxy_coa_stats = FR_STATS_INIT;
-fr_stats_t proxy_dsc_stats = FR_STATS_INIT;
+fr_stats_id_t proxy_coa_stats = 7;
+fr_stats_id_t proxy_dsc_stats = 8;
 #endif
 #endif
 
+#define STATS_ID_FIRST	(9)
+
+/*
+ *	Each thread keeps its counters in pages of STATS_PAGE_SIZE
+ *	entries, indexed by ID.  Pages are allocated the first time
+ *	the thread updates a counter in them.
+ *
+ *	Only the owning thread writes to its counters.  Readers
+ *	add up the counters from all threads, holding stats_mutex.
+ *	The owning thread holds it only when allocating a page.
+ */
+#define STATS_PAGE_SIZE	(64)
+
+typedef struct stats_thread_t stats_thread_t;
+
+struct stats_thread_t {
+	fr_stats_t	**pages;
+	int		num_pages;
+
+	stats_thread_t	*next;
+	stats_thread_t	*prev;
+};
+
+/*
+ *	Counters from threads which have exited.
+ */
+static stats_thread_t	stats_retired;
+
+static stats_thread_t	*stats_threads = NULL;
+
+static fr_stats_id_t	stats_max_id = STATS_ID_FIRST;
+static fr_stats_id_t	*stats_free_ids = NULL;
+static int		stats_num_free = 0;
+static int		stats_max_free = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t	stats_key;
+static pthread_once_t	stats_once = PTHREAD_ONCE_INIT;
+
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+static stats_thread_t	stats_main;
+
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+static void stats_add(fr_stats_t *out, const fr_stats_t *in)
+{
+	int i;
+
+	out->total_requests += in->total_requests;
+	out->total_invalid_requests += in->total_invalid_requests;
+	out->total_dup_requests += in->total_dup_requests;
+	out->total_responses += in->total_responses;
+	out->total_access_accepts += in->total_access_accepts;
+	out->total_access_rejects += in->total_access_rejects;
+	out->total_access_challenges += in->total_access_challenges;
+	out->total_malformed_requests += in->total_malformed_requests;
+	out->total_bad_authenticators += in->total_bad_authenticators;
+	out->total_packets_dropped += in->total_packets_dropped;
+	out->total_no_records += in->total_no_records;
+	out->total_unknown_types += in->total_unknown_types;
+	out->total_timeouts += in->total_timeouts;
+
+	if (in->last_packet > out->last_packet) {
+		out->last_packet = in->last_packet;
+	}
+
+	for (i = 0; i < 8; i++) {
+		out->elapsed[i] += in->elapsed[i];
+	}
+}
+
+/*
+ *	Return the counters for an ID in a thread, allocating the
+ *	page if necessary.  Must be called with stats_mutex held.
+ */
+static fr_stats_t *stats_thread_entry(stats_thread_t *st, fr_stats_id_t id)
+{
+	int page = id / STATS_PAGE_SIZE;
+
+	if (page >= st->num_pages) {
+		int num_pages;
+		fr_stats_t **pages;
+
+		num_pages = st->num_pages ? st->num_pages : 16;
+		while (num_pages <= page) num_pages *= 2;
+
+		pages = rad_malloc(num_pages * sizeof(*pages));
+		memset(pages, 0, num_pages * sizeof(*pages));
+		if (st->pages) {
+			memcpy(pages, st->pages,
+			       st->num_pages * sizeof(*pages));
+			free(st->pages);
+		}
+		st->pages = pages;
+		st->num_pages = num_pages;
+	}
 
-static void tv_sub(struct timeval *end, struct timeval *start,
-		   struct timeval *elapsed)
+	if (!st->pages[page]) {
+		st->pages[page] = rad_malloc(STATS_PAGE_SIZE * sizeof(fr_stats_t));
+		memset(st->pages[page], 0, STATS_PAGE_SIZE * sizeof(fr_stats_t));
+	}
+
+	return &st->pages[page][id % STATS_PAGE_SIZE];
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	A thread is exiting.  Keep its counters.
+ */
+static void stats_thread_free(void *data)
 {
-	elapsed->tv_sec = end->tv_sec - start->tv_sec;
-	if (elapsed->tv_sec > 0) {
-		elapsed->tv_sec--;
-		elapsed->tv_usec = USEC;
+	int i, j;
+	stats_thread_t *st = data;
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+
+	for (i = 0; i < st->num_pages; i++) {
+		if (!st->pages[i]) continue;
+
+		for (j = 0; j < STATS_PAGE_SIZE; j++) {
+			stats_add(stats_thread_entry(&stats_retired,
+						     (i * STATS_PAGE_SIZE) + j),
+				  &st->pages[i][j]);
+		}
+		free(st->pages[i]);
+	}
+
+	if (st->prev) {
+		st->prev->next = st->next;
 	} else {
-		elapsed->tv_usec = 0;
+		stats_threads = st->next;
 	}
-	elapsed->tv_usec += end->tv_usec;
-	elapsed->tv_usec -= start->tv_usec;
-	
-	if (elapsed->tv_usec >= USEC) {
-		elapsed->tv_usec -= USEC;
-		elapsed->tv_sec++;
+	if (st->next) st->next->prev = st->prev;
+
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+
+	free(st->pages);
+	free(st);
+}
+
+static void stats_make_key(void)
+{
+	pthread_key_create(&stats_key, stats_thread_free);
+}
+#endif
+
+static stats_thread_t *stats_thread_self(void)
+{
+	stats_thread_t *st;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_once(&stats_once, stats_make_key);
+
+	st = pthread_getspecific(stats_key);
+	if (st) return st;
+
+	st = rad_malloc(sizeof(*st));
+	memset(st, 0, sizeof(*st));
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+	st->next = stats_threads;
+	if (stats_threads) stats_threads->prev = st;
+	stats_threads = st;
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+
+	pthread_setspecific(stats_key, st);
+#else
+	st = &stats_main;
+	if (!stats_threads) stats_threads = st;
+#endif
+
+	return st;
+}
+
+/** Allocate an ID for a new set of statistics
+ *
+ * @return the new ID.
+ */
+fr_stats_id_t fr_stats_alloc(void)
+{
+	fr_stats_id_t id;
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+	if (stats_num_free > 0) {
+		id = stats_free_ids[--stats_num_free];
+	} else {
+		id = stats_max_id++;
 	}
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+
+	return id;
+}
+
+/** Release an ID, and clear its counters
+ *
+ * @param id to release.
+ */
+void fr_stats_free(fr_stats_id_t id)
+{
+	stats_thread_t *st;
+
+	if (id < STATS_ID_FIRST) return;
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+
+	/*
+	 *	Clear the counters, so that the next user of the ID
+	 *	starts from zero.
+	 */
+	for (st = stats_threads; st != NULL; st = st->next) {
+		if ((id / STATS_PAGE_SIZE) >= st->num_pages) continue;
+		if (!st->pages[id / STATS_PAGE_SIZE]) continue;
+
+		memset(stats_thread_entry(st, id), 0, sizeof(fr_stats_t));
+	}
+	if ((id / STATS_PAGE_SIZE) < stats_retired.num_pages) {
+		memset(stats_thread_entry(&stats_retired, id), 0,
+		       sizeof(fr_stats_t));
+	}
+
+	if (stats_num_free == stats_max_free) {
+		fr_stats_id_t *ids;
+
+		stats_max_free = stats_max_free ? (stats_max_free * 2) : 256;
+		ids = rad_malloc(stats_max_free * sizeof(*ids));
+		if (stats_free_ids) {
+			memcpy(ids, stats_free_ids,
+			       stats_num_free * sizeof(*ids));
+			free(stats_free_ids);
+		}
+		stats_free_ids = ids;
+	}
+	stats_free_ids[stats_num_free++] = id;
+
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+}
+
+/** Return this thread's counters for an ID
+ *
+ * The counters MUST only be updated by the calling thread.
+ *
+ * @param id of the statistics.
+ * @return the counters.
+ */
+fr_stats_t *fr_stats_local(fr_stats_id_t id)
+{
+	fr_stats_t *stats;
+	stats_thread_t *st;
+	int page = id / STATS_PAGE_SIZE;
+
+	st = stats_thread_self();
+
+	if ((page < st->num_pages) && st->pages[page]) {
+		return &st->pages[page][id % STATS_PAGE_SIZE];
+	}
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+	stats = stats_thread_entry(st, id);
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+
+	return stats;
+}
+
+/** Add up the counters for an ID from all threads
+ *
+ * @param id of the statistics.
+ * @param stats where the totals are written.
+ */
+void fr_stats_read(fr_stats_id_t id, fr_stats_t *stats)
+{
+	int page = id / STATS_PAGE_SIZE;
+	stats_thread_t *st;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (id <= 0) return;
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+
+	for (st = stats_threads; st != NULL; st = st->next) {
+		if ((page >= st->num_pages) || !st->pages[page]) continue;
+
+		stats_add(stats, &st->pages[page][id % STATS_PAGE_SIZE]);
+	}
+
+	if ((page < stats_retired.num_pages) && stats_retired.pages[page]) {
+		stats_add(stats, &stats_retired.pages[page][id % STATS_PAGE_SIZE]);
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
 }
 
 static void stats_time(fr_stats_t *stats, struct timeval *start,
@@ -89,7 +367,7 @@ static void stats_time(fr_stats_t *stats, struct timeval *start,
 	if ((start->tv_sec == 0) || (end->tv_sec == 0) ||
 	    (end->tv_sec < start->tv_sec)) return;
 
-	tv_sub(end, start, &diff);
+	fr_tv_sub(end, start, &diff);
 
 	if (diff.tv_sec >= 10) {
 		stats->elapsed[7]++;
@@ -131,26 +409,26 @@ void request_stats_final(REQUEST *request)
 		return;
 
 #undef INC_AUTH
-#define INC_AUTH(_x) radius_auth_stats._x++;request->listener->stats._x++;request->client->auth._x++;
+#define INC_AUTH(_x) fr_stats_local(radius_auth_stats)->_x++;fr_stats_local(request->listener->stats)->_x++;fr_stats_local(request->client->auth)->_x++;
 
 
 #undef INC_ACCT
 #ifdef WITH_ACCOUNTING
-#define INC_ACCT(_x) radius_acct_stats._x++;request->listener->stats._x++;request->client->acct._x++
+#define INC_ACCT(_x) fr_stats_local(radius_acct_stats)->_x++;fr_stats_local(request->listener->stats)->_x++;fr_stats_local(request->client->acct)->_x++
 #else
 #define INC_ACCT(_x)
 #endif
 
 #undef INC_COA
 #ifdef WITH_COA
-#define INC_COA(_x) radius_coa_stats._x++;request->listener->stats._x++;request->client->coa._x++
+#define INC_COA(_x) fr_stats_local(radius_coa_stats)->_x++;fr_stats_local(request->listener->stats)->_x++;fr_stats_local(request->client->coa)->_x++
 #else
 #define INC_COA(_x)
 #endif
 
 #undef INC_DSC
 #ifdef WITH_DSC
-#define INC_DSC(_x) radius_dsc_stats._x++;request->listener->stats._x++;request->client->dsc._x++
+#define INC_DSC(_x) fr_stats_local(radius_dsc_stats)->_x++;fr_stats_local(request->listener->stats)->_x++;fr_stats_local(request->client->dsc)->_x++
 #else
 #define INC_DSC(_x)
 #endif
@@ -173,13 +451,13 @@ void request_stats_final(REQUEST *request)
 		/*
 		 *	FIXME: Do the time calculations once...
 		 */
-		stats_time(&radius_auth_stats,
+		stats_time(fr_stats_local(radius_auth_stats),
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
-		stats_time(&request->client->auth,
+		stats_time(fr_stats_local(request->client->auth),
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
-		stats_time(&request->listener->stats,
+		stats_time(fr_stats_local(request->listener->stats),
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
 		break;
@@ -195,10 +473,10 @@ void request_stats_final(REQUEST *request)
 #ifdef WITH_ACCOUNTING
 	case PW_ACCOUNTING_RESPONSE:
 		INC_ACCT(total_responses);
-		stats_time(&radius_acct_stats,
+		stats_time(fr_stats_local(radius_acct_stats),
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
-		stats_time(&request->client->acct,
+		stats_time(fr_stats_local(request->client->acct),
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
 		break;
@@ -209,7 +487,7 @@ void request_stats_final(REQUEST *request)
 		INC_COA(total_access_accepts);
 	  coa_stats:
 		INC_COA(total_responses);
-		stats_time(&request->client->coa,
+		stats_time(fr_stats_local(request->client->coa),
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
 		break;
@@ -222,7 +500,7 @@ void request_stats_final(REQUEST *request)
 		INC_DSC(total_access_accepts);
 	  dsc_stats:
 		INC_DSC(total_responses);
-		stats_time(&request->client->dsc,
+		stats_time(fr_stats_local(request->client->dsc),
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
 		break;
@@ -261,16 +539,16 @@ void request_stats_final(REQUEST *request)
 
 	switch (request->proxy->code) {
 	case PW_AUTHENTICATION_REQUEST:
-		proxy_auth_stats.total_requests += request->num_proxied_requests;
-		request->proxy_listener->stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		fr_stats_local(proxy_auth_stats)->total_requests += request->num_proxied_requests;
+		fr_stats_local(request->proxy_listener->stats)->total_requests += request->num_proxied_requests;
+		fr_stats_local(request->home_server->stats)->total_requests += request->num_proxied_requests;
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_ACCOUNTING_REQUEST:
-		proxy_acct_stats.total_requests++;
-		request->proxy_listener->stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		fr_stats_local(proxy_acct_stats)->total_requests++;
+		fr_stats_local(request->proxy_listener->stats)->total_requests += request->num_proxied_requests;
+		fr_stats_local(request->home_server->stats)->total_requests += request->num_proxied_requests;
 		break;
 #endif
 
@@ -281,17 +559,17 @@ void request_stats_final(REQUEST *request)
 	if (!request->proxy_reply) goto done;	/* simplifies formatting */
 
 #undef INC
-#define INC(_x) proxy_auth_stats._x += request->num_proxied_responses; request->proxy_listener->stats._x += request->num_proxied_responses; request->home_server->stats._x += request->num_proxied_responses;
+#define INC(_x) fr_stats_local(proxy_auth_stats)->_x += request->num_proxied_responses; fr_stats_local(request->proxy_listener->stats)->_x += request->num_proxied_responses; fr_stats_local(request->home_server->stats)->_x += request->num_proxied_responses;
 
 	switch (request->proxy_reply->code) {
 	case PW_AUTHENTICATION_ACK:
 		INC(total_access_accepts);
 	proxy_stats:
 		INC(total_responses);
-		stats_time(&proxy_auth_stats,
+		stats_time(fr_stats_local(proxy_auth_stats),
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
-		stats_time(&request->home_server->stats,
+		stats_time(fr_stats_local(request->home_server->stats),
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
 		break;
@@ -306,22 +584,22 @@ void request_stats_final(REQUEST *request)
 
 #ifdef WITH_ACCOUNTING
 	case PW_ACCOUNTING_RESPONSE:
-		proxy_acct_stats.total_responses++;
-		request->proxy_listener->stats.total_responses++;
-		request->home_server->stats.total_responses++;
-		stats_time(&proxy_acct_stats,
+		fr_stats_local(proxy_acct_stats)->total_responses++;
+		fr_stats_local(request->proxy_listener->stats)->total_responses++;
+		fr_stats_local(request->home_server->stats)->total_responses++;
+		stats_time(fr_stats_local(proxy_acct_stats),
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
-		stats_time(&request->home_server->stats,
+		stats_time(fr_stats_local(request->home_server->stats),
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
 		break;
 #endif
 
 	default:
-		proxy_auth_stats.total_unknown_types++;
-		request->proxy_listener->stats.total_unknown_types++;
-		request->home_server->stats.total_unknown_types++;
+		fr_stats_local(proxy_auth_stats)->total_unknown_types++;
+		fr_stats_local(request->proxy_listener->stats)->total_unknown_types++;
+		fr_stats_local(request->home_server->stats)->total_unknown_types++;
 		break;
 	}
 
@@ -431,18 +709,21 @@ static fr_stats2vp client_acctvp[] = {
 #endif
 
 static void request_stats_addvp(REQUEST *request,
-				fr_stats2vp *table, fr_stats_t *stats)
+				fr_stats2vp *table, fr_stats_id_t id)
 {
 	int i;
 	fr_uint_t counter;
 	VALUE_PAIR *vp;
+	fr_stats_t stats;
+
+	fr_stats_read(id, &stats);
 
 	for (i = 0; table[i].attribute != 0; i++) {
 		vp = radius_paircreate(request, &request->reply->vps,
 				       table[i].attribute, VENDORPEC_FREERADIUS);
 		if (!vp) continue;
 
-		counter = *(fr_uint_t *) (((uint8_t *) stats) + table[i].offset);
+		counter = *(fr_uint_t *) (((uint8_t *) &stats) + table[i].offset);
 		vp->vp_integer = counter;
 	}
 }
@@ -466,7 +747,7 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x01) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, authvp, &radius_auth_stats);
+		request_stats_addvp(request, authvp, radius_auth_stats);
 	}
 		
 #ifdef WITH_ACCOUNTING
@@ -475,7 +756,7 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x02) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, acctvp, &radius_acct_stats);
+		request_stats_addvp(request, acctvp, radius_acct_stats);
 	}
 #endif
 
@@ -485,7 +766,7 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x04) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_authvp, &proxy_auth_stats);
+		request_stats_addvp(request, proxy_authvp, proxy_auth_stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -494,7 +775,7 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x08) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_acctvp, &proxy_acct_stats);
+		request_stats_addvp(request, proxy_acctvp, proxy_acct_stats);
 	}
 #endif
 #endif
@@ -623,12 +904,12 @@ void request_stats_reply(REQUEST *request)
 
 			if ((flag->vp_integer & 0x01) != 0) {
 				request_stats_addvp(request, client_authvp,
-						    &client->auth);
+						    client->auth);
 			}
 #ifdef WITH_ACCOUNTING
 			if ((flag->vp_integer & 0x01) != 0) {
 				request_stats_addvp(request, client_acctvp,
-						    &client->acct);
+						    client->acct);
 			}
 #endif
 		} /* else client wasn't found, don't echo it back */
@@ -672,14 +953,14 @@ void request_stats_reply(REQUEST *request)
 		if (((flag->vp_integer & 0x01) != 0) &&
 		    ((request->listener->type == RAD_LISTEN_AUTH) ||
 		     (request->listener->type == RAD_LISTEN_NONE))) {
-			request_stats_addvp(request, authvp, &this->stats);
+			request_stats_addvp(request, authvp, this->stats);
 		}
 		
 #ifdef WITH_ACCOUNTING
 		if (((flag->vp_integer & 0x02) != 0) &&
 		    ((request->listener->type == RAD_LISTEN_ACCT) ||
 		     (request->listener->type == RAD_LISTEN_NONE))) {
-			request_stats_addvp(request, acctvp, &this->stats);
+			request_stats_addvp(request, acctvp, this->stats);
 		}
 #endif
 	}
@@ -776,14 +1057,14 @@ void request_stats_reply(REQUEST *request)
 		if (((flag->vp_integer & 0x01) != 0) &&
 		    (home->type == HOME_TYPE_AUTH)) {
 			request_stats_addvp(request, proxy_authvp,
-					    &home->stats);
+					    home->stats);
 		}
 
 #ifdef WITH_ACCOUNTING
 		if (((flag->vp_integer & 0x02) != 0) &&
 		    (home->type == HOME_TYPE_ACCT)) {
 			request_stats_addvp(request, proxy_acctvp,
-					    &home->stats);
+					    home->stats);
 		}
 #endif
 	}
@@ -466,134 +466,152 @@ int dual_tls_send(rad_listen_t *listener, REQUEST *request)
 }
 
 
+/*
+ *	Read everything which SSL has decrypted, and process each
+ *	complete reply in turn.  Any partial packet is left in the
+ *	buffer for the next read.
+ */
 int proxy_tls_recv(rad_listen_t *listener)
 {
-	int rcode;
-	size_t length;
+	int rcode, count = 0;
+	size_t room;
 	listen_socket_t *sock = listener->data;
 	char buffer[256];
 	RADIUS_PACKET *packet;
-	uint8_t *data;
 
-	/*
-	 *	Get the maximum size of data to receive.
-	 */
-	if (!sock->data) sock->data = talloc_array(sock, uint8_t,
-						   sock->ssn->offset);
-	data = sock->data;
+	if (!sock->rbuf) {
+		sock->rbuf = talloc_zero(sock, fr_tcp_buffer_t);
+		if (!sock->rbuf) return 0;
+	}
 
 	DEBUG3("Proxy SSL socket has data to read");
 	PTHREAD_MUTEX_LOCK(&sock->mutex);
-redo:
-	rcode = SSL_read(sock->ssn->ssl, data, 4);
-	if (rcode <= 0) {
-		int err = SSL_get_error(sock->ssn->ssl, rcode);
-		switch (err) {
-		case SSL_ERROR_WANT_READ:
-		case SSL_ERROR_WANT_WRITE:
-			goto redo;
-
-		case SSL_ERROR_ZERO_RETURN:
-			/* remote end sent close_notify, send one back */
-			SSL_shutdown(sock->ssn->ssl);
-
-		case SSL_ERROR_SYSCALL:
-		do_close:
-			PTHREAD_MUTEX_UNLOCK(&sock->mutex);
-			tls_socket_close(listener);
-			return 0;
+	do {
+		room = fr_tcp_buffer_room(sock->rbuf);
+		if (room == 0) break;
 
-		default:
-			while ((err = ERR_get_error())) {
-				DEBUG("proxy recv says %s",
-				      ERR_error_string(err, NULL));
+		rcode = SSL_read(sock->ssn->ssl,
+				 sock->rbuf->data + sock->rbuf->end, room);
+		if (rcode <= 0) {
+			int err = SSL_get_error(sock->ssn->ssl, rcode);
+			switch (err) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				/*
+				 *	There may be complete replies
+				 *	from this read, or an earlier
+				 *	one.  Process them now.
+				 */
+				if (sock->rbuf->end > sock->rbuf->start) {
+					goto read_done;
+				}
+				PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+				return 0;
+
+			case SSL_ERROR_ZERO_RETURN:
+				/* remote end sent close_notify, send one back */
+				SSL_shutdown(sock->ssn->ssl);
+
+			case SSL_ERROR_SYSCALL:
+			do_close:
+				PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+				tls_socket_close(listener);
+				return 0;
+
+			default:
+				while ((err = ERR_get_error())) {
+					DEBUG("proxy recv says %s",
+					      ERR_error_string(err, NULL));
+				}
+
+				goto do_close;
 			}
-			
-			goto do_close;
 		}
-	}
 
-	length = (data[2] << 8) | data[3];
-	DEBUG3("Proxy received header saying we have a packet of %u bytes",
-	       (unsigned int) length);
+		sock->rbuf->end += rcode;
+	} while (SSL_pending(sock->ssn->ssl) > 0);
 
-	if (length > sock->ssn->offset) {
-		radlog(L_INFO,
-		       "Received packet will be too large! Set \"fragment_size=%u\"",
-		       (data[2] << 8) | data[3]);
-		goto do_close;
-	}
-	
-	rcode = SSL_read(sock->ssn->ssl, data + 4, length);
-	if (rcode <= 0) {
-		switch (SSL_get_error(sock->ssn->ssl, rcode)) {
-		case SSL_ERROR_WANT_READ:
-		case SSL_ERROR_WANT_WRITE:
-			break;
+read_done:
+	PTHREAD_MUTEX_UNLOCK(&sock->mutex);
 
-		case SSL_ERROR_ZERO_RETURN:
-			/* remote end sent close_notify, send one back */
-			SSL_shutdown(sock->ssn->ssl);
-			goto do_close;
-		default:
-			goto do_close;
+	while ((rcode = fr_tcp_buffer_packet(sock->rbuf, listener->fd, 0,
+					     &packet)) != 0) {
+		if (rcode < 0) {
+			radlog(L_ERR, "Closing connection to home server %s port %d: %s",
+			       ip_ntoh(&sock->other_ipaddr, buffer, sizeof(buffer)),
+			       sock->other_port, fr_strerror());
+			tls_socket_close(listener);
+			return count;
 		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&sock->mutex);
 
-	packet = rad_alloc(NULL, 0);
-	packet->sockfd = listener->fd;
-	packet->src_ipaddr = sock->other_ipaddr;
-	packet->src_port = sock->other_port;
-	packet->dst_ipaddr = sock->my_ipaddr;
-	packet->dst_port = sock->my_port;
-	packet->code = data[0];
-	packet->id = data[1];
-	packet->data_len = length;
-	packet->data = talloc_array(packet, uint8_t, packet->data_len);
-	memcpy(packet->data, data, packet->data_len);
-	memcpy(packet->vector, packet->data + 4, 16);
+		packet->src_ipaddr = sock->other_ipaddr;
+		packet->src_port = sock->other_port;
+		packet->dst_ipaddr = sock->my_ipaddr;
+		packet->dst_port = sock->my_port;
 
-	/*
-	 *	FIXME: Client MIB updates?
-	 */
-	switch(packet->code) {
-	case PW_AUTHENTICATION_ACK:
-	case PW_ACCESS_CHALLENGE:
-	case PW_AUTHENTICATION_REJECT:
-		break;
+		/*
+		 *	FIXME: Client MIB updates?
+		 */
+		switch(packet->code) {
+		case PW_AUTHENTICATION_ACK:
+		case PW_ACCESS_CHALLENGE:
+		case PW_AUTHENTICATION_REJECT:
+			break;
 
 #ifdef WITH_ACCOUNTING
-	case PW_ACCOUNTING_RESPONSE:
-		break;
+		case PW_ACCOUNTING_RESPONSE:
+			break;
 #endif
 
-	default:
-		/*
-		 *	FIXME: Update MIB for packet types?
-		 */
-		radlog(L_ERR, "Invalid packet code %d sent to a proxy port "
-		       "from home server %s port %d - ID %d : IGNORED",
-		       packet->code,
-		       ip_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
-		       packet->src_port, packet->id);
-		rad_free(&packet);
-		return 0;
-	}
+		default:
+			/*
+			 *	FIXME: Update MIB for packet types?
+			 */
+			radlog(L_ERR, "Invalid packet code %d sent to a proxy port "
+			       "from home server %s port %d - ID %d : IGNORED",
+			       packet->code,
+			       ip_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
+			       packet->src_port, packet->id);
+			rad_free(&packet);
+			continue;
+		}
 
-	if (!request_proxy_reply(packet)) {
-		rad_free(&packet);
-		return 0;
+		if (!request_proxy_reply(packet)) {
+			rad_free(&packet);
+			continue;
+		}
+
+		count++;
 	}
 
-	return 1;
+	return count;
 }
 
-int proxy_tls_send(rad_listen_t *listener, REQUEST *request)
+static ssize_t proxy_tls_write(rad_listen_t *listener,
+			       const uint8_t *data, size_t data_len)
 {
 	int rcode;
 	listen_socket_t *sock = listener->data;
 
+	DEBUG3("Proxy is writing %u bytes to SSL", (unsigned int) data_len);
+	PTHREAD_MUTEX_LOCK(&sock->mutex);
+	rcode = SSL_write(sock->ssn->ssl, data, data_len);
+	if (rcode <= 0) {
+		int err;
+		while ((err = ERR_get_error())) {
+			DEBUG("proxy SSL_write says %s",
+			      ERR_error_string(err, NULL));
+		}
+		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+		return -1;
+	}
+	PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+
+	return rcode;
+}
+
+int proxy_tls_send(rad_listen_t *listener, REQUEST *request)
+{
 	/*
 	 *	Normal proxying calls us with the data already
 	 *	encoded.  The "ping home server" code does not.  So,
@@ -604,21 +622,20 @@ int proxy_tls_send(rad_listen_t *listener, REQUEST *request)
 						request);
 	}
 
-	DEBUG3("Proxy is writing %u bytes to SSL",
-	       (unsigned int) request->proxy->data_len);
-	PTHREAD_MUTEX_LOCK(&sock->mutex);
-	while ((rcode = SSL_write(sock->ssn->ssl, request->proxy->data,
-				  request->proxy->data_len)) < 0) {
-		int err;
-		while ((err = ERR_get_error())) {
-			DEBUG("proxy SSL_write says %s",
-			      ERR_error_string(err, NULL));
-		}
-		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+	/*
+	 *	Requests from many threads are written with one
+	 *	SSL_write().  That is split into TLS records of at most
+	 *	16K, so a large batch may be several records, and a
+	 *	packet may be split across two of them.  The home
+	 *	server reassembles the stream, as we do in
+	 *	proxy_tls_recv().
+	 */
+	if (listen_stream_write(listener, request->proxy->data,
+				request->proxy->data_len,
+				proxy_tls_write) < 0) {
 		tls_socket_close(listener);
 		return 0;
 	}
-	PTHREAD_MUTEX_UNLOCK(&sock->mutex);
 
 	return 1;
 }
@@ -120,27 +120,31 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 #ifdef HAVE_REGEX_H
 	if (check->op == T_OP_REG_EQ) {
 		int i, compare;
-		regex_t reg;
+		fr_regex_t *rx;
 		char value[1024];
+		char errbuf[256];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 
 		vp_prints_value(value, sizeof(value), vp, -1);
 
 		/*
-		 *	Include substring matches.
+		 *	Check items may come from a database, so
+		 *	don't pin them in the regex cache.
 		 */
-		compare = regcomp(&reg, check->vp_strvalue, REG_EXTENDED);
-		if (compare != 0) {
-			char buffer[256];
-			regerror(compare, &reg, buffer, sizeof(buffer));
-
+		rx = regex_cache_find(check->vp_strvalue, REG_EXTENDED, FALSE,
+				      errbuf, sizeof(errbuf));
+		if (!rx) {
 			RDEBUG("Invalid regular expression %s: %s",
-			       check->vp_strvalue, buffer);
+			       check->vp_strvalue, errbuf);
 			return -1;
 		}
-		compare = regexec(&reg, value,  REQUEST_MAX_REGEX + 1,
-				  rxmatch, 0);
-		regfree(&reg);
+
+		/*
+		 *	Include substring matches.
+		 */
+		compare = regex_cache_exec(rx, value, REQUEST_MAX_REGEX + 1,
+					   rxmatch);
+		regex_cache_release(rx);
 
 		/*
 		 *	Add %{0}, %{1}, etc.
@@ -195,28 +199,24 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 
 	if (check->op == T_OP_REG_NE) {
 		int compare;
-		regex_t reg;
+		fr_regex_t *rx;
 		char value[1024];
+		char errbuf[256];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 
 		vp_prints_value(value, sizeof(value), vp, -1);
 
-		/*
-		 *	Include substring matches.
-		 */
-		compare = regcomp(&reg, (char *)check->vp_strvalue,
-				  REG_EXTENDED);
-		if (compare != 0) {
-			char buffer[256];
-			regerror(compare, &reg, buffer, sizeof(buffer));
-
+		rx = regex_cache_find(check->vp_strvalue, REG_EXTENDED, FALSE,
+				      errbuf, sizeof(errbuf));
+		if (!rx) {
 			RDEBUG("Invalid regular expression %s: %s",
-			       check->vp_strvalue, buffer);
+			       check->vp_strvalue, errbuf);
 			return -1;
 		}
-		compare = regexec(&reg, value,  REQUEST_MAX_REGEX + 1,
-				  rxmatch, 0);
-		regfree(&reg);
+
+		compare = regex_cache_exec(rx, value, REQUEST_MAX_REGEX + 1,
+					   rxmatch);
+		regex_cache_release(rx);
 
 		if (compare != 0) return 0;
 		return -1;
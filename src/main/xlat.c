@@ -42,6 +42,12 @@ typedef struct xlat_t {
 
 static rbtree_t *xlat_root = NULL;
 
+/*
+ *	Bumped whenever an xlat_t is freed, so that compiled
+ *	expansions know their bound xlat_t pointers are stale.
+ */
+static unsigned int xlat_generation = 0;
+
 /*
  *	Define all xlat's in the structure.
  */
@@ -108,17 +114,15 @@ static int valuepair2str(char * out,int outlen,VALUE_PAIR * pair, int type)
 }
 
 /*
- *	Dynamically translate for check:, request:, reply:, etc.
+ *	Resolve the list used by check:, request:, reply:, etc.
  */
-static size_t xlat_packet(void *instance, REQUEST *request,
-			  const char *fmt, char *out, size_t outlen)
+static int xlat_packet_list(int list, REQUEST *request,
+			    VALUE_PAIR **pvps, RADIUS_PACKET **ppacket)
 {
-	const DICT_ATTR	*da;
-	VALUE_PAIR	*vp;
 	VALUE_PAIR	*vps = NULL;
 	RADIUS_PACKET	*packet = NULL;
 
-	switch (*(int*) instance) {
+	switch (list) {
 	case 0:
 		vps = request->config_items;
 		break;
@@ -168,6 +172,30 @@ static size_t xlat_packet(void *instance, REQUEST *request,
 		break;
 			
 	default:		/* WTF? */
+		return -1;
+	}
+
+	*pvps = vps;
+	*ppacket = packet;
+	return 0;
+}
+
+static size_t xlat_packet_attr(REQUEST *request, VALUE_PAIR *vps,
+			       RADIUS_PACKET *packet, const DICT_ATTR *da,
+			       char *out, size_t outlen);
+
+/*
+ *	Dynamically translate for check:, request:, reply:, etc.
+ */
+static size_t xlat_packet(void *instance, REQUEST *request,
+			  const char *fmt, char *out, size_t outlen)
+{
+	const DICT_ATTR	*da;
+	VALUE_PAIR	*vp;
+	VALUE_PAIR	*vps;
+	RADIUS_PACKET	*packet;
+
+	if (xlat_packet_list(*(int*) instance, request, &vps, &packet) < 0) {
 		return 0;
 	}
 
@@ -328,6 +356,19 @@ static size_t xlat_packet(void *instance, REQUEST *request,
 		return valuepair2str(out, outlen, vp, da->type);
 	}
 
+	return xlat_packet_attr(request, vps, packet, da, out, outlen);
+}
+
+/*
+ *	Print the first instance of a resolved attribute, or one of
+ *	the "magic" attributes which live in the packet.
+ */
+static size_t xlat_packet_attr(REQUEST *request, VALUE_PAIR *vps,
+			       RADIUS_PACKET *packet, const DICT_ATTR *da,
+			       char *out, size_t outlen)
+{
+	VALUE_PAIR	*vp;
+
 	vp = pairfind(vps, da->attr, da->vendor, TAG_ANY);
 	if (!vp) {
 		/*
@@ -911,6 +952,7 @@ void xlat_unregister(const char *module, UNUSED RAD_XLAT_FUNC func, void *instan
 	if (c->instance != instance) return;
 
 	rbtree_deletebydata(xlat_root, c);
+	xlat_generation++;
 }
 
 /** De-register all xlat functions, used mainly for debugging.
@@ -919,9 +961,79 @@ void xlat_unregister(const char *module, UNUSED RAD_XLAT_FUNC func, void *instan
 void xlat_free(void)
 {
 	rbtree_free(xlat_root);
+	xlat_generation++;
 }
 
 
+/** Escape the output of an expansion
+ *
+ * @param[in] request Current server request.
+ * @param[out] q where to write the output.
+ * @param[in] freespace remaining in output buffer.
+ * @param[in] tmpbuf the unescaped expansion, or NULL if it was written
+ *	directly to q.
+ * @param[in] retlen length of the expansion.
+ * @param[in] do_length write the length of the expansion instead of the
+ *	expansion itself, for %{#...}.
+ * @param[in] func Optional function to escape output.
+ * @param[in] funcarg pointer to pass to escape function.
+ * @return number of bytes written to q.
+ */
+static int xlat_escape(REQUEST *request, char *q, int freespace,
+		       const char *tmpbuf, int retlen, int do_length,
+		       RADIUS_ESCAPE_STRING func, void *funcarg)
+{
+	if (tmpbuf && (retlen > 0)) {
+		retlen = func(request, q, freespace, tmpbuf, funcarg);
+		if (retlen > 0) {
+			RDEBUG2("\tescape: \'%s\' -> \'%s\'", tmpbuf, q);
+		} else if (retlen < 0) {
+			RDEBUG2("String escape failed");
+			retlen = 0;
+		}
+	}
+	if ((retlen > 0) && do_length) {
+		snprintf(q, freespace, "%d", retlen);
+		retlen = strlen(q);
+	}
+
+	return retlen;
+}
+
+/** Call an xlat function, and escape its output
+ *
+ * @param[in] do_xlat function to call.
+ * @param[in] instance argument to the xlat function.
+ * @param[in] xlat_str string passed to the xlat function.
+ * @param[in] do_length write the length of the expansion instead of the
+ *	expansion itself, for %{#...}.
+ * @param[in] request Current server request.
+ * @param[out] q where to write the output.
+ * @param[in] freespace remaining in output buffer.
+ * @param[in] func Optional function to escape output.
+ * @param[in] funcarg pointer to pass to escape function.
+ * @return number of bytes written to q.
+ */
+static int xlat_call(RAD_XLAT_FUNC do_xlat, void *instance,
+		     const char *xlat_str, int do_length, REQUEST *request,
+		     char *q, int freespace,
+		     RADIUS_ESCAPE_STRING func, void *funcarg)
+{
+	int retlen;
+
+	if (func) {
+		/* xlat to a temporary buffer, then escape */
+		char tmpbuf[8192];
+		retlen = do_xlat(instance, request, xlat_str, tmpbuf, sizeof(tmpbuf));
+		return xlat_escape(request, q, freespace, tmpbuf, retlen,
+				   do_length, func, funcarg);
+	}
+
+	retlen = do_xlat(instance, request, xlat_str, q, freespace);
+	return xlat_escape(request, q, freespace, NULL, retlen,
+			   do_length, func, funcarg);
+}
+
 /** Decode an attribute name into a string
  *
  * This expands the various formats:
@@ -1150,28 +1262,9 @@ do_xlat:
 
 	if (!c->internal) RDEBUG3("radius_xlat: Running registered xlat function of module %s for string \'%s\'",
 				  c->module, xlat_str);
-	if (func) {
-		/* xlat to a temporary buffer, then escape */
-		char tmpbuf[8192];
-		retlen = c->do_xlat(c->instance, request, xlat_str, tmpbuf, sizeof(tmpbuf));
-		if (retlen > 0) {
-			retlen = func(request, q, freespace, tmpbuf, funcarg);
-			if (retlen > 0) {
-				RDEBUG2("\tescape: \'%s\' -> \'%s\'", tmpbuf, q);
-			} else if (retlen < 0) {
-				RDEBUG2("String escape failed");
-			}
-		}
-	} else {
-		retlen = c->do_xlat(c->instance, request, xlat_str, q, freespace);
-	}
-	if (retlen > 0) {
-		if (do_length) {
-			snprintf(q, freespace, "%d", retlen);
-			retlen = strlen(q);
-		}
-		
-	} else if (next) {
+	retlen = xlat_call(c->do_xlat, c->instance, xlat_str, do_length,
+			   request, q, freespace, func, funcarg);
+	if ((retlen <= 0) && next) {
 		/*
 		 *	Expand the second bit.
 		 */
@@ -1185,6 +1278,135 @@ done:
 	return 0;
 }
 
+/** Expand a single character %X sequence
+ *
+ * @param[in] c the character after the '%'.
+ * @param[in] request current request.
+ * @param[out] q where to write the output.
+ * @param[in] freespace remaining in output buffer.
+ * @return number of bytes written to q, or -1 if the sequence is unknown.
+ */
+static int xlat_percent(int c, REQUEST *request, char *q, int freespace)
+{
+	int len;
+	char *start = q;
+	char *nl;
+	VALUE_PAIR *tmp;
+	struct tm *TM, s_TM;
+	char tmpdt[40]; /* For temporary storing of dates */
+
+	switch (c) {
+	case 'd': /* request day */
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%d", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 'l': /* request timestamp */
+		snprintf(tmpdt, sizeof(tmpdt), "%lu",
+			 (unsigned long) request->timestamp);
+		strlcpy(q,tmpdt,freespace);
+		q += strlen(q);
+		break;
+	case 'm': /* request month */
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%m", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 't': /* request timestamp */
+		CTIME_R(&request->timestamp, tmpdt, sizeof(tmpdt));
+		nl = strchr(tmpdt, '\n');
+		if (nl) *nl = '\0';
+		strlcpy(q, tmpdt, freespace);
+		q += strlen(q);
+		break;
+	case 'C': /* ClientName */
+		strlcpy(q,request->client->shortname,freespace);
+		q += strlen(q);
+		break;
+	case 'D': /* request date */
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%Y%m%d", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 'G': /* request minute */
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%M", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 'H': /* request hour */
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%H", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 'I': /* Request ID */
+		snprintf(tmpdt, sizeof(tmpdt), "%i", request->packet->id);
+		strlcpy(q, tmpdt, freespace);
+		q += strlen(q);
+		break;
+	case 'S': /* request timestamp in SQL format*/
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%Y-%m-%d %H:%M:%S", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 'T': /* request timestamp */
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%Y-%m-%d-%H.%M.%S.000000", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 'V': /* Request-Authenticator */
+		strlcpy(q,"Verified",freespace);
+		q += strlen(q);
+		break;
+	case 'Y': /* request year */
+		TM = localtime_r(&request->timestamp, &s_TM);
+		len = strftime(tmpdt, sizeof(tmpdt), "%Y", TM);
+		if (len > 0) {
+			strlcpy(q, tmpdt, freespace);
+			q += strlen(q);
+		}
+		break;
+	case 'Z': /* Full request pairs except password */
+		tmp = request->packet->vps;
+		while (tmp && (freespace > 3)) {
+			if (!(!tmp->da->vendor &&
+			    (tmp->da->attr == PW_USER_PASSWORD))) {
+				*q++ = '\t';
+				len = vp_prints(q, freespace - 2, tmp);
+				q += len;
+				freespace -= (len + 2);
+				*q++ = '\n';
+			}
+			tmp = tmp->next;
+		}
+		break;
+	default:
+		return -1;
+	}
+
+	return q - start;
+}
+
 /** Replace %whatever in a string.
  *
  * See 'doc/variables.txt' for more information.
@@ -1204,10 +1426,6 @@ size_t radius_xlat(char *out, int outlen, const char *fmt,
 	int c, len, freespace;
 	const char *p;
 	char *q;
-	char *nl;
-	VALUE_PAIR *tmp;
-	struct tm *TM, s_TM;
-	char tmpdt[40]; /* For temporary storing of dates */
 
 	/*
 	 *	Catch bad modules.
@@ -1270,136 +1488,551 @@ size_t radius_xlat(char *out, int outlen, const char *fmt,
 			case '%':
 				*q++ = *p++;
 				break;
-			case 'd': /* request day */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%d", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'l': /* request timestamp */
-				snprintf(tmpdt, sizeof(tmpdt), "%lu",
-					 (unsigned long) request->timestamp);
-				strlcpy(q,tmpdt,freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'm': /* request month */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%m", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 't': /* request timestamp */
-				CTIME_R(&request->timestamp, tmpdt, sizeof(tmpdt));
-				nl = strchr(tmpdt, '\n');
-				if (nl) *nl = '\0';
-				strlcpy(q, tmpdt, freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'C': /* ClientName */
-				strlcpy(q,request->client->shortname,freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'D': /* request date */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y%m%d", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'G': /* request minute */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%M", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
+
+			default:
+				len = xlat_percent(*p, request, q, freespace);
+				if (len >= 0) {
+					q += len;
+					p++;
+					break;
 				}
-				p++;
-				break;
-			case 'H': /* request hour */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%H", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
+
+				RDEBUG2W("Unknown variable '%%%c': See 'doc/variables.txt'", *p);
+				if (freespace > 2) {
+					*q++ = '%';
+					*q++ = *p++;
 				}
-				p++;
 				break;
-			case 'I': /* Request ID */
-				snprintf(tmpdt, sizeof(tmpdt), "%i", request->packet->id);
-				strlcpy(q, tmpdt, freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'S': /* request timestamp in SQL format*/
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y-%m-%d %H:%M:%S", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
+		}
+	}
+	*q = '\0';
+
+	RDEBUG2("\texpand: '%s' -> '%s'", fmt, out);
+
+	return strlen(out);
+}
+
+/*
+ *	Pre-compiled expansions.
+ *
+ *	radius_xlat() re-parses the format string, and re-resolves
+ *	attribute and module names every time it's called.  Most
+ *	formats (SQL queries, linelog lines, detail filenames) are
+ *	static, so we parse them once into a list of tokens, and
+ *	expand the tokens at run time.
+ */
+typedef enum xlat_token_type {
+	XLAT_LITERAL = 0,	//!< Literal text, copied as-is.
+	XLAT_PERCENT,		//!< Single character %X expansion.
+	XLAT_ATTRIBUTE,		//!< %{list:Attribute} with a resolved DICT_ATTR.
+	XLAT_MODULE,		//!< %{module:string}.
+	XLAT_VARIABLE		//!< Anything else, see decode_attribute().
+} xlat_token_type_t;
+
+typedef struct xlat_token {
+	xlat_token_type_t	type;
+	char			*fmt;		//!< Literal text, the string
+						//!< passed to the xlat function,
+						//!< or the complete %{...}.
+	size_t			len;		//!< Length of literal text.
+	int			percent;	//!< For XLAT_PERCENT.
+	int			do_length;	//!< %{#...}
+
+	int			list;		//!< For XLAT_ATTRIBUTE.
+	const DICT_ATTR		*da;		//!< For XLAT_ATTRIBUTE.
+
+	char			*module;	//!< For XLAT_MODULE.
+	const xlat_t		*xlat;		//!< Bound xlat function.
+	unsigned int		generation;	//!< Of the bound xlat function.
+
+	struct xlat_token	*next;
+} xlat_token_t;
+
+struct xlat_exp {
+	const char		*fmt;		//!< Original format string.
+	xlat_token_t		*head;
+	int			invalid;	//!< fmt couldn't be parsed, fall
+						//!< back to radius_xlat().
+};
+
+static xlat_token_t *xlat_token_alloc(xlat_exp_t *exp, xlat_token_t ***tail,
+				      xlat_token_type_t type)
+{
+	xlat_token_t *tok;
+
+	tok = talloc_zero(exp, xlat_token_t);
+	tok->type = type;
+	**tail = tok;
+	*tail = &tok->next;
+
+	return tok;
+}
+
+/*
+ *	Add literal text, merging it with the previous literal token
+ *	if possible.
+ */
+static void xlat_literal_add(xlat_exp_t *exp, xlat_token_t **last,
+			     xlat_token_t ***tail, const char *text, size_t len)
+{
+	xlat_token_t *tok = *last;
+
+	if (!tok || (tok->type != XLAT_LITERAL)) {
+		tok = xlat_token_alloc(exp, tail, XLAT_LITERAL);
+		tok->fmt = talloc_array(tok, char, 1);
+		tok->fmt[0] = '\0';
+		*last = tok;
+	}
+
+	tok->fmt = talloc_realloc(tok, tok->fmt, char, tok->len + len + 1);
+	memcpy(tok->fmt + tok->len, text, len);
+	tok->len += len;
+	tok->fmt[tok->len] = '\0';
+}
+
+/*
+ *	Parse the contents of %{...} into a token.
+ */
+static void xlat_variable_compile(xlat_token_t *tok, const char *var)
+{
+	char *buffer, *p, *l;
+	const char *module_name = NULL;
+	const xlat_t *c;
+
+	tok->type = XLAT_VARIABLE;
+	buffer = talloc_strdup(tok, var);
+
+	p = buffer + 2;
+	p[strlen(p) - 1] = '\0';	/* kill the trailing '}' */
+	if (*p == '#') {
+		p++;
+		tok->do_length = 1;
+	}
+
+	/*
+	 *	%{%{foo}:-%{bar}} is left to decode_attribute().
+	 */
+	if ((p[0] == '%') && (p[1] == '{')) goto done;
+
+	for (l = p; *l != '\0'; l++) {
+		if (*l == ':') {
+			module_name = p;
+			*l = '\0';
+			p = l + 1;
+			break;
+		}
+
+		if ((*l == ' ') || (*l == '\t')) break;
+	}
+
+	if (!module_name) {
+		/*
+		 *	Same lookup order as decode_attribute().
+		 */
+		c = xlat_find(p);
+		if (c) {
+			module_name = p;
+			goto module;
+		}
+
+		tok->da = dict_attrbyname(p);
+		if (!tok->da) goto done;
+
+		tok->type = XLAT_ATTRIBUTE;
+		tok->list = 1;	/* request */
+		goto done;
+	}
+
+	/*
+	 *	Old-style %{foo:-bar}
+	 */
+	if (*p == '-') goto done;
+
+	c = xlat_find(module_name);
+	if (c && (c->do_xlat == xlat_packet)) {
+		tok->da = dict_attrbyname(p);
+		if (tok->da) {
+			tok->type = XLAT_ATTRIBUTE;
+			tok->list = *(int *) c->instance;
+			goto done;
+		}
+	}
+
+	/*
+	 *	The module may not have been instantiated yet, in which
+	 *	case we look it up by name when expanding.
+	 */
+module:
+	tok->type = XLAT_MODULE;
+	tok->module = talloc_strdup(tok, module_name);
+	tok->xlat = c;
+	tok->generation = xlat_generation;
+	tok->fmt = talloc_strdup(tok, p);
+
+done:
+	if (tok->type == XLAT_VARIABLE) tok->fmt = talloc_strdup(tok, var);
+	talloc_free(buffer);
+}
+
+/** Pre-parse a format string for radius_xlat_compiled()
+ *
+ * Literal text is collected into runs, attribute references are
+ * resolved to DICT_ATTRs, and %{module:...} expansions are bound
+ * to their xlat functions.
+ *
+ * If the string can't be parsed, a warning is printed, and
+ * radius_xlat_compiled() falls back to calling radius_xlat(),
+ * which will fail in the same way it always has.
+ *
+ * @param[in] ctx to allocate the compiled expansion in.
+ * @param[in] fmt string to compile.  Must remain valid for the
+ *	lifetime of the compiled expansion.
+ * @return compiled expansion, or NULL if fmt is NULL.
+ */
+xlat_exp_t *xlat_compile(TALLOC_CTX *ctx, const char *fmt)
+{
+	xlat_exp_t *exp;
+	xlat_token_t *tok, *last = NULL, **tail;
+	const char *p;
+	char *buffer;
+	int len;
+
+	if (!fmt) return NULL;
+
+	exp = talloc_zero(ctx, xlat_exp_t);
+	exp->fmt = fmt;
+	tail = &exp->head;
+
+	buffer = talloc_array(exp, char, strlen(fmt) + 1);
+
+	p = fmt;
+	while (*p && !exp->invalid) {
+		char c = *p;
+
+		if ((c != '%') && (c != '$') && (c != '\\')) {
+			len = strcspn(p, "%$\\");
+			xlat_literal_add(exp, &last, &tail, p, len);
+			p += len;
+			continue;
+		}
+
+		/*
+		 *	Trailing '%', '$' or '\\' is copied as-is.
+		 */
+		if (*++p == '\0') {
+			xlat_literal_add(exp, &last, &tail, &c, 1);
+			break;
+		}
+
+		if (c == '\\') {
+			switch (*p) {
+			case '\\':
+				xlat_literal_add(exp, &last, &tail, "\\", 1);
 				break;
-			case 'T': /* request timestamp */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y-%m-%d-%H.%M.%S.000000", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
+			case 't':
+				xlat_literal_add(exp, &last, &tail, "\t", 1);
 				break;
-			case 'V': /* Request-Authenticator */
-				strlcpy(q,"Verified",freespace);
-				q += strlen(q);
-				p++;
+			case 'n':
+				xlat_literal_add(exp, &last, &tail, "\n", 1);
 				break;
-			case 'Y': /* request year */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
+			default:
+				xlat_literal_add(exp, &last, &tail, p - 1, 2);
 				break;
-			case 'Z': /* Full request pairs except password */
-				tmp = request->packet->vps;
-				while (tmp && (freespace > 3)) {
-					if (!(!tmp->da->vendor &&
-					    (tmp->da->attr == PW_USER_PASSWORD))) {
-						*q++ = '\t';
-						len = vp_prints(q, freespace - 2, tmp);
-						q += len;
-						freespace -= (len + 2);
-						*q++ = '\n';
-					}
-					tmp = tmp->next;
-				}
-				p++;
+			}
+			p++;
+			continue;
+		}
+
+		/*
+		 *	radius_xlat() silently eats '$'.
+		 */
+		if (c != '%') continue;
+
+		switch (*p) {
+		case '{':
+			len = rad_copy_variable(buffer, p - 1);
+			if (len < 0) {
+				DEBUGW("Badly formatted variable in \"%s\"", fmt);
+				exp->invalid = TRUE;
 				break;
-			default:
-				RDEBUG2W("Unknown variable '%%%c': See 'doc/variables.txt'", *p);
-				if (freespace > 2) {
-					*q++ = '%';
-					*q++ = *p++;
-				}
+			}
+
+			tok = xlat_token_alloc(exp, &tail, XLAT_VARIABLE);
+			xlat_variable_compile(tok, buffer);
+			last = tok;
+			p += len - 1;
+			break;
+
+		case '%':
+			xlat_literal_add(exp, &last, &tail, "%", 1);
+			p++;
+			break;
+
+		case 'd':
+		case 'l':
+		case 'm':
+		case 't':
+		case 'C':
+		case 'D':
+		case 'G':
+		case 'H':
+		case 'I':
+		case 'S':
+		case 'T':
+		case 'V':
+		case 'Y':
+		case 'Z':
+			tok = xlat_token_alloc(exp, &tail, XLAT_PERCENT);
+			tok->percent = *p;
+			last = tok;
+			p++;
+			break;
+
+		default:
+			DEBUGW("Unknown variable '%%%c' in \"%s\": See 'doc/variables.txt'",
+			       *p, fmt);
+			xlat_literal_add(exp, &last, &tail, p - 1, 2);
+			p++;
+			break;
+		}
+	}
+
+	talloc_free(buffer);
+
+	return exp;
+}
+
+/** Check whether a compiled format string expands to constant text
+ *
+ * @param[in] exp compiled format string.
+ * @return the text it always expands to, or NULL if the expansion
+ *	depends on the request.
+ */
+const char *xlat_literal(const xlat_exp_t *exp)
+{
+	if (!exp || exp->invalid) return NULL;
+
+	if (!exp->head) return "";
+
+	if (exp->head->next || (exp->head->type != XLAT_LITERAL)) return NULL;
+
+	return exp->head->fmt;
+}
+
+/*
+ *	Expand an XLAT_ATTRIBUTE token.
+ */
+static size_t xlat_attribute(const xlat_token_t *tok, REQUEST *request,
+			     char *out, size_t outlen)
+{
+	VALUE_PAIR	*vps;
+	RADIUS_PACKET	*packet;
+
+	if (xlat_packet_list(tok->list, request, &vps, &packet) < 0) {
+		return 0;
+	}
+
+	return xlat_packet_attr(request, vps, packet, tok->da, out, outlen);
+}
+
+/** Expand a format string which was compiled with xlat_compile()
+ *
+ * Produces the same output as radius_xlat() on the original format
+ * string.
+ *
+ * @param[out] out output buffer.
+ * @param[in] outlen size of output buffer.
+ * @param[in] exp compiled format string.
+ * @param[in] request current request.
+ * @param[in] func function to escape final value e.g. SQL quoting.
+ * @param[in] funcarg pointer to pass to escape function.
+ * @return length of string written.
+ */
+size_t radius_xlat_compiled(char *out, int outlen, const xlat_exp_t *exp,
+			    REQUEST *request,
+			    RADIUS_ESCAPE_STRING func, void *funcarg)
+{
+	int len, freespace;
+	char *q;
+	const xlat_token_t *tok;
+	const xlat_t *c;
+
+	if (!exp || !out || !request) return 0;
+
+	if (exp->invalid) {
+		return radius_xlat(out, outlen, exp->fmt, request,
+				   func, funcarg);
+	}
+
+	q = out;
+	for (tok = exp->head; tok != NULL; tok = tok->next) {
+		freespace = outlen - (q - out);
+		if (freespace <= 1) break;
+
+		switch (tok->type) {
+		case XLAT_LITERAL:
+			len = tok->len;
+			if (len > (freespace - 1)) len = freespace - 1;
+			memcpy(q, tok->fmt, len);
+			q += len;
+			break;
+
+		case XLAT_PERCENT:
+			q += xlat_percent(tok->percent, request, q, freespace);
+			break;
+
+		case XLAT_ATTRIBUTE:
+			if (func) {
+				char tmpbuf[8192];
+
+				len = xlat_attribute(tok, request, tmpbuf, sizeof(tmpbuf));
+				q += xlat_escape(request, q, freespace, tmpbuf, len,
+						 tok->do_length, func, funcarg);
 				break;
+			}
+
+			len = xlat_attribute(tok, request, q, freespace);
+			q += xlat_escape(request, q, freespace, NULL, len,
+					 tok->do_length, func, funcarg);
+			break;
+
+		case XLAT_MODULE:
+			c = tok->xlat;
+			if (!c || (tok->generation != xlat_generation)) {
+				c = xlat_find(tok->module);
+			}
+			if (!c) {
+				RDEBUG2W("Unknown module \"%s\" in string expansion \"%s\"",
+					 tok->module, tok->fmt);
+				*out = '\0';
+				return 0;
+			}
+
+			if (!c->internal) RDEBUG3("radius_xlat: Running registered xlat function of module %s for string \'%s\'",
+						  c->module, tok->fmt);
+			q += xlat_call(c->do_xlat, c->instance, tok->fmt,
+				       tok->do_length, request, q, freespace,
+				       func, funcarg);
+			break;
+
+		case XLAT_VARIABLE:
+		{
+			const char *from = tok->fmt;
+
+			if (decode_attribute(&from, &q, freespace, request,
+					     func, funcarg) < 0) {
+				*out = '\0';
+				return 0;
+			}
+		}
+			break;
 		}
 	}
 	*q = '\0';
 
-	RDEBUG2("\texpand: '%s' -> '%s'", fmt, out);
+	RDEBUG2("\texpand: '%s' -> '%s'", exp->fmt, out);
 
 	return strlen(out);
 }
+
+/*
+ *	Compiled expansions for every CONF_PAIR in a section.
+ */
+struct xlat_section {
+	rbtree_t	*tree;
+};
+
+typedef struct xlat_section_entry {
+	const CONF_PAIR	*cp;
+	xlat_exp_t	*exp;
+} xlat_section_entry_t;
+
+static int xlat_section_cmp(const void *one, const void *two)
+{
+	const xlat_section_entry_t *a = one;
+	const xlat_section_entry_t *b = two;
+
+	if (a->cp < b->cp) return -1;
+	if (a->cp > b->cp) return +1;
+	return 0;
+}
+
+static int xlat_section_free(void *ctx)
+{
+	xlat_section_t *xs = ctx;
+
+	rbtree_free(xs->tree);
+	return 0;
+}
+
+static void xlat_section_walk(xlat_section_t *xs, CONF_SECTION *cs)
+{
+	CONF_ITEM *ci;
+	xlat_section_entry_t *entry;
+	const char *value;
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			xlat_section_walk(xs, cf_itemtosection(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		value = cf_pair_value(cf_itemtopair(ci));
+		if (!value) continue;
+
+		entry = talloc_zero(xs, xlat_section_entry_t);
+		entry->cp = cf_itemtopair(ci);
+		entry->exp = xlat_compile(entry, value);
+		rbtree_insert(xs->tree, entry);
+	}
+}
+
+/** Compile the values of all CONF_PAIRs in a section, and its subsections
+ *
+ * Used by modules which pick the format to expand at run time, e.g. via
+ * a "reference" to a CONF_PAIR.
+ *
+ * @param[in] ctx to allocate the compiled expansions in.
+ * @param[in] cs to compile.
+ * @return the compiled expansions, to be searched with xlat_section_find().
+ */
+xlat_section_t *xlat_compile_section(TALLOC_CTX *ctx, CONF_SECTION *cs)
+{
+	xlat_section_t *xs;
+
+	xs = talloc_zero(ctx, xlat_section_t);
+	xs->tree = rbtree_create(xlat_section_cmp, NULL, 0);
+	if (!xs->tree) {
+		talloc_free(xs);
+		return NULL;
+	}
+	talloc_set_destructor((void *) xs, xlat_section_free);
+
+	xlat_section_walk(xs, cs);
+
+	return xs;
+}
+
+/** Find the compiled expansion for a CONF_PAIR
+ *
+ * @param[in] xs compiled section.
+ * @param[in] cp to find.
+ * @return compiled expansion, or NULL if cp wasn't in the section.
+ */
+const xlat_exp_t *xlat_section_find(const xlat_section_t *xs,
+				    const CONF_PAIR *cp)
+{
+	xlat_section_entry_t my_entry, *entry;
+
+	if (!xs || !cp) return NULL;
+
+	my_entry.cp = cp;
+	entry = rbtree_finddata(xs->tree, &my_entry);
+	if (!entry) return NULL;
+
+	return entry->exp;
+}
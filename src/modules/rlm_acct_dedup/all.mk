@@ -0,0 +1,4 @@
+TARGET		:= rlm_acct_dedup.a
+SOURCES		:= rlm_acct_dedup.c
+
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,430 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_acct_dedup.c
+ * @brief Suppress accounting records which have already been written.
+ *
+ * @copyright 2013  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+
+/*
+ *	The entries are split across a number of tables, each with
+ *	its own lock, so that threads rarely wait for each other.
+ *	The table is chosen by the top bits of the hash, as the
+ *	hash table uses the bottom ones.
+ */
+#define DEDUP_STRIPES		(16)
+#define DEDUP_STRIPE(_hash)	((_hash) >> 28)
+
+/*
+ *	One accounting record.  The entries in a stripe are also on
+ *	a list, oldest first.  The lifetime is the same for all of
+ *	them, so the oldest entry is always the next one to expire.
+ */
+typedef struct dedup_entry_t {
+	struct dedup_entry_t	*prev;
+	struct dedup_entry_t	*next;
+
+	uint32_t		hash;
+	time_t			created;
+	int			done;		//!< Or still being processed.
+
+	const char		*id;		//!< Acct-Unique-Session-Id.
+	uint32_t		status;		//!< Acct-Status-Type.
+	unsigned int		time_attr;	//!< Which attribute "when" is from.
+	uint32_t		when;
+} dedup_entry_t;
+
+typedef struct dedup_stripe_t {
+	fr_hash_table_t		*ht;
+	dedup_entry_t		*head;
+	dedup_entry_t		*tail;
+	int			num;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+} dedup_stripe_t;
+
+typedef struct rlm_acct_dedup_t {
+	const char		*name;
+	int			max_entries;
+	int			lifetime;
+
+	int			stripe_entries;
+	dedup_stripe_t		stripes[DEDUP_STRIPES];
+} rlm_acct_dedup_t;
+
+/*
+ *	Remembers which record a request added, so that it can be
+ *	marked as written, or removed if it never is.
+ */
+typedef struct dedup_pending_t {
+	rlm_acct_dedup_t	*inst;
+	dedup_entry_t		key;
+	int			committed;
+} dedup_pending_t;
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+static const CONF_PARSER module_config[] = {
+	{ "max_entries", PW_TYPE_INTEGER,
+	  offsetof(rlm_acct_dedup_t, max_entries), NULL, "65536" },
+	{ "lifetime", PW_TYPE_INTEGER,
+	  offsetof(rlm_acct_dedup_t, lifetime), NULL, "3600" },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+static uint32_t dedup_entry_hash(const void *data)
+{
+	const dedup_entry_t *e = data;
+
+	return e->hash;
+}
+
+static int dedup_entry_cmp(const void *one, const void *two)
+{
+	const dedup_entry_t *a = one;
+	const dedup_entry_t *b = two;
+
+	if (a->status != b->status) return a->status - b->status;
+	if (a->time_attr != b->time_attr) return a->time_attr - b->time_attr;
+	if (a->when < b->when) return -1;
+	if (a->when > b->when) return +1;
+
+	return strcmp(a->id, b->id);
+}
+
+static void dedup_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+/*
+ *	Build the key for an accounting record.  Records without an
+ *	Acct-Unique-Session-Id, or which can't be told apart from
+ *	other records in the same session, are never suppressed.
+ */
+static int dedup_key(REQUEST *request, dedup_entry_t *key)
+{
+	VALUE_PAIR *vp;
+
+	memset(key, 0, sizeof(*key));
+
+	vp = pairfind(request->packet->vps, PW_ACCT_UNIQUE_SESSION_ID, 0, TAG_ANY);
+	if (!vp || !vp->length) return -1;
+	key->id = vp->vp_strvalue;
+
+	vp = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE, 0, TAG_ANY);
+	if (!vp) return -1;
+	key->status = vp->vp_integer;
+
+	vp = pairfind(request->packet->vps, PW_ACCT_SESSION_TIME, 0, TAG_ANY);
+	if (!vp) vp = pairfind(request->packet->vps, PW_EVENT_TIMESTAMP, 0, TAG_ANY);
+	if (vp) {
+		key->time_attr = vp->da->attr;
+		key->when = (vp->da->type == PW_TYPE_DATE) ? vp->vp_date : vp->vp_integer;
+
+	} else if (key->status != PW_STATUS_START) {
+		return -1;
+	}
+
+	key->hash = fr_hash_string(key->id);
+	key->hash = fr_hash_update(&key->status, sizeof(key->status), key->hash);
+	key->hash = fr_hash_update(&key->time_attr, sizeof(key->time_attr), key->hash);
+	key->hash = fr_hash_update(&key->when, sizeof(key->when), key->hash);
+
+	return 0;
+}
+
+/*
+ *	Must be called with the stripe locked.
+ */
+static void dedup_remove(dedup_stripe_t *stripe, dedup_entry_t *e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		stripe->head = e->next;
+	}
+
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		stripe->tail = e->prev;
+	}
+
+	stripe->num--;
+	fr_hash_table_delete(stripe->ht, e);
+}
+
+/*
+ *	Must be called with the stripe locked.  When the stripe is
+ *	full, the oldest entry is thrown away, even if it hasn't
+ *	expired.
+ */
+static dedup_entry_t *dedup_insert(rlm_acct_dedup_t *inst,
+				   dedup_stripe_t *stripe,
+				   const dedup_entry_t *key, time_t now)
+{
+	dedup_entry_t *e;
+
+	while (stripe->head &&
+	       ((stripe->num >= inst->stripe_entries) ||
+		((stripe->head->created + inst->lifetime) <= now))) {
+		dedup_remove(stripe, stripe->head);
+	}
+
+	e = talloc_zero(NULL, dedup_entry_t);
+	if (!e) return NULL;
+
+	e->hash = key->hash;
+	e->created = now;
+	e->id = talloc_strdup(e, key->id);
+	e->status = key->status;
+	e->time_attr = key->time_attr;
+	e->when = key->when;
+
+	if (!fr_hash_table_insert(stripe->ht, e)) {
+		talloc_free(e);
+		return NULL;
+	}
+
+	e->prev = stripe->tail;
+	if (stripe->tail) {
+		stripe->tail->next = e;
+	} else {
+		stripe->head = e;
+	}
+	stripe->tail = e;
+	stripe->num++;
+
+	return e;
+}
+
+/*
+ *	Called when the request is freed.  If the record was never
+ *	written, the NAS will send it again, and it has to be
+ *	processed then.
+ */
+static void dedup_pending_free(void *data)
+{
+	dedup_pending_t	*pending = data;
+	dedup_stripe_t	*stripe;
+	dedup_entry_t	*e;
+
+	if (!pending->committed) {
+		stripe = &pending->inst->stripes[DEDUP_STRIPE(pending->key.hash)];
+
+		PTHREAD_MUTEX_LOCK(&stripe->mutex);
+		e = fr_hash_table_finddata(stripe->ht, &pending->key);
+		if (e && !e->done) dedup_remove(stripe, e);
+		PTHREAD_MUTEX_UNLOCK(&stripe->mutex);
+	}
+
+	talloc_free(pending);
+}
+
+/*
+ *	Before the storage modules.  If the record has already been
+ *	written, reply to the NAS, and stop.
+ */
+static rlm_rcode_t mod_check(void *instance, REQUEST *request)
+{
+	rlm_acct_dedup_t	*inst = instance;
+	dedup_stripe_t		*stripe;
+	dedup_entry_t		key, *e;
+	dedup_pending_t		*pending;
+
+	if (dedup_key(request, &key) < 0) {
+		RDEBUG2("Not enough information to find duplicates of this packet");
+		return RLM_MODULE_NOOP;
+	}
+
+	stripe = &inst->stripes[DEDUP_STRIPE(key.hash)];
+
+	PTHREAD_MUTEX_LOCK(&stripe->mutex);
+	e = fr_hash_table_finddata(stripe->ht, &key);
+	if (e && ((e->created + inst->lifetime) <= request->timestamp)) {
+		dedup_remove(stripe, e);
+		e = NULL;
+	}
+
+	if (e) {
+		int done = e->done;
+
+		PTHREAD_MUTEX_UNLOCK(&stripe->mutex);
+
+		/*
+		 *	Another copy is still being written.  We don't
+		 *	know if that will succeed, so the NAS should
+		 *	try again later.
+		 */
+		if (!done) {
+			RDEBUG("Duplicate of a packet which is still being processed.  Not replying");
+			return RLM_MODULE_HANDLED;
+		}
+
+		RDEBUG("Duplicate of a packet which has already been written");
+		request->reply->code = PW_ACCOUNTING_RESPONSE;
+		return RLM_MODULE_HANDLED;
+	}
+
+	e = dedup_insert(inst, stripe, &key, request->timestamp);
+	PTHREAD_MUTEX_UNLOCK(&stripe->mutex);
+
+	if (!e) {
+		RDEBUG2("Failed adding entry");
+		return RLM_MODULE_NOOP;
+	}
+
+	pending = talloc_zero(NULL, dedup_pending_t);
+	pending->inst = inst;
+	pending->key = key;
+	pending->key.id = talloc_strdup(pending, key.id);
+
+	request_data_add(request, inst, 0, pending, dedup_pending_free);
+
+	return RLM_MODULE_NOOP;
+}
+
+/*
+ *	After the storage modules.  Any which failed will have
+ *	stopped the section before we get here.
+ */
+static rlm_rcode_t mod_commit(void *instance, REQUEST *request)
+{
+	rlm_acct_dedup_t	*inst = instance;
+	dedup_stripe_t		*stripe;
+	dedup_entry_t		*e;
+	dedup_pending_t		*pending;
+
+	pending = request_data_reference(request, inst, 0);
+	if (!pending || pending->committed) return RLM_MODULE_NOOP;
+
+	stripe = &inst->stripes[DEDUP_STRIPE(pending->key.hash)];
+
+	PTHREAD_MUTEX_LOCK(&stripe->mutex);
+	e = fr_hash_table_finddata(stripe->ht, &pending->key);
+
+	/*
+	 *	It was thrown away to make room while the packet
+	 *	was being processed.
+	 */
+	if (!e) e = dedup_insert(inst, stripe, &pending->key,
+				 request->timestamp);
+	if (e) e->done = TRUE;
+	PTHREAD_MUTEX_UNLOCK(&stripe->mutex);
+
+	pending->committed = TRUE;
+	RDEBUG2("Recorded packet as written");
+
+	return RLM_MODULE_NOOP;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_acct_dedup_t	*inst = instance;
+	int			i;
+
+	for (i = 0; i < DEDUP_STRIPES; i++) {
+		fr_hash_table_free(inst->stripes[i].ht);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&inst->stripes[i].mutex);
+#endif
+	}
+
+	return 0;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_acct_dedup_t	*inst = instance;
+	int			i;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	if ((inst->lifetime < 1) || (inst->lifetime > 86400)) {
+		cf_log_err_cs(conf, "'lifetime' must be between 1 and 86400");
+		return -1;
+	}
+
+	if (inst->max_entries < DEDUP_STRIPES) {
+		cf_log_err_cs(conf, "'max_entries' must be at least %d",
+			      DEDUP_STRIPES);
+		return -1;
+	}
+
+	inst->stripe_entries = inst->max_entries / DEDUP_STRIPES;
+
+	for (i = 0; i < DEDUP_STRIPES; i++) {
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&inst->stripes[i].mutex, NULL) < 0) {
+			DEBUGE("Failed initializing mutex: %s",
+			       strerror(errno));
+			return -1;
+		}
+#endif
+
+		inst->stripes[i].ht = fr_hash_table_create(dedup_entry_hash,
+							   dedup_entry_cmp,
+							   dedup_entry_free);
+		if (!inst->stripes[i].ht) {
+			DEBUGE("Failed to create hash table");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	The module name should be the only globally exported symbol.
+ *	That is, everything else should be 'static'.
+ */
+module_t rlm_acct_dedup = {
+	RLM_MODULE_INIT,
+	"acct_dedup",
+	0,				/* type */
+	sizeof(rlm_acct_dedup_t),
+	module_config,
+	mod_instantiate,		/* instantiation */
+	mod_detach,			/* detach */
+	{
+		NULL,			/* authentication */
+		NULL,			/* authorization */
+		mod_check,		/* preaccounting */
+		mod_commit,		/* accounting */
+		NULL,			/* checksimul */
+		NULL,			/* pre-proxy */
+		NULL,			/* post-proxy */
+		NULL			/* post-auth */
+	},
+	NULL				/* flush */
+};
@@ -147,4 +147,5 @@ module_t rlm_always = {
 		always_return		/* send-coa */
 #endif
 	},
+	NULL				/* flush */
 };
@@ -365,5 +365,6 @@ module_t rlm_attr_filter = {
 		mod_send_coa
 #endif
 	},
+	NULL				/* flush */
 };
 
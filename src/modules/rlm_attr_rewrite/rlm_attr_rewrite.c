@@ -27,10 +27,6 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
-#ifdef HAVE_REGEX_H
-#	include <regex.h>
-#endif
-
 #define RLM_REGEX_INPACKET 0
 #define RLM_REGEX_INCONFIG 1
 #define RLM_REGEX_INREPLY  2
@@ -56,6 +52,12 @@ typedef struct rlm_attr_rewrite {
 				//!< attr.
 	int  num_matches;	//!< Maximum number of matches.
 	const char *name;	//!< The module name.
+
+	int  cflags;		//!< Flags passed to regcomp().
+	xlat_exp_t *search_xlat;//!< Pre-parsed search pattern.
+	int  search_compiled;	//!< Whether the search pattern is constant,
+				//!< and compiled into preg.
+	regex_t preg;		//!< The compiled search pattern.
 } rlm_attr_rewrite_t;
 
 static const CONF_PARSER module_config[] = {
@@ -137,21 +139,55 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->da = dict_attrbyname(inst->attribute);
 	rad_assert(inst->da != NULL);
 
+	inst->cflags = REG_EXTENDED;
+	if (inst->nocase) inst->cflags |= REG_ICASE;
+
+	/*
+	 *	If the search pattern doesn't reference any
+	 *	attributes, compile it now.  Otherwise it's compiled
+	 *	(and cached) when the request is processed.
+	 */
+	inst->search_xlat = xlat_compile(inst, inst->search);
+	if (xlat_literal(inst->search_xlat)) {
+		int err;
+
+		err = regcomp(&inst->preg, xlat_literal(inst->search_xlat),
+			      inst->cflags);
+		if (err != 0) {
+			char err_msg[MAX_STRING_LEN];
+
+			regerror(err, &inst->preg, err_msg, sizeof(err_msg));
+			cf_log_err_cs(conf, "Invalid regular expression in 'searchfor': %s",
+				      err_msg);
+			return -1;
+		}
+		inst->search_compiled = TRUE;
+	}
+
 	/* Add the module instance name */
 	inst->name = cf_section_name2(conf); /* may be NULL */
 
 	return 0;
 }
 
+static int mod_detach(void *instance)
+{
+	rlm_attr_rewrite_t *inst = instance;
+
+	if (inst->search_compiled) regfree(&inst->preg);
+
+	return 0;
+}
+
 static rlm_rcode_t do_attr_rewrite(void *instance, REQUEST *request)
 {
 	rlm_attr_rewrite_t *inst = (rlm_attr_rewrite_t *) instance;
 	rlm_rcode_t rcode = RLM_MODULE_NOOP;
 	VALUE_PAIR *attr_vp = NULL;
 	VALUE_PAIR *tmp = NULL;
-	regex_t preg;
+	const regex_t *preg;
+	fr_regex_t *rx = NULL;
 	regmatch_t pmatch[9];
-	int cflags = 0;
 	int err = 0;
 	char done_xlat = 0;
 	unsigned int len = 0;
@@ -267,19 +303,21 @@ do_again:
 			DEBUG2("%s: Attribute %s string value NULL or of zero length", inst->name,inst->attribute);
 			return rcode;
 		}
-		cflags |= REG_EXTENDED;
-		if (inst->nocase)
-			cflags |= REG_ICASE;
-
-		if (!radius_xlat(search_STR, sizeof(search_STR), inst->search, request, NULL, NULL) && inst->search_len != 0) {
-			DEBUG2("%s: xlat on search string failed.", inst->name);
-			return rcode;
-		}
+		if (inst->search_compiled) {
+			preg = &inst->preg;
+		} else {
+			if (!radius_xlat_compiled(search_STR, sizeof(search_STR), inst->search_xlat, request, NULL, NULL) && inst->search_len != 0) {
+				DEBUG2("%s: xlat on search string failed.", inst->name);
+				return rcode;
+			}
 
-		if ((err = regcomp(&preg,search_STR,cflags))) {
-			regerror(err, &preg, err_msg, MAX_STRING_LEN);
-			DEBUG2("%s: regcomp() returned error: %s", inst->name,err_msg);
-			return rcode;
+			rx = regex_cache_find(search_STR, inst->cflags, FALSE,
+					      err_msg, sizeof(err_msg));
+			if (!rx) {
+				DEBUG2("%s: regcomp() returned error: %s", inst->name, err_msg);
+				return rcode;
+			}
+			preg = NULL;
 		}
 
 		if ((attr_vp->da->type == PW_TYPE_IPADDR) &&
@@ -294,18 +332,22 @@ do_again:
 		counter = 0;
 
 		for ( i = 0 ;i < (unsigned)inst->num_matches; i++) {
-			err = regexec(&preg, ptr2, REQUEST_MAX_REGEX, pmatch, 0);
+			if (preg) {
+				err = regexec(preg, ptr2, REQUEST_MAX_REGEX, pmatch, 0);
+			} else {
+				err = regex_cache_exec(rx, ptr2, REQUEST_MAX_REGEX, pmatch);
+			}
 			if (err == REG_NOMATCH) {
 				if (i == 0) {
 					DEBUG2("%s: Does not match: %s = %s", inst->name,
 							inst->attribute, attr_vp->vp_strvalue);
-					regfree(&preg);
+					regex_cache_release(rx);
 					goto to_do_again;
 				} else
 					break;
 			}
 			if (err != 0) {
-				regfree(&preg);
+				regex_cache_release(rx);
 				radlog(L_ERR, "%s: match failure for attribute %s with value '%s'", inst->name,
 						inst->attribute, attr_vp->vp_strvalue);
 				return rcode;
@@ -318,7 +360,7 @@ do_again:
 			}
 			counter += len;
 			if (counter >= MAX_STRING_LEN) {
-				regfree(&preg);
+				regex_cache_release(rx);
 				DEBUG2("%s: Replacement out of limits for attribute %s with value '%s'", inst->name,
 						inst->attribute, attr_vp->vp_strvalue);
 				return rcode;
@@ -365,6 +407,7 @@ do_again:
 			if (!done_xlat){
 				if (inst->replace_len != 0 &&
 				radius_xlat(replace_STR, sizeof(replace_STR), inst->replace, request, NULL, NULL) == 0) {
+					regex_cache_release(rx);
 					DEBUG2("%s: xlat on replace string failed.", inst->name);
 					return rcode;
 				}
@@ -374,7 +417,7 @@ do_again:
 
 			counter += replace_len;
 			if (counter >= MAX_STRING_LEN) {
-				regfree(&preg);
+				regex_cache_release(rx);
 				DEBUG2("%s: Replacement out of limits for attribute %s with value '%s'", inst->name,
 						inst->attribute, attr_vp->vp_strvalue);
 				return rcode;
@@ -385,7 +428,7 @@ do_again:
 				*ptr = '\0';
 			}
 		}
-		regfree(&preg);
+		regex_cache_release(rx);
 		len = strlen(ptr2) + 1;		/* We add the ending NULL */
 		counter += len;
 		if (counter >= MAX_STRING_LEN){
@@ -454,7 +497,7 @@ module_t rlm_attr_rewrite = {
 	sizeof(rlm_attr_rewrite_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,					/* detach */
+	mod_detach,				/* detach */
 	{
 		mod_authenticate,	/* authentication */
 		mod_authorize, 	/* authorization */
@@ -474,4 +517,5 @@ module_t rlm_attr_rewrite = {
 		mod_send_coa
 #endif
 	},
+	NULL				/* flush */
 };
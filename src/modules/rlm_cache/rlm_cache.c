@@ -857,4 +857,5 @@ module_t rlm_cache = {
 		cache_it,	       	/* post-proxy */
 		cache_it,		/* post-auth */
 	},
+	NULL				/* flush */
 };
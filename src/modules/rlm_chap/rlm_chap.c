@@ -144,4 +144,5 @@ module_t rlm_chap = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
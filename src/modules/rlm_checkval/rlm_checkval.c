@@ -27,9 +27,6 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
-#ifdef HAVE_REGEX_H
-#	include <regex.h>
-#endif
 #ifndef REG_EXTENDED
 #define REG_EXTENDED (0)
 #endif
@@ -206,22 +203,21 @@ static rlm_rcode_t do_checkval(void *instance, REQUEST *request)
 #ifdef HAVE_REGEX_H
 		if (rcode == RLM_MODULE_REJECT &&
 		    check->op == T_OP_REG_EQ) {
-			regex_t reg;
-			int err;
+			fr_regex_t *rx;
 			char err_msg[MAX_STRING_LEN];
 
 			DEBUG("rlm_checkval: Doing regex");
-			err = regcomp(&reg, (char *)check->vp_strvalue, REG_EXTENDED|REG_NOSUB);
-			if (err){
-				regerror(err, &reg,err_msg, MAX_STRING_LEN);
+			rx = regex_cache_find(check->vp_strvalue, REG_EXTENDED|REG_NOSUB, FALSE,
+					      err_msg, sizeof(err_msg));
+			if (!rx){
 				DEBUG("rlm_checkval: regcomp() returned error: %s", err_msg);
 				return RLM_MODULE_FAIL;
 			}
-			if (regexec(&reg, (char *)item->vp_strvalue,0, NULL, 0) == 0)
+			if (regex_cache_exec(rx, item->vp_strvalue, 0, NULL) == 0)
 				rcode = RLM_MODULE_OK;
 			else
 				rcode = RLM_MODULE_REJECT;
-			regfree(&reg);
+			regex_cache_release(rx);
 		}
 #endif
 		tmp = check->next;
@@ -279,4 +275,5 @@ module_t rlm_checkval = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
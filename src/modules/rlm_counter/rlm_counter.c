@@ -884,4 +884,5 @@ module_t rlm_counter = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
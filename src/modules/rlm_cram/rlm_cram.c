@@ -209,4 +209,5 @@ module_t rlm_cram = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -43,25 +43,103 @@ RCSID("$Id$")
 #include <grp.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#include	<sys/uio.h>
+#endif
+
 #define DIRLEN	8192		//!< Maximum path length.
 
+#ifdef HAVE_PTHREAD_H
+#define DETAIL_MAX_QUEUED	(8192)	//!< Records waiting for the writer.
+#define DETAIL_IDLE_TIMEOUT	(60)	//!< Close files not written for this long.
+
+#if defined(IOV_MAX) && (IOV_MAX < 64)
+#define DETAIL_MAX_IOV		IOV_MAX
+#else
+#define DETAIL_MAX_IOV		(64)	//!< Records per writev().
+#endif
+
+/** A record waiting for the writer thread
+ *
+ * These live on the stack of the worker which queued them.  The
+ * worker waits until the writer thread sets "done".
+ */
+typedef struct detail_entry_t {
+	struct detail_entry_t *next;
+	const char	*filename;
+	uint8_t		*data;
+	size_t		len;
+
+	struct detail_file_t *file;	//!< Used by the writer thread.
+	int		done;		//!< Written, or failed.
+	rlm_rcode_t	rcode;
+} detail_entry_t;
+
+/** A file which the writer thread has open
+ *
+ * These are only used by the writer thread, so they need no locking.
+ */
+typedef struct detail_file_t {
+	const char	*filename;
+	int		fd;
+	dev_t		dev;		//!< Of the file we opened, to see
+	ino_t		ino;		//!< if it has been moved.
+	time_t		used;		//!< When it was last written to.
+	time_t		synced;		//!< When it was last fsync'd.
+	int		dirty;		//!< Written to since the last fsync.
+
+	int		pending;	//!< On the list for this batch.
+	int		failed;		//!< A write failed in this batch.
+	struct detail_file_t *next;
+
+	int		num_iov;
+	struct iovec	iov[DETAIL_MAX_IOV];
+} detail_file_t;
+#endif
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
  */
 typedef struct detail_instance {
 	char	*detailfile;	//!< File/path to write to.
+	xlat_exp_t *detailfile_xlat; //!< Pre-parsed detailfile.
 	int	detailperm;	//!< Permissions to use for new files.
 	char	*group;		//!< Group to use for new files.
 	
 	int	dirperm;	//!< Directory permissions to use for new files.
 	
 	char	*header;	//!< Header format.
+	xlat_exp_t *header_xlat; //!< Pre-parsed header.
 	int	locking;	//!< Whether the file should be locked.
 	
 	int	log_srcdst;	//!< Add IP src/dst attributes to entries.
 
+	int	binary;		//!< Write binary records instead of text.
+
+	int	async;		//!< Write from a background thread.
+	int	fsync;		//!< fsync() after writing.
+	int	fsync_interval;	//!< At most this often, or every batch if 0.
+
 	fr_hash_table_t *ht;	//!< Holds suppressed attributes.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;	//!< Protects the queue, or serialises writes
+				//!< when async = no.
+	pthread_cond_t	cond;	//!< Wakes up the writer thread.
+	pthread_cond_t	space;	//!< Wakes up workers waiting for room in the queue.
+	pthread_cond_t	done;	//!< Wakes up workers waiting for their records.
+	pthread_t	thread;
+	int		running;
+	int		waiting;	//!< The writer thread is idle.
+	int		stop;
+
+	detail_entry_t	*head;	//!< Records waiting to be written.
+	detail_entry_t	**tail;
+	int		num_queued;
+
+	fr_hash_table_t *files;	//!< Files the writer thread has open.
+#endif
 } detail_instance_t;
 
 static const CONF_PARSER module_config[] = {
@@ -79,6 +157,14 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(struct detail_instance,locking),    NULL, "no" },
 	{ "log_packet_header",       PW_TYPE_BOOLEAN,
 	  offsetof(struct detail_instance,log_srcdst),    NULL, "no" },
+	{ "binary",       PW_TYPE_BOOLEAN,
+	  offsetof(struct detail_instance,binary),    NULL, "no" },
+	{ "async",       PW_TYPE_BOOLEAN,
+	  offsetof(struct detail_instance,async),    NULL, "no" },
+	{ "fsync",       PW_TYPE_BOOLEAN,
+	  offsetof(struct detail_instance,fsync),    NULL, "no" },
+	{ "fsync_interval",       PW_TYPE_INTEGER,
+	  offsetof(struct detail_instance,fsync_interval),    NULL, "0" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -90,6 +176,27 @@ static int mod_detach(void *instance)
 {
 	struct detail_instance *inst = instance;
 	if (inst->ht) fr_hash_table_free(inst->ht);
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->async) {
+		/*
+		 *	The writer thread writes everything which
+		 *	is queued before it exits.
+		 */
+		pthread_mutex_lock(&inst->mutex);
+		inst->stop = TRUE;
+		pthread_cond_signal(&inst->cond);
+		pthread_mutex_unlock(&inst->mutex);
+
+		if (inst->running) pthread_join(inst->thread, NULL);
+
+		if (inst->files) fr_hash_table_free(inst->files);
+		pthread_cond_destroy(&inst->done);
+		pthread_cond_destroy(&inst->space);
+		pthread_cond_destroy(&inst->cond);
+	}
+	pthread_mutex_destroy(&inst->mutex);
+#endif
 	return 0;
 }
 
@@ -108,6 +215,31 @@ static int detail_cmp(const void *a, const void *b)
 	return one - two;
 }
 
+#ifdef HAVE_PTHREAD_H
+static uint32_t detail_file_hash(const void *data)
+{
+	const detail_file_t *file = data;
+
+	return fr_hash_string(file->filename);
+}
+
+static int detail_file_cmp(const void *a, const void *b)
+{
+	const detail_file_t *one = a;
+	const detail_file_t *two = b;
+
+	return strcmp(one->filename, two->filename);
+}
+
+static void detail_file_free(void *data)
+{
+	detail_file_t *file = data;
+
+	if (file->fd >= 0) close(file->fd);
+	free(file);
+}
+#endif
+
 
 /*
  *	(Re-)read radiusd.conf into memory.
@@ -117,6 +249,39 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	detail_instance_t *inst = instance;
 	CONF_SECTION	*cs;
 
+	inst->detailfile_xlat = xlat_compile(inst, inst->detailfile);
+	inst->header_xlat = xlat_compile(inst, inst->header);
+
+	if (inst->binary && inst->log_srcdst) {
+		cf_log_err_cs(conf, "WARNING: log_packet_header is ignored when binary = yes");
+	}
+
+	if (inst->async) {
+#ifdef HAVE_PTHREAD_H
+		if (inst->fsync_interval < 0) {
+			cf_log_err_cs(conf, "fsync_interval must not be negative");
+			return -1;
+		}
+
+		inst->files = fr_hash_table_create(detail_file_hash,
+						   detail_file_cmp,
+						   detail_file_free);
+		if (!inst->files) return -1;
+
+		inst->tail = &inst->head;
+		pthread_cond_init(&inst->cond, NULL);
+		pthread_cond_init(&inst->space, NULL);
+		pthread_cond_init(&inst->done, NULL);
+#else
+		cf_log_err_cs(conf, "WARNING: async = yes needs thread support.  Writing records directly");
+		inst->async = FALSE;
+#endif
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+#endif
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -155,83 +320,248 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 }
 
 /*
- *	Do detail, compatible with old accounting
+ *	Whether or not an attribute is written to the detail file.
  */
-static rlm_rcode_t do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
-			     int compat)
+static int detail_suppress(detail_instance_t *inst, VALUE_PAIR *vp, int compat)
 {
-	int		outfd;
-	char		timestamp[256];
-	char		buffer[DIRLEN];
-	char		*p;
-	struct stat	st;
-	int		locked;
-	int		lock_count;
-	struct timeval	tv;
-	VALUE_PAIR	*vp;
-	off_t		fsize;
-	FILE		*fp;
+	if (inst->ht &&
+	    fr_hash_table_finddata(inst->ht, vp->da)) return TRUE;
 
-#ifdef HAVE_GRP_H
-	gid_t		gid;
-	struct group	*grp;
-	char		*endptr;
-#endif
+	/*
+	 *	Don't print passwords in old format...
+	 */
+	if (compat && !vp->da->vendor && (vp->da->attr == PW_USER_PASSWORD)) return TRUE;
 
-	struct detail_instance *inst = instance;
+	return FALSE;
+}
 
-	rad_assert(request != NULL);
+/*
+ *	Build one binary record.  The timestamp, client address and
+ *	packet code go into the record header, and the attributes are
+ *	encoded as they would be in a packet.
+ */
+static uint8_t *detail_binary(detail_instance_t *inst, REQUEST *request,
+			      RADIUS_PACKET *packet, int compat, size_t *plen)
+{
+	fr_detail_hdr_t	hdr;
+	VALUE_PAIR	*vp, *vps, **tail;
+	uint8_t		data[FR_DETAIL_HDR_LEN + FR_DETAIL_MAX_LEN];
+	ssize_t		len;
+	int		copy;
 
 	/*
-	 *	Nothing to log: don't do anything.
+	 *	Only copy the attributes if some of them have to be
+	 *	left out, or added.
 	 */
-	if (!packet) {
-		return RLM_MODULE_NOOP;
+	vps = packet->vps;
+	for (vp = packet->vps; vp != NULL; vp = vp->next) {
+		if (detail_suppress(inst, vp, compat)) break;
+	}
+
+	copy = (vp != NULL);
+#ifdef WITH_PROXY
+	if (compat && request->proxy) copy = TRUE;
+#endif
+
+	if (copy) {
+		vps = NULL;
+		tail = &vps;
+
+		for (vp = packet->vps; vp != NULL; vp = vp->next) {
+			if (detail_suppress(inst, vp, compat)) continue;
+
+			*tail = paircopyvp(request, vp);
+			if (*tail) tail = &((*tail)->next);
+		}
+
+#ifdef WITH_PROXY
+		if (compat && request->proxy &&
+		    (request->proxy->dst_ipaddr.af == AF_INET)) {
+			vp = paircreate(request, PW_FREERADIUS_PROXIED_TO,
+					VENDORPEC_FREERADIUS);
+			if (vp) {
+				vp->vp_ipaddr = request->proxy->dst_ipaddr.ipaddr.ip4addr.s_addr;
+				*tail = vp;
+			}
+		}
+#endif
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.code = packet->code;
+	hdr.timestamp = request->timestamp;
+	hdr.client_ip = request->packet->src_ipaddr;
+
+	len = fr_detail_encode(data, sizeof(data), &hdr, vps);
+	if (vps != packet->vps) pairfree(&vps);
+
+	if (len < 0) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Failed encoding record: %s",
+			       fr_strerror());
+		return NULL;
+	}
+
+	*plen = len;
+	return talloc_memdup(request, data, len);
+}
+
+/*
+ *	Add one attribute to a text record.
+ */
+static char *detail_text_vp(char *record, const VALUE_PAIR *vp)
+{
+	char buffer[1024];
+
+	vp_prints(buffer, sizeof(buffer), vp);
+
+	return talloc_asprintf_append_buffer(record, "\t%s\n", buffer);
+}
+
+/*
+ *	Build one text record.
+ */
+static uint8_t *detail_text(detail_instance_t *inst, REQUEST *request,
+			    RADIUS_PACKET *packet, int compat, size_t *plen)
+{
+	char		timestamp[256];
+	char		*record;
+	VALUE_PAIR	*vp;
+
+	if (radius_xlat_compiled(timestamp, sizeof(timestamp), inst->header_xlat, request, NULL, NULL) == 0) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Unable to expand detail header format %s",
+			inst->header);
+		return NULL;
 	}
 
+	record = talloc_asprintf(request, "%s\n", timestamp);
+
 	/*
-	 *	Create a directory for this nas.
-	 *
-	 *	Generate the path for the detail file.  Use the
-	 *	same format, but truncate at the last /.  Then
-	 *	feed it through radius_xlat() to expand the
-	 *	variables.
+	 *	Write the information to the file.
 	 */
-	if (radius_xlat(buffer, sizeof(buffer), inst->detailfile, request, NULL, NULL) == 0) {
-		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to expand detail file %s",
-		    inst->detailfile);
-	    return RLM_MODULE_FAIL;
+	if (!compat) {
+		/*
+		 *	Print out names, if they're OK.
+		 *	Numbers, if not.
+		 */
+		if ((packet->code > 0) &&
+		    (packet->code < FR_MAX_PACKET_CODE)) {
+			record = talloc_asprintf_append_buffer(record, "\tPacket-Type = %s\n",
+							       fr_packet_codes[packet->code]);
+		} else {
+			record = talloc_asprintf_append_buffer(record, "\tPacket-Type = %d\n",
+							       packet->code);
+		}
+	}
+
+	if (inst->log_srcdst) {
+		VALUE_PAIR src_vp, dst_vp;
+
+		memset(&src_vp, 0, sizeof(src_vp));
+		memset(&dst_vp, 0, sizeof(dst_vp));
+		src_vp.op = dst_vp.op = T_OP_EQ;
+
+		switch (packet->src_ipaddr.af) {
+		case AF_INET:
+			src_vp.da = dict_attrbyvalue(PW_PACKET_SRC_IP_ADDRESS, 0);
+			src_vp.vp_ipaddr = packet->src_ipaddr.ipaddr.ip4addr.s_addr;
+
+			dst_vp.da = dict_attrbyvalue(PW_PACKET_DST_IP_ADDRESS, 0);
+			dst_vp.vp_ipaddr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
+			break;
+		case AF_INET6:
+			src_vp.da = dict_attrbyvalue(PW_PACKET_SRC_IPV6_ADDRESS, 0);
+			memcpy(src_vp.vp_strvalue,
+			       &packet->src_ipaddr.ipaddr.ip6addr,
+			       sizeof(packet->src_ipaddr.ipaddr.ip6addr));
+			dst_vp.da = dict_attrbyvalue(PW_PACKET_DST_IPV6_ADDRESS, 0);
+			memcpy(dst_vp.vp_strvalue,
+			       &packet->dst_ipaddr.ipaddr.ip6addr,
+			       sizeof(packet->dst_ipaddr.ipaddr.ip6addr));
+			break;
+		default:
+			break;
+		}
+
+		record = detail_text_vp(record, &src_vp);
+		record = detail_text_vp(record, &dst_vp);
+
+		src_vp.da = dict_attrbyvalue(PW_PACKET_SRC_PORT, 0);
+		src_vp.vp_integer = packet->src_port;
+		dst_vp.da = dict_attrbyvalue(PW_PACKET_DST_PORT, 0);
+		dst_vp.vp_integer = packet->dst_port;
+
+		record = detail_text_vp(record, &src_vp);
+		record = detail_text_vp(record, &dst_vp);
+	}
+
+	/* Write each attribute/value to the log file */
+	for (vp = packet->vps; vp != NULL; vp = vp->next) {
+		if (detail_suppress(inst, vp, compat)) continue;
+
+		/*
+		 *	Print all of the attributes.
+		 */
+		record = detail_text_vp(record, vp);
 	}
-	RDEBUG2("%s expands to %s", inst->detailfile, buffer);
 
-#ifdef HAVE_FNMATCH_H
-#ifdef FNM_FILE_NAME
 	/*
-	 *	If we read it from a detail file, and we're about to
-	 *	write it back to the SAME detail file directory, then
-	 *	suppress the write.  This check prevents an infinite
-	 *	loop.
+	 *	Add non-protocol attibutes.
 	 */
-	if ((request->listener->type == RAD_LISTEN_DETAIL) &&
-	    (fnmatch(((listen_detail_t *)request->listener->data)->filename,
-		     buffer, FNM_FILE_NAME | FNM_PERIOD ) == 0)) {
-		RDEBUG2W("Suppressing infinite loop.");
-		return RLM_MODULE_NOOP;
-	}
-#endif
+	if (compat) {
+#ifdef WITH_PROXY
+		if (request->proxy) {
+			char proxy_buffer[128];
+
+			inet_ntop(request->proxy->dst_ipaddr.af,
+				  &request->proxy->dst_ipaddr.ipaddr,
+				  proxy_buffer, sizeof(proxy_buffer));
+			record = talloc_asprintf_append_buffer(record, "\tFreeradius-Proxied-To = %s\n",
+							       proxy_buffer);
+			RDEBUG("Freeradius-Proxied-To = %s",
+				proxy_buffer);
+		}
 #endif
 
+		record = talloc_asprintf_append_buffer(record, "\tTimestamp = %ld\n",
+						       (unsigned long) request->timestamp);
+	}
+
+	record = talloc_asprintf_append_buffer(record, "\n");
+	if (!record) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Out of memory");
+		return NULL;
+	}
+
+	*plen = strlen(record);
+	return (uint8_t *) record;
+}
+
+/*
+ *	Create the directory for a detail file.
+ */
+static int detail_mkdir(detail_instance_t *inst, REQUEST *request,
+			const char *filename)
+{
+	const char *p;
+	char dir[DIRLEN];
+
 	/*
 	 *	Grab the last directory delimiter.
 	 */
-	p = strrchr(buffer,'/');
+	p = strrchr(filename,'/');
 
 	/*
 	 *	There WAS a directory delimiter there, and the file
 	 *	doesn't exist, so we must create it the directories..
 	 */
 	if (p) {
-		*p = '\0';
+		if ((size_t) (p - filename) >= sizeof(dir)) {
+			radlog_request(L_ERR, 0, request, "rlm_detail: Directory name is too long in %s", filename);
+			return -1;
+		}
+
+		memcpy(dir, filename, p - filename);
+		dir[p - filename] = '\0';
 
 		/*
 		 *	Always try to create the directory.  If it
@@ -241,14 +571,61 @@ static rlm_rcode_t do_detail(void *instance, REQUEST *request, RADIUS_PACKET *pa
 		 *	This catches the case where some idiot deleted
 		 *	a directory that the server was using.
 		 */
-		if (rad_mkdir(buffer, inst->dirperm) < 0) {
-			radlog_request(L_ERR, 0, request, "rlm_detail: Failed to create directory %s: %s", buffer, strerror(errno));
-			return RLM_MODULE_FAIL;
+		if (rad_mkdir(dir, inst->dirperm) < 0) {
+			radlog_request(L_ERR, 0, request, "rlm_detail: Failed to create directory %s: %s", dir, strerror(errno));
+			return -1;
 		}
-		
-		*p = '/';
 	} /* else there was no directory delimiter. */
 
+	return 0;
+}
+
+/*
+ *	Set the group of a detail file.
+ */
+static void detail_group(detail_instance_t *inst, REQUEST *request,
+			 const char *filename)
+{
+#ifdef HAVE_GRP_H
+	gid_t		gid;
+	struct group	*grp;
+	char		*endptr;
+
+	if (inst->group != NULL) {
+		gid = strtol(inst->group, &endptr, 10);
+		if (*endptr != '\0') {
+			grp = getgrnam(inst->group);
+			if (!grp) {
+				RDEBUG2("rlm_detail: Unable to find system group \"%s\"", inst->group);
+				return;
+			}
+			gid = grp->gr_gid;
+		}
+
+		if (chown(filename, -1, gid) == -1) {
+			RDEBUG2("rlm_detail: Unable to change system group of \"%s\"", filename);
+		}
+	}
+#endif
+}
+
+/*
+ *	Write one record straight to the file.
+ */
+static rlm_rcode_t detail_write(detail_instance_t *inst, REQUEST *request,
+				char *buffer, const uint8_t *data, size_t len)
+{
+	int		outfd;
+	struct stat	st;
+	int		locked;
+	int		lock_count;
+	struct timeval	tv;
+	off_t		fsize;
+	size_t		done;
+	ssize_t		rcode;
+
+	if (detail_mkdir(inst, request, buffer) < 0) return RLM_MODULE_FAIL;
+
 	locked = 0;
 	lock_count = 0;
 	do {
@@ -310,30 +687,8 @@ static rlm_rcode_t do_detail(void *instance, REQUEST *request, RADIUS_PACKET *pa
 		return RLM_MODULE_FAIL;
 	}
 
+	detail_group(inst, request, buffer);
 
-#ifdef HAVE_GRP_H
-	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			grp = getgrnam(inst->group);
-			if (!grp) {
-				RDEBUG2("rlm_detail: Unable to find system group \"%s\"", inst->group);
-				goto skip_group;
-			}
-			gid = grp->gr_gid;
-		}
-
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("rlm_detail: Unable to change system group of \"%s\"", buffer);
-		}
-	}
-
- skip_group:
-#endif
-
-	/*
-	 *	Post a timestamp
-	 */
 	fsize = lseek(outfd, 0L, SEEK_END);
 	if (fsize < 0) {
 		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to seek to the end of detail file %s",
@@ -342,139 +697,501 @@ static rlm_rcode_t do_detail(void *instance, REQUEST *request, RADIUS_PACKET *pa
 		return RLM_MODULE_FAIL;
 	}
 
-	if (radius_xlat(timestamp, sizeof(timestamp), inst->header, request, NULL, NULL) == 0) {
-		radlog_request(L_ERR, 0, request, "rlm_detail: Unable to expand detail header format %s",
-			inst->header);
-		close(outfd);
-		return RLM_MODULE_FAIL;
-	}
-
 	/*
-	 *	Open the FP for buffering.
+	 *	The record is written with one write(), so we don't
+	 *	need stdio.
 	 */
-	if ((fp = fdopen(outfd, "a")) == NULL) {
-		radlog_request(L_ERR, 0, request, "rlm_detail: Couldn't open file %s: %s",
-			       buffer, strerror(errno));
-		close(outfd);
-		return RLM_MODULE_FAIL;
+	for (done = 0; done < len; done += rcode) {
+		rcode = write(outfd, data + done, len - done);
+		if (rcode < 0) {
+			if (errno == EINTR) {
+				rcode = 0;
+				continue;
+			}
+
+			/*
+			 *	If we can't write it to disk, truncate
+			 *	the file and return an error.
+			 */
+			radlog_request(L_ERR, 0, request, "rlm_detail: Failed writing to %s: %s",
+				       buffer, strerror(errno));
+			ftruncate(outfd, fsize); /* ignore errors! */
+			close(outfd);
+			return RLM_MODULE_FAIL;
+		}
 	}
 
-	fprintf(fp, "%s\n", timestamp);
+	close(outfd);
 
 	/*
-	 *	Write the information to the file.
+	 *	And everything is fine.
 	 */
-	if (!compat) {
-		/*
-		 *	Print out names, if they're OK.
-		 *	Numbers, if not.
-		 */
-		if ((packet->code > 0) &&
-		    (packet->code < FR_MAX_PACKET_CODE)) {
-			fprintf(fp, "\tPacket-Type = %s\n",
-				fr_packet_codes[packet->code]);
-		} else {
-			fprintf(fp, "\tPacket-Type = %d\n", packet->code);
+	return RLM_MODULE_OK;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	The writer thread.
+ *
+ *	Workers format their record, put it on the queue, and wait.
+ *	The writer thread takes everything on the queue at once, and
+ *	writes all of the records for each file with one writev().
+ *	The files are kept open between batches, so there's no
+ *	open(), lock or close() per record.  When the batch has been
+ *	written, the workers are woken up, and return.
+ */
+static detail_file_t *detail_file_find(detail_instance_t *inst,
+				       const char *filename)
+{
+	char		*p;
+	detail_file_t	*file, my_file;
+
+	my_file.filename = filename;
+	file = fr_hash_table_finddata(inst->files, &my_file);
+	if (file) return file;
+
+	file = rad_malloc(sizeof(*file) + strlen(filename) + 1);
+	memset(file, 0, sizeof(*file));
+	file->fd = -1;
+	p = (char *) (file + 1);
+	strcpy(p, filename);
+	file->filename = p;
+
+	if (!fr_hash_table_insert(inst->files, file)) {
+		free(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+static void detail_file_close(detail_instance_t *inst, detail_file_t *file)
+{
+	if (file->fd < 0) return;
+
+	if (inst->fsync && file->dirty) fsync(file->fd);
+	close(file->fd);
+	file->fd = -1;
+	file->dirty = FALSE;
+}
+
+static int detail_file_open(detail_instance_t *inst, detail_file_t *file)
+{
+	struct stat st;
+
+	if (detail_mkdir(inst, NULL, file->filename) < 0) return -1;
+
+	file->fd = open(file->filename, O_WRONLY | O_APPEND | O_CREAT,
+			inst->detailperm);
+	if (file->fd < 0) {
+		radlog(L_ERR, "rlm_detail: Couldn't open file %s: %s",
+		       file->filename, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(file->fd, &st) < 0) {
+		radlog(L_ERR, "rlm_detail: Couldn't stat file %s: %s",
+		       file->filename, strerror(errno));
+		close(file->fd);
+		file->fd = -1;
+		return -1;
+	}
+
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+
+	detail_group(inst, NULL, file->filename);
+
+	return 0;
+}
+
+/*
+ *	writev() everything, even if it's a partial write.
+ */
+static int detail_writev(int fd, struct iovec *iov, int num_iov)
+{
+	ssize_t rcode;
+
+	while (num_iov > 0) {
+		rcode = writev(fd, iov, num_iov);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		while ((num_iov > 0) && ((size_t) rcode >= iov->iov_len)) {
+			rcode -= iov->iov_len;
+			iov++;
+			num_iov--;
+		}
+
+		if (num_iov > 0) {
+			iov->iov_base = ((char *) iov->iov_base) + rcode;
+			iov->iov_len -= rcode;
 		}
 	}
 
-	if (inst->log_srcdst) {
-		VALUE_PAIR src_vp, dst_vp;
+	return 0;
+}
 
-		memset(&src_vp, 0, sizeof(src_vp));
-		memset(&dst_vp, 0, sizeof(dst_vp));
-		src_vp.op = dst_vp.op = T_OP_EQ;
+/*
+ *	Write the records waiting for one file.
+ */
+static void detail_file_flush(detail_instance_t *inst, detail_file_t *file,
+			      time_t now)
+{
+	int		tries;
+	off_t		fsize;
+	struct stat	st;
+	struct timeval	tv;
 
-		switch (packet->src_ipaddr.af) {
-		case AF_INET:
-			src_vp.da = dict_attrbyvalue(PW_PACKET_SRC_IP_ADDRESS, 0);
-			src_vp.vp_ipaddr = packet->src_ipaddr.ipaddr.ip4addr.s_addr;
+	if (file->num_iov == 0) return;
 
-			dst_vp.da = dict_attrbyvalue(PW_PACKET_DST_IP_ADDRESS, 0);
-			dst_vp.vp_ipaddr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
-			break;
-		case AF_INET6:
-			src_vp.da = dict_attrbyvalue(PW_PACKET_SRC_IPV6_ADDRESS, 0);
-			memcpy(src_vp.vp_strvalue,
-			       &packet->src_ipaddr.ipaddr.ip6addr,
-			       sizeof(packet->src_ipaddr.ipaddr.ip6addr));
-			dst_vp.da = dict_attrbyvalue(PW_PACKET_DST_IPV6_ADDRESS, 0);
-			memcpy(dst_vp.vp_strvalue,
-			       &packet->dst_ipaddr.ipaddr.ip6addr,
-			       sizeof(packet->dst_ipaddr.ipaddr.ip6addr));
-			break;
-		default:
+	for (tries = 0; tries < 80; tries++) {
+		if ((file->fd < 0) &&
+		    (detail_file_open(inst, file) < 0)) goto fail;
+
+		/*
+		 *	Same as the workers do.  Try for about two
+		 *	seconds, and then give up.
+		 */
+		if (inst->locking) {
+			lseek(file->fd, 0L, SEEK_SET);
+			if (rad_lockfd_nonblock(file->fd, 0) < 0) {
+				tv.tv_sec = 0;
+				tv.tv_usec = 25000;
+				select(0, NULL, NULL, NULL, &tv);
+				continue;
+			}
+		}
+
+		/*
+		 *	The file may have been renamed by the detail
+		 *	file reader, or deleted by someone else, since
+		 *	we opened it.  If so, open the new one.
+		 */
+		if ((stat(file->filename, &st) == 0) &&
+		    (st.st_dev == file->dev) && (st.st_ino == file->ino)) {
 			break;
 		}
 
-		vp_print(fp, &src_vp);
-		vp_print(fp, &dst_vp);
+		DEBUG2("rlm_detail: File %s was moved, re-opening it",
+		       file->filename);
+		detail_file_close(inst, file);
+	}
 
-		src_vp.da = dict_attrbyvalue(PW_PACKET_SRC_PORT, 0);
-		src_vp.vp_integer = packet->src_port;
-		dst_vp.da = dict_attrbyvalue(PW_PACKET_DST_PORT, 0);
-		dst_vp.vp_integer = packet->dst_port;
+	if (tries == 80) {
+		radlog(L_ERR, "rlm_detail: Failed to acquire filelock for %s, giving up",
+		       file->filename);
+		goto fail;
+	}
 
-		vp_print(fp, &src_vp);
-		vp_print(fp, &dst_vp);
+	fsize = lseek(file->fd, 0L, SEEK_END);
+	if (detail_writev(file->fd, file->iov, file->num_iov) < 0) {
+		radlog(L_ERR, "rlm_detail: Failed writing %d records to %s: %s",
+		       file->num_iov, file->filename, strerror(errno));
+		if (fsize >= 0) ftruncate(file->fd, fsize); /* ignore errors! */
+		file->failed = TRUE;
+	} else {
+		file->dirty = TRUE;
 	}
 
-	/* Write each attribute/value to the log file */
-	for (vp = packet->vps; vp != NULL; vp = vp->next) {
-		if (inst->ht &&
-		    fr_hash_table_finddata(inst->ht, &vp->da)) continue;
+	if (inst->locking) rad_unlockfd(file->fd, 0);
+
+	file->num_iov = 0;
+	file->used = now;
+	return;
+
+fail:
+	radlog(L_ERR, "rlm_detail: Discarding %d records for %s",
+	       file->num_iov, file->filename);
+	file->num_iov = 0;
+	file->failed = TRUE;
+}
+
+/*
+ *	fsync() files, and close the ones which haven't been used for
+ *	a while.  The expanded filename usually changes over time, so
+ *	the old files have to be closed.
+ */
+static int detail_file_idle(void *ctx, void *data)
+{
+	detail_instance_t *inst = ctx;
+	detail_file_t *file = data;
+	time_t now = time(NULL);
+
+	if (file->dirty && inst->fsync &&
+	    ((now - file->synced) >= inst->fsync_interval)) {
+		fsync(file->fd);
+		file->dirty = FALSE;
+		file->synced = now;
+	}
+
+	if ((now - file->used) >= DETAIL_IDLE_TIMEOUT) {
+		detail_file_close(inst, file);
+		fr_hash_table_delete(inst->files, file);
+	}
+
+	return 0;
+}
+
+static int detail_file_shutdown(void *ctx, void *data)
+{
+	detail_file_close(ctx, data);
+	return 0;
+}
+
+static void *detail_writer(void *arg)
+{
+	detail_instance_t *inst = arg;
+	detail_entry_t	*head, *entry;
+	detail_file_t	*file, *pending;
+	struct timespec	when;
+	time_t		now, idle = 0;
+
+	pthread_mutex_lock(&inst->mutex);
+	while (1) {
+		if (!inst->head) {
+			if (inst->stop) break;
+
+			when.tv_sec = time(NULL) + 1;
+			when.tv_nsec = 0;
+			inst->waiting = TRUE;
+			pthread_cond_timedwait(&inst->cond, &inst->mutex, &when);
+			inst->waiting = FALSE;
+		}
+
+		head = inst->head;
+		inst->head = NULL;
+		inst->tail = &inst->head;
+		inst->num_queued = 0;
+		pthread_cond_broadcast(&inst->space);
+		pthread_mutex_unlock(&inst->mutex);
+
+		now = time(NULL);
 
 		/*
-		 *	Don't print passwords in old format...
+		 *	Gather the records for each file, keeping
+		 *	them in order.
 		 */
-		if (compat && !vp->da->vendor && (vp->da->attr == PW_USER_PASSWORD)) continue;
+		pending = NULL;
+		for (entry = head; entry != NULL; entry = entry->next) {
+			file = detail_file_find(inst, entry->filename);
+			entry->file = file;
+			if (!file) {
+				radlog(L_ERR, "rlm_detail: Discarding record for %s",
+				       entry->filename);
+				continue;
+			}
+
+			if (file->num_iov == DETAIL_MAX_IOV) {
+				detail_file_flush(inst, file, now);
+			}
+
+			if (!file->pending) {
+				file->pending = TRUE;
+				file->failed = FALSE;
+				file->next = pending;
+				pending = file;
+			}
+
+			file->iov[file->num_iov].iov_base = entry->data;
+			file->iov[file->num_iov].iov_len = entry->len;
+			file->num_iov++;
+		}
+
+		for (file = pending; file != NULL; file = file->next) {
+			detail_file_flush(inst, file, now);
+			file->pending = FALSE;
+
+			if (inst->fsync && !inst->fsync_interval &&
+			    file->dirty) {
+				if (fsync(file->fd) < 0) {
+					radlog(L_ERR, "rlm_detail: Failed syncing %s: %s",
+					       file->filename, strerror(errno));
+					file->failed = TRUE;
+				}
+				file->dirty = FALSE;
+				file->synced = now;
+			}
+		}
 
 		/*
-		 *	Print all of the attributes.
+		 *	Tell the workers how it went.  The entries
+		 *	belong to them, and can't be used once "done"
+		 *	is set and the mutex is released.
 		 */
-		vp_print(fp, vp);
+		pthread_mutex_lock(&inst->mutex);
+		for (entry = head; entry != NULL; entry = entry->next) {
+			if (entry->file && !entry->file->failed) {
+				entry->rcode = RLM_MODULE_OK;
+			} else {
+				entry->rcode = RLM_MODULE_FAIL;
+			}
+			entry->done = TRUE;
+		}
+		pthread_cond_broadcast(&inst->done);
+		pthread_mutex_unlock(&inst->mutex);
+
+		if (idle != now) {
+			fr_hash_table_walk(inst->files, detail_file_idle, inst);
+			idle = now;
+		}
+
+		pthread_mutex_lock(&inst->mutex);
 	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	fr_hash_table_walk(inst->files, detail_file_shutdown, inst);
+
+	return NULL;
+}
+
+/*
+ *	Give a record to the writer thread, and wait for it to be
+ *	written.
+ */
+static rlm_rcode_t detail_queue(detail_instance_t *inst, REQUEST *request,
+				const char *filename, uint8_t *data,
+				size_t len)
+{
+	detail_entry_t	entry;
+	int		rcode;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.filename = filename;
+	entry.data = data;
+	entry.len = len;
+
+	pthread_mutex_lock(&inst->mutex);
 
 	/*
-	 *	Add non-protocol attibutes.
+	 *	The thread is started on first use, as the server
+	 *	forks after the modules have been instantiated.
 	 */
-	if (compat) {
-#ifdef WITH_PROXY
-		if (request->proxy) {
-			char proxy_buffer[128];
-
-			inet_ntop(request->proxy->dst_ipaddr.af,
-				  &request->proxy->dst_ipaddr.ipaddr,
-				  proxy_buffer, sizeof(proxy_buffer));
-			fprintf(fp, "\tFreeradius-Proxied-To = %s\n",
-				proxy_buffer);
-			RDEBUG("Freeradius-Proxied-To = %s",
-				proxy_buffer);
+	if (!inst->running) {
+		rcode = pthread_create(&inst->thread, NULL, detail_writer, inst);
+		if (rcode != 0) {
+			pthread_mutex_unlock(&inst->mutex);
+			radlog_request(L_ERR, 0, request, "rlm_detail: Failed creating writer thread: %s",
+				       strerror(rcode));
+			return RLM_MODULE_FAIL;
 		}
-#endif
+		inst->running = TRUE;
+	}
 
-		fprintf(fp, "\tTimestamp = %ld\n",
-			(unsigned long) request->timestamp);
+	/*
+	 *	Don't let the queue grow without bound if the disk
+	 *	can't keep up.
+	 */
+	while (inst->num_queued >= DETAIL_MAX_QUEUED) {
+		pthread_cond_wait(&inst->space, &inst->mutex);
 	}
 
-	fprintf(fp, "\n");
+	*inst->tail = &entry;
+	inst->tail = &entry.next;
+	inst->num_queued++;
 
 	/*
-	 *	If we can't flush it to disk, truncate the file and
-	 *	return an error.
+	 *	If the writer thread is busy, it will see the new
+	 *	record when it's done with the current batch.
 	 */
-	if (fflush(fp) != 0) {
-		ftruncate(outfd, fsize); /* ignore errors! */
-		fclose(fp);
-		return RLM_MODULE_FAIL;
+	if (inst->waiting) pthread_cond_signal(&inst->cond);
+
+	RDEBUG2("Queued record for %s", filename);
+
+	/*
+	 *	Other workers queue their records while we wait, so
+	 *	they are all written together in the next batch.
+	 */
+	while (!entry.done) {
+		pthread_cond_wait(&inst->done, &inst->mutex);
 	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return entry.rcode;
+}
+#endif	/* HAVE_PTHREAD_H */
+
+/*
+ *	Do detail, compatible with old accounting
+ */
+static rlm_rcode_t do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
+			     int compat)
+{
+	char		buffer[DIRLEN];
+	uint8_t		*data;
+	size_t		len;
+	rlm_rcode_t	rcode;
+
+	struct detail_instance *inst = instance;
 
-	fclose(fp);
+	rad_assert(request != NULL);
 
 	/*
-	 *	And everything is fine.
+	 *	Nothing to log: don't do anything.
 	 */
-	return RLM_MODULE_OK;
+	if (!packet) {
+		return RLM_MODULE_NOOP;
+	}
+
+	/*
+	 *	Generate the path for the detail file.  Feed it
+	 *	through radius_xlat() to expand the variables.
+	 */
+	if (radius_xlat_compiled(buffer, sizeof(buffer), inst->detailfile_xlat, request, NULL, NULL) == 0) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to expand detail file %s",
+		    inst->detailfile);
+	    return RLM_MODULE_FAIL;
+	}
+	RDEBUG2("%s expands to %s", inst->detailfile, buffer);
+
+#ifdef HAVE_FNMATCH_H
+#ifdef FNM_FILE_NAME
+	/*
+	 *	If we read it from a detail file, and we're about to
+	 *	write it back to the SAME detail file directory, then
+	 *	suppress the write.  This check prevents an infinite
+	 *	loop.
+	 */
+	if ((request->listener->type == RAD_LISTEN_DETAIL) &&
+	    (fnmatch(((listen_detail_t *)request->listener->data)->filename,
+		     buffer, FNM_FILE_NAME | FNM_PERIOD ) == 0)) {
+		RDEBUG2W("Suppressing infinite loop.");
+		return RLM_MODULE_NOOP;
+	}
+#endif
+#endif
+
+	if (inst->binary) {
+		data = detail_binary(inst, request, packet, compat, &len);
+	} else {
+		data = detail_text(inst, request, packet, compat, &len);
+	}
+	if (!data) return RLM_MODULE_FAIL;
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->async) {
+		rcode = detail_queue(inst, request, buffer, data, len);
+	} else
+#endif
+	{
+		/*
+		 *	Locks on the file don't stop other threads from
+		 *	writing to it, so only one thread writes at a time.
+		 */
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&inst->mutex);
+#endif
+		rcode = detail_write(inst, request, buffer, data, len);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&inst->mutex);
+#endif
+	}
+
+	talloc_free(data);
+
+	return rcode;
 }
 
 /*
@@ -579,7 +1296,7 @@ static rlm_rcode_t mod_post_proxy(void *instance, REQUEST *request)
 module_t rlm_detail = {
 	RLM_MODULE_INIT,
 	"detail",
-	RLM_TYPE_THREAD_UNSAFE | RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE,
+	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE,
 	sizeof(detail_instance_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
@@ -602,5 +1319,6 @@ module_t rlm_detail = {
 		mod_send_coa
 #endif
 	},
+	NULL				/* flush */
 };
 
@@ -140,6 +140,7 @@ module_t rlm_dhcp = {
 		NULL,		 	/* post-proxy */
 		NULL,			/* post-auth */
 	},
+	NULL				/* flush */
 };
 
 #endif
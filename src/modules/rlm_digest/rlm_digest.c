@@ -619,4 +619,5 @@ module_t rlm_digest = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
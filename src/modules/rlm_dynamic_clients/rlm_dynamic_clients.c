@@ -125,4 +125,5 @@ module_t rlm_dynamic_clients = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -777,4 +777,5 @@ module_t rlm_eap = {
 #endif
 		mod_post_auth		/* post-auth */
 	},
+	NULL				/* flush */
 };
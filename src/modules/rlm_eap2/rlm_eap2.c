@@ -1002,4 +1002,5 @@ module_t rlm_eap2 = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -193,4 +193,5 @@ module_t rlm_example = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
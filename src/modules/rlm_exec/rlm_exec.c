@@ -467,4 +467,5 @@ module_t rlm_exec = {
 		exec_dispatch
 #endif
 	},
+	NULL				/* flush */
 };
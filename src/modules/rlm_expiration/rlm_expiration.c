@@ -178,4 +178,5 @@ module_t rlm_expiration = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
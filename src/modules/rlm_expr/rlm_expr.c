@@ -767,4 +767,5 @@ module_t rlm_expr = {
 		NULL,			/* pre-accounting */
 		NULL			/* accounting */
 	},
+	NULL				/* flush */
 };
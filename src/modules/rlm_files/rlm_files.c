@@ -548,5 +548,6 @@ module_t rlm_files = {
 #endif
 		mod_post_auth		/* post-auth */
 	},
+	NULL				/* flush */
 };
 
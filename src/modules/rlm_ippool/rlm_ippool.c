@@ -797,4 +797,5 @@ module_t rlm_ippool = {
 		NULL,			/* post-proxy */
 		mod_post_auth		/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -547,4 +547,5 @@ module_t rlm_krb5 = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
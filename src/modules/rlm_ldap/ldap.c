@@ -485,6 +485,40 @@ static ldap_rcode_t rlm_ldap_result(const ldap_instance_t *inst, const ldap_hand
 	return status;
 }
 
+/** Get the handle of a pool connection
+ *
+ * Remembers which connection the handle is in, so that it can be released.
+ *
+ * @param pool_conn returned by the connection pool, may be NULL.
+ * @return the handle, or NULL if there was no connection.
+ */
+static ldap_handle_t *rlm_ldap_handle(fr_connection_t *pool_conn)
+{
+	ldap_handle_t *conn;
+
+	if (!pool_conn) return NULL;
+
+	conn = fr_connection_handle(pool_conn);
+	conn->pool_conn = pool_conn;
+
+	return conn;
+}
+
+/** Replace the handle of a connection which is down
+ *
+ * If that fails, another connection from the pool is used.
+ *
+ * @param inst rlm_ldap configuration.
+ * @param conn to replace.
+ * @return the new handle, or NULL if there are no connections.
+ */
+static ldap_handle_t *rlm_ldap_reconnect(const ldap_instance_t *inst, ldap_handle_t *conn)
+{
+	if (!conn) return NULL;
+
+	return rlm_ldap_handle(fr_connection_reconnect(inst->pool, conn->pool_conn));
+}
+
 /** Bind to the LDAP directory as a user
  *
  * Performs a simple bind to the LDAP directory, and handles any errors that occur.
@@ -544,7 +578,7 @@ retry:
 
 	case LDAP_PROC_RETRY:
 		if (retry) {
-			*pconn = fr_connection_reconnect(inst->pool, *pconn);
+			*pconn = rlm_ldap_reconnect(inst, *pconn);
 			if (*pconn) {
 				LDAP_DBGW_REQ("Bind with %s to %s:%d failed: %s. Got new socket, retrying...",
 					      dn, inst->server, inst->port, error);
@@ -657,7 +691,7 @@ retry:
 		case LDAP_PROC_SUCCESS:
 			break;
 		case LDAP_PROC_RETRY:
-			*pconn = fr_connection_reconnect(inst->pool, *pconn);
+			*pconn = rlm_ldap_reconnect(inst, *pconn);
 			if (*pconn) {
 				RDEBUGW("Search failed: %s. Got new socket, retrying...", error);
 				
@@ -743,7 +777,7 @@ ldap_rcode_t rlm_ldap_modify(const ldap_instance_t *inst, REQUEST *request, ldap
 		case LDAP_PROC_SUCCESS:
 			break;
 		case LDAP_PROC_RETRY:
-			*pconn = fr_connection_reconnect(inst->pool, *pconn);
+			*pconn = rlm_ldap_reconnect(inst, *pconn);
 			if (*pconn) {
 				RDEBUGW("Modify failed: %s. Got new socket, retrying...", error);
 				
@@ -1204,7 +1238,7 @@ ldap_handle_t *rlm_ldap_get_socket(const ldap_instance_t *inst, REQUEST *request
 {
 	ldap_handle_t *conn;
 
-	conn = fr_connection_get(inst->pool);
+	conn = rlm_ldap_handle(fr_connection_get(inst->pool));
 	if (!conn) {
 		RDEBUGE("All ldap connections are in use");
 		
@@ -1239,10 +1273,10 @@ void rlm_ldap_release_socket(const ldap_instance_t *inst, ldap_handle_t *conn)
 	 *	rebind.
 	 */
 	if (conn->referred) {
-		fr_connection_del(inst->pool, conn);
+		fr_connection_del(inst->pool, conn->pool_conn);
 		return;
 	}
 
-	fr_connection_release(inst->pool, conn);
+	fr_connection_release(inst->pool, conn->pool_conn);
 	return;
 }
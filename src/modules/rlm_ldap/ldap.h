@@ -204,6 +204,7 @@ typedef struct ldap_handle {
 	int		referred;			//!< Whether the connection is now established a server 
 							//!< other than the configured one.
 	ldap_instance_t	*inst;				//!< rlm_ldap configuration.
+	fr_connection_t	*pool_conn;			//!< Pool connection holding the handle.
 } ldap_handle_t;
 
 typedef struct rlm_ldap_map_xlat {
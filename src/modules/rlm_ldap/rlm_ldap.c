@@ -1181,4 +1181,5 @@ module_t rlm_ldap = {
 		NULL,			/* post-proxy 		 */
 		mod_post_auth		/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -64,6 +64,12 @@ typedef struct rlm_linelog_t {
 	char		*group;
 	char		*line;
 	char		*reference;
+
+	xlat_exp_t	*filename_xlat;		//!< Pre-parsed filename.
+	xlat_exp_t	*line_xlat;		//!< Pre-parsed format.
+	xlat_exp_t	*reference_xlat;	//!< Pre-parsed reference.
+	xlat_section_t	*section_xlat;		//!< Pre-parsed entries which
+						//!< reference can point to.
 } rlm_linelog_t;
 
 /*
@@ -126,6 +132,13 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	inst->filename_xlat = xlat_compile(inst, inst->filename);
+	inst->line_xlat = xlat_compile(inst, inst->line);
+	if (inst->reference) {
+		inst->reference_xlat = xlat_compile(inst, inst->reference);
+		inst->section_xlat = xlat_compile_section(inst, conf);
+	}
+
 	inst->cs = conf;
 	return 0;
 }
@@ -202,6 +215,7 @@ static rlm_rcode_t do_linelog(void *instance, REQUEST *request)
 	char line[1024];
 	rlm_linelog_t *inst = (rlm_linelog_t*) instance;
 	const char *value = inst->line;
+	const xlat_exp_t *value_xlat = inst->line_xlat;
 
 #ifdef HAVE_GRP_H
 	gid_t gid;
@@ -213,8 +227,9 @@ static rlm_rcode_t do_linelog(void *instance, REQUEST *request)
 		CONF_ITEM *ci;
 		CONF_PAIR *cp;
 
-		radius_xlat(line + 1, sizeof(line) - 2, inst->reference,
-			    request, linelog_escape_func, NULL);
+		radius_xlat_compiled(line + 1, sizeof(line) - 2,
+				     inst->reference_xlat, request,
+				     linelog_escape_func, NULL);
 		line[0] = '.';	/* force to be in current section */
 
 		/*
@@ -244,6 +259,8 @@ static rlm_rcode_t do_linelog(void *instance, REQUEST *request)
 		 *	Value exists, but is empty.  Don't log anything.
 		 */
 		if (!*value) return RLM_MODULE_OK;
+
+		value_xlat = xlat_section_find(inst->section_xlat, cp);
 	}
 
  do_log:
@@ -251,8 +268,8 @@ static rlm_rcode_t do_linelog(void *instance, REQUEST *request)
 	 *	FIXME: Check length.
 	 */
 	if (strcmp(inst->filename, "syslog") != 0) {
-		radius_xlat(buffer, sizeof(buffer), inst->filename, request,
-			    NULL, NULL);
+		radius_xlat_compiled(buffer, sizeof(buffer),
+				     inst->filename_xlat, request, NULL, NULL);
 		
 		/* check path and eventually create subdirs */
 		p = strrchr(buffer,'/');
@@ -296,8 +313,13 @@ static rlm_rcode_t do_linelog(void *instance, REQUEST *request)
 	/*
 	 *	FIXME: Check length.
 	 */
-	radius_xlat(line, sizeof(line) - 1, value, request,
-		    linelog_escape_func, NULL);
+	if (value_xlat) {
+		radius_xlat_compiled(line, sizeof(line) - 1, value_xlat,
+				     request, linelog_escape_func, NULL);
+	} else {
+		radius_xlat(line, sizeof(line) - 1, value, request,
+			    linelog_escape_func, NULL);
+	}
 
 	if (fd >= 0) {
 		strcat(line, "\n");
@@ -340,4 +362,5 @@ module_t rlm_linelog = {
 		do_linelog	/* send-coa */
 #endif
 	},
+	NULL				/* flush */
 };
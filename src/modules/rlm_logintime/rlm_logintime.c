@@ -266,4 +266,5 @@ module_t rlm_logintime = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
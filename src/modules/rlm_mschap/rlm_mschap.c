@@ -1875,4 +1875,5 @@ module_t rlm_mschap = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -486,4 +486,5 @@ module_t rlm_opendirectory = {
 		NULL,		/* post-proxy */
 		NULL		/* post-auth */
 	},
+	NULL				/* flush */
 };
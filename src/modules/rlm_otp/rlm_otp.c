@@ -448,4 +448,5 @@ module_t rlm_otp = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -262,5 +262,6 @@ module_t rlm_pam = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
 
@@ -748,4 +748,5 @@ module_t rlm_pap = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -570,5 +570,6 @@ module_t rlm_passwd = {
 		passwd_map
 #endif
 	},
+	NULL				/* flush */
 };
 #endif /* TEST */
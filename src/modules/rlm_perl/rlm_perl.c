@@ -943,4 +943,5 @@ module_t rlm_perl = {
 		mod_send_coa
 #endif
 	},
+	NULL				/* flush */
 };
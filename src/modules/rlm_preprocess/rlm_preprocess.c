@@ -731,5 +731,6 @@ module_t rlm_preprocess = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
 
@@ -680,5 +680,6 @@ module_t rlm_python = {
 		, mod_recv_coa,
 		mod_send_coa
 #endif
-	}
+	},
+	NULL				/* flush */
 };
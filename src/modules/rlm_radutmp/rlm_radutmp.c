@@ -721,5 +721,6 @@ module_t rlm_radutmp = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
 
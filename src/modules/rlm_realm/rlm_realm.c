@@ -491,4 +491,5 @@ module_t rlm_realm = {
 		NULL			/* send-coa */
 #endif
 	},
+	NULL				/* flush */
 };
@@ -140,17 +140,20 @@ static size_t redis_xlat(void *instance, REQUEST *request,
 {
 	REDIS_INST *inst = instance;
 	REDISSOCK *dissocket;
+	fr_connection_t *pool_conn;
 	size_t ret = 0;
 	char *buffer_ptr;
 	char buffer[21];
 
-	dissocket = fr_connection_get(inst->pool);
-	if (!dissocket) {
+	pool_conn = fr_connection_get(inst->pool);
+	if (!pool_conn) {
 		radlog(L_ERR, "rlm_redis (%s): redis_get_socket() failed",
 		       inst->xlat_name);
 
 		return 0;
 	}
+	dissocket = fr_connection_handle(pool_conn);
+	dissocket->pool_conn = pool_conn;
 
 	/* Query failed for some reason, release socket and return */
 	if (rlm_redis_query(&dissocket, inst, fmt, request) < 0) {
@@ -187,8 +190,10 @@ static size_t redis_xlat(void *instance, REQUEST *request,
 	strlcpy(out, buffer_ptr, freespace);
 
 release:
-	rlm_redis_finish_query(dissocket);
-	fr_connection_release(inst->pool, dissocket);
+	if (dissocket) {
+		rlm_redis_finish_query(dissocket);
+		fr_connection_release(inst->pool, dissocket->pool_conn);
+	}
 	
 	return ret;
 }
@@ -217,6 +222,7 @@ int rlm_redis_query(REDISSOCK **dissocket_p, REDIS_INST *inst,
 		    const char *query, REQUEST *request)
 {
 	REDISSOCK *dissocket;
+	fr_connection_t *pool_conn;
 	int argc;
 	const char *argv[MAX_REDIS_ARGS];
 	char argv_buf[MAX_QUERY_LEN];
@@ -239,18 +245,21 @@ int rlm_redis_query(REDISSOCK **dissocket_p, REDIS_INST *inst,
 		radlog(L_ERR, "rlm_redis: (%s) REDIS error: %s",
 		       inst->xlat_name, dissocket->conn->errstr);
 
-		dissocket = fr_connection_reconnect(inst->pool, dissocket);
-		if (!dissocket) {
+		pool_conn = fr_connection_reconnect(inst->pool,
+						    dissocket->pool_conn);
+		if (!pool_conn) {
 		error:
 			*dissocket_p = NULL;
 			return -1;
 		}
+		dissocket = fr_connection_handle(pool_conn);
+		dissocket->pool_conn = pool_conn;
 
 		dissocket->reply = redisCommand(dissocket->conn, query);
 		if (!dissocket->reply) {
 			radlog(L_ERR, "rlm_redis (%s): failed after re-connect",
 			       inst->xlat_name);
-			fr_connection_del(inst->pool, dissocket);
+			fr_connection_del(inst->pool, dissocket->pool_conn);
 			goto error;
 		}
 
@@ -322,4 +331,5 @@ module_t rlm_redis = {
 		NULL, /* post-proxy */
 		NULL /* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -36,6 +36,7 @@ RCSIDH(rlm_redis_h, "$Id$")
 typedef struct redis_socket_t {
 	redisContext	*conn;
 	redisReply      *reply;
+	fr_connection_t	*pool_conn;	/* which holds this socket */
 } REDISSOCK;
 
 typedef struct rlm_redis_t REDIS_INST;
@@ -169,6 +169,7 @@ static rlm_rcode_t mod_accounting(void * instance, REQUEST * request)
 	const char *insert, *trim, *expire;
 	rlm_rediswho_t *inst = (rlm_rediswho_t *) instance;
 	REDISSOCK *dissocket;
+	fr_connection_t *pool_conn;
 
 	vp = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE, 0, TAG_ANY);
 	if (!vp) {
@@ -188,11 +189,13 @@ static rlm_rcode_t mod_accounting(void * instance, REQUEST * request)
 		return RLM_MODULE_NOOP;
 	}
 
-	dissocket = fr_connection_get(inst->redis_inst->pool);
-	if (!dissocket) {
+	pool_conn = fr_connection_get(inst->redis_inst->pool);
+	if (!pool_conn) {
 		RDEBUG("cannot allocate redis connection");
 		return RLM_MODULE_FAIL;
 	}
+	dissocket = fr_connection_handle(pool_conn);
+	dissocket->pool_conn = pool_conn;
 
 	insert = cf_pair_value(cf_pair_find(cs, "insert"));
 	trim = cf_pair_value(cf_pair_find(cs, "trim"));
@@ -203,7 +206,8 @@ static rlm_rcode_t mod_accounting(void * instance, REQUEST * request)
 					trim,
 					expire);
 
-	if (dissocket) fr_connection_release(inst->redis_inst->pool, dissocket);
+	if (dissocket) fr_connection_release(inst->redis_inst->pool,
+					     dissocket->pool_conn);
 
 	return rcode;
 }
@@ -227,4 +231,5 @@ module_t rlm_rediswho = {
 		NULL, /* post-proxy */
 		NULL /* post-auth */
 	},
+	NULL				/* flush */
 };
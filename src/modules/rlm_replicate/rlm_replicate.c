@@ -299,4 +299,5 @@ module_t rlm_replicate = {
 		NULL
 #endif
 	},
+	NULL				/* flush */
 };
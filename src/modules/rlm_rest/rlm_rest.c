@@ -281,13 +281,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 	rlm_rest_t *my_instance = instance;
 	rlm_rest_section_t *section = &my_instance->authorize;
 
+	fr_connection_t *pool_conn;
 	void *handle;
 	int hcode;
 	int rcode = RLM_MODULE_OK;
 	int ret;
 
-	handle = fr_connection_get(my_instance->conn_pool);
-	if (!handle) return RLM_MODULE_FAIL;
+	pool_conn = fr_connection_get(my_instance->conn_pool);
+	if (!pool_conn) return RLM_MODULE_FAIL;
+	handle = fr_connection_handle(pool_conn);
 
 	ret = rlm_rest_perform(instance, section, handle, request);
 	if (ret < 0) {
@@ -343,7 +345,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 
 	rlm_rest_cleanup(instance, section, handle);
 
-	fr_connection_release(my_instance->conn_pool, handle);
+	fr_connection_release(my_instance->conn_pool, pool_conn);
 
 	return rcode;
 }
@@ -425,4 +427,5 @@ module_t rlm_rest = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
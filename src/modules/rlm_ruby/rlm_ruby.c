@@ -469,4 +469,5 @@ module_t rlm_ruby = {
 		mod_send_coa
 #endif
 	},
+	NULL				/* flush */
 };
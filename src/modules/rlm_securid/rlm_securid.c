@@ -563,4 +563,5 @@ module_t rlm_securid = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -201,15 +201,17 @@ static rlm_rcode_t mod_authenticate(void *instance, REQUEST *request)
 	VALUE_PAIR *state;
 	int bufsize;
 	int *fdp;
+	fr_connection_t *pool_conn;
 	rlm_rcode_t rcode = RLM_MODULE_FAIL;
 	char buffer[1000];
 	char output[1000];
 
-	fdp = fr_connection_get(inst->pool);
-	if (!fdp) {
+	pool_conn = fr_connection_get(inst->pool);
+	if (!pool_conn) {
 		RDEBUGE("Failed to get handle from connection pool");
 		return RLM_MODULE_FAIL;
 	}
+	fdp = fr_connection_handle(pool_conn);
 	
 	/* Get greeting */
 	bufsize = read_all(fdp, buffer, sizeof(buffer));
@@ -300,7 +302,7 @@ static rlm_rcode_t mod_authenticate(void *instance, REQUEST *request)
 	rcode = RLM_MODULE_HANDLED;
 
 done:
-	fr_connection_release(inst->pool, fdp);
+	fr_connection_release(inst->pool, pool_conn);
 	return rcode;
 }
 
@@ -357,4 +359,5 @@ module_t rlm_smsotp = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -225,4 +225,5 @@ module_t rlm_soh = {
 		NULL,			/* post-proxy */
 		mod_post_auth		/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -197,4 +197,5 @@ module_t rlm_sometimes = {
 		sometimes_reply		/* send-coa */
 #endif
 	},
+	NULL				/* flush */
 };
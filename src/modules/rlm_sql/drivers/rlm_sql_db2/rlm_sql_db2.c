@@ -328,4 +328,6 @@ rlm_sql_module_t rlm_sql_db2 = {
 	sql_finish_query,
 	sql_finish_select_query,
 	sql_affected_rows,
+	NULL,	/* sql_prepared_query */
+	NULL	/* sql_prepared_select_query */
 };
@@ -380,5 +380,7 @@ rlm_sql_module_t rlm_sql_iodbc = {
 	sql_error,
 	sql_finish_query,
 	sql_finish_select_query,
-	sql_affected_rows
+	sql_affected_rows,
+	NULL,	/* sql_prepared_query */
+	NULL	/* sql_prepared_select_query */
 };
@@ -67,6 +67,27 @@ static int sql_socket_destructor(void *c)
 	return 0;
 }
 
+static int mod_instantiate(UNUSED CONF_SECTION *conf,
+			   UNUSED rlm_sql_config_t *config)
+{
+	/*
+	 *	mysql_init() initialises the library the first time
+	 *	it's called, and that isn't thread-safe.  Connections
+	 *	for different modules may be opened in parallel, so
+	 *	we initialise the library here, before any of them.
+	 */
+#if (MYSQL_VERSION_ID >= 50003)
+	if (mysql_library_init(0, NULL, NULL) != 0) {
+#else
+	if (mysql_server_init(0, NULL, NULL) != 0) {
+#endif
+		radlog(L_ERR, "rlm_sql_mysql: Couldn't initialise MySQL client library");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*************************************************************************
  *
  *	Function: sql_create_socket
@@ -490,7 +511,7 @@ static int sql_affected_rows(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t
 /* Exported to rlm_sql */
 rlm_sql_module_t rlm_sql_mysql = {
 	"rlm_sql_mysql",
-	NULL,
+	mod_instantiate,
 	sql_socket_init,
 	sql_query,
 	sql_select_query,
@@ -502,5 +523,7 @@ rlm_sql_module_t rlm_sql_mysql = {
 	sql_error,
 	sql_finish_query,
 	sql_finish_select_query,
-	sql_affected_rows
+	sql_affected_rows,
+	NULL,	/* sql_prepared_query */
+	NULL	/* sql_prepared_select_query */
 };
@@ -54,6 +54,8 @@ typedef struct rlm_sql_postgres_conn {
    int	     num_fields;
    int		   affected_rows;
    char	    **row;
+   uint8_t	*prepared;	/* indexed by sql_stmt_t id */
+   int		num_prepared;
 } rlm_sql_postgres_conn_t;
 
 /* Internal function. Return true if the postgresql status value
@@ -199,25 +201,17 @@ static int sql_init_socket(rlm_sql_handle_t *handle, rlm_sql_config_t *config) {
 
 /*************************************************************************
  *
- *	Function: sql_query
+ *	Function: sql_result
  *
- *	Purpose: Issue a query to the database
+ *	Purpose: Check the result of a query
  *
  *************************************************************************/
-static int sql_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *config,
-		     char *querystr) {
+static int sql_result(rlm_sql_postgres_conn_t *conn) {
 
-	rlm_sql_postgres_conn_t *conn = handle->conn;
 	int numfields = 0;
 	char *errorcode;
 	char *errormsg;
 
-	if (!conn->db) {
-		radlog(L_ERR, "rlm_sql_postgresql: Socket not connected");
-		return SQL_DOWN;
-	}
-
-	conn->result = PQexec(conn->db, querystr);
 		/*
 		 * Returns a PGresult pointer or possibly a null pointer.
 		 * A non-null pointer will generally be returned except in
@@ -323,6 +317,79 @@ static int sql_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *config,
 	return -1;
 }
 
+/*************************************************************************
+ *
+ *	Function: sql_query
+ *
+ *	Purpose: Issue a query to the database
+ *
+ *************************************************************************/
+static int sql_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *config,
+		     char *querystr) {
+
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		radlog(L_ERR, "rlm_sql_postgresql: Socket not connected");
+		return SQL_DOWN;
+	}
+
+	conn->result = PQexec(conn->db, querystr);
+
+	return sql_result(conn);
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_prepared_query
+ *
+ *	Purpose: Issue a prepared statement to the database, preparing
+ *	       it the first time it's used on this connection
+ *
+ *************************************************************************/
+static int sql_prepared_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *config,
+			      const sql_stmt_t *stmt, const char **params) {
+
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char name[32];
+
+	if (!conn->db) {
+		radlog(L_ERR, "rlm_sql_postgresql: Socket not connected");
+		return SQL_DOWN;
+	}
+
+	if (stmt->id >= conn->num_prepared) {
+		MEM(conn->prepared = talloc_realloc(conn, conn->prepared, uint8_t, stmt->id + 1));
+		memset(conn->prepared + conn->num_prepared, 0,
+		       stmt->id + 1 - conn->num_prepared);
+		conn->num_prepared = stmt->id + 1;
+	}
+
+	snprintf(name, sizeof(name), "fr_stmt_%d", stmt->id);
+
+	/*
+	 *	The parameter types are left for the server to work
+	 *	out, as it does for quoted strings.
+	 */
+	if (!conn->prepared[stmt->id]) {
+		conn->result = PQprepare(conn->db, name, stmt->numbered,
+					 stmt->num_params, NULL);
+		if (!conn->result ||
+		    (PQresultStatus(conn->result) != PGRES_COMMAND_OK)) {
+			return sql_result(conn);
+		}
+
+		PQclear(conn->result);
+		conn->result = NULL;
+		conn->prepared[stmt->id] = 1;
+	}
+
+	conn->result = PQexecPrepared(conn->db, name, stmt->num_params,
+				      params, NULL, NULL, 0);
+
+	return sql_result(conn);
+}
+
 
 /*************************************************************************
  *
@@ -499,4 +566,6 @@ rlm_sql_module_t rlm_sql_postgresql = {
 	sql_finish_query,
 	sql_finish_select_query,
 	sql_affected_rows,
+	sql_prepared_query,
+	sql_prepared_query
 };
@@ -36,11 +36,23 @@ RCSID("$Id$")
 
 #include "rlm_sql.h"
 
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 static const CONF_PARSER acct_section_config[] = {
 	{"reference", PW_TYPE_STRING_PTR,
 	  offsetof(sql_acct_section_t, reference), NULL, ".query"},
 	{"logfile", PW_TYPE_STRING_PTR,
 	 offsetof(sql_acct_section_t, logfile), NULL, NULL},
+	{"batch_size", PW_TYPE_INTEGER,
+	 offsetof(sql_acct_section_t, batch_size), NULL, "0"},
+	{"batch_timeout", PW_TYPE_INTEGER,
+	 offsetof(sql_acct_section_t, batch_timeout), NULL, "10"},
 	
 	{NULL, -1, 0, NULL, NULL}
 };
@@ -98,6 +110,17 @@ static const CONF_PARSER module_config[] = {
 	 */
 	{"query_timeout", PW_TYPE_INTEGER,
 	 offsetof(rlm_sql_config_t,query_timeout), NULL, NULL},
+
+	/*
+	 *	So does this.
+	 */
+	{"prepared_statements", PW_TYPE_BOOLEAN,
+	 offsetof(rlm_sql_config_t,prepared_statements), NULL, "no"},
+
+	{"authorize_cache_ttl", PW_TYPE_INTEGER,
+	 offsetof(rlm_sql_config_t,authorize_cache_ttl), NULL, "0"},
+	{"authorize_cache_max_entries", PW_TYPE_INTEGER,
+	 offsetof(rlm_sql_config_t,authorize_cache_max_entries), NULL, "16384"},
 	
 	{NULL, -1, 0, NULL, NULL}
 };
@@ -453,18 +476,16 @@ int sql_set_user(rlm_sql_t *inst, REQUEST *request, const char *username)
 {
 	char buffer[254];
 	VALUE_PAIR *vp = NULL;
-	const char *sqluser;
 	size_t len;
 
 	if (username != NULL) {
-		sqluser = username;
+		len = radius_xlat(buffer, sizeof(buffer), username, request, NULL, NULL);
 	} else if (*inst->config->query_user) {
-		sqluser = inst->config->query_user;
+		len = radius_xlat_compiled(buffer, sizeof(buffer), inst->query_user_xlat, request, NULL, NULL);
 	} else {
 		return 0;
 	}
 	
-	len = radius_xlat(buffer, sizeof(buffer), sqluser, request, NULL, NULL);
 	if (!len) {
 		return -1;
 	}
@@ -498,14 +519,21 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t *handle,
 	    (inst->config->groupmemb_query[0] == 0))
 		return 0;
 
-	if (!radius_xlat(querystr, sizeof(querystr), inst->config->groupmemb_query, request, sql_escape_func, inst)) {
-		radlog_request(L_ERR, 0, request, "xlat \"%s\" failed.",
-			       inst->config->groupmemb_query);
-		return -1;
-	}
+	if (inst->groupmemb_stmt) {
+		if (rlm_sql_prepared_select_query(&handle, inst, request,
+						  inst->groupmemb_stmt) < 0) {
+			return -1;
+		}
+	} else {
+		if (!radius_xlat_compiled(querystr, sizeof(querystr), inst->groupmemb_xlat, request, sql_escape_func, inst)) {
+			radlog_request(L_ERR, 0, request, "xlat \"%s\" failed.",
+				       inst->config->groupmemb_query);
+			return -1;
+		}
 
-	if (rlm_sql_select_query(&handle, inst, querystr) < 0) {
-		return -1;
+		if (rlm_sql_select_query(&handle, inst, querystr) < 0) {
+			return -1;
+		}
 	}
 	while (rlm_sql_fetch_row(&handle, inst) == 0) {
 		row = handle->row;
@@ -534,6 +562,323 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t *handle,
 	return num_groups;
 }
 
+/*
+ *	Run one of the authorize queries, and get the check or reply
+ *	pairs it returns.
+ */
+static int sql_authorize_getvpdata(rlm_sql_t *inst, REQUEST *request,
+				   rlm_sql_handle_t **handle, TALLOC_CTX *ctx,
+				   VALUE_PAIR **pair, const sql_stmt_t *stmt,
+				   xlat_exp_t *xlat)
+{
+	char querystr[MAX_QUERY_LEN];
+
+	if (stmt) {
+		return sql_stmt_getvpdata(inst, handle, request, ctx, pair, stmt);
+	}
+
+	if (!radius_xlat_compiled(querystr, sizeof(querystr), xlat, request, sql_escape_func, inst)) {
+		radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
+		return -1;
+	}
+
+	return sql_getvpdata(inst, handle, ctx, pair, querystr);
+}
+
+/*
+ *	The results of the authorize queries for one SQL-User-Name.
+ */
+typedef struct sql_cache_entry {
+	const char		*key;
+	int			offset;		//!< For the heap.
+	time_t			expires;
+	int			refs;		//!< Requests using the entry.
+	int			loading;	//!< Still being read.
+	int			failed;		//!< Reading it failed.
+	int			dead;		//!< No longer in the cache.
+
+	int			check_rows;
+	VALUE_PAIR		*check;
+	int			reply_rows;
+	VALUE_PAIR		*reply;
+	rlm_sql_grouplist_t	*groups;
+} sql_cache_entry_t;
+
+static int sql_cache_cmp(const void *one, const void *two)
+{
+	const sql_cache_entry_t *a = one;
+	const sql_cache_entry_t *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static int sql_cache_heap_cmp(const void *one, const void *two)
+{
+	const sql_cache_entry_t *a = one;
+	const sql_cache_entry_t *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+/*
+ *	Remove an entry from the cache.  Requests which are using it
+ *	can carry on, and the last one frees it.
+ *
+ *	Must be called with the cache mutex held.
+ */
+static void sql_cache_unlink(rlm_sql_t *inst, sql_cache_entry_t *c)
+{
+	fr_heap_extract(inst->cache_heap, c);
+	rbtree_deletebydata(inst->cache, c);
+	c->dead = TRUE;
+
+	if (c->refs == 0) talloc_free(c);
+}
+
+static void sql_cache_release(rlm_sql_t *inst, sql_cache_entry_t *c)
+{
+	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
+	c->refs--;
+	if (c->dead && (c->refs == 0)) talloc_free(c);
+	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+}
+
+/*
+ *	Run all of the authorize queries, and save their results in
+ *	the entry.  The group replies are read even if the group
+ *	checks won't match this request, as they may match the next.
+ */
+static int sql_cache_fill(rlm_sql_t *inst, REQUEST *request,
+			  rlm_sql_handle_t **handle, sql_cache_entry_t *c)
+{
+	rlm_sql_grouplist_t *entry;
+
+	if (inst->config->authorize_check_query &&
+	    *inst->config->authorize_check_query) {
+		c->check_rows = sql_authorize_getvpdata(inst, request, handle, c, &c->check,
+							inst->authorize_check_stmt,
+							inst->authorize_check_xlat);
+		if (c->check_rows < 0) return -1;
+	}
+
+	if (inst->config->authorize_reply_query &&
+	    *inst->config->authorize_reply_query) {
+		c->reply_rows = sql_authorize_getvpdata(inst, request, handle, c, &c->reply,
+							inst->authorize_reply_stmt,
+							inst->authorize_reply_xlat);
+		if (c->reply_rows < 0) return -1;
+	}
+
+	if (sql_get_grouplist(inst, *handle, request, &c->groups) < 0) {
+		return -1;
+	}
+	talloc_steal(c, c->groups);
+
+	for (entry = c->groups; entry != NULL; entry = entry->next) {
+		if (!pairmake_packet("Sql-Group", entry->name, T_OP_EQ)) {
+			return -1;
+		}
+
+		entry->check_rows = sql_authorize_getvpdata(inst, request, handle, c, &entry->check,
+							    inst->authorize_group_check_stmt,
+							    inst->authorize_group_check_xlat);
+		if (entry->check_rows >= 0) {
+			entry->reply_rows = sql_authorize_getvpdata(inst, request, handle, c, &entry->reply,
+								    inst->authorize_group_reply_stmt,
+								    inst->authorize_group_reply_xlat);
+		}
+
+		pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
+
+		if ((entry->check_rows < 0) || (entry->reply_rows < 0)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Find the results of the authorize queries for the user in
+ *	SQL-User-Name, reading them from the database if they aren't
+ *	cached.  Requests which miss on the same user at the same time
+ *	wait for the first one to read them, instead of all running
+ *	the same queries.
+ *
+ *	Returns 1 and an entry which must be released, 0 if there is
+ *	no SQL-User-Name, or -1 if the queries failed.
+ */
+static int sql_cache_get(rlm_sql_t *inst, REQUEST *request,
+			 sql_cache_entry_t **out)
+{
+	int rcode;
+	VALUE_PAIR *vp;
+	sql_cache_entry_t *c, my_c;
+	rlm_sql_handle_t *handle;
+
+	*out = NULL;
+
+	vp = pairfind(request->packet->vps, inst->sql_user->attr, inst->sql_user->vendor, TAG_ANY);
+	if (!vp) return 0;
+
+	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
+
+	/*
+	 *	Expire old entries.
+	 */
+	while (((c = fr_heap_peek(inst->cache_heap)) != NULL) &&
+	       (c->expires < request->timestamp)) {
+		sql_cache_unlink(inst, c);
+	}
+
+	my_c.key = vp->vp_strvalue;
+	c = rbtree_finddata(inst->cache, &my_c);
+	if (c) {
+		c->refs++;
+
+#ifdef HAVE_PTHREAD_H
+		if (c->loading) {
+			RDEBUG2("Waiting for the entries for \"%s\" to be read",
+				c->key);
+		}
+		while (c->loading) {
+			pthread_cond_wait(&inst->cache_cond, &inst->cache_mutex);
+		}
+#endif
+		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+
+		if (c->failed) {
+			sql_cache_release(inst, c);
+			return -1;
+		}
+
+		RDEBUG2("Using cached entries for \"%s\"", c->key);
+		*out = c;
+		return 1;
+	}
+
+	/*
+	 *	Make room, by throwing away the entry which would
+	 *	expire first.
+	 */
+	if (rbtree_num_elements(inst->cache) >= inst->config->authorize_cache_max_entries) {
+		sql_cache_unlink(inst, fr_heap_peek(inst->cache_heap));
+	}
+
+	c = talloc_zero(NULL, sql_cache_entry_t);
+	c->key = talloc_strdup(c, vp->vp_strvalue);
+	c->expires = request->timestamp + inst->config->authorize_cache_ttl;
+	c->refs = 1;
+	c->loading = TRUE;
+
+	if (!rbtree_insert(inst->cache, c)) {
+		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		talloc_free(c);
+		return -1;
+	}
+	fr_heap_insert(inst->cache_heap, c);
+
+	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+
+	RDEBUG2("Reading entries for \"%s\" into the cache", c->key);
+
+	rcode = -1;
+	handle = sql_get_socket(inst);
+	if (handle) {
+		rcode = sql_cache_fill(inst, request, &handle, c);
+		if (handle) sql_release_socket(inst, handle);
+	}
+
+	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
+
+	c->loading = FALSE;
+	if (rcode < 0) {
+		c->failed = TRUE;
+		if (!c->dead) sql_cache_unlink(inst, c);
+
+	} else if (!c->dead) {
+		/*
+		 *	The entry is as old as its data.
+		 */
+		fr_heap_extract(inst->cache_heap, c);
+		c->expires = time(NULL) + inst->config->authorize_cache_ttl;
+		fr_heap_insert(inst->cache_heap, c);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_broadcast(&inst->cache_cond);
+#endif
+	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+
+	if (rcode < 0) {
+		sql_cache_release(inst, c);
+		return -1;
+	}
+
+	*out = c;
+	return 1;
+}
+
+/*
+ *	Drop the cached results for one SQL-User-Name, or for all of
+ *	them.
+ */
+static int mod_flush(void *instance, const char *key)
+{
+	int count = 0;
+	rlm_sql_t *inst = instance;
+	sql_cache_entry_t *c, my_c;
+
+	if (!inst->cache) return 0;
+
+	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
+
+	if (key) {
+		my_c.key = key;
+		c = rbtree_finddata(inst->cache, &my_c);
+		if (c) {
+			sql_cache_unlink(inst, c);
+			count++;
+		}
+
+	} else {
+		while ((c = fr_heap_peek(inst->cache_heap)) != NULL) {
+			sql_cache_unlink(inst, c);
+			count++;
+		}
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+
+	return count;
+}
+
+/*
+ *	Drop the cached results for a user, e.g.
+ *
+ *	"%{sql_flush:%{User-Name}}"
+ *
+ *	Returns the number of entries dropped.
+ */
+static size_t sql_flush_xlat(void *instance, REQUEST *request,
+			     const char *fmt, char *out, size_t freespace)
+{
+	rlm_sql_t *inst = instance;
+	char buffer[MAX_STRING_LEN];
+
+	if (!radius_xlat(buffer, sizeof(buffer), fmt, request, NULL, NULL)) {
+		*out = '\0';
+		return 0;
+	}
+
+	snprintf(out, freespace, "%d", mod_flush(inst, buffer));
+
+	return strlen(out);
+}
+
 
 /*
  * sql groupcmp function. That way we can do group comparisons (in the users file for example)
@@ -545,9 +890,11 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t *handle,
 static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *request_vp, VALUE_PAIR *check,
 			UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
 {
-	rlm_sql_handle_t *handle;
+	rlm_sql_handle_t *handle = NULL;
 	rlm_sql_t *inst = instance;
-	rlm_sql_grouplist_t *head, *entry;
+	rlm_sql_grouplist_t *head = NULL, *entry;
+	sql_cache_entry_t *cached = NULL;
+	int rcode = 1;
 
 	RDEBUG("sql_groupcmp");
 	if (!check || !check->length){
@@ -564,65 +911,84 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	if (sql_set_user(inst, request, NULL) < 0)
 		return 1;
 
-	/*
-	 *	Get a socket for this lookup
-	 */
-	handle = sql_get_socket(inst);
-	if (!handle) {
-		return 1;
-	}
-
-	/*
-	 *	Get the list of groups this user is a member of
-	 */
-	if (sql_get_grouplist(inst, handle, request, &head) < 0) {
+	if (inst->cache &&
+	    (sql_cache_get(inst, request, &cached) < 0)) {
 		radlog_request(L_ERR, 0, request,
 			       "Error getting group membership");
-		sql_release_socket(inst, handle);
 		return 1;
 	}
 
+	if (cached) {
+		head = cached->groups;
+	} else {
+		/*
+		 *	Get a socket for this lookup
+		 */
+		handle = sql_get_socket(inst);
+		if (!handle) {
+			return 1;
+		}
+
+		/*
+		 *	Get the list of groups this user is a member of
+		 */
+		if (sql_get_grouplist(inst, handle, request, &head) < 0) {
+			radlog_request(L_ERR, 0, request,
+				       "Error getting group membership");
+			sql_release_socket(inst, handle);
+			return 1;
+		}
+	}
+
 	for (entry = head; entry != NULL; entry = entry->next) {
 		if (strcmp(entry->name, check->vp_strvalue) == 0){
 			RDEBUG("sql_groupcmp finished: User is a member of group %s",
 			       check->vp_strvalue);
-			talloc_free(head);
-			sql_release_socket(inst, handle);
-			return 0;
+			rcode = 0;
+			break;
 		}
 	}
 
-	/* Free the grouplist */
-	talloc_free(head);
-	sql_release_socket(inst,handle);
+	if (cached) {
+		sql_cache_release(inst, cached);
+	} else {
+		/* Free the grouplist */
+		talloc_free(head);
+		sql_release_socket(inst,handle);
+	}
 
-	RDEBUG("sql_groupcmp finished: User is NOT a member of group %s",
-	       check->vp_strvalue);
+	if (rcode != 0) {
+		RDEBUG("sql_groupcmp finished: User is NOT a member of group %s",
+		       check->vp_strvalue);
+	}
 
-	return 1;
+	return rcode;
 }
 
 
 
-static int rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t *handle, int *dofallthrough)
+static int rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				  sql_cache_entry_t *cached, int *dofallthrough)
 {
 	VALUE_PAIR *check_tmp = NULL;
 	VALUE_PAIR *reply_tmp = NULL;
-	rlm_sql_grouplist_t *head, *entry;
+	rlm_sql_grouplist_t *head = NULL, *entry;
 	VALUE_PAIR *sql_group = NULL;
-	char    querystr[MAX_QUERY_LEN];
 	int found = 0;
 	int rows;
 
 	/*
 	 *	Get the list of groups this user is a member of
 	 */
-	if (sql_get_grouplist(inst, handle, request, &head) < 0) {
+	if (!cached &&
+	    (sql_get_grouplist(inst, handle, request, &head) < 0)) {
 		radlog_request(L_ERR, 0, request, "Error retrieving group list");
 		return -1;
 	}
 
-	for (entry = head; entry != NULL && *dofallthrough != 0; entry = entry->next) {
+	for (entry = cached ? cached->groups : head;
+	     entry != NULL && *dofallthrough != 0;
+	     entry = entry->next) {
 		/*
 		 *	Add the Sql-Group attribute to the request list so we know
 		 *	which group we're retrieving attributes for
@@ -634,15 +1000,14 @@ static int rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm_sql_han
 			talloc_free(head);
 			return -1;
 		}
-		if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_group_check_query, request, sql_escape_func, inst)) {
-			radlog_request(L_ERR, 0, request,
-				       "Error generating query; rejecting user");
-			/* Remove the grouup we added above */
-			pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
-			talloc_free(head);
-			return -1;
+		if (cached) {
+			check_tmp = paircopy(request, entry->check);
+			rows = entry->check_rows;
+		} else {
+			rows = sql_authorize_getvpdata(inst, request, &handle, request, &check_tmp,
+						       inst->authorize_group_check_stmt,
+						       inst->authorize_group_check_xlat);
 		}
-		rows = sql_getvpdata(inst, &handle, request, &check_tmp, querystr);
 		if (rows < 0) {
 			radlog_request(L_ERR, 0, request, "Error retrieving check pairs for group %s",
 			       entry->name);
@@ -651,61 +1016,33 @@ static int rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm_sql_han
 			pairfree(&check_tmp);
 			talloc_free(head);
 			return -1;
-		} else if (rows > 0) {
-			/*
-			 *	Only do this if *some* check pairs were returned
-			 */
-			if (paircompare(request, request->packet->vps, check_tmp, &request->reply->vps) == 0) {
-				found = 1;
-				RDEBUG2("User found in group %s",
-					entry->name);
-				/*
-				 *	Now get the reply pairs since the paircompare matched
-				 */
-				if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_group_reply_query, request, sql_escape_func, inst)) {
-					radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
-					/* Remove the grouup we added above */
-					pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
-					pairfree(&check_tmp);
-					talloc_free(head);
-					return -1;
-				}
-				if (sql_getvpdata(inst, &handle, request->reply, &reply_tmp, querystr) < 0) {
-					radlog_request(L_ERR, 0, request, "Error retrieving reply pairs for group %s",
-					       entry->name);
-					/* Remove the grouup we added above */
-					pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
-					pairfree(&check_tmp);
-					pairfree(&reply_tmp);
-					talloc_free(head);
-					return -1;
-				}
-				*dofallthrough = fallthrough(reply_tmp);
-				radius_xlat_move(request, &request->reply->vps, &reply_tmp);
-				radius_xlat_move(request, &request->config_items, &check_tmp);
-			}
-		} else {
-			/*
-			 *	rows == 0.  This is like having the username on a line
-			 * 	in the user's file with no check vp's.  As such, we treat
-			 *	it as found and add the reply attributes, so that we
-			 *	match expected behavior
-			 */
+		}
+
+		/*
+		 *	Only compare if *some* check pairs were returned.
+		 *
+		 *	rows == 0 is like having the username on a line
+		 * 	in the user's file with no check vp's.  As such, we treat
+		 *	it as found and add the reply attributes, so that we
+		 *	match expected behavior
+		 */
+		if ((rows == 0) ||
+		    (paircompare(request, request->packet->vps, check_tmp, &request->reply->vps) == 0)) {
 			found = 1;
 			RDEBUG2("User found in group %s",
 				entry->name);
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_group_reply_query, request, sql_escape_func, inst)) {
-				radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
-				/* Remove the grouup we added above */
-				pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
-				pairfree(&check_tmp);
-				talloc_free(head);
-				return -1;
+			if (cached) {
+				reply_tmp = paircopy(request->reply, entry->reply);
+				rows = entry->reply_rows;
+			} else {
+				rows = sql_authorize_getvpdata(inst, request, &handle, request->reply, &reply_tmp,
+							       inst->authorize_group_reply_stmt,
+							       inst->authorize_group_reply_xlat);
 			}
-			if (sql_getvpdata(inst, &handle, request->reply, &reply_tmp, querystr) < 0) {
+			if (rows < 0) {
 				radlog_request(L_ERR, 0, request, "Error retrieving reply pairs for group %s",
 				       entry->name);
 				/* Remove the grouup we added above */
@@ -743,9 +1080,39 @@ static int mod_detach(void *instance)
 	if (inst->config) {
 		if (inst->pool) sql_poolfree(inst);
 
+#ifdef HAVE_PTHREAD_H
+		if (inst->config->accounting &&
+		    (inst->config->accounting->batch_size > 1)) {
+			pthread_mutex_destroy(&inst->config->accounting->batch_mutex);
+			pthread_cond_destroy(&inst->config->accounting->batch_cond);
+		}
+
+		if (inst->config->postauth &&
+		    (inst->config->postauth->batch_size > 1)) {
+			pthread_mutex_destroy(&inst->config->postauth->batch_mutex);
+			pthread_cond_destroy(&inst->config->postauth->batch_cond);
+		}
+#endif
+
 		if (inst->config->xlat_name) {
 			xlat_unregister(inst->config->xlat_name, sql_xlat, instance);
 		}
+
+		if (inst->cache) {
+			char buffer[MAX_STRING_LEN];
+
+			snprintf(buffer, sizeof(buffer), "%s_flush",
+				 inst->config->xlat_name);
+			xlat_unregister(buffer, sql_flush_xlat, instance);
+
+			mod_flush(inst, NULL);
+			rbtree_free(inst->cache);
+			fr_heap_delete(inst->cache_heap);
+#ifdef HAVE_PTHREAD_H
+			pthread_mutex_destroy(&inst->cache_mutex);
+			pthread_cond_destroy(&inst->cache_cond);
+#endif
+		}
 	}
 
 	if (inst->handle) {
@@ -788,9 +1155,76 @@ static int parse_sub_section(CONF_SECTION *parent,
 		
 	(*config)->cs = cs;
 
+	/*
+	 *	Pre-parse the reference, and all of the queries it
+	 *	could point to.
+	 */
+	(*config)->reference_xlat = xlat_compile(*config, (*config)->reference);
+	(*config)->queries = xlat_compile_section(*config, cs);
+
+	if ((*config)->batch_size > 1) {
+#ifdef HAVE_PTHREAD_H
+		if (((*config)->batch_timeout < 1) ||
+		    ((*config)->batch_timeout > 1000)) {
+			cf_log_err_cs(cs, "batch_timeout must be between 1 and 1000");
+			return -1;
+		}
+
+		pthread_mutex_init(&(*config)->batch_mutex, NULL);
+		pthread_cond_init(&(*config)->batch_cond, NULL);
+#else
+		radlog(L_INFO, "rlm_sql (%s): Ignoring \"batch_size\" for %s, "
+		       "as the server has no threads", inst->config->xlat_name,
+		       name);
+		(*config)->batch_size = 0;
+#endif
+	}
+
 	return 0;
 }
 
+/*
+ *	Prepare the queries in an accounting or post-auth section.
+ *	The section's own configuration items aren't queries.
+ */
+static void sql_stmt_compile_section(rlm_sql_t *inst,
+				     sql_acct_section_t *section,
+				     CONF_SECTION *cs)
+{
+	int		i;
+	CONF_ITEM	*ci;
+	CONF_PAIR	*cp;
+	sql_stmt_t	*stmt;
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			sql_stmt_compile_section(inst, section,
+						 cf_itemtosection(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+		cp = cf_itemtopair(ci);
+
+		if (cs == section->cs) {
+			for (i = 0; acct_section_config[i].name != NULL; i++) {
+				if (strcmp(cf_pair_attr(cp),
+					   acct_section_config[i].name) == 0) break;
+			}
+			if (acct_section_config[i].name) continue;
+		}
+
+		stmt = sql_stmt_compile(inst, section, cf_pair_value(cp));
+		if (!stmt) continue;
+
+		stmt->cp = cp;
+		stmt->next = section->stmts;
+		section->stmts = stmt;
+	}
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_sql_t *inst = instance;
@@ -823,6 +1257,19 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	if (!inst->sql_user) {
 		return -1;
 	}
+
+	/*
+	 *	Pre-parse the queries, so that we don't have to do it
+	 *	for every request.
+	 */
+	inst->query_user_xlat = xlat_compile(inst, inst->config->query_user);
+	inst->authorize_check_xlat = xlat_compile(inst, inst->config->authorize_check_query);
+	inst->authorize_reply_xlat = xlat_compile(inst, inst->config->authorize_reply_query);
+	inst->authorize_group_check_xlat = xlat_compile(inst, inst->config->authorize_group_check_query);
+	inst->authorize_group_reply_xlat = xlat_compile(inst, inst->config->authorize_group_reply_query);
+	inst->simul_count_xlat = xlat_compile(inst, inst->config->simul_count_query);
+	inst->simul_verify_xlat = xlat_compile(inst, inst->config->simul_verify_query);
+	inst->groupmemb_xlat = xlat_compile(inst, inst->config->groupmemb_query);
 	
 	/*
 	 *	Export these methods, too.  This avoids RTDL_GLOBAL.
@@ -944,6 +1391,79 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	       inst->config->xlat_name, inst->config->sql_driver_name,
 	       inst->module->name);
 
+	if (inst->config->prepared_statements &&
+	    (!inst->module->sql_prepared_query ||
+	     !inst->module->sql_prepared_select_query)) {
+		radlog(L_INFO, "rlm_sql (%s): Driver %s does not support "
+		       "prepared statements", inst->config->xlat_name,
+		       inst->config->sql_driver_name);
+
+	} else if (inst->config->prepared_statements) {
+		inst->authorize_check_stmt = sql_stmt_compile(inst, inst, inst->config->authorize_check_query);
+		inst->authorize_reply_stmt = sql_stmt_compile(inst, inst, inst->config->authorize_reply_query);
+		inst->authorize_group_check_stmt = sql_stmt_compile(inst, inst, inst->config->authorize_group_check_query);
+		inst->authorize_group_reply_stmt = sql_stmt_compile(inst, inst, inst->config->authorize_group_reply_query);
+		inst->groupmemb_stmt = sql_stmt_compile(inst, inst, inst->config->groupmemb_query);
+
+		/*
+		 *	Queries which are logged to a file, or which are
+		 *	batched, need the text of the query.
+		 */
+		if (inst->config->accounting && !inst->config->logfile &&
+		    !inst->config->accounting->logfile &&
+		    (inst->config->accounting->batch_size <= 1)) {
+			sql_stmt_compile_section(inst, inst->config->accounting,
+						 inst->config->accounting->cs);
+		}
+
+		if (inst->config->postauth && !inst->config->logfile &&
+		    !inst->config->postauth->logfile &&
+		    (inst->config->postauth->batch_size <= 1)) {
+			sql_stmt_compile_section(inst, inst->config->postauth,
+						 inst->config->postauth->cs);
+		}
+	}
+
+	/*
+	 *	Cache the results of the authorize queries.
+	 */
+	if (inst->config->authorize_cache_ttl < 0) {
+		radlog(L_ERR, "rlm_sql (%s): authorize_cache_ttl must not be "
+		       "negative", inst->config->xlat_name);
+		return -1;
+	}
+
+	if (inst->config->authorize_cache_ttl > 0) {
+		char buffer[MAX_STRING_LEN];
+
+		if (inst->config->authorize_cache_max_entries < 1) {
+			inst->config->authorize_cache_max_entries = 1;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		if ((pthread_mutex_init(&inst->cache_mutex, NULL) != 0) ||
+		    (pthread_cond_init(&inst->cache_cond, NULL) != 0)) {
+			radlog(L_ERR, "rlm_sql (%s): Failed initializing cache "
+			       "mutex: %s", inst->config->xlat_name,
+			       strerror(errno));
+			return -1;
+		}
+#endif
+
+		inst->cache = rbtree_create(sql_cache_cmp, NULL, 0);
+		inst->cache_heap = fr_heap_create(sql_cache_heap_cmp,
+						  offsetof(sql_cache_entry_t, offset));
+		if (!inst->cache || !inst->cache_heap) {
+			radlog(L_ERR, "rlm_sql (%s): Failed creating cache",
+			       inst->config->xlat_name);
+			return -1;
+		}
+
+		snprintf(buffer, sizeof(buffer), "%s_flush",
+			 inst->config->xlat_name);
+		xlat_register(buffer, sql_flush_xlat, inst);
+	}
+
 	/*
 	 *	Initialise the connection pool for this instance
 	 */
@@ -973,7 +1493,8 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	int ret = RLM_MODULE_NOTFOUND;
 	
 	rlm_sql_t *inst = instance;
-	rlm_sql_handle_t  *handle;
+	rlm_sql_handle_t  *handle = NULL;
+	sql_cache_entry_t *cached = NULL;
 	
 	VALUE_PAIR *check_tmp = NULL;
 	VALUE_PAIR *reply_tmp = NULL;
@@ -982,8 +1503,6 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	int	dofallthrough = 1;
 	int	rows;
 
-	char	querystr[MAX_QUERY_LEN];
-
 	/*
 	 *  Set, escape, and check the user attr here
 	 */
@@ -991,14 +1510,27 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 		return RLM_MODULE_FAIL;
 
 	/*
-	 *  Reserve a socket
+	 *  Look in the cache first.  If the user is there, no socket
+	 *  is needed.
 	 *
 	 *  After this point use goto error or goto release to cleanup sockets
-	 *  temporary pairlists and temporary attributes.
+	 *  cache entries, temporary pairlists and temporary attributes.
 	 */
-	handle = sql_get_socket(inst);
-	if (!handle)
-		goto error;
+	if (inst->cache &&
+	    (sql_cache_get(inst, request, &cached) < 0)) {
+		radlog_request(L_ERR, 0, request, "SQL query error; rejecting user");
+
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *  Reserve a socket
+	 */
+	if (!cached) {
+		handle = sql_get_socket(inst);
+		if (!handle)
+			goto error;
+	}
 
 	/*
 	 *  Query the check table to find any conditions associated with
@@ -1006,13 +1538,14 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	 */
 	if (inst->config->authorize_check_query &&
 	    *inst->config->authorize_check_query) {
-		if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_check_query, request, sql_escape_func, inst)) {
-			radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
-	
-			goto error;
+		if (cached) {
+			check_tmp = paircopy(request, cached->check);
+			rows = cached->check_rows;
+		} else {
+			rows = sql_authorize_getvpdata(inst, request, &handle, request, &check_tmp,
+						       inst->authorize_check_stmt,
+						       inst->authorize_check_xlat);
 		}
-		
-		rows = sql_getvpdata(inst, &handle, request, &check_tmp, querystr);
 		if (rows < 0) {
 			radlog_request(L_ERR, 0, request, "SQL query error; rejecting user");
 	
@@ -1044,13 +1577,14 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 		/*
 		 *  Now get the reply pairs since the paircompare matched
 		 */
-		if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_reply_query, request, sql_escape_func, inst)) {
-			radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
-			
-			goto error;
+		if (cached) {
+			reply_tmp = paircopy(request->reply, cached->reply);
+			rows = cached->reply_rows;
+		} else {
+			rows = sql_authorize_getvpdata(inst, request, &handle, request->reply, &reply_tmp,
+						       inst->authorize_reply_stmt,
+						       inst->authorize_reply_xlat);
 		}
-		
-		rows = sql_getvpdata(inst, &handle, request->reply, &reply_tmp, querystr);
 		if (rows < 0) {
 			radlog_request(L_ERR, 0, request, "SQL query error; rejecting user");
 
@@ -1085,7 +1619,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	 *  the groups as well.
 	 */
 	if (dofallthrough) {
-		rows = rlm_sql_process_groups(inst, request, handle, &dofallthrough);
+		rows = rlm_sql_process_groups(inst, request, handle, cached, &dofallthrough);
 		if (rows < 0) {
 			radlog_request(L_ERR, 0, request, "Error processing groups; rejecting user");
 
@@ -1119,8 +1653,28 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 
 			goto error;
 		}
+
+		/*
+		 *  The profile has its own cache entry.
+		 */
+		if (cached) {
+			sql_cache_release(inst, cached);
+			cached = NULL;
+
+			if (sql_cache_get(inst, request, &cached) < 0) {
+				radlog_request(L_ERR, 0, request, "Error processing profile groups; rejecting user");
+
+				goto error;
+			}
+		}
+
+		if (!cached && !handle) {
+			handle = sql_get_socket(inst);
+			if (!handle)
+				goto error;
+		}
 		
-		rows = rlm_sql_process_groups(inst, request, handle, &dofallthrough);
+		rows = rlm_sql_process_groups(inst, request, handle, cached, &dofallthrough);
 		if (rows < 0) {
 			radlog_request(L_ERR, 0, request, "Error processing profile groups; rejecting user");
 
@@ -1137,7 +1691,8 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	ret = RLM_MODULE_FAIL;
 	
 	release:
-	sql_release_socket(inst, handle);
+	if (handle) sql_release_socket(inst, handle);
+	if (cached) sql_cache_release(inst, cached);
 		
 	pairfree(&check_tmp);
 	pairfree(&reply_tmp);
@@ -1145,6 +1700,249 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	return ret;
 }
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Skip a quoted string.  Returns a pointer to the closing quote,
+ *	or NULL if there isn't one.
+ */
+static const char *sql_skip_quoted(const char *p)
+{
+	char quote = *p++;
+
+	while (*p) {
+		if ((*p == '\\') && p[1]) {
+			p += 2;
+			continue;
+		}
+
+		if (*p == quote) {
+			if (p[1] != quote) return p;
+			p++;	/* '' is an escaped quote */
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Split "INSERT ... VALUES (...)" into the part which is the
+ *	same for every row, and the row.  Anything else, including
+ *	INSERTs of many rows, or with ON DUPLICATE KEY, can't be
+ *	batched.
+ *
+ *	Returns the length of the prefix, or 0.
+ */
+static size_t sql_batch_split(const char *query, const char **values)
+{
+	const char *p, *q;
+	int depth = 0;
+
+	p = query;
+	while (isspace((int) *p)) p++;
+	if (strncasecmp(p, "INSERT", 6) != 0) return 0;
+
+	/*
+	 *	Find the VALUES keyword, outside of strings and
+	 *	brackets.
+	 */
+	for (p += 6; *p; p++) {
+		switch (*p) {
+		case '\'':
+		case '"':
+		case '`':
+			p = sql_skip_quoted(p);
+			if (!p) return 0;
+			continue;
+
+		case '(':
+			depth++;
+			continue;
+
+		case ')':
+			depth--;
+			continue;
+
+		default:
+			break;
+		}
+
+		if (depth || (!isspace((int) p[-1]) && (p[-1] != ')')) ||
+		    (strncasecmp(p, "VALUES", 6) != 0) ||
+		    (!isspace((int) p[6]) && (p[6] != '('))) continue;
+
+		break;
+	}
+	if (!*p) return 0;
+
+	q = p + 6;
+	while (isspace((int) *q)) q++;
+	if (*q != '(') return 0;
+	*values = q;
+
+	/*
+	 *	Find the end of the row, and check there's nothing
+	 *	after it.
+	 */
+	for (; *q; q++) {
+		if ((*q == '\'') || (*q == '"') || (*q == '`')) {
+			q = sql_skip_quoted(q);
+			if (!q) return 0;
+			continue;
+		}
+
+		if (*q == '(') depth++;
+		if ((*q == ')') && (--depth == 0)) break;
+	}
+	if (!*q) return 0;
+
+	for (q++; *q; q++) {
+		if (!isspace((int) *q) && (*q != ';')) return 0;
+	}
+
+	return (p + 6) - query;
+}
+
+/*
+ *	Write a batch, and tell everyone waiting for it.  The batch
+ *	has been taken off of the list, so nothing else can be added
+ *	to it.
+ */
+static void sql_batch_flush(rlm_sql_t *inst, REQUEST *request,
+			    sql_acct_section_t *section, sql_batch_t *batch)
+{
+	int			rcode = -1;
+	rlm_sql_handle_t	*handle;
+
+	RDEBUG2("Writing %d rows as one query", batch->rows);
+
+	handle = sql_get_socket(inst);
+	if (handle) {
+		if (rlm_sql_query(&handle, inst, batch->query) == 0) {
+			/*
+			 *	If some of the rows weren't written,
+			 *	we don't know which.  They're all tried
+			 *	again, one by one.
+			 */
+			if ((inst->module->sql_affected_rows)(handle, inst->config) == batch->rows) {
+				rcode = 0;
+			}
+		}
+
+		if (handle) {
+			(inst->module->sql_finish_query)(handle, inst->config);
+			sql_release_socket(inst, handle);
+		}
+	}
+
+	pthread_mutex_lock(&section->batch_mutex);
+	batch->rcode = rcode;
+	batch->done = TRUE;
+	pthread_cond_broadcast(&section->batch_cond);
+	pthread_mutex_unlock(&section->batch_mutex);
+}
+
+/*
+ *	Add an INSERT to a batch, and wait until the batch has been
+ *	written.  The first request in a batch waits for up to
+ *	"batch_timeout" for more rows.  The request which fills the
+ *	batch writes it.
+ *
+ *	Returns 0 if the row was written, 1 if the query can't be
+ *	batched, or -1 if the batch failed, and the query should be
+ *	run on its own.
+ */
+static int sql_batch_query(rlm_sql_t *inst, REQUEST *request,
+			   sql_acct_section_t *section, const char *query)
+{
+	int		rcode = 0, first = FALSE;
+	size_t		prefix_len;
+	const char	*values = NULL;
+	sql_batch_t	*batch, **last;
+	struct timespec	when;
+
+	prefix_len = sql_batch_split(query, &values);
+	if (!prefix_len) return 1;
+
+	pthread_mutex_lock(&section->batch_mutex);
+
+	/*
+	 *	There are usually only a few different INSERTs, so
+	 *	the list is short.
+	 */
+	for (batch = section->batches; batch != NULL; batch = batch->next) {
+		if ((batch->prefix_len == prefix_len) &&
+		    (strncmp(batch->query, query, prefix_len) == 0)) break;
+	}
+
+	if (!batch) {
+		batch = talloc_zero(NULL, sql_batch_t);
+		batch->query = talloc_strndup(batch, query, prefix_len);
+		batch->prefix_len = prefix_len;
+
+		gettimeofday(&batch->flush_at, NULL);
+		batch->flush_at.tv_usec += section->batch_timeout * 1000;
+		batch->flush_at.tv_sec += batch->flush_at.tv_usec / 1000000;
+		batch->flush_at.tv_usec %= 1000000;
+
+		batch->next = section->batches;
+		section->batches = batch;
+		first = TRUE;
+	}
+
+	batch->query = talloc_asprintf_append_buffer(batch->query, "%s%s",
+						     batch->rows ? ", " : " ",
+						     values);
+	batch->rows++;
+	batch->waiting++;
+
+	RDEBUG2("Added row %d to batch", batch->rows);
+
+	while (!batch->done) {
+		/*
+		 *	Full, or timed out.  Take it off of the list,
+		 *	and write it.
+		 */
+		if (!batch->flushing &&
+		    ((batch->rows >= section->batch_size) ||
+		     (first && (rcode == ETIMEDOUT)))) {
+			batch->flushing = TRUE;
+			for (last = &section->batches; *last != NULL; last = &(*last)->next) {
+				if (*last == batch) {
+					*last = batch->next;
+					break;
+				}
+			}
+
+			pthread_mutex_unlock(&section->batch_mutex);
+			sql_batch_flush(inst, request, section, batch);
+			pthread_mutex_lock(&section->batch_mutex);
+			break;
+		}
+
+		if (first && !batch->flushing) {
+			when.tv_sec = batch->flush_at.tv_sec;
+			when.tv_nsec = batch->flush_at.tv_usec * 1000;
+			rcode = pthread_cond_timedwait(&section->batch_cond,
+						       &section->batch_mutex,
+						       &when);
+		} else {
+			pthread_cond_wait(&section->batch_cond,
+					  &section->batch_mutex);
+		}
+	}
+
+	rcode = batch->rcode;
+	if (--batch->waiting == 0) talloc_free(batch);
+
+	pthread_mutex_unlock(&section->batch_mutex);
+
+	if (rcode < 0) RDEBUG("Batch failed, writing row on its own");
+
+	return rcode;
+}
+#endif
+
 /*
  *	Generic function for failing between a bunch of queries.
  *
@@ -1168,6 +1966,8 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request,
 	CONF_PAIR  *pair;
 	const char *attr = NULL;
 	const char *value;
+	const xlat_exp_t *query;
+	const sql_stmt_t *stmt;
 
 	char	path[MAX_STRING_LEN];
 	char	querystr[MAX_QUERY_LEN];
@@ -1179,8 +1979,8 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request,
 	if (section->reference[0] != '.')
 		*p++ = '.';
 	
-	if (!radius_xlat(p, (sizeof(path) - (p - path)) - 1,
-			section->reference, request, NULL, NULL))
+	if (!radius_xlat_compiled(p, (sizeof(path) - (p - path)) - 1,
+				  section->reference_xlat, request, NULL, NULL))
 		return RLM_MODULE_FAIL;
 
 	item = cf_reference_item(NULL, section->cs, path);
@@ -1198,10 +1998,6 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request,
 	
 	RDEBUG2("Using query template '%s'", attr);
 	
-	handle = sql_get_socket(inst);
-	if (!handle)
-		return RLM_MODULE_FAIL;
-		
 	sql_set_user(inst, request, NULL);
 
 	while (TRUE) {
@@ -1213,8 +2009,20 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request,
 			goto release;
 		}
 		
-		radius_xlat(querystr, sizeof(querystr), value, request,
-			    sql_escape_func, inst);
+		/*
+		 *  Prepared queries don't need to be expanded.
+		 */
+		stmt = sql_stmt_find(section->stmts, pair);
+		if (stmt) goto run;
+		
+		query = xlat_section_find(section->queries, pair);
+		if (query) {
+			radius_xlat_compiled(querystr, sizeof(querystr), query,
+					     request, sql_escape_func, inst);
+		} else {
+			radius_xlat(querystr, sizeof(querystr), value, request,
+				    sql_escape_func, inst);
+		}
 		if (!*querystr) {
 			RDEBUG("Ignoring null query");
 			ret = RLM_MODULE_NOOP;
@@ -1223,6 +2031,30 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request,
 		}
 		
 		rlm_sql_query_log(inst, request, section, querystr);
+
+#ifdef HAVE_PTHREAD_H
+		/*
+		 *  INSERTs may be written along with those from other
+		 *  requests.  If the batch fails, the query is run on
+		 *  its own.
+		 */
+		if ((section->batch_size > 1) &&
+		    (sql_batch_query(inst, request, section, querystr) == 0)) {
+			goto release;
+		}
+#endif
+
+	run:
+
+		/*
+		 *  The handle isn't taken until it's needed, so that
+		 *  requests waiting for a batch don't hold one.
+		 */
+		if (!handle) {
+			handle = sql_get_socket(inst);
+			if (!handle)
+				return RLM_MODULE_FAIL;
+		}
 		
 		/*
 		 *  If rlm_sql_query cannot use the socket it'll try and
@@ -1233,7 +2065,11 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request,
 		 *  were exhausted, and we couldn't create a new connection,
 		 *  so we do not need to call sql_release_socket.
 		 */
-		sql_ret = rlm_sql_query(&handle, inst, querystr);	
+		if (stmt) {
+			sql_ret = rlm_sql_prepared_query(&handle, inst, request, stmt);
+		} else {
+			sql_ret = rlm_sql_query(&handle, inst, querystr);
+		}
 		if (sql_ret == SQL_DOWN)
 			return RLM_MODULE_FAIL;
 		
@@ -1274,7 +2110,7 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request,
 	(inst->module->sql_finish_query)(handle, inst->config);
 
 	release:
-	sql_release_socket(inst, handle);
+	if (handle) sql_release_socket(inst, handle);
 
 	return ret;
 }
@@ -1335,7 +2171,7 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request) {
 	if(sql_set_user(inst, request, NULL) < 0)
 		return RLM_MODULE_FAIL;
 
-	radius_xlat(querystr, sizeof(querystr), inst->config->simul_count_query, request, sql_escape_func, inst);
+	radius_xlat_compiled(querystr, sizeof(querystr), inst->simul_count_xlat, request, sql_escape_func, inst);
 
 	/* initialize the sql socket */
 	handle = sql_get_socket(inst);
@@ -1379,7 +2215,7 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request) {
 		return RLM_MODULE_OK;
 	}
 
-	radius_xlat(querystr, sizeof(querystr), inst->config->simul_verify_query, request, sql_escape_func, inst);
+	radius_xlat_compiled(querystr, sizeof(querystr), inst->simul_verify_xlat, request, sql_escape_func, inst);
 	if(rlm_sql_select_query(&handle, inst, querystr)) {
 		sql_release_socket(inst, handle);
 		return RLM_MODULE_FAIL;
@@ -1527,4 +2363,5 @@ module_t rlm_sql = {
 		NULL,			/* post-proxy */
 		mod_post_auth	/* post-auth */
 	},
+	mod_flush		/* flush */
 };
@@ -12,6 +12,7 @@ RCSIDH(rlm_sql_h, "$Id$")
 
 #include	<freeradius-devel/connection.h>
 #include	<freeradius-devel/modpriv.h>
+#include	<freeradius-devel/heap.h>
 
 #include "conf.h"
 
@@ -20,6 +21,38 @@ RCSIDH(rlm_sql_h, "$Id$")
 
 typedef char** rlm_sql_row_t;
 
+/*
+ *	Rows from many requests, written as one multi-row INSERT.
+ */
+typedef struct sql_batch {
+	struct sql_batch *next;		//!< Next batch which is filling.
+	char		*query;		//!< "INSERT ... VALUES (...), (...)".
+	size_t		prefix_len;	//!< Length of "INSERT ... VALUES".
+	int		rows;
+	int		waiting;	//!< Requests which haven't seen the result.
+	int		flushing;
+	int		done;
+	int		rcode;		//!< 0 if all of the rows were written.
+	struct timeval	flush_at;
+} sql_batch_t;
+
+#define SQL_MAX_PARAMS		64
+
+/*
+ *	A query with its expansions replaced by placeholders, so that
+ *	it can be prepared once per connection.  See sql_stmt_compile().
+ */
+typedef struct sql_stmt {
+	struct sql_stmt	*next;
+	const CONF_PAIR	*cp;		//!< Which it was compiled from.
+	int		id;		//!< Index into each connection's
+					//!< cache of prepared statements.
+	char		*query;		//!< With "?" placeholders.
+	char		*numbered;	//!< With "$1" placeholders.
+	int		num_params;
+	xlat_exp_t	**params;	//!< Expand to the parameters.
+} sql_stmt_t;
+
 /*
  * Sections where we dynamically resolve the config entry to use,
  * by xlating reference.
@@ -28,8 +61,20 @@ typedef struct sql_acct_section {
 	CONF_SECTION	*cs;
 	
 	const char	*reference;
+	xlat_exp_t	*reference_xlat;	//!< Pre-parsed reference.
 	
 	const char	*logfile;
+
+	xlat_section_t	*queries;	//!< Pre-parsed queries.
+	sql_stmt_t	*stmts;		//!< Queries which can be prepared.
+
+	int		batch_size;	//!< Most rows in one INSERT.
+	int		batch_timeout;	//!< Milliseconds to wait for more.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	batch_mutex;
+	pthread_cond_t	batch_cond;
+	sql_batch_t	*batches;	//!< Which are filling.
+#endif
 } sql_acct_section_t;
 
 typedef struct sql_config {
@@ -63,6 +108,9 @@ typedef struct sql_config {
 	int const	deletestalesessions;
 	const char	*allowed_chars;
 	int const	query_timeout;
+	int		prepared_statements;
+	int		authorize_cache_ttl;
+	int		authorize_cache_max_entries;
 	
 	void		*driver;	//!< Where drivers should write a
 					//!< pointer to their configurations.
@@ -85,6 +133,7 @@ typedef struct rlm_sql_handle {
 	void	*conn;
 	rlm_sql_row_t row;
 	rlm_sql_t *inst;
+	fr_connection_t *pool_conn;	//!< Pool connection holding the handle.
 } rlm_sql_handle_t;
 
 typedef struct rlm_sql_module_t {
@@ -103,6 +152,16 @@ typedef struct rlm_sql_module_t {
 	int (*sql_finish_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	int (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	int (*sql_affected_rows)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+	/*
+	 *	Optional.  The driver prepares the statement the first
+	 *	time it's used on a connection, and keeps it until the
+	 *	connection is closed.
+	 */
+	int (*sql_prepared_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				  const sql_stmt_t *stmt, const char **params);
+	int (*sql_prepared_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					 const sql_stmt_t *stmt, const char **params);
 } rlm_sql_module_t;
 
 struct sql_inst {
@@ -113,6 +172,39 @@ struct sql_inst {
 
 	const DICT_ATTR		*sql_user;	//!< Cached pointer to SQL-User-Name
 						//!< dictionary attribute.
+
+	/*
+	 *	Pre-parsed queries, see xlat_compile().
+	 */
+	xlat_exp_t		*query_user_xlat;
+	xlat_exp_t		*authorize_check_xlat;
+	xlat_exp_t		*authorize_reply_xlat;
+	xlat_exp_t		*authorize_group_check_xlat;
+	xlat_exp_t		*authorize_group_reply_xlat;
+	xlat_exp_t		*simul_count_xlat;
+	xlat_exp_t		*simul_verify_xlat;
+	xlat_exp_t		*groupmemb_xlat;
+
+	/*
+	 *	Prepared versions of the authorize queries, or NULL.
+	 */
+	int			num_stmts;
+	sql_stmt_t		*authorize_check_stmt;
+	sql_stmt_t		*authorize_reply_stmt;
+	sql_stmt_t		*authorize_group_check_stmt;
+	sql_stmt_t		*authorize_group_reply_stmt;
+	sql_stmt_t		*groupmemb_stmt;
+
+	/*
+	 *	Results of the authorize queries, by SQL-User-Name.
+	 */
+	rbtree_t		*cache;
+	fr_heap_t		*cache_heap;	//!< The same entries, by expiry.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		cache_mutex;
+	pthread_cond_t		cache_cond;	//!< Signalled when an entry
+						//!< has been read.
+#endif
 					
 	void *handle;
 	rlm_sql_module_t *module;
@@ -129,6 +221,14 @@ struct sql_inst {
 typedef struct sql_grouplist {
 	char			name[MAX_STRING_LEN];
 	struct sql_grouplist	*next;
+
+	/*
+	 *	Only set for groups in the authorize cache.
+	 */
+	int			check_rows;
+	VALUE_PAIR		*check;
+	int			reply_rows;
+	VALUE_PAIR		*reply;
 } rlm_sql_grouplist_t;
 
 int     sql_socket_pool_init(rlm_sql_t *inst);
@@ -139,6 +239,8 @@ int     sql_release_socket(rlm_sql_t *inst, rlm_sql_handle_t *handle);
 int     sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int     sql_read_realms(rlm_sql_handle_t *handle);
 int     sql_getvpdata(rlm_sql_t *inst, rlm_sql_handle_t **handle, TALLOC_CTX *ctx, VALUE_PAIR **pair, char *query);
+int	sql_stmt_getvpdata(rlm_sql_t *inst, rlm_sql_handle_t **handle, REQUEST *request,
+			   TALLOC_CTX *ctx, VALUE_PAIR **pair, const sql_stmt_t *stmt);
 int     sql_read_naslist(rlm_sql_handle_t *handle);
 int     sql_read_clients(rlm_sql_handle_t *handle);
 int     sql_dict_init(rlm_sql_handle_t *handle);
@@ -147,5 +249,11 @@ void 	rlm_sql_query_log(rlm_sql_t *inst, REQUEST *request,
 int	rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char *query);
 int	rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char *query);
 int	rlm_sql_fetch_row(rlm_sql_handle_t **handle, rlm_sql_t *inst);
+sql_stmt_t *sql_stmt_compile(rlm_sql_t *inst, TALLOC_CTX *ctx, const char *query);
+const sql_stmt_t *sql_stmt_find(const sql_stmt_t *head, const CONF_PAIR *cp);
+int	rlm_sql_prepared_query(rlm_sql_handle_t **handle, rlm_sql_t *inst,
+			       REQUEST *request, const sql_stmt_t *stmt);
+int	rlm_sql_prepared_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst,
+				      REQUEST *request, const sql_stmt_t *stmt);
 int	sql_set_user(rlm_sql_t *inst, REQUEST *request, const char *username);
 #endif
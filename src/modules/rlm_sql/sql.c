@@ -128,6 +128,22 @@ void sql_poolfree(rlm_sql_t * inst)
 }
 
 
+/*
+ *	Get the handle of a pool connection, and remember which
+ *	connection it's in, so that it can be released.
+ */
+static rlm_sql_handle_t *sql_handle(fr_connection_t *pool_conn)
+{
+	rlm_sql_handle_t *handle;
+
+	if (!pool_conn) return NULL;
+
+	handle = fr_connection_handle(pool_conn);
+	handle->pool_conn = pool_conn;
+
+	return handle;
+}
+
 /*************************************************************************
  *
  *	Function: sql_get_socket
@@ -137,7 +153,7 @@ void sql_poolfree(rlm_sql_t * inst)
  *************************************************************************/
 rlm_sql_handle_t * sql_get_socket(rlm_sql_t * inst)
 {
-	return fr_connection_get(inst->pool);
+	return sql_handle(fr_connection_get(inst->pool));
 }
 
 /*************************************************************************
@@ -149,10 +165,21 @@ rlm_sql_handle_t * sql_get_socket(rlm_sql_t * inst)
  *************************************************************************/
 int sql_release_socket(rlm_sql_t * inst, rlm_sql_handle_t * handle)
 {
-	fr_connection_release(inst->pool, handle);
+	if (handle) fr_connection_release(inst->pool, handle->pool_conn);
 	return 0;
 }
 
+/*
+ *	Replace the handle of a connection which is down.  If that
+ *	fails, another connection is used.
+ */
+static rlm_sql_handle_t *sql_reconnect(rlm_sql_t *inst, rlm_sql_handle_t *handle)
+{
+	if (!handle) return NULL;
+
+	return sql_handle(fr_connection_reconnect(inst->pool, handle->pool_conn));
+}
+
 
 /*************************************************************************
  *
@@ -335,7 +362,7 @@ int rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char *query)
 		 */
 		if (ret == SQL_DOWN) {
 			sql_down:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
+			*handle = sql_reconnect(inst, *handle);
 			if (!*handle) return SQL_DOWN;
 			
 			continue;
@@ -386,7 +413,7 @@ int rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char *query
 		 */
 		if (ret == SQL_DOWN) {
 			sql_down:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
+			*handle = sql_reconnect(inst, *handle);
 			if (!*handle) return SQL_DOWN;
 			
 			continue;
@@ -404,23 +431,288 @@ int rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char *query
 }
 
 
+/*
+ *	Add the text from start to end, which has no expansions.
+ */
+static int sql_stmt_literal(sql_stmt_t *stmt, const char *start,
+			    const char *end)
+{
+	char		*text;
+	const char	*value;
+	xlat_exp_t	*exp;
+
+	if (start == end) return 0;
+
+	/*
+	 *	Let xlat handle any backslashes and "%%", in the same
+	 *	way as it would when expanding the whole query.
+	 */
+	text = talloc_strndup(stmt, start, end - start);
+	exp = xlat_compile(text, text);
+	value = xlat_literal(exp);
+	if (!value) {
+		talloc_free(text);
+		return -1;
+	}
+
+	stmt->query = talloc_strdup_append(stmt->query, value);
+	stmt->numbered = talloc_strdup_append(stmt->numbered, value);
+	talloc_free(text);
+
+	return 0;
+}
+
 /*************************************************************************
  *
- *	Function: sql_getvpdata
+ *	Function: sql_stmt_compile
  *
- *	Purpose: Get any group check or reply pairs
+ *	Purpose: Turn a query into a statement with placeholders.  Each
+ *	quoted string which contains an expansion becomes a parameter,
+ *	which is bound as a string, exactly as the quoted string would
+ *	have been.  The parameters are escaped with safe_characters, as
+ *	for text queries, so the database stores the same values either
+ *	way.
+ *
+ *	Expansions outside of quotes may be numbers, NULL, or other
+ *	pieces of SQL, which can't be bound.  Queries with them are
+ *	left as text.
+ *
+ *	Returns NULL if the query can't be converted, or has no
+ *	parameters.
  *
  *************************************************************************/
-int sql_getvpdata(rlm_sql_t * inst, rlm_sql_handle_t **handle,
-		  TALLOC_CTX *ctx, VALUE_PAIR **pair, char *query)
+sql_stmt_t *sql_stmt_compile(rlm_sql_t *inst, TALLOC_CTX *ctx,
+			     const char *query)
 {
-	rlm_sql_row_t row;
-	int     rows = 0;
+	sql_stmt_t	*stmt;
+	const char	*p, *q, *start;
+	char		*text, *t;
+	xlat_exp_t	*exp;
+
+	if (!query || !*query) return NULL;
+
+	stmt = talloc_zero(ctx, sql_stmt_t);
+	stmt->query = talloc_strdup(stmt, "");
+	stmt->numbered = talloc_strdup(stmt, "");
+	stmt->params = talloc_array(stmt, xlat_exp_t *, SQL_MAX_PARAMS);
+
+	start = p = query;
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			if (p[1]) p++;
+			break;
 
-	if (rlm_sql_select_query(handle, inst, query)) {
-		return -1;
+		case '%':
+			if (p[1] == '%') {
+				p++;
+				break;
+			}
+			/* FALL-THROUGH */
+
+		case '?':
+		case '$':
+			DEBUG2("rlm_sql (%s): Not preparing \"%s\": it has "
+			       "expansions outside of quotes",
+			       inst->config->xlat_name, query);
+			goto fail;
+
+		case '\'':
+			for (q = p + 1; *q; q++) {
+				/*
+				 *	Databases differ in what a
+				 *	backslash means in a string.
+				 */
+				if (*q == '\\') goto fail;
+				if (*q != '\'') continue;
+				if (q[1] != '\'') break;
+				q++;	/* '' is an escaped quote */
+			}
+			if (!*q) goto fail;
+
+			if (!memchr(p, '%', q - p)) {
+				p = q;
+				break;
+			}
+
+			/*
+			 *	Check the string really has an expansion,
+			 *	and isn't just "%%".
+			 */
+			text = talloc_strndup(stmt, p + 1, q - (p + 1));
+			for (t = text; (t = strstr(t, "''")) != NULL; t++) {
+				memmove(t, t + 1, strlen(t));
+			}
+
+			exp = xlat_compile(stmt, text);
+			if (xlat_literal(exp)) {
+				talloc_free(exp);
+				talloc_free(text);
+				p = q;
+				break;
+			}
+
+			if (stmt->num_params == SQL_MAX_PARAMS) {
+				DEBUG2("rlm_sql (%s): Not preparing \"%s\": it "
+				       "has too many expansions",
+				       inst->config->xlat_name, query);
+				goto fail;
+			}
+
+			if (sql_stmt_literal(stmt, start, p) < 0) goto fail;
+
+			stmt->params[stmt->num_params++] = exp;
+			stmt->query = talloc_strdup_append(stmt->query, "?");
+			stmt->numbered = talloc_asprintf_append(stmt->numbered, "$%d",
+								stmt->num_params);
+			start = p = q + 1;
+			continue;
+
+		default:
+			break;
+		}
+		p++;
+	}
+
+	if (sql_stmt_literal(stmt, start, p) < 0) goto fail;
+
+	/*
+	 *	Nothing to bind.  This also skips pieces of queries,
+	 *	such as column lists, in the accounting sections.
+	 */
+	if (stmt->num_params == 0) goto fail;
+
+	stmt->id = inst->num_stmts++;
+
+	DEBUG2("rlm_sql (%s): Prepared query %d: '%s'",
+	       inst->config->xlat_name, stmt->id, stmt->query);
+
+	return stmt;
+
+fail:
+	talloc_free(stmt);
+	return NULL;
+}
+
+/*
+ *	Find the statement for a query in an accounting section.
+ */
+const sql_stmt_t *sql_stmt_find(const sql_stmt_t *head, const CONF_PAIR *cp)
+{
+	const sql_stmt_t *stmt;
+
+	for (stmt = head; stmt != NULL; stmt = stmt->next) {
+		if (stmt->cp == cp) return stmt;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Expand the parameters of a statement, and run it.
+ */
+static int sql_stmt_exec(rlm_sql_handle_t **handle, rlm_sql_t *inst,
+			 REQUEST *request, const sql_stmt_t *stmt, int select)
+{
+	int		i, ret;
+	size_t		len;
+	char		buffer[MAX_QUERY_LEN];
+	char		*p = buffer;
+	const char	*params[SQL_MAX_PARAMS];
+
+	for (i = 0; i < stmt->num_params; i++) {
+		if ((p + 1) >= (buffer + sizeof(buffer))) {
+			radlog_request(L_ERR, 0, request, "Parameters of query "
+				       "are too long");
+			return -1;
+		}
+
+		len = radius_xlat_compiled(p, (buffer + sizeof(buffer)) - p,
+					   stmt->params[i], request,
+					   inst->sql_escape_func, inst);
+		params[i] = p;
+		p += len + 1;
+	}
+
+	if (!*handle || !(*handle)->conn) {
+		ret = -1;
+		goto sql_down;
 	}
 
+	while (1) {
+		DEBUG("rlm_sql (%s): Executing prepared query: '%s'",
+		      inst->config->xlat_name, stmt->query);
+		for (i = 0; i < stmt->num_params; i++) {
+			DEBUG2("rlm_sql (%s):    %d = '%s'",
+			       inst->config->xlat_name, i + 1, params[i]);
+		}
+
+		if (select) {
+			ret = (inst->module->sql_prepared_select_query)(*handle, inst->config,
+									stmt, params);
+		} else {
+			ret = (inst->module->sql_prepared_query)(*handle, inst->config,
+								 stmt, params);
+		}
+
+		/*
+		 *	Prepared statements belong to the connection,
+		 *	so a new one will prepare it again.
+		 */
+		if (ret == SQL_DOWN) {
+			sql_down:
+			*handle = sql_reconnect(inst, *handle);
+			if (!*handle) return SQL_DOWN;
+
+			continue;
+		}
+
+		if (ret < 0) {
+			radlog(L_ERR,
+			       "rlm_sql (%s): Database query error: '%s'",
+			       inst->config->xlat_name,
+			       (inst->module->sql_error)(*handle, inst->config));
+		}
+
+		return ret;
+	}
+}
+
+/*************************************************************************
+ *
+ *	Function: rlm_sql_prepared_query
+ *
+ *	Purpose: Run a prepared statement which doesn't return rows.
+ *
+ *************************************************************************/
+int rlm_sql_prepared_query(rlm_sql_handle_t **handle, rlm_sql_t *inst,
+			   REQUEST *request, const sql_stmt_t *stmt)
+{
+	return sql_stmt_exec(handle, inst, request, stmt, FALSE);
+}
+
+/*************************************************************************
+ *
+ *	Function: rlm_sql_prepared_select_query
+ *
+ *	Purpose: Run a prepared statement which returns rows.
+ *
+ *************************************************************************/
+int rlm_sql_prepared_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst,
+				  REQUEST *request, const sql_stmt_t *stmt)
+{
+	return sql_stmt_exec(handle, inst, request, stmt, TRUE);
+}
+
+/*
+ *	Read the pairs from the result of a select query.
+ */
+static int sql_getvpdata_rows(rlm_sql_t *inst, rlm_sql_handle_t **handle,
+			      TALLOC_CTX *ctx, VALUE_PAIR **pair)
+{
+	rlm_sql_row_t row;
+	int     rows = 0;
+
 	while (rlm_sql_fetch_row(handle, inst) == 0) {
 		row = (*handle)->row;
 		if (!row)
@@ -439,6 +731,42 @@ int sql_getvpdata(rlm_sql_t * inst, rlm_sql_handle_t **handle,
 	return rows;
 }
 
+/*************************************************************************
+ *
+ *	Function: sql_getvpdata
+ *
+ *	Purpose: Get any group check or reply pairs
+ *
+ *************************************************************************/
+int sql_getvpdata(rlm_sql_t * inst, rlm_sql_handle_t **handle,
+		  TALLOC_CTX *ctx, VALUE_PAIR **pair, char *query)
+{
+	if (rlm_sql_select_query(handle, inst, query)) {
+		return -1;
+	}
+
+	return sql_getvpdata_rows(inst, handle, ctx, pair);
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_stmt_getvpdata
+ *
+ *	Purpose: Get any group check or reply pairs, with a prepared
+ *	statement.
+ *
+ *************************************************************************/
+int sql_stmt_getvpdata(rlm_sql_t *inst, rlm_sql_handle_t **handle,
+		       REQUEST *request, TALLOC_CTX *ctx, VALUE_PAIR **pair,
+		       const sql_stmt_t *stmt)
+{
+	if (rlm_sql_prepared_select_query(handle, inst, request, stmt)) {
+		return -1;
+	}
+
+	return sql_getvpdata_rows(inst, handle, ctx, pair);
+}
+
 /*
  *	Log the query to a file.
  */
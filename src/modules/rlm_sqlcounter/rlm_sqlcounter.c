@@ -606,5 +606,6 @@ module_t rlm_sqlcounter = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
 
@@ -780,4 +780,5 @@ module_t rlm_sqlhpwippool = {
 		NULL,			/* post-proxy */
 		mod_post_auth	/* post-auth */
 	},
+	NULL				/* flush */
 };
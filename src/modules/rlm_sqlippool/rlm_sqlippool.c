@@ -710,4 +710,5 @@ module_t rlm_sqlippool = {
 		NULL,			/* post-proxy */
 		mod_post_auth	/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -511,4 +511,5 @@ module_t rlm_unix = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -78,4 +78,5 @@ module_t rlm_utf8 = {
 		NULL
 #endif
 	},
+	NULL				/* flush */
 };
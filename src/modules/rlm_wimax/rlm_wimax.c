@@ -483,4 +483,5 @@ module_t rlm_wimax = {
 		NULL,			/* post-proxy */
 		mod_post_auth 		/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -412,4 +412,5 @@ module_t rlm_yubikey = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	NULL				/* flush */
 };
@@ -0,0 +1,98 @@
+#!/bin/bash
+#
+#  Check that work files left behind by the detail file reader are
+#  replayed when the server is restarted with a different number of
+#  shards.
+#
+#  Each test creates one work file, as if the server had stopped part
+#  way through reading it, then runs the server with the given number
+#  of shards, and checks that every record in the work file is read.
+#
+
+: ${BIN_PATH=./}
+: ${LIB_PATH=../../build/lib/.libs/}
+: ${DICT_PATH=../../share}
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/detail-shards.XXXXXX` || exit 1
+RECORDS=20
+RCODE=0
+
+trap 'rm -rf $DIR' EXIT
+
+#
+#  Usage: run <work file> <shards>
+#
+run() {
+	rm -rf $DIR/acct
+	mkdir $DIR/acct
+	: > $DIR/done.log
+	: > $DIR/radius.log
+
+	for i in `seq 1 $RECORDS`
+	do
+		echo "Mon Jun 10 12:00:00 2013"
+		echo "	Acct-Session-Id = \"$1-$i\""
+		echo "	Acct-Status-Type = Stop"
+		echo "	User-Name = \"bob\""
+		echo ""
+	done > $DIR/acct/$1
+
+	cat > $DIR/radiusd.conf <<EOF
+prefix = $DIR
+libdir = $LIB_PATH
+logdir = $DIR
+run_dir = $DIR
+pidfile = $DIR/radiusd.pid
+dictionary = $DICT_PATH
+
+modules {
+	linelog {
+		filename = $DIR/done.log
+		format = "%{Acct-Session-Id}"
+	}
+}
+
+server detail {
+	listen {
+		type = detail
+		filename = $DIR/acct/detail-*
+		load_factor = 100
+		poll_interval = 1
+		shards = $2
+	}
+
+	accounting {
+		linelog
+	}
+}
+EOF
+
+	$BIN_PATH/radiusd -f -d $DIR -n radiusd -l $DIR/radius.log &
+	PID=$!
+
+	for i in `seq 1 20`
+	do
+		[ `wc -l < $DIR/done.log` -ge $RECORDS ] && break
+		kill -0 $PID 2>/dev/null || break
+		sleep 0.5
+	done
+
+	kill $PID 2>/dev/null
+	wait $PID 2>/dev/null
+
+	if [ `sort -u $DIR/done.log | wc -l` -ne $RECORDS ] || [ -f $DIR/acct/$1 ]; then
+		echo "FAIL: $1 with shards = $2"
+		tail -n 20 $DIR/radius.log
+		RCODE=1
+	else
+		echo "OK: $1 with shards = $2"
+	fi
+}
+
+run detail.work 2
+run detail.work 4
+run detail-1.work 1
+run detail-3.work 2
+run detail-0.work 1
+
+exit $RCODE